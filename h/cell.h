@@ -26,16 +26,176 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "./structures/circuit.h"
 #include "./connections.h"
 
-void v_hostize_variable_short_cell( CellShortVariable* cell );
-void v_hostize_variable_cell( CellVariable* cell );
-void v_hostize_cell( Cell* cell );
-void v_networkize_variable_short_cell( CellShortVariable* cell );
-void v_networkize_variable_cell ( CellVariable* cell );
-void v_networkize_cell( Cell* cell );
+extern MinitorMutex cell_pool_mutex;
 
+// cells stay in wire format from the moment they are built or received, the
+// multi byte fields are only ever read and written through these, the
+// structures are packed so the loads and stores go a byte at a time
+static inline uint16_t ud_load_be16( const void* p )
+{
+  const uint8_t* bytes = p;
+
+  return ( (uint16_t)bytes[0] << 8 ) | (uint16_t)bytes[1];
+}
+
+static inline uint32_t ud_load_be32( const void* p )
+{
+  const uint8_t* bytes = p;
+
+  return ( (uint32_t)bytes[0] << 24 ) | ( (uint32_t)bytes[1] << 16 ) | ( (uint32_t)bytes[2] << 8 ) | (uint32_t)bytes[3];
+}
+
+static inline void v_store_be16( void* p, uint16_t value )
+{
+  uint8_t* bytes = p;
+
+  bytes[0] = (uint8_t)( value >> 8 );
+  bytes[1] = (uint8_t)value;
+}
+
+static inline void v_store_be32( void* p, uint32_t value )
+{
+  uint8_t* bytes = p;
+
+  bytes[0] = (uint8_t)( value >> 24 );
+  bytes[1] = (uint8_t)( value >> 16 );
+  bytes[2] = (uint8_t)( value >> 8 );
+  bytes[3] = (uint8_t)value;
+}
+
+// fixed cells
+static inline uint32_t ud_get_cell_circ_id( const Cell* cell )
+{
+  return ud_load_be32( &cell->circ_id );
+}
+
+static inline void v_set_cell_circ_id( Cell* cell, uint32_t circ_id )
+{
+  v_store_be32( &cell->circ_id, circ_id );
+}
+
+static inline void v_set_netinfo_time( Cell* cell, uint32_t time )
+{
+  v_store_be32( &cell->payload.netinfo.time, time );
+}
+
+static inline void v_set_create2_handshake_type( Create2* create2, uint16_t handshake_type )
+{
+  v_store_be16( &create2->handshake_type, handshake_type );
+}
+
+static inline uint16_t ud_get_create2_handshake_length( const Create2* create2 )
+{
+  return ud_load_be16( &create2->handshake_length );
+}
+
+static inline void v_set_create2_handshake_length( Create2* create2, uint16_t handshake_length )
+{
+  v_store_be16( &create2->handshake_length, handshake_length );
+}
+
+// relay header, only valid once the payload is decrypted
+static inline uint16_t ud_get_relay_stream_id( const Cell* cell )
+{
+  return ud_load_be16( &cell->payload.relay.stream_id );
+}
+
+static inline void v_set_relay_stream_id( Cell* cell, uint16_t stream_id )
+{
+  v_store_be16( &cell->payload.relay.stream_id, stream_id );
+}
+
+static inline uint16_t ud_get_relay_length( const Cell* cell )
+{
+  return ud_load_be16( &cell->payload.relay.length );
+}
+
+static inline void v_set_relay_length( Cell* cell, uint16_t length )
+{
+  v_store_be16( &cell->payload.relay.length, length );
+}
+
+static inline uint16_t ud_get_introduce2_auth_key_length( const Cell* cell )
+{
+  return ud_load_be16( &cell->payload.relay.introduce2.auth_key_length );
+}
+
+static inline void v_set_establish_intro_auth_key_length( Cell* cell, uint16_t auth_key_length )
+{
+  v_store_be16( &cell->payload.relay.establish_intro.auth_key_length, auth_key_length );
+}
+
+// variable cells
+static inline void v_set_short_variable_circ_id( CellShortVariable* cell, uint16_t circ_id )
+{
+  v_store_be16( &cell->circ_id, circ_id );
+}
+
+static inline void v_set_short_variable_length( CellShortVariable* cell, uint16_t length )
+{
+  v_store_be16( &cell->length, length );
+}
+
+static inline void v_set_version( CellShortVariable* cell, int index, uint16_t version )
+{
+  v_store_be16( &cell->payload.versions[index], version );
+}
+
+static inline uint32_t ud_get_variable_circ_id( const CellVariable* cell )
+{
+  return ud_load_be32( &cell->circ_id );
+}
+
+static inline void v_set_variable_circ_id( CellVariable* cell, uint32_t circ_id )
+{
+  v_store_be32( &cell->circ_id, circ_id );
+}
+
+static inline void v_set_variable_length( CellVariable* cell, uint16_t length )
+{
+  v_store_be16( &cell->length, length );
+}
+
+static inline uint16_t ud_get_cert_length( const TorCert* cert )
+{
+  return ud_load_be16( &cert->cert_length );
+}
+
+static inline void v_set_cert_length( TorCert* cert, uint16_t cert_length )
+{
+  v_store_be16( &cert->cert_length, cert_length );
+}
+
+static inline void v_set_authenticate_auth_type( CellVariable* cell, uint16_t auth_type )
+{
+  v_store_be16( &cell->payload.authenticate.auth_type, auth_type );
+}
+
+static inline void v_set_authenticate_auth_length( CellVariable* cell, uint16_t auth_length )
+{
+  v_store_be16( &cell->payload.authenticate.auth_length, auth_length );
+}
+
+// reads at most length bytes into buf, returns how many or <= 0 on error
+typedef int ( *CellReader )( void* reader_data, uint8_t* buf, int length );
+
+void v_pad_cell( Cell* cell );
+
+Cell* px_take_pooled_cell();
+void v_give_pooled_cell( Cell* cell );
+int d_pooled_cell_count();
+
+// cells passed to the send functions must be MINITOR_CELL_LEN long, they
+// are returned to the cell pool once sent
 int d_send_cell_and_free( DlConnection* or_connection, Cell* cell );
 int d_send_relay_cell_and_free( DlConnection* or_connection, Cell* cell, DoublyLinkedOnionRelayList* relay_list, HsCrypto* hs_crypto );
+int d_encrypt_relay_cell( Cell* cell, DoublyLinkedOnionRelayList* relay_list, HsCrypto* hs_crypto );
 int d_recv_cell( WOLFSSL* ssl, uint8_t** cell, int circ_id_length );
+int d_recv_cell_from( CellReader reader, void* reader_data, uint8_t** cell, int circ_id_length );
+#ifdef MINITOR_BENCHMARK
+int d_socket_cell_reader( void* reader_data, uint8_t* buf, int length );
+#endif
+bool b_recognize_relay_cell( RelayCrypto* relay_crypto, Cell* cell );
 int d_decrypt_cell( Cell* cell, int circ_id_length, DoublyLinkedOnionRelayList* relay_list, HsCrypto* hs_crypto );
 
 #endif
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MINITOR_CIRCUIT_H
 
 #include "./structures/circuit.h"
+#include "./structures/crypto_job.h"
 
 #include "./cell.h"
 
@@ -28,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 //int d_build_random_onion_circuit( OnionCircuit* circuit, int circuit_length );
 //int d_build_onion_circuit_to( OnionCircuit* circuit, int circuit_length, OnionRelay* destination_relay );
 //int d_extend_onion_circuit_to( OnionCircuit* circuit, int circuit_length, OnionRelay* destination_relay );
+uint32_t ud_next_circ_id( int shard );
 int d_prepare_onion_circuit( OnionCircuit* onion_circuit, int length, OnionRelay* start_relay, OnionRelay* destination_relay );
 //int d_prepare_random_onion_circuit( OnionCircuit* circuit, int circuit_length, unsigned char* exclude );
 int d_get_suitable_relay( DoublyLinkedOnionRelayList* relay_list, int guard, uint8_t* exclude_start, uint8_t* exclude_end );
@@ -37,9 +39,9 @@ int d_destroy_onion_circuit( OnionCircuit* circuit, DlConnection* or_connection
 int d_router_truncate( OnionCircuit* circuit, DlConnection* or_connection, int new_length );
 //void v_handle_circuit( void* pv_parameters );
 int d_router_extend2( OnionCircuit* circuit, DlConnection* or_connection, int node_index );
-int d_router_extended2( OnionCircuit* circuit, int node_index, Cell* extended2_cell );
 int d_router_create2( OnionCircuit* circuit, DlConnection* or_connection );
-int d_router_created2( OnionCircuit* circuit, Cell* unpacked_cell );
+CryptoJob* px_router_ntor_job( OnionCircuit* circuit, int node_index, uint8_t* handshake_data );
+int d_router_ntor_job_finish( OnionCircuit* circuit, CryptoJob* job );
 int d_ntor_handshake_start( unsigned char* handshake_data, OnionRelay* relay, curve25519_key* key );
 int d_ntor_handshake_finish( uint8_t* handshake_data, DoublyLinkedOnionRelay* db_relay, curve25519_key* key );
 int d_router_handshake( WOLFSSL* ssl );
@@ -1,22 +1,32 @@
 #ifndef MINITOR_CONNECTIONS_H
 #define MINITOR_CONNECTIONS_H
 
+#include "../include/config.h"
 #include "./structures/circuit.h"
 #include "./structures/connections.h"
 
 extern MinitorMutex connections_mutex;
-extern MinitorMutex connection_access_mutex[16];
+extern MinitorMutex local_streams_mutex;
 extern DlConnection* connections;
 
 void v_cleanup_connection( DlConnection* dl_connection );
 void v_connections_daemon( void* pv_parameters );
 int d_attach_or_connection( uint32_t address, uint16_t port, OnionCircuit* circuit );
-int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, uint16_t port );
+int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, uint16_t port, int coalesce_ms );
 int d_forward_to_local_connection( uint32_t circ_id, uint32_t stream_id, uint8_t* data, uint32_t length );
 void v_cleanup_local_connection( uint32_t circ_id, uint32_t stream_id );
 void v_cleanup_local_connections_by_circ_id( uint32_t circ_id );
 bool b_verify_or_connection( uint32_t id );
 void v_dettach_connection( DlConnection* or_connection );
 DlConnection* px_get_conn_by_id_and_lock( uint32_t id );
+uint8_t* px_pop_connection_cell( DlConnection* dl_connection, int shard, int* length );
+bool b_connection_has_cells( DlConnection* dl_connection, int shard );
+void v_rearm_connection_cells( DlConnection* dl_connection, int shard );
+void v_get_backpressure_stats( BackpressureStats* stats );
+void v_connections_lane_dequeued();
+
+#ifdef MINITOR_BENCHMARK
+int d_attach_bench_or_connection( int sock_fd, OnionCircuit* circuit );
+#endif
 
 #endif
@@ -19,6 +19,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef MINITOR_CONSENSUS_H
 #define MINITOR_CONSENSUS_H
 
+#include "../include/config.h"
 #include "./structures/consensus.h"
 
 extern MinitorMutex fastest_cache_mutex;
@@ -28,5 +29,11 @@ void v_handle_crypto_and_insert( void* pv_parameters );
 int d_get_hs_time_period( time_t fresh_until, time_t valid_after, int hsdir_interval );
 int d_set_next_consenus();
 int d_fetch_consensus_info();
+void v_minitor_set_dir_authorities( const char** authorities, int count );
+void v_get_consensus_timings( ConsensusTimings* timings );
+
+#ifdef MINITOR_BENCHMARK
+int d_replay_consensus( const char* consensus_path, const char* descriptors_path );
+#endif
 
 #endif
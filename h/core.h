@@ -1,20 +1,29 @@
 #ifndef MINITOR_CORE_H
 #define MINITOR_CORE_H
 
+#include "../include/config.h"
 #include "./consensus.h"
 #include "./circuit.h"
 #include "./onion_service.h"
+#include "./structures/onion_message.h"
 
 void v_send_init_circuit( int length, CircuitStatus target_status, OnionService* service, int desc_index, int target_relay_index, OnionRelay* start_relay, OnionRelay* end_relay, HsCrypto* hs_crypto );
 void v_minitor_daemon( void* pv_parameters );
 void v_set_hsdir_timer( MinitorTimer hsdir_timer );
 int d_get_standby_count();
+int d_core_shard_for_circ_id( uint32_t circ_id );
+bool b_core_enqueue_ms( OnionMessage* onion_message, int ms );
+void v_core_enqueue_blocking( OnionMessage* onion_message );
+void v_core_enqueue_shard_blocking( OnionMessage* onion_message, int shard );
+void v_core_broadcast_blocking( OnionMessageType type, void* data );
+int d_core_lane_spaces( CoreLane lane );
+void v_core_get_lane_stats( CoreLaneStats* stats );
 
 extern MinitorTimer keepalive_timer;
 extern MinitorTimer timeout_timer;
 extern OnionCircuit* onion_circuits;
 extern OnionService* onion_services;
-extern MinitorQueue core_task_queue;
+extern CoreShard core_shards[MINITOR_CORE_SHARDS];
 extern MinitorMutex circuits_mutex;
 
 #endif
@@ -0,0 +1,31 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_CRYPTO_POOL_H
+#define MINITOR_CRYPTO_POOL_H
+
+#include "./structures/crypto_job.h"
+
+void v_crypto_pool_daemon( void* pv_parameters );
+bool b_submit_crypto_job( CryptoJob* job );
+void v_run_crypto_job( CryptoJob* job );
+void v_free_crypto_job( CryptoJob* job );
+
+extern MinitorQueue crypto_job_queue;
+
+#endif
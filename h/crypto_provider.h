@@ -0,0 +1,53 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_CRYPTO_PROVIDER_H
+#define MINITOR_CRYPTO_PROVIDER_H
+
+#include "user_settings.h"
+#include "wolfssl/wolfcrypt/aes.h"
+#include "wolfssl/wolfcrypt/sha.h"
+#include "wolfssl/wolfcrypt/sha3.h"
+#include "wolfssl/wolfcrypt/curve25519.h"
+
+// the primitives on the relay cell path, every backend works on the same
+// wolfcrypt contexts so keys are still set up and freed with wolfcrypt and a
+// backend only has to replace the calls it can do faster
+typedef struct MinitorCryptoProvider
+{
+  const char* name;
+  // 0 if the backend can run here
+  int ( *init )( void );
+  // counter mode in place or out of place, keeps the context's counter and
+  // unused keystream in step with wc_AesCtrEncrypt
+  int ( *aes_ctr )( Aes* aes, uint8_t* out, const uint8_t* in, uint32_t length );
+  int ( *sha_update )( Sha* sha, const uint8_t* data, uint32_t length );
+  int ( *sha3_256_update )( Sha3* sha3, const uint8_t* data, uint32_t length );
+  int ( *x25519_shared_secret )( curve25519_key* private_key, curve25519_key* public_key, uint8_t* out, word32* out_length );
+} MinitorCryptoProvider;
+
+extern const MinitorCryptoProvider* crypto_provider;
+
+int d_crypto_provider_init();
+
+#define MINITOR_AES_CTR( aes, out, in, length ) crypto_provider->aes_ctr( aes, out, in, length )
+#define MINITOR_SHA_UPDATE( sha, data, length ) crypto_provider->sha_update( sha, data, length )
+#define MINITOR_SHA3_256_UPDATE( sha3, data, length ) crypto_provider->sha3_256_update( sha3, data, length )
+#define MINITOR_X25519_SHARED_SECRET( private_key, public_key, out, out_length ) crypto_provider->x25519_shared_secret( private_key, public_key, out, out_length )
+
+#endif
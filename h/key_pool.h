@@ -0,0 +1,32 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_KEY_POOL_H
+#define MINITOR_KEY_POOL_H
+
+#include "user_settings.h"
+#include "wolfssl/wolfcrypt/curve25519.h"
+
+#include "./port_types.h"
+
+void v_key_pool_daemon( void* pv_parameters );
+int d_take_ephemeral_key( curve25519_key* key );
+
+extern MinitorQueue ephemeral_key_queue;
+
+#endif
@@ -0,0 +1,34 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_LOCK_PROFILE_H
+#define MINITOR_LOCK_PROFILE_H
+
+#include "../include/config.h"
+
+#ifdef MINITOR_LOCK_PROFILE
+#include "./port_types.h"
+#include "./structures/lock_profile.h"
+
+MinitorMutex px_lock_profile_create( const char* name );
+BaseType_t d_lock_profile_take( MinitorMutex mutex, TickType_t ticks, const char* file, int line );
+BaseType_t d_lock_profile_give( MinitorMutex mutex );
+int d_minitor_get_lock_stats( MinitorLockStats* stats, int max );
+#endif
+
+#endif
@@ -27,19 +27,22 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "./structures/circuit.h"
 #include "./structures/onion_message.h"
 #include "./structures/cell.h"
+#include "./structures/crypto_job.h"
 
 //void v_handle_onion_service( void* pv_parameters );
-void v_onion_service_handle_local_tcp_data( OnionCircuit* circuit, DlConnection* or_connection, ServiceTcpTraffic* tcp_traffic );
-void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connection, Cell* relay_cell );
+void v_onion_service_handle_local_tcp_data( OnionCircuit* circuit, DlConnection* or_connection, Cell* relay_cell );
+bool b_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connection, Cell* relay_cell );
 int d_onion_service_handle_relay_data( OnionService* onion_service, Cell* unpacked_cell );
 int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection* or_connection, Cell* begin_cell );
 //int d_onion_service_handle_relay_end( OnionService* onion_service, Cell* unpacked_cell );
 int d_onion_service_handle_relay_truncated( OnionCircuit* rend_circuit, DlConnection* or_connection, Cell* truncated_cell );
 void v_handle_local( void* pv_parameters );
 int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* unpacked_cell );
+int d_onion_service_introduce_2_crypto( CryptoJob* job );
+int d_onion_service_finish_introduce_2( OnionCircuit* intro_circuit, CryptoJob* job );
 int d_router_join_rendezvous( OnionCircuit* rend_circuit, DlConnection* or_connection, unsigned char* rendezvous_cookie, unsigned char* hs_pub_key, unsigned char* auth_input_mac );
-int d_verify_and_decrypt_introduce_2( OnionService* onion_service, Cell* introduce_cell, uint8_t num_extensions, uint8_t* client_pk, uint8_t* encrypted_data, OnionCircuit* intro_circuit, curve25519_key* client_handshake_key );
-int d_hs_ntor_handshake_finish( Cell* introduce_cell, uint8_t* client_pk, OnionCircuit* intro_circuit, curve25519_key* hs_handshake_key, curve25519_key* client_handshake_key, HsCrypto* hs_crypto, unsigned char* auth_input_mac );
+int d_verify_and_decrypt_introduce_2( uint8_t* current_sub_credential, uint8_t* previous_sub_credential, Cell* introduce_cell, uint8_t num_extensions, uint8_t* client_pk, uint8_t* encrypted_data, curve25519_key* encrypt_key, curve25519_key* client_handshake_key );
+int d_hs_ntor_handshake_finish( Cell* introduce_cell, uint8_t* client_pk, curve25519_key* encrypt_key, curve25519_key* hs_handshake_key, curve25519_key* client_handshake_key, HsCrypto* hs_crypto, unsigned char* auth_input_mac );
 //int d_send_descriptors( unsigned char* descriptor_text, int descriptor_length, DoublyLinkedOnionRelayList* target_relays );
 //int d_post_descriptor( unsigned char* descriptor_text, int descriptor_length, OnionCircuit* publish_circuit );
 int d_generate_outer_descriptor( char* filename, ed25519_key* descriptor_signing_key, long int valid_after, ed25519_key* blinded_key, int revision_counter );
@@ -6,6 +6,7 @@
 // INCLUDE LIBRARIES
 #include "stdlib.h"
 #include "esp_log.h"
+#include "esp_system.h"
 
 #include "lwip/sockets.h"
 
@@ -15,11 +16,31 @@
 //#define MINITOR_MALLOC( size ) malloc( size )
 //#define MINITOR_FREE( pointer ) free( pointer )
 
-#define MINITOR_MUTEX_CREATE() xSemaphoreCreateMutex()
+// the name groups mutexes in the lock profile, it is ignored otherwise
+#ifdef MINITOR_LOCK_PROFILE
+
+#include "./lock_profile.h"
+
+#define MINITOR_MUTEX_CREATE( name ) px_lock_profile_create( name )
+#define MINITOR_MUTEX_TAKE_MS( mutex, ms ) d_lock_profile_take( mutex, ms / portTICK_PERIOD_MS, __FILE__, __LINE__ )
+#define MINITOR_MUTEX_TAKE_BLOCKING( mutex ) d_lock_profile_take( mutex, portMAX_DELAY, __FILE__, __LINE__ )
+#define MINITOR_MUTEX_GIVE( mutex ) d_lock_profile_give( mutex )
+
+#else
+
+#define MINITOR_MUTEX_CREATE( name ) xSemaphoreCreateMutex()
 #define MINITOR_MUTEX_TAKE_MS( mutex, ms ) xSemaphoreTake( mutex, ms / portTICK_PERIOD_MS )
 #define MINITOR_MUTEX_TAKE_BLOCKING( mutex ) xSemaphoreTake( mutex, portMAX_DELAY )
 #define MINITOR_MUTEX_GIVE( mutex ) xSemaphoreGive( mutex )
 
+#endif
+
+#define MINITOR_SEMAPHORE_CREATE_COUNTING( max, initial ) xSemaphoreCreateCounting( max, initial )
+#define MINITOR_SEMAPHORE_TAKE_MS( semaphore, ms ) xSemaphoreTake( semaphore, ms / portTICK_PERIOD_MS )
+#define MINITOR_SEMAPHORE_TAKE_BLOCKING( semaphore ) xSemaphoreTake( semaphore, portMAX_DELAY )
+#define MINITOR_SEMAPHORE_GIVE( semaphore ) xSemaphoreGive( semaphore )
+#define MINITOR_SEMAPHORE_DELETE( semaphore ) vSemaphoreDelete( semaphore )
+
 #define MINITOR_TIMER_CREATE_MS( name, ms, repeat, timer_p, function ) xTimerCreate( name, ms / portTICK_PERIOD_MS, repeat, timer_p, function )
 #define MINITOR_TIMER_SET_MS_BLOCKING( timer, ms ) xTimerChangePeriod( timer, ms / portTICK_PERIOD_MS, portMAX_DELAY )
 #define MINITOR_TIMER_RESET_BLOCKING( timer ) xTimerReset( timer, portMAX_DELAY )
@@ -31,27 +52,44 @@
 #define MINITOR_DEQUEUE_MS( queue, pointer, ms ) xQueueReceive( queue, pointer, ms / portTICK_PERIOD_MS )
 #define MINITOR_DEQUEUE_BLOCKING( queue, pointer ) xQueueReceive( queue, pointer, portMAX_DELAY )
 #define MINITOR_QUEUE_MESSAGES_WAITING( queue ) uxQueueMessagesWaiting( queue )
+#define MINITOR_QUEUE_SPACES_AVAILABLE( queue ) uxQueueSpacesAvailable( queue )
 
 #define MINITOR_TASK_DELETE( task ) vTaskDelete( task )
 
 #define MINITOR_RANDOM() esp_random()
 #define MINITOR_FILL_RANDOM( dest, length ) esp_fill_random( dest, length )
+// bulk bytes for cell padding, a buffered stream seeded from MINITOR_FILL_RANDOM
+#define MINITOR_FILL_PADDING( dest, length ) v_fill_padding( dest, length )
 
 #define MINITOR_GET_TIME() esp_timer_get_time()
 
+#define MINITOR_HEAP_FREE() esp_get_free_heap_size()
+#define MINITOR_HEAP_MIN_FREE() esp_get_minimum_free_heap_size()
+
+#define MINITOR_LOG_LEVEL_ERROR 1
+#define MINITOR_LOG_LEVEL_DEBUG 2
+
+// every source file defines MINITOR_LOG_SUBSYSTEM as one of the
+// MINITOR_LOG_* levels from config.h, messages above it compile to nothing
 #ifdef DEBUG_MINITOR
 
-#define MINITOR_LOG ESP_LOGE
+#define MINITOR_LOG( tag, format, ... ) do { if ( MINITOR_LOG_SUBSYSTEM >= MINITOR_LOG_LEVEL_ERROR ) { ESP_LOGE( tag, format, ##__VA_ARGS__ ); } } while(0)
+#define MINITOR_LOG_DEBUG( tag, format, ... ) do { if ( MINITOR_LOG_SUBSYSTEM >= MINITOR_LOG_LEVEL_DEBUG ) { ESP_LOGI( tag, format, ##__VA_ARGS__ ); } } while(0)
 
 #else
 
 #define MINITOR_LOG( tag, format, ... ) do {} while(0)
+#define MINITOR_LOG_DEBUG( tag, format, ... ) do {} while(0)
 
 #endif
 
-bool b_create_core_task( MinitorTask* handle );
+bool b_create_core_task( MinitorTask* handle, int shard );
 bool b_create_connections_task( MinitorTask* handle );
 bool b_create_fetch_task( MinitorTask* handle, void* consensus );
 bool b_create_insert_task( MinitorTask* handle, void* consensus );
+bool b_create_crypto_task( MinitorTask* handle );
+bool b_create_key_pool_task( MinitorTask* handle );
+bool b_create_stats_task( MinitorTask* handle );
+bool b_create_bench_server_task( MinitorTask* handle, void* server );
 
 #endif
@@ -8,6 +8,7 @@
 
 // DEFINE TYPES
 typedef SemaphoreHandle_t MinitorMutex;
+typedef SemaphoreHandle_t MinitorSemaphore;
 typedef TimerHandle_t MinitorTimer;
 typedef QueueHandle_t MinitorQueue;
 typedef TaskHandle_t MinitorTask;
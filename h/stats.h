@@ -0,0 +1,65 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_STATS_H
+#define MINITOR_STATS_H
+
+#include "./structures/stats.h"
+
+typedef enum MinitorCounter
+{
+  STAT_CELLS_RECEIVED,
+  STAT_CELLS_SENT,
+  STAT_RELAY_CELLS_RECEIVED,
+  STAT_RELAY_CELLS_SENT,
+  STAT_CELLS_DISCARDED,
+  STAT_CELLS_UNRECOGNIZED,
+  STAT_STREAM_BYTES_IN,
+  STAT_STREAM_BYTES_OUT,
+  STAT_STREAMS_OPENED,
+  STAT_INTRODUCE2_RECEIVED,
+  STAT_INTRODUCE2_RATE_LIMITED,
+  STAT_INTRODUCE2_REJECTED,
+  STAT_INTRODUCE2_BUSY,
+  STAT_COUNTER_COUNT,
+} MinitorCounter;
+
+typedef enum MinitorLatencyType
+{
+  LATENCY_HOP_HANDSHAKE,
+  LATENCY_NTOR_CRYPTO,
+  LATENCY_INTRODUCE2_CRYPTO,
+  LATENCY_RENDEZVOUS,
+  LATENCY_LOCAL_FIRST_BYTE,
+  LATENCY_TYPE_COUNT,
+} MinitorLatencyType;
+
+extern uint32_t minitor_counters[STAT_COUNTER_COUNT];
+
+// relaxed atomics, any task can count without taking a lock
+#define MINITOR_STAT_ADD( counter, amount ) __atomic_fetch_add( &minitor_counters[counter], amount, __ATOMIC_RELAXED )
+#define MINITOR_STAT_INC( counter ) MINITOR_STAT_ADD( counter, 1 )
+
+void v_stats_record_latency( MinitorLatencyType type, int64_t us );
+void v_stats_record_message( OnionMessageType type, int64_t wait_us, int64_t service_us );
+int d_minitor_get_message_stats( MinitorMessageStats* stats );
+int d_minitor_get_stats( MinitorStats* stats );
+int d_minitor_get_connection_stats( MinitorConnectionStats* stats, int max );
+void v_stats_daemon( void* pv_parameters );
+
+#endif
@@ -28,18 +28,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define PK_ENC_LEN 128
 #define PK_PAD_LEN 42
 #define HASH_LEN 20
-#define PAYLOAD_LEN CELL_LEN - 5
-#define RELAY_PAYLOAD_LEN PAYLOAD_LEN - 11
+#define PAYLOAD_LEN ( CELL_LEN - 5 )
+#define RELAY_PAYLOAD_LEN ( PAYLOAD_LEN - 11 )
 #define MAC_LEN 32
 #define PK_PUBKEY_LEN 32
 #define TAP_C_HANDSHAKE_LEN DH_LEN+KEY_LEN+PK_PAD_LEN
 #define TAP_S_HANDSHAKE_LEN DH_LEN+HASH_LEN
 #define LEGACY_RENDEZVOUS_PAYLOAD_LEN 168
 #define FIXED_CELL_OFFSET 2
-#define MINITOR_CELL_LEN CELL_LEN + FIXED_CELL_OFFSET
+#define MINITOR_CELL_LEN ( CELL_LEN + FIXED_CELL_OFFSET )
 #define FIXED_CELL_HEADER_SIZE 5
 #define VARIABLE_CELL_HEADER_SIZE 7
 #define RELAY_CELL_HEADER_SIZE 11
+#define STREAM_SENDME_INCREMENT 50
 
 #define NTOR_HANDSHAKE_TAG "ntorNTORntorNTOR\0"
 
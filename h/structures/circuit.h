@@ -57,13 +57,17 @@ typedef struct IntroCrypto
 
 typedef struct HsCrypto
 {
-  Sha3 hs_running_sha_forward;
+  // double buffered the same way as running_sha_backward in RelayCrypto
+  Sha3 hs_running_sha_forward[2];
+  uint8_t hs_sha_forward_index;
   Sha3 hs_running_sha_backward;
   Aes hs_aes_forward;
   Aes hs_aes_backward;
   uint8_t rendezvous_cookie[20];
   uint8_t point[PK_PUBKEY_LEN];
   uint8_t auth_input_mac[MAC_LEN];
+  // when the INTRODUCE2 that started this rendezvous arrived
+  int64_t introduce_us;
 } HsCrypto;
 
 typedef struct OnionCircuit
@@ -84,6 +88,13 @@ typedef struct OnionCircuit
   int desc_index;
   int target_relay_index;
   int relay_early_count;
+  // a crypto worker has a handshake for this circuit, only the core task
+  // reads or writes it
+  bool crypto_pending;
+  // INTRODUCE2 handshakes out on workers, each job has its own key copies
+  uint8_t intro_jobs_pending;
+  // when the last CREATE2 or EXTEND2 went out, for the handshake latency stat
+  int64_t handshake_start_us;
 } OnionCircuit;
 
 extern unsigned int circ_id_counter;
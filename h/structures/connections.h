@@ -23,6 +23,25 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "wolfssl/ssl.h"
 #include "wolfssl/wolfcrypt/rsa.h"
 
+#include "../../include/config.h"
+#include "../port_types.h"
+
+// must be a power of 2
+#define CELL_RING_SIZE 32
+
+// cells from the connections daemon to one core shard, single producer single
+// consumer, the daemon only moves end and the core task only moves start, both
+// run freely and are masked on use
+typedef struct CellRing
+{
+  uint32_t start;
+  uint32_t end;
+  uint8_t* buf[CELL_RING_SIZE];
+  int length[CELL_RING_SIZE];
+  // set when the shard has been told about cells in the ring
+  bool notified;
+} CellRing;
+
 typedef enum ConnectionStatus
 {
   CONNECTION_WANT_VERSIONS,
@@ -42,11 +61,35 @@ typedef struct DlConnection
   uint16_t port;
   WOLFSSL* ssl;
   int sock_fd;
+  // slot_index is fixed for the life of the connection, poll_index is only
+  // valid inside the connections daemon and changes when the poll set is rebuilt
+  int slot_index;
   int poll_index;
-  int mutex_index;
+  MinitorMutex access_mutex;
   uint32_t circ_id;
   uint16_t stream_id;
   time_t last_action;
+  // local connections hold reads here until a full RELAY_DATA
+  // payload is ready or the coalesce deadline passes
+  struct Cell* coalesce_cell;
+  int coalesce_length;
+  int coalesce_ms;
+  int64_t coalesce_deadline;
+  // when the stream was opened, cleared once its first RELAY_DATA goes out
+  int64_t begin_us;
+  // local stream table chains and data from the circuit the local server
+  // hasn't accepted yet, guarded by local_streams_mutex
+  struct DlConnection* stream_next;
+  struct DlConnection* circ_stream_next;
+  struct DlConnection* pollout_next;
+  bool pollout_requested;
+  uint8_t* output_buf;
+  int output_length;
+  int output_capacity;
+  int delivered_cells;
+  bool close_pending;
+  // the client ended the stream or the circuit is gone, close without a RELAY_END
+  bool close_quietly;
   uint8_t is_or;
   uint8_t* responder_rsa_identity_key_der;
   int responder_rsa_identity_key_der_size;
@@ -56,11 +99,25 @@ typedef struct DlConnection
   Sha256 responder_sha;
   RsaKey initiator_rsa_auth_key;
   bool has_versions;
-  uint32_t cell_ring_start;
-  uint32_t cell_ring_end;
-  uint8_t* cell_ring_buf[20];
+  // one ring per core shard, cells go to the shard that owns their circ_id
+  CellRing cell_rings[MINITOR_CORE_SHARDS];
+  // set by the daemon when a ring filled up and it stopped reading
+  bool reads_paused;
+  // only ever read for stats, a torn read is fine
+  uint32_t cells_received;
+  uint32_t cells_sent;
 } DlConnection;
 
+// how often and for how long the connections daemon stopped reading because
+// the core task had no room for what it would read
+typedef struct BackpressureStats
+{
+  uint32_t or_events;
+  int64_t or_us;
+  uint32_t local_events;
+  int64_t local_us;
+} BackpressureStats;
+
 void v_add_connection_to_list( DlConnection* connection, DlConnection** list );
 void v_remove_connection_from_list( DlConnection* connection, DlConnection** list );
 
@@ -61,7 +61,10 @@ typedef struct OnionRelay {
 
 typedef struct RelayCrypto {
   Sha running_sha_forward;
-  Sha running_sha_backward;
+  // the live backward digest is running_sha_backward[sha_backward_index],
+  // the other one is scratch for checking cells and becomes live on a match
+  Sha running_sha_backward[2];
+  uint8_t sha_backward_index;
   Aes aes_forward;
   Aes aes_backward;
   unsigned char nonce[DIGEST_LEN];
@@ -81,6 +84,34 @@ typedef struct DoublyLinkedOnionRelayList {
   DoublyLinkedOnionRelay* tail;
 } DoublyLinkedOnionRelayList;
 
+// one stage of fetching the consensus, items are relays except for the raw
+// download and store stages where only bytes count
+typedef struct ConsensusStage {
+  uint32_t items;
+  uint32_t bytes;
+  uint32_t us;
+} ConsensusStage;
+
+// where the time went on the last consensus download or replay, the fetch
+// tasks run side by side so their stages can add up to more than the wall time
+typedef struct ConsensusTimings {
+  uint32_t wall_us;
+  // consensus bytes coming off the socket, or the file when replaying
+  ConsensusStage download;
+  // appending the consensus to the sd card
+  ConsensusStage store;
+  // splitting the consensus into relays
+  ConsensusStage parse;
+  // descriptor requests from connect to the last byte
+  ConsensusStage fetch;
+  // pulling the keys out of the descriptors, part of fetch
+  ConsensusStage descriptor_parse;
+  // the two sha3 hsdir index hashes per relay
+  ConsensusStage id_hash;
+  // writing the relays into the staging lists on the sd card
+  ConsensusStage insert;
+} ConsensusTimings;
+
 void v_add_relay_to_list( DoublyLinkedOnionRelay* node, DoublyLinkedOnionRelayList* list );
 void v_pop_relay_from_list_back( DoublyLinkedOnionRelayList* list );
 OnionRelay* px_get_relay_by_index( DoublyLinkedOnionRelayList* list, int index );
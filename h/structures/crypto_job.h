@@ -0,0 +1,68 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_STRUCTURES_CRYPTO_JOB_H
+#define MINITOR_STRUCTURES_CRYPTO_JOB_H
+
+#include "user_settings.h"
+#include "wolfssl/wolfcrypt/curve25519.h"
+#include "wolfssl/wolfcrypt/sha256.h"
+#include "wolfssl/wolfcrypt/sha3.h"
+
+#include "../constants.h"
+#include "./consensus.h"
+#include "./cell.h"
+#include "./circuit.h"
+
+typedef enum CryptoJobType
+{
+  // finish the ntor handshake from a CREATED2 or EXTENDED2 cell
+  CRYPTO_JOB_NTOR,
+  // verify and decrypt an INTRODUCE2 cell and run the hs_ntor handshake
+  CRYPTO_JOB_INTRODUCE_2,
+} CryptoJobType;
+
+// everything a worker needs is copied into the job, a worker never touches a
+// circuit, the core checks the circuit is still alive when the result comes
+// back and throws the result away if it isn't
+typedef struct CryptoJob
+{
+  CryptoJobType type;
+  OnionCircuit* circuit;
+  uint32_t circ_id;
+  int result;
+  // CRYPTO_JOB_NTOR
+  int node_index;
+  uint8_t handshake_data[G_LENGTH + WC_SHA256_DIGEST_SIZE];
+  OnionRelay relay;
+  DoublyLinkedOnionRelay db_relay;
+  curve25519_key handshake_key;
+  // CRYPTO_JOB_INTRODUCE_2, the cell is decrypted in place
+  Cell* cell;
+  int64_t received_us;
+  curve25519_key encrypt_key;
+  uint8_t current_sub_credential[WC_SHA3_256_DIGEST_SIZE];
+  uint8_t previous_sub_credential[WC_SHA3_256_DIGEST_SIZE];
+  // offset of the decrypted section in the cell
+  int decrypted_offset;
+  HsCrypto* hs_crypto;
+  uint8_t hs_point[PK_PUBKEY_LEN];
+  uint8_t auth_input_mac[MAC_LEN];
+} CryptoJob;
+
+#endif
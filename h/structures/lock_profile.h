@@ -0,0 +1,41 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_STRUCTURES_LOCK_PROFILE_H
+#define MINITOR_STRUCTURES_LOCK_PROFILE_H
+
+#include <stdint.h>
+
+// totals for every mutex created with the same name, the call sites are
+// where the longest wait and the longest hold started
+typedef struct MinitorLockStats
+{
+  const char* name;
+  uint32_t acquisitions;
+  uint32_t timeouts;
+  uint32_t total_wait_us;
+  uint32_t max_wait_us;
+  const char* max_wait_file;
+  int max_wait_line;
+  uint32_t total_hold_us;
+  uint32_t max_hold_us;
+  const char* max_hold_file;
+  int max_hold_line;
+} MinitorLockStats;
+
+#endif
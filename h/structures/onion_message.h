@@ -24,9 +24,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 typedef enum OnionMessageType
 {
+  // data is a conn_id with cells waiting in its cell ring, sent once per
+  // batch, both handshake and live cells
   TOR_CELL,
+  // data is a pooled Cell with circ_id, stream_id, relay_command and
+  // payload already set by the connections daemon
   SERVICE_TCP_DATA,
-  CONN_HANDSHAKE,
   CONN_READY,
   CONN_CLOSE,
   INIT_SERVICE,
@@ -35,23 +38,48 @@ typedef enum OnionMessageType
   TIMER_KEEPALIVE,
   TIMER_HSDIR,
   TIMER_CIRCUIT_TIMEOUT,
+  // data is a finished CryptoJob from a crypto worker
+  CRYPTO_RESULT,
 } OnionMessageType;
 
+typedef enum CoreLane
+{
+  CORE_LANE_CONTROL,
+  CORE_LANE_BULK,
+  CORE_LANE_COUNT,
+} CoreLane;
+
+typedef struct CoreLaneStats
+{
+  uint32_t enqueued;
+  uint32_t dequeued;
+  // enqueue attempts that timed out on a full lane
+  uint32_t rejected;
+  uint32_t high_water;
+} CoreLaneStats;
+
+// one core task's queues, circuits are owned by the shard their circ_id hashes
+// to and only that shard's task builds, tears down or times them out
+typedef struct CoreShard
+{
+  MinitorQueue lane_queues[CORE_LANE_COUNT];
+  // counts messages across both lanes, the shard's task sleeps on it
+  MinitorSemaphore wake_semaphore;
+  CoreLaneStats lane_stats[CORE_LANE_COUNT];
+  int control_streak;
+  // seconds until the next of this shard's circuits would time out
+  time_t timeout_left;
+} CoreShard;
+
 typedef struct OnionMessage
 {
   OnionMessageType type;
   int length;
   void* data;
+  // stamped when it goes on a core lane, for the queue wait histogram
+  int64_t enqueued_us;
 } OnionMessage;
 
-typedef struct ServiceTcpTraffic
-{
-  int circ_id;
-  int stream_id;
-  int length;
-  unsigned char* data;
-} ServiceTcpTraffic;
-
 typedef struct CreateCircuitRequest
 {
   int length;
@@ -43,6 +43,7 @@ typedef struct OnionService
   struct OnionService* previous;
   unsigned short exit_port;
   unsigned short local_port;
+  unsigned int local_coalesce_ms;
   ed25519_key master_key;
   unsigned char current_sub_credential[WC_SHA3_256_DIGEST_SIZE];
   unsigned char previous_sub_credential[WC_SHA3_256_DIGEST_SIZE];
@@ -0,0 +1,106 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_STRUCTURES_STATS_H
+#define MINITOR_STRUCTURES_STATS_H
+
+#include <stdint.h>
+
+#include "./circuit.h"
+#include "./connections.h"
+#include "./onion_message.h"
+
+#define CIRCUIT_STATUS_COUNT ( CIRCUIT_RENDEZVOUS + 1 )
+#define ONION_MESSAGE_TYPE_COUNT ( CRYPTO_RESULT + 1 )
+// bucket 0 is under 2us, bucket n holds 2^n up to 2^(n+1) us and the last
+// bucket takes everything past about 8 seconds
+#define MINITOR_HISTOGRAM_BUCKETS 24
+
+// the sums are 64 bit, 32 bits of microseconds wraps in about 71 minutes
+typedef struct MinitorLatency
+{
+  uint32_t count;
+  uint64_t total_us;
+  uint32_t max_us;
+} MinitorLatency;
+
+typedef struct MinitorHistogram
+{
+  uint32_t count;
+  uint64_t total_us;
+  uint32_t buckets[MINITOR_HISTOGRAM_BUCKETS];
+} MinitorHistogram;
+
+// indexed by OnionMessageType, wait is from enqueue to dispatch on the core
+// task and service is how long the handler ran
+typedef struct MinitorMessageStats
+{
+  MinitorHistogram wait[ONION_MESSAGE_TYPE_COUNT];
+  MinitorHistogram service[ONION_MESSAGE_TYPE_COUNT];
+} MinitorMessageStats;
+
+// a snapshot from d_minitor_get_stats, counters only go up from start
+typedef struct MinitorStats
+{
+  uint32_t cells_received;
+  uint32_t cells_sent;
+  uint32_t relay_cells_received;
+  uint32_t relay_cells_sent;
+  uint32_t cells_discarded;
+  uint32_t cells_unrecognized;
+  // bytes between the circuit and the local server
+  uint32_t stream_bytes_in;
+  uint32_t stream_bytes_out;
+  uint32_t streams_opened;
+  uint32_t introduce2_received;
+  uint32_t introduce2_rate_limited;
+  uint32_t introduce2_rejected;
+  // dropped because the intro circuit already had its limit of handshakes out
+  uint32_t introduce2_busy;
+  // CREATE2 or EXTEND2 sent to CREATED2 or EXTENDED2 received
+  MinitorLatency hop_handshake;
+  // time a crypto job spent in the handshake math
+  MinitorLatency ntor_crypto;
+  MinitorLatency introduce2_crypto;
+  // INTRODUCE2 received to RENDEZVOUS1 sent, including building the circuit
+  MinitorLatency rendezvous;
+  // RELAY_BEGIN to the first RELAY_DATA from the local server, how long the
+  // local server takes to answer, the client also waits on the circuit
+  MinitorLatency local_first_byte;
+  // gauges, read when the snapshot is taken
+  uint32_t circuits[CIRCUIT_STATUS_COUNT];
+  uint32_t or_connections;
+  uint32_t local_connections;
+  CoreLaneStats lanes[CORE_LANE_COUNT];
+  BackpressureStats backpressure;
+  uint32_t pooled_cells;
+  uint32_t heap_free;
+  uint32_t heap_min_free;
+} MinitorStats;
+
+typedef struct MinitorConnectionStats
+{
+  uint32_t conn_id;
+  uint32_t address;
+  uint16_t port;
+  uint8_t is_or;
+  uint32_t cells_received;
+  uint32_t cells_sent;
+} MinitorConnectionStats;
+
+#endif
@@ -0,0 +1,65 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef MINITOR_TRACE_H
+#define MINITOR_TRACE_H
+
+#include <stdint.h>
+
+#include "../include/config.h"
+
+typedef enum MinitorTraceEventId
+{
+  // circ_id, command
+  TRACE_CELL_RECEIVED = 1,
+  // circ_id, command
+  TRACE_CELL_DISCARDED,
+  // circ_id, 0
+  TRACE_CELL_UNRECOGNIZED,
+  // circ_id, command
+  TRACE_CELL_SENT,
+  // stream_id, length
+  TRACE_STREAM_DATA_IN,
+  // stream_id, relay_command
+  TRACE_STREAM_DATA_OUT,
+  // message type, shard
+  TRACE_CORE_MESSAGE,
+} MinitorTraceEventId;
+
+typedef struct MinitorTraceEvent
+{
+  // position in the ring plus one, 0 while the slot is being written
+  uint32_t sequence;
+  // low 32 bits of MINITOR_GET_TIME
+  uint32_t time;
+  uint16_t event;
+  uint32_t arg0;
+  uint32_t arg1;
+} MinitorTraceEvent;
+
+#if MINITOR_TRACE_SIZE > 0
+#define MINITOR_TRACE( event, arg0, arg1 ) v_minitor_trace( event, arg0, arg1 )
+#else
+#define MINITOR_TRACE( event, arg0, arg1 ) do {} while(0)
+#endif
+
+void v_minitor_trace( uint16_t event, uint32_t arg0, uint32_t arg1 );
+int d_minitor_trace_read( MinitorTraceEvent* events, int max );
+void v_minitor_trace_dump();
+
+#endif
@@ -25,10 +25,74 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MINITOR_DIR_ADDR_STR "204.13.164.118"
 #define MINITOR_DIR_PORT 80
 //#define MINITOR_CHUTNEY
+// offer the esp32 aes peripheral for relay cell encryption, it is only used
+// if it passes its self test and beats wolfcrypt when Minitor starts
+//#define MINITOR_ESP_AES
+// benchmark cell crypto, framing, encoding, ntor, a consensus replay and
+// streams over a loopback rendezvous circuit when Minitor starts and print
+// the results as one json object per line
+//#define MINITOR_BENCHMARK
 #define MINITOR_CHUTNEY_ADDRESS 0x7602a8c0
 #define MINITOR_CHUTNEY_ADDRESS_STR "192.168.2.118"
 #define MINITOR_CHUTNEY_DIR_PORT 7000
 #define FILESYSTEM_PREFIX "/sdcard/"
+// a recorded consensus and the bare server descriptors of its hsdir relays,
+// in consensus order, that MINITOR_BENCHMARK replays through the bootstrap
+#define MINITOR_REPLAY_CONSENSUS FILESYSTEM_PREFIX "replay/consensus"
+#define MINITOR_REPLAY_DESCRIPTORS FILESYSTEM_PREFIX "replay/descriptors"
+// how long a local read waits for more data before being sent as a partial
+// RELAY_DATA cell, 0 sends every read immediately
+#define MINITOR_LOCAL_COALESCE_MS 20
+// number of freed cells kept around for reuse instead of going back to the heap
+#define MINITOR_CELL_POOL_SIZE 8
+// bytes waiting for a slow local server before we stop sending stream SENDMEs
+#define MINITOR_LOCAL_OUTPUT_HIGH_WATER 4096
+// bytes waiting for a local server before the stream is closed
+#define MINITOR_LOCAL_OUTPUT_MAX 32768
+// upper bound on open OR and local connections, slots are allocated 16 at a time
+#define MINITOR_CONNECTIONS_MAX 64
+// most messages the core task takes off its queue per wakeup
+#define MINITOR_CORE_BATCH 16
+// the core queue has a control lane for timers, handshakes and circuit work
+// and a bulk lane for local stream data, each with its own depth
+#define MINITOR_CORE_CONTROL_DEPTH 25
+#define MINITOR_CORE_BULK_DEPTH 25
+// 0 always serves the control lane first, N lets one bulk message through
+// after N control messages in a row so stream data can't be starved
+#define MINITOR_CORE_BULK_WEIGHT 4
+// core tasks, rendezvous and standby circuits are spread across them by
+// circ_id, everything else stays on the first one
+#define MINITOR_CORE_SHARDS 1
+// tasks that finish ntor and INTRODUCE2 handshakes off the core task, 0 runs
+// them all on the core task
+#define MINITOR_CRYPTO_WORKERS 1
+// handshakes waiting for a worker before the core runs new ones itself
+#define MINITOR_CRYPTO_QUEUE_DEPTH 8
+// INTRODUCE2 handshakes one intro circuit can have out at once, so intros that
+// fail their MAC can't hold the circuit against real clients
+#define MINITOR_INTRO_JOBS_PER_CIRCUIT 4
+// ephemeral curve25519 keypairs made ahead of time by an idle priority task
+// for CREATE2, EXTEND2 and INTRODUCE2, 0 makes every key when it is needed
+#define MINITOR_KEY_POOL_SIZE 4
+// bytes of cell padding drawn from one chacha20 key before it is replaced with
+// a fresh one from the hardware rng
+#define MINITOR_PADDING_RESEED_BYTES 65536
+// log level for each subsystem when DEBUG_MINITOR is defined, 0 is silent, 1
+// logs errors and 2 adds per cell debug messages, lower levels aren't built in
+#define MINITOR_LOG_CORE 1
+#define MINITOR_LOG_CELL 1
+#define MINITOR_LOG_CIRCUIT 1
+#define MINITOR_LOG_CONNECTIONS 1
+#define MINITOR_LOG_CONSENSUS 1
+#define MINITOR_LOG_ONION_SERVICE 1
+#define MINITOR_LOG_CRYPTO 1
+// events kept in the binary trace ring, a power of 2, 0 compiles tracing out
+#define MINITOR_TRACE_SIZE 256
+// serve the runtime stats in prometheus text format on 127.0.0.1 at this port,
+// undefined builds without the endpoint
+//#define MINITOR_STATS_PORT 9035
+// time every mutex take and hold, read back with d_minitor_get_lock_stats
+//#define MINITOR_LOCK_PROFILE
 
 extern const char* tor_authorities[];
 extern int tor_authorities_count;
@@ -19,10 +19,29 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef MINITOR_MINITOR_H
 #define MINITOR_MINITOR_H
 
+#include "./config.h"
 #include "../h/structures/onion_service.h"
 #include "../h/structures/circuit.h"
+#include "../h/structures/stats.h"
+#include "../h/structures/lock_profile.h"
 
+// directory authorities to fetch the consensus from in place of the built in
+// list, each "ip dirport=port", call before d_minitor_INIT and keep the array
+void v_minitor_set_dir_authorities( const char** authorities, int count );
 int d_minitor_INIT();
 int d_setup_onion_service( unsigned short local_port, unsigned short exit_port, const char* onion_service_directory );
+int d_setup_onion_service_ex( unsigned short local_port, unsigned short exit_port, const char* onion_service_directory, unsigned int coalesce_ms );
+// prints the binary trace ring to stdout, oldest event first
+void v_minitor_trace_dump();
+// fills in a snapshot of the daemon wide counters and gauges
+int d_minitor_get_stats( MinitorStats* stats );
+// fills up to max entries with per connection cell counts, returns how many
+int d_minitor_get_connection_stats( MinitorConnectionStats* stats, int max );
+// copies the queue wait and handler time histograms for each core message type
+int d_minitor_get_message_stats( MinitorMessageStats* stats );
+#ifdef MINITOR_LOCK_PROFILE
+// wait and hold times for each named mutex, returns how many were filled
+int d_minitor_get_lock_stats( MinitorLockStats* stats, int max );
+#endif
 
 #endif
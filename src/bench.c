@@ -0,0 +1,2152 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "../include/config.h"
+
+#ifdef MINITOR_BENCHMARK
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "user_settings.h"
+#include "wolfssl/wolfcrypt/sha.h"
+#include "wolfssl/wolfcrypt/sha3.h"
+#include "wolfssl/wolfcrypt/aes.h"
+#include "wolfssl/wolfcrypt/hmac.h"
+#include "wolfssl/wolfcrypt/random.h"
+#include "wolfssl/wolfcrypt/curve25519.h"
+#include "wolfssl/wolfcrypt/ed25519.h"
+
+#include "../h/port.h"
+#include "../h/constants.h"
+#include "../h/cell.h"
+#include "../h/circuit.h"
+#include "../h/encoding.h"
+#include "../h/crypto_provider.h"
+#include "../h/consensus.h"
+#include "../h/connections.h"
+#include "../h/core.h"
+#include "../h/stats.h"
+#include "../h/bench.h"
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CRYPTO
+
+static const char* BENCH_TAG = "MINITOR BENCH";
+
+// cells run through each cell benchmark, they are MINITOR_CELL_LEN apart
+#define BENCH_CELLS 32
+// the most hops a relay benchmark builds
+#define BENCH_MAX_HOPS 3
+// bytes base64 encoded and decoded per round, a multiple of 3 so there is no
+// partial group at the end
+#define BENCH_ENCODE_LENGTH 1023
+#define BENCH_ENCODE_ROUNDS 16
+// an onion address is 35 bytes before it is base32 encoded
+#define BENCH_ONION_ADDRESS_LENGTH 35
+#define BENCH_NTOR_ROUNDS 4
+// bytes of data in each benchmark relay cell, the rest is padding
+#define BENCH_RELAY_DATA_LENGTH 256
+// streams opened on the loopback circuit and what the local server sends on
+// each of them
+#define BENCH_STREAMS 4
+#define BENCH_STREAM_LENGTH ( 256 * 1024 )
+#define BENCH_SERVER_CHUNK 1024
+#define BENCH_STREAM_TIMEOUT_S 10
+// intros answered on the loopback link, each gets its own standby circuit
+#define BENCH_RENDEZVOUS_ROUNDS 4
+// hops the service builds before it is asked to extend to a rendezvous point
+#define BENCH_STANDBY_HOPS 2
+#define BENCH_REND_OR_PORT 9001
+
+typedef struct BenchStream
+{
+  uint8_t* data;
+  int length;
+  int offset;
+} BenchStream;
+
+typedef struct BenchServer
+{
+  int listen_fd;
+  int streams;
+  int length;
+  MinitorSemaphore done;
+} BenchServer;
+
+// the client's end of the loopback rendezvous circuit, its keys are made
+// from the hop numbers like the service's end so the two match
+typedef struct BenchClient
+{
+  int relay_fd;
+  uint32_t circ_id;
+  RelayCrypto relay_cryptos[BENCH_MAX_HOPS];
+  HsCrypto hs_crypto;
+} BenchClient;
+
+// the client, the intro point and the relays of the rendezvous benchmark.
+// the intro point and the standby circuit's hops have keys made from their
+// hop numbers like the service's ends, the rendezvous point is a real ntor
+// responder so the service's last hop gets keys from a handshake
+typedef struct BenchRendezvous
+{
+  int relay_fd;
+  WC_RNG rng;
+  OnionService* service;
+  OnionCircuit* intro_circuit;
+  RelayCrypto intro_cryptos[BENCH_MAX_HOPS];
+  RelayCrypto standby_cryptos[BENCH_STANDBY_HOPS];
+  OnionRelay rend_relay;
+  curve25519_key rend_onion_key;
+} BenchRendezvous;
+
+// one json object per line so the results can be pulled out of the console
+// output with grep and compared between builds
+static void v_bench_report( const char* name, int ops, int64_t elapsed_us )
+{
+  if ( elapsed_us <= 0 )
+  {
+    elapsed_us = 1;
+  }
+
+  printf(
+    "{\"bench\":\"%s\",\"ops\":%d,\"us\":%lld,\"ns_per_op\":%lld,\"ops_per_sec\":%lld}\n",
+    name,
+    ops,
+    (long long)elapsed_us,
+    (long long)( elapsed_us * 1000 / ops ),
+    (long long)( ops * 1000000LL / elapsed_us )
+  );
+}
+
+// a consensus stage counts relays and bytes rather than ops
+static void v_bench_report_stage( const char* name, ConsensusStage* stage )
+{
+  uint32_t us = stage->us;
+
+  if ( us == 0 )
+  {
+    us = 1;
+  }
+
+  printf(
+    "{\"bench\":\"consensus_replay_%s\",\"relays\":%u,\"bytes\":%u,\"us\":%u,\"relays_per_sec\":%lld,\"bytes_per_sec\":%lld}\n",
+    name,
+    (unsigned int)stage->items,
+    (unsigned int)stage->bytes,
+    (unsigned int)stage->us,
+    (long long)stage->items * 1000000LL / us,
+    (long long)stage->bytes * 1000000LL / us
+  );
+}
+
+// the digest check as it was before running_sha_backward was double
+// buffered, a copy out to a temporary and a copy back on a match
+static bool b_recognize_relay_cell_copy( RelayCrypto* relay_crypto, Cell* cell )
+{
+  Sha tmp_sha;
+  unsigned char zeros[4] = { 0 };
+  unsigned char tmp_digest[WC_SHA_DIGEST_SIZE];
+
+  wc_ShaCopy( &relay_crypto->running_sha_backward[relay_crypto->sha_backward_index], &tmp_sha );
+
+  MINITOR_SHA_UPDATE( &tmp_sha, (uint8_t*)(&cell->payload), 5 );
+  MINITOR_SHA_UPDATE( &tmp_sha, zeros, 4 );
+  MINITOR_SHA_UPDATE( &tmp_sha, (uint8_t*)(&cell->payload.relay.length), PAYLOAD_LEN - 9 );
+  wc_ShaGetHash( &tmp_sha, tmp_digest );
+
+  if ( memcmp( tmp_digest, (uint8_t*)(&cell->payload.relay.digest), 4 ) != 0 )
+  {
+    wc_ShaFree( &tmp_sha );
+
+    return false;
+  }
+
+  wc_ShaCopy( &tmp_sha, &relay_crypto->running_sha_backward[relay_crypto->sha_backward_index] );
+  wc_ShaFree( &tmp_sha );
+
+  return true;
+}
+
+// both ends of a hop are set up from the hop number so a sender and a
+// receiver made for the same hop share keys and digests
+static void v_bench_init_hop( RelayCrypto* relay_crypto, int hop )
+{
+  int i;
+  uint8_t key[KEY_LEN];
+  uint8_t aes_iv[16] = { 0 };
+
+  for ( i = 0; i < KEY_LEN; i++ )
+  {
+    key[i] = hop * KEY_LEN + i;
+  }
+
+  wc_InitSha( &relay_crypto->running_sha_forward );
+  wc_InitSha( &relay_crypto->running_sha_backward[0] );
+  wc_InitSha( &relay_crypto->running_sha_backward[1] );
+  relay_crypto->sha_backward_index = 0;
+
+  wc_ShaUpdate( &relay_crypto->running_sha_forward, key, KEY_LEN );
+  wc_ShaUpdate( &relay_crypto->running_sha_backward[0], key, KEY_LEN );
+
+  wc_AesInit( &relay_crypto->aes_forward, NULL, INVALID_DEVID );
+  wc_AesInit( &relay_crypto->aes_backward, NULL, INVALID_DEVID );
+  wc_AesSetKeyDirect( &relay_crypto->aes_forward, key, KEY_LEN, aes_iv, AES_ENCRYPTION );
+  wc_AesSetKeyDirect( &relay_crypto->aes_backward, key, KEY_LEN, aes_iv, AES_ENCRYPTION );
+}
+
+static void v_bench_free_hop( RelayCrypto* relay_crypto )
+{
+  wc_ShaFree( &relay_crypto->running_sha_forward );
+  wc_ShaFree( &relay_crypto->running_sha_backward[0] );
+  wc_ShaFree( &relay_crypto->running_sha_backward[1] );
+  wc_AesFree( &relay_crypto->aes_forward );
+  wc_AesFree( &relay_crypto->aes_backward );
+}
+
+static void v_bench_init_hs( HsCrypto* hs_crypto )
+{
+  int i;
+  uint8_t key[AES_256_KEY_SIZE];
+  uint8_t aes_iv[16] = { 0 };
+
+  for ( i = 0; i < AES_256_KEY_SIZE; i++ )
+  {
+    key[i] = 0xa0 + i;
+  }
+
+  wc_InitSha3_256( &hs_crypto->hs_running_sha_forward[0], NULL, INVALID_DEVID );
+  wc_InitSha3_256( &hs_crypto->hs_running_sha_forward[1], NULL, INVALID_DEVID );
+  wc_InitSha3_256( &hs_crypto->hs_running_sha_backward, NULL, INVALID_DEVID );
+  hs_crypto->hs_sha_forward_index = 0;
+
+  wc_Sha3_256_Update( &hs_crypto->hs_running_sha_forward[0], key, AES_256_KEY_SIZE );
+  wc_Sha3_256_Update( &hs_crypto->hs_running_sha_backward, key, AES_256_KEY_SIZE );
+
+  wc_AesInit( &hs_crypto->hs_aes_forward, NULL, INVALID_DEVID );
+  wc_AesInit( &hs_crypto->hs_aes_backward, NULL, INVALID_DEVID );
+  wc_AesSetKeyDirect( &hs_crypto->hs_aes_forward, key, AES_256_KEY_SIZE, aes_iv, AES_ENCRYPTION );
+  wc_AesSetKeyDirect( &hs_crypto->hs_aes_backward, key, AES_256_KEY_SIZE, aes_iv, AES_ENCRYPTION );
+}
+
+static void v_bench_free_hs( HsCrypto* hs_crypto )
+{
+  wc_Sha3_256_Free( &hs_crypto->hs_running_sha_forward[0] );
+  wc_Sha3_256_Free( &hs_crypto->hs_running_sha_forward[1] );
+  wc_Sha3_256_Free( &hs_crypto->hs_running_sha_backward );
+  wc_AesFree( &hs_crypto->hs_aes_forward );
+  wc_AesFree( &hs_crypto->hs_aes_backward );
+}
+
+static void v_bench_build_relay_list( DoublyLinkedOnionRelayList* relay_list, DoublyLinkedOnionRelay* db_relays, RelayCrypto* relay_cryptos, int hops )
+{
+  int i;
+
+  memset( relay_list, 0, sizeof( DoublyLinkedOnionRelayList ) );
+
+  for ( i = 0; i < hops; i++ )
+  {
+    v_bench_init_hop( &relay_cryptos[i], i );
+
+    db_relays[i].relay = NULL;
+    db_relays[i].relay_crypto = &relay_cryptos[i];
+
+    v_add_relay_to_list( &db_relays[i], relay_list );
+  }
+
+  relay_list->built_length = hops;
+}
+
+// a RELAY_DATA cell as the onion service would fill it, before padding
+static void v_bench_fill_relay_cell( Cell* cell, int i )
+{
+  v_set_cell_circ_id( cell, 0x80000001 );
+  cell->command = RELAY;
+  cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + BENCH_RELAY_DATA_LENGTH;
+
+  cell->payload.relay.relay_command = RELAY_DATA;
+  cell->payload.relay.recognized = 0;
+  v_set_relay_stream_id( cell, 1 );
+  memset( &cell->payload.relay.digest, 0, 4 );
+  v_set_relay_length( cell, BENCH_RELAY_DATA_LENGTH );
+  memset( cell->payload.relay.data, i, BENCH_RELAY_DATA_LENGTH );
+}
+
+static void v_bench_relay_name( char* name, int name_length, const char* prefix, int hops, bool hs )
+{
+  snprintf( name, name_length, "%s_%d_hop%s", prefix, hops, hs ? "_hs" : "" );
+}
+
+// cells/sec through the relay digest check, with and without the copy back
+static int d_bench_relay_recognition()
+{
+  int i;
+  int ret = 0;
+  int64_t start;
+  int64_t copy_elapsed;
+  int64_t double_buffer_elapsed;
+  uint8_t* cells;
+  Cell* cell;
+  RelayCrypto* sender_crypto;
+  RelayCrypto* copy_crypto;
+  RelayCrypto* double_buffer_crypto;
+  unsigned char tmp_digest[WC_SHA_DIGEST_SIZE];
+
+  cells = malloc( MINITOR_CELL_LEN * BENCH_CELLS );
+  sender_crypto = malloc( sizeof( RelayCrypto ) );
+  copy_crypto = malloc( sizeof( RelayCrypto ) );
+  double_buffer_crypto = malloc( sizeof( RelayCrypto ) );
+
+  v_bench_init_hop( sender_crypto, 0 );
+  v_bench_init_hop( copy_crypto, 0 );
+  v_bench_init_hop( double_buffer_crypto, 0 );
+
+  // digest each cell the way the sending hop would
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    cell = (Cell*)( cells + i * MINITOR_CELL_LEN );
+
+    memset( cell->payload.data, i, PAYLOAD_LEN );
+    cell->payload.relay.recognized = 0;
+    memset( &cell->payload.relay.digest, 0, 4 );
+
+    wc_ShaUpdate( &sender_crypto->running_sha_backward[0], cell->payload.data, PAYLOAD_LEN );
+    wc_ShaGetHash( &sender_crypto->running_sha_backward[0], tmp_digest );
+
+    memcpy( &cell->payload.relay.digest, tmp_digest, 4 );
+  }
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    if ( !b_recognize_relay_cell_copy( copy_crypto, (Cell*)( cells + i * MINITOR_CELL_LEN ) ) )
+    {
+      ret = -1;
+    }
+  }
+
+  copy_elapsed = MINITOR_GET_TIME() - start;
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    if ( !b_recognize_relay_cell( double_buffer_crypto, (Cell*)( cells + i * MINITOR_CELL_LEN ) ) )
+    {
+      ret = -1;
+    }
+  }
+
+  double_buffer_elapsed = MINITOR_GET_TIME() - start;
+
+  if ( ret < 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "relay recognition: a cell was not recognized" );
+  }
+  else
+  {
+    v_bench_report( "relay_recognize_copy", BENCH_CELLS, copy_elapsed );
+    v_bench_report( "relay_recognize_double_buffer", BENCH_CELLS, double_buffer_elapsed );
+  }
+
+  v_bench_free_hop( sender_crypto );
+  v_bench_free_hop( copy_crypto );
+  v_bench_free_hop( double_buffer_crypto );
+  free( sender_crypto );
+  free( copy_crypto );
+  free( double_buffer_crypto );
+  free( cells );
+
+  return ret;
+}
+
+// the send path up to the socket, padding, digest and every onion layer
+static int d_bench_relay_encrypt( int hops, bool hs )
+{
+  int i;
+  int ret = 0;
+  int64_t start;
+  int64_t elapsed;
+  char name[32];
+  Cell* cell;
+  HsCrypto* hs_crypto = NULL;
+  RelayCrypto* relay_cryptos;
+  DoublyLinkedOnionRelay db_relays[BENCH_MAX_HOPS];
+  DoublyLinkedOnionRelayList relay_list;
+
+  cell = malloc( MINITOR_CELL_LEN );
+  relay_cryptos = malloc( sizeof( RelayCrypto ) * BENCH_MAX_HOPS );
+
+  v_bench_build_relay_list( &relay_list, db_relays, relay_cryptos, hops );
+
+  if ( hs )
+  {
+    hs_crypto = malloc( sizeof( HsCrypto ) );
+    v_bench_init_hs( hs_crypto );
+  }
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    v_bench_fill_relay_cell( cell, i );
+    v_pad_cell( cell );
+
+    if ( d_encrypt_relay_cell( cell, &relay_list, hs_crypto ) < 0 )
+    {
+      ret = -1;
+    }
+  }
+
+  elapsed = MINITOR_GET_TIME() - start;
+
+  v_bench_relay_name( name, sizeof( name ), "relay_encrypt", hops, hs );
+
+  if ( ret < 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "%s: failed to encrypt a cell", name );
+  }
+  else
+  {
+    v_bench_report( name, BENCH_CELLS, elapsed );
+  }
+
+  for ( i = 0; i < hops; i++ )
+  {
+    v_bench_free_hop( &relay_cryptos[i] );
+  }
+
+  if ( hs_crypto != NULL )
+  {
+    v_bench_free_hs( hs_crypto );
+    free( hs_crypto );
+  }
+
+  free( relay_cryptos );
+  free( cell );
+
+  return ret;
+}
+
+// cells come from the last hop, or from the client through the hs layer,
+// they are made ahead of time with a second set of keys for the sending side
+static int d_bench_relay_decrypt( int hops, bool hs )
+{
+  int i;
+  int j;
+  int ret = 0;
+  int64_t start;
+  int64_t elapsed;
+  char name[32];
+  uint8_t* cells;
+  Cell* cell;
+  HsCrypto* hs_crypto = NULL;
+  HsCrypto* sender_hs_crypto = NULL;
+  RelayCrypto* relay_cryptos;
+  RelayCrypto* sender_cryptos;
+  DoublyLinkedOnionRelay db_relays[BENCH_MAX_HOPS];
+  DoublyLinkedOnionRelayList relay_list;
+  unsigned char tmp_digest[WC_SHA3_256_DIGEST_SIZE];
+
+  // the crypto state is too big for the stack of the task calling init
+  cells = malloc( MINITOR_CELL_LEN * BENCH_CELLS );
+  relay_cryptos = malloc( sizeof( RelayCrypto ) * BENCH_MAX_HOPS );
+  sender_cryptos = malloc( sizeof( RelayCrypto ) * BENCH_MAX_HOPS );
+
+  v_bench_build_relay_list( &relay_list, db_relays, relay_cryptos, hops );
+
+  for ( i = 0; i < hops; i++ )
+  {
+    v_bench_init_hop( &sender_cryptos[i], i );
+  }
+
+  if ( hs )
+  {
+    hs_crypto = malloc( sizeof( HsCrypto ) );
+    sender_hs_crypto = malloc( sizeof( HsCrypto ) );
+    v_bench_init_hs( hs_crypto );
+    v_bench_init_hs( sender_hs_crypto );
+  }
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    cell = (Cell*)( cells + i * MINITOR_CELL_LEN );
+
+    v_bench_fill_relay_cell( cell, i );
+    v_pad_cell( cell );
+
+    if ( hs )
+    {
+      wc_Sha3_256_Update( &sender_hs_crypto->hs_running_sha_forward[0], cell->payload.data, PAYLOAD_LEN );
+      wc_Sha3_256_GetHash( &sender_hs_crypto->hs_running_sha_forward[0], tmp_digest );
+      memcpy( &cell->payload.relay.digest, tmp_digest, 4 );
+
+      MINITOR_AES_CTR( &sender_hs_crypto->hs_aes_forward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+    }
+    else
+    {
+      wc_ShaUpdate( &sender_cryptos[hops - 1].running_sha_backward[0], cell->payload.data, PAYLOAD_LEN );
+      wc_ShaGetHash( &sender_cryptos[hops - 1].running_sha_backward[0], tmp_digest );
+      memcpy( &cell->payload.relay.digest, tmp_digest, 4 );
+    }
+
+    // the hop furthest from us adds its layer first
+    for ( j = hops - 1; j >= 0; j-- )
+    {
+      MINITOR_AES_CTR( &sender_cryptos[j].aes_backward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+    }
+  }
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    if ( d_decrypt_cell( (Cell*)( cells + i * MINITOR_CELL_LEN ), CIRCID_LEN, &relay_list, hs_crypto ) < 0 )
+    {
+      ret = -1;
+    }
+  }
+
+  elapsed = MINITOR_GET_TIME() - start;
+
+  v_bench_relay_name( name, sizeof( name ), "relay_decrypt", hops, hs );
+
+  if ( ret < 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "%s: a cell was not recognized", name );
+  }
+  else
+  {
+    v_bench_report( name, BENCH_CELLS, elapsed );
+  }
+
+  for ( i = 0; i < hops; i++ )
+  {
+    v_bench_free_hop( &relay_cryptos[i] );
+    v_bench_free_hop( &sender_cryptos[i] );
+  }
+
+  if ( hs_crypto != NULL )
+  {
+    v_bench_free_hs( hs_crypto );
+    v_bench_free_hs( sender_hs_crypto );
+    free( hs_crypto );
+    free( sender_hs_crypto );
+  }
+
+  free( relay_cryptos );
+  free( sender_cryptos );
+  free( cells );
+
+  return ret;
+}
+
+// cell padding is the per cell cost left on the send path now that cells
+// are built in wire format instead of being converted before sending
+static int d_bench_pad_cell()
+{
+  int i;
+  int64_t start;
+  Cell* cell;
+
+  cell = malloc( MINITOR_CELL_LEN );
+
+  v_bench_fill_relay_cell( cell, 0 );
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    v_pad_cell( cell );
+  }
+
+  v_bench_report( "pad_relay_cell", BENCH_CELLS, MINITOR_GET_TIME() - start );
+
+  free( cell );
+
+  return 0;
+}
+
+// hands out whatever is asked for until the buffer runs out, like a tls
+// record that holds every cell
+static int d_bench_stream_reader( void* reader_data, uint8_t* buf, int length )
+{
+  BenchStream* stream = reader_data;
+
+  if ( length > stream->length - stream->offset )
+  {
+    length = stream->length - stream->offset;
+  }
+
+  memcpy( buf, stream->data + stream->offset, length );
+  stream->offset += length;
+
+  return length;
+}
+
+static int d_bench_recv_cell()
+{
+  int i;
+  int ret = 0;
+  int64_t start;
+  uint8_t* cell;
+  BenchStream stream;
+
+  stream.length = CELL_LEN * BENCH_CELLS;
+  stream.offset = 0;
+  stream.data = malloc( stream.length );
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    memset( stream.data + i * CELL_LEN, i, CELL_LEN );
+    v_store_be32( stream.data + i * CELL_LEN, 0x80000001 );
+    stream.data[i * CELL_LEN + CIRCID_LEN] = RELAY;
+  }
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    if ( d_recv_cell_from( d_bench_stream_reader, &stream, &cell, CIRCID_LEN ) != CELL_LEN )
+    {
+      ret = -1;
+
+      break;
+    }
+
+    free( cell );
+  }
+
+  if ( ret < 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "recv_cell: failed to frame a cell" );
+  }
+  else
+  {
+    v_bench_report( "recv_cell", BENCH_CELLS, MINITOR_GET_TIME() - start );
+  }
+
+  free( stream.data );
+
+  return ret;
+}
+
+static int d_bench_encoding()
+{
+  int i;
+  int ret = 0;
+  int64_t start;
+  int64_t encode_elapsed;
+  int64_t decode_elapsed;
+  uint8_t* source;
+  uint8_t* decoded;
+  char* encoded;
+  char onion_address[BENCH_ONION_ADDRESS_LENGTH * 8 / 5 + 1];
+  int encoded_length = BENCH_ENCODE_LENGTH / 3 * 4;
+
+  source = malloc( BENCH_ENCODE_LENGTH );
+  decoded = malloc( BENCH_ENCODE_LENGTH );
+  encoded = malloc( encoded_length );
+
+  for ( i = 0; i < BENCH_ENCODE_LENGTH; i++ )
+  {
+    source[i] = i * 7;
+  }
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_ENCODE_ROUNDS; i++ )
+  {
+    v_base_64_encode( encoded, source, BENCH_ENCODE_LENGTH );
+  }
+
+  encode_elapsed = MINITOR_GET_TIME() - start;
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_ENCODE_ROUNDS; i++ )
+  {
+    v_base_64_decode( decoded, encoded, encoded_length );
+  }
+
+  decode_elapsed = MINITOR_GET_TIME() - start;
+
+  if ( memcmp( source, decoded, BENCH_ENCODE_LENGTH ) != 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "base64: decoded data does not match" );
+
+    ret = -1;
+  }
+  else
+  {
+    v_bench_report( "base64_encode_1023", BENCH_ENCODE_ROUNDS, encode_elapsed );
+    v_bench_report( "base64_decode_1023", BENCH_ENCODE_ROUNDS, decode_elapsed );
+  }
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < BENCH_CELLS; i++ )
+  {
+    v_base_32_encode( onion_address, source + i, BENCH_ONION_ADDRESS_LENGTH );
+  }
+
+  v_bench_report( "base32_encode_onion_address", BENCH_CELLS, MINITOR_GET_TIME() - start );
+
+  free( source );
+  free( decoded );
+  free( encoded );
+
+  return ret;
+}
+
+// plays the relay's side of the ntor handshake so d_ntor_handshake_finish
+// gets a CREATED2 it accepts, Y followed by AUTH. only the client's public
+// key is needed, the relay uses its own private keys like a real one would
+static int d_bench_ntor_created2( uint8_t* handshake_data, OnionRelay* relay, uint8_t* client_public, curve25519_key* server_key, curve25519_key* onion_key )
+{
+  int ret = 0;
+  unsigned int idx;
+  uint8_t secret_input[SECRET_INPUT_LENGTH];
+  uint8_t auth_input[AUTH_INPUT_LENGTH];
+  uint8_t* working;
+  Hmac hmac;
+  curve25519_key client_key;
+
+  wc_curve25519_init( &client_key );
+
+  idx = G_LENGTH;
+
+  if (
+    wc_curve25519_export_public_ex( server_key, handshake_data, &idx, EC25519_LITTLE_ENDIAN ) != 0 ||
+    wc_curve25519_import_public_ex( client_public, G_LENGTH, &client_key, EC25519_LITTLE_ENDIAN ) != 0
+  )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  // EXP(X,y) | EXP(X,b) | ID | B | X | Y | PROTOID, the same values the
+  // client gets from its side
+  working = secret_input;
+
+  idx = 32;
+
+  if ( MINITOR_X25519_SHARED_SECRET( server_key, &client_key, working, &idx ) < 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  working += 32;
+
+  idx = 32;
+
+  if ( MINITOR_X25519_SHARED_SECRET( onion_key, &client_key, working, &idx ) < 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  working += 32;
+
+  memcpy( working, relay->identity, ID_LENGTH );
+  working += ID_LENGTH;
+  memcpy( working, relay->ntor_onion_key, H_LENGTH );
+  working += H_LENGTH;
+  memcpy( working, client_public, G_LENGTH );
+  working += G_LENGTH;
+  memcpy( working, handshake_data, G_LENGTH );
+  working += G_LENGTH;
+  memcpy( working, PROTOID, PROTOID_LENGTH );
+
+  // verify | ID | B | Y | X | PROTOID | "Server"
+  working = auth_input;
+
+  wc_HmacSetKey( &hmac, WC_SHA256, (unsigned char*)PROTOID_VERIFY, PROTOID_VERIFY_LENGTH );
+  wc_HmacUpdate( &hmac, secret_input, SECRET_INPUT_LENGTH );
+  wc_HmacFinal( &hmac, working );
+  wc_HmacFree( &hmac );
+
+  working += WC_SHA256_DIGEST_SIZE;
+
+  memcpy( working, relay->identity, ID_LENGTH );
+  working += ID_LENGTH;
+  memcpy( working, relay->ntor_onion_key, H_LENGTH );
+  working += H_LENGTH;
+  memcpy( working, handshake_data, G_LENGTH );
+  working += G_LENGTH;
+  memcpy( working, client_public, G_LENGTH );
+  working += G_LENGTH;
+  memcpy( working, PROTOID, PROTOID_LENGTH );
+  working += PROTOID_LENGTH;
+  memcpy( working, SERVER_STR, SERVER_STR_LENGTH );
+
+  wc_HmacSetKey( &hmac, WC_SHA256, (unsigned char*)PROTOID_MAC, PROTOID_MAC_LENGTH );
+  wc_HmacUpdate( &hmac, auth_input, AUTH_INPUT_LENGTH );
+  wc_HmacFinal( &hmac, handshake_data + G_LENGTH );
+  wc_HmacFree( &hmac );
+
+finish:
+  wc_curve25519_free( &client_key );
+
+  return ret;
+}
+
+static int d_bench_ntor()
+{
+  int i;
+  int ret = 0;
+  unsigned int idx;
+  int64_t start;
+  int64_t elapsed = 0;
+  WC_RNG rng;
+  OnionRelay* relay;
+  DoublyLinkedOnionRelay db_relay;
+  curve25519_key client_key;
+  curve25519_key server_key;
+  curve25519_key onion_key;
+  uint8_t client_public[G_LENGTH];
+  uint8_t handshake_data[G_LENGTH + WC_SHA256_DIGEST_SIZE];
+
+  relay = malloc( sizeof( OnionRelay ) );
+  memset( relay, 0, sizeof( OnionRelay ) );
+  // so the cleanup can free it even if init fails
+  memset( &rng, 0, sizeof( WC_RNG ) );
+
+  wc_curve25519_init( &client_key );
+  wc_curve25519_init( &server_key );
+  wc_curve25519_init( &onion_key );
+
+  if (
+    wc_InitRng( &rng ) != 0 ||
+    wc_curve25519_make_key( &rng, 32, &client_key ) != 0 ||
+    wc_curve25519_make_key( &rng, 32, &server_key ) != 0 ||
+    wc_curve25519_make_key( &rng, 32, &onion_key ) != 0
+  )
+  {
+    MINITOR_LOG( BENCH_TAG, "ntor: failed to make keys" );
+
+    ret = -1;
+    goto finish;
+  }
+
+  MINITOR_FILL_RANDOM( relay->identity, ID_LENGTH );
+
+  idx = H_LENGTH;
+  wc_curve25519_export_public_ex( &onion_key, relay->ntor_onion_key, &idx, EC25519_LITTLE_ENDIAN );
+
+  idx = G_LENGTH;
+  wc_curve25519_export_public_ex( &client_key, client_public, &idx, EC25519_LITTLE_ENDIAN );
+
+  if ( d_bench_ntor_created2( handshake_data, relay, client_public, &server_key, &onion_key ) < 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "ntor: failed to make CREATED2" );
+
+    ret = -1;
+    goto finish;
+  }
+
+  for ( i = 0; i < BENCH_NTOR_ROUNDS; i++ )
+  {
+    db_relay.relay = relay;
+    db_relay.relay_crypto = NULL;
+
+    start = MINITOR_GET_TIME();
+
+    if ( d_ntor_handshake_finish( handshake_data, &db_relay, &client_key ) < 0 )
+    {
+      MINITOR_LOG( BENCH_TAG, "ntor: handshake did not finish" );
+
+      ret = -1;
+      goto finish;
+    }
+
+    elapsed += MINITOR_GET_TIME() - start;
+
+    v_bench_free_hop( db_relay.relay_crypto );
+    free( db_relay.relay_crypto );
+  }
+
+  v_bench_report( "ntor_handshake_finish", BENCH_NTOR_ROUNDS, elapsed );
+
+finish:
+  wc_FreeRng( &rng );
+  wc_curve25519_free( &client_key );
+  wc_curve25519_free( &server_key );
+  wc_curve25519_free( &onion_key );
+  free( relay );
+
+  return ret;
+}
+
+// a loopback socket on a port picked by the stack
+static int d_bench_listen( uint16_t* port )
+{
+  int fd;
+  struct sockaddr_in addr;
+  socklen_t addr_length = sizeof( addr );
+
+  fd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
+
+  if ( fd < 0 )
+  {
+    return -1;
+  }
+
+  memset( &addr, 0, sizeof( addr ) );
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  addr.sin_port = 0;
+
+  if (
+    bind( fd, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 ||
+    listen( fd, 1 ) != 0 ||
+    getsockname( fd, (struct sockaddr*)&addr, &addr_length ) != 0
+  )
+  {
+    close( fd );
+
+    return -1;
+  }
+
+  *port = ntohs( addr.sin_port );
+
+  return fd;
+}
+
+// a connected pair of loopback sockets, the returned end goes to the daemon
+// as the service's link and the benchmark plays the relays on relay_fd
+static int d_bench_link( int* relay_fd )
+{
+  int listen_fd;
+  int link_fd;
+  uint16_t port;
+  struct sockaddr_in addr;
+  struct timeval timeout;
+
+  *relay_fd = -1;
+
+  listen_fd = d_bench_listen( &port );
+
+  if ( listen_fd < 0 )
+  {
+    return -1;
+  }
+
+  link_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
+
+  memset( &addr, 0, sizeof( addr ) );
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  addr.sin_port = htons( port );
+
+  if ( link_fd < 0 || connect( link_fd, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 )
+  {
+    if ( link_fd >= 0 )
+    {
+      close( link_fd );
+    }
+
+    close( listen_fd );
+
+    return -1;
+  }
+
+  *relay_fd = accept( listen_fd, NULL, NULL );
+
+  close( listen_fd );
+
+  if ( *relay_fd < 0 )
+  {
+    close( link_fd );
+
+    return -1;
+  }
+
+  // don't hang the boot if the service never answers
+  timeout.tv_sec = BENCH_STREAM_TIMEOUT_S;
+  timeout.tv_usec = 0;
+
+  setsockopt( *relay_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+
+  return link_fd;
+}
+
+// reads cells off the link until one with command comes in for circ_id,
+// padding and cells for the other circuits on the link are dropped
+static int d_bench_recv_circuit_cell( int relay_fd, uint32_t circ_id, uint8_t command, Cell** cell )
+{
+  while ( 1 )
+  {
+    if ( d_recv_cell_from( d_socket_cell_reader, &relay_fd, (uint8_t**)cell, CIRCID_LEN ) < 0 )
+    {
+      return -1;
+    }
+
+    if ( (*cell)->command == command && ud_get_cell_circ_id( *cell ) == circ_id )
+    {
+      return 0;
+    }
+
+    free( *cell );
+  }
+}
+
+// sends a relay cell toward the service from hop, the relay_cryptos are the
+// relays' ends of the circuit. hop sets the digest and it and every hop
+// before it add their layer
+static int d_bench_relay_send( int relay_fd, RelayCrypto* relay_cryptos, int hop, Cell* cell )
+{
+  int i;
+  unsigned char tmp_digest[WC_SHA_DIGEST_SIZE];
+
+  cell->command = RELAY;
+  cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + ud_get_relay_length( cell );
+  cell->payload.relay.recognized = 0;
+  memset( &cell->payload.relay.digest, 0, 4 );
+
+  v_pad_cell( cell );
+
+  wc_ShaUpdate( &relay_cryptos[hop].running_sha_backward[0], cell->payload.data, PAYLOAD_LEN );
+  wc_ShaGetHash( &relay_cryptos[hop].running_sha_backward[0], tmp_digest );
+  memcpy( &cell->payload.relay.digest, tmp_digest, 4 );
+
+  for ( i = hop; i >= 0; i-- )
+  {
+    MINITOR_AES_CTR( &relay_cryptos[i].aes_backward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+  }
+
+  if ( send( relay_fd, (uint8_t*)cell + FIXED_CELL_OFFSET, CELL_LEN, 0 ) != CELL_LEN )
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+// answers each stream's request with server->length bytes then closes it,
+// the way a small web server would serve a file
+void v_bench_stream_server( void* pv_parameters )
+{
+  int i;
+  int sock_fd;
+  int sent;
+  int chunk;
+  int succ;
+  uint8_t* buf;
+  BenchServer* server = pv_parameters;
+
+  buf = malloc( BENCH_SERVER_CHUNK );
+
+  for ( i = 0; i < server->streams; i++ )
+  {
+    // fails once the benchmark closes the listener
+    sock_fd = accept( server->listen_fd, NULL, NULL );
+
+    if ( sock_fd < 0 )
+    {
+      break;
+    }
+
+    succ = recv( sock_fd, buf, BENCH_SERVER_CHUNK, 0 );
+
+    memset( buf, 'm', BENCH_SERVER_CHUNK );
+
+    for ( sent = 0; succ > 0 && sent < server->length; sent += succ )
+    {
+      chunk = server->length - sent;
+
+      if ( chunk > BENCH_SERVER_CHUNK )
+      {
+        chunk = BENCH_SERVER_CHUNK;
+      }
+
+      succ = send( sock_fd, buf, chunk, 0 );
+    }
+
+    close( sock_fd );
+  }
+
+  free( buf );
+
+  MINITOR_SEMAPHORE_GIVE( server->done );
+
+  MINITOR_TASK_DELETE( NULL );
+}
+
+// encrypts a cell the way the client would, the hs layer then every hop's
+// layer, and writes it to the link
+static int d_bench_client_send( BenchClient* client, uint8_t relay_command, uint16_t stream_id, uint8_t* data, int length )
+{
+  int i;
+  int ret = 0;
+  Cell* cell;
+  unsigned char tmp_digest[WC_SHA3_256_DIGEST_SIZE];
+
+  cell = malloc( MINITOR_CELL_LEN );
+
+  v_set_cell_circ_id( cell, client->circ_id );
+  cell->command = RELAY;
+  cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + length;
+
+  cell->payload.relay.relay_command = relay_command;
+  cell->payload.relay.recognized = 0;
+  v_set_relay_stream_id( cell, stream_id );
+  memset( &cell->payload.relay.digest, 0, 4 );
+  v_set_relay_length( cell, length );
+  memcpy( cell->payload.relay.data, data, length );
+
+  v_pad_cell( cell );
+
+  MINITOR_SHA3_256_UPDATE( &client->hs_crypto.hs_running_sha_forward[0], cell->payload.data, PAYLOAD_LEN );
+  wc_Sha3_256_GetHash( &client->hs_crypto.hs_running_sha_forward[0], tmp_digest );
+  memcpy( &cell->payload.relay.digest, tmp_digest, 4 );
+
+  MINITOR_AES_CTR( &client->hs_crypto.hs_aes_forward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+
+  for ( i = BENCH_MAX_HOPS - 1; i >= 0; i-- )
+  {
+    MINITOR_AES_CTR( &client->relay_cryptos[i].aes_backward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+  }
+
+  if ( send( client->relay_fd, (uint8_t*)cell + FIXED_CELL_OFFSET, CELL_LEN, 0 ) != CELL_LEN )
+  {
+    ret = -1;
+  }
+
+  free( cell );
+
+  return ret;
+}
+
+// reads the next cell for our circuit and checks it against the service's
+// hs digest
+static int d_bench_client_recv( BenchClient* client, Cell** cell )
+{
+  int i;
+  uint8_t digest[4];
+  unsigned char tmp_digest[WC_SHA3_256_DIGEST_SIZE];
+
+  if ( d_bench_recv_circuit_cell( client->relay_fd, client->circ_id, RELAY, cell ) < 0 )
+  {
+    return -1;
+  }
+
+  for ( i = 0; i < BENCH_MAX_HOPS; i++ )
+  {
+    MINITOR_AES_CTR( &client->relay_cryptos[i].aes_forward, (*cell)->payload.data, (*cell)->payload.data, PAYLOAD_LEN );
+  }
+
+  MINITOR_AES_CTR( &client->hs_crypto.hs_aes_backward, (*cell)->payload.data, (*cell)->payload.data, PAYLOAD_LEN );
+
+  memcpy( digest, &(*cell)->payload.relay.digest, 4 );
+  memset( &(*cell)->payload.relay.digest, 0, 4 );
+
+  MINITOR_SHA3_256_UPDATE( &client->hs_crypto.hs_running_sha_backward, (*cell)->payload.data, PAYLOAD_LEN );
+  wc_Sha3_256_GetHash( &client->hs_crypto.hs_running_sha_backward, tmp_digest );
+
+  if ( (*cell)->payload.relay.recognized != 0 || memcmp( digest, tmp_digest, 4 ) != 0 )
+  {
+    free( *cell );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+// one stream as a client sees it, BEGIN, CONNECTED, the request and then
+// the response until the service sends RELAY_END
+static int d_bench_client_stream( BenchClient* client, uint16_t stream_id )
+{
+  int ret = 0;
+  int bytes = 0;
+  int64_t start;
+  int64_t connected_us = 0;
+  int64_t first_us = 0;
+  int64_t end_us;
+  int64_t elapsed;
+  int64_t bytes_per_sec;
+  Cell* cell;
+  uint8_t begin_data[] = "bench.onion:80\0\0\0\0";
+  uint8_t request[] = "GET / HTTP/1.0\r\n\r\n";
+
+  start = MINITOR_GET_TIME();
+
+  if ( d_bench_client_send( client, RELAY_BEGIN, stream_id, begin_data, sizeof( begin_data ) ) < 0 )
+  {
+    return -1;
+  }
+
+  while ( 1 )
+  {
+    if ( d_bench_client_recv( client, &cell ) < 0 )
+    {
+      return -1;
+    }
+
+    if ( ud_get_relay_stream_id( cell ) != stream_id )
+    {
+      free( cell );
+
+      continue;
+    }
+
+    switch ( cell->payload.relay.relay_command )
+    {
+      case RELAY_CONNECTED:
+        connected_us = MINITOR_GET_TIME() - start;
+
+        if ( d_bench_client_send( client, RELAY_DATA, stream_id, request, sizeof( request ) - 1 ) < 0 )
+        {
+          ret = -1;
+        }
+
+        break;
+      case RELAY_DATA:
+        if ( bytes == 0 )
+        {
+          first_us = MINITOR_GET_TIME();
+        }
+
+        bytes += ud_get_relay_length( cell );
+
+        break;
+      case RELAY_END:
+        ret = 1;
+
+        break;
+      default:
+        break;
+    }
+
+    free( cell );
+
+    if ( ret != 0 )
+    {
+      break;
+    }
+  }
+
+  end_us = MINITOR_GET_TIME();
+
+  if ( ret < 0 || connected_us == 0 || bytes == 0 )
+  {
+    return -1;
+  }
+
+  // sustained rate, from the first byte to the end of the stream
+  elapsed = end_us - first_us;
+
+  if ( elapsed <= 0 )
+  {
+    elapsed = 1;
+  }
+
+  bytes_per_sec = (int64_t)bytes * 1000000LL / elapsed;
+
+  printf(
+    "{\"bench\":\"stream_loopback\",\"stream\":%d,\"connect_us\":%lld,\"ttfb_us\":%lld,\"bytes\":%d,\"us\":%lld,\"bytes_per_sec\":%lld,\"mb_per_sec\":%lld.%02lld}\n",
+    stream_id,
+    (long long)connected_us,
+    (long long)( first_us - start ),
+    bytes,
+    (long long)elapsed,
+    (long long)bytes_per_sec,
+    (long long)( bytes_per_sec / 1000000 ),
+    (long long)( bytes_per_sec / 10000 % 100 )
+  );
+
+  return 0;
+}
+
+// streams through the real service path, the connections daemon, the core
+// task and relay crypto, to a local server task. the benchmark plays the
+// client and every relay on a plain loopback link, so the numbers leave out
+// tls and the network but include the client's own crypto on this chip
+static int d_bench_stream_loopback()
+{
+  int i;
+  int ret = 0;
+  int link_fd = -1;
+  OnionService* service;
+  OnionCircuit* circuit;
+  DoublyLinkedOnionRelay* db_relays;
+  RelayCrypto* relay_cryptos;
+  BenchServer* server;
+  BenchClient* client;
+  DlConnection* or_connection;
+
+  service = malloc( sizeof( OnionService ) );
+  circuit = malloc( sizeof( OnionCircuit ) );
+  db_relays = malloc( sizeof( DoublyLinkedOnionRelay ) * BENCH_MAX_HOPS );
+  relay_cryptos = malloc( sizeof( RelayCrypto ) * BENCH_MAX_HOPS );
+  server = malloc( sizeof( BenchServer ) );
+  client = malloc( sizeof( BenchClient ) );
+
+  memset( service, 0, sizeof( OnionService ) );
+  memset( circuit, 0, sizeof( OnionCircuit ) );
+  memset( client, 0, sizeof( BenchClient ) );
+
+  client->relay_fd = -1;
+
+  // the local server
+  server->listen_fd = d_bench_listen( &service->local_port );
+  server->streams = BENCH_STREAMS;
+  server->length = BENCH_STREAM_LENGTH;
+  server->done = MINITOR_SEMAPHORE_CREATE_COUNTING( 1, 0 );
+
+  if ( server->listen_fd < 0 || b_create_bench_server_task( NULL, server ) == false )
+  {
+    MINITOR_LOG( BENCH_TAG, "stream_loopback: failed to start the local server" );
+
+    if ( server->listen_fd >= 0 )
+    {
+      close( server->listen_fd );
+    }
+
+    MINITOR_SEMAPHORE_DELETE( server->done );
+    free( server );
+    server = NULL;
+
+    ret = -1;
+    goto finish;
+  }
+
+  // the link, the daemon gets one end and we play the relays on the other
+  link_fd = d_bench_link( &client->relay_fd );
+
+  if ( link_fd < 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  // a rendezvous circuit as if the client had just been joined to it
+  service->exit_port = 80;
+  service->local_coalesce_ms = MINITOR_LOCAL_COALESCE_MS;
+
+  circuit->circ_id = ud_next_circ_id( 0 );
+  circuit->status = CIRCUIT_RENDEZVOUS;
+  circuit->target_status = CIRCUIT_RENDEZVOUS;
+  circuit->service = service;
+  circuit->hs_crypto = malloc( sizeof( HsCrypto ) );
+  time( &circuit->last_action );
+
+  v_bench_build_relay_list( &circuit->relay_list, db_relays, relay_cryptos, BENCH_MAX_HOPS );
+  v_bench_init_hs( circuit->hs_crypto );
+
+  client->circ_id = circuit->circ_id;
+
+  for ( i = 0; i < BENCH_MAX_HOPS; i++ )
+  {
+    v_bench_init_hop( &client->relay_cryptos[i], i );
+  }
+
+  v_bench_init_hs( &client->hs_crypto );
+
+  if ( d_attach_bench_or_connection( link_fd, circuit ) < 0 )
+  {
+    ret = -1;
+    goto free_crypto;
+  }
+
+  // the daemon owns the link now, it closes it when we close our end
+  link_fd = -1;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  v_add_circuit_to_list( circuit, &onion_circuits );
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  for ( i = 0; i < BENCH_STREAMS; i++ )
+  {
+    if ( d_bench_client_stream( client, i + 1 ) < 0 )
+    {
+      MINITOR_LOG( BENCH_TAG, "stream_loopback: stream %d failed", i + 1 );
+
+      ret = -1;
+
+      break;
+    }
+  }
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  v_remove_circuit_from_list( circuit, &onion_circuits );
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  // the core only uses the circuit while it holds the link's access mutex,
+  // once we have had it the circuit can be freed
+  // MUTEX TAKE
+  or_connection = px_get_conn_by_id_and_lock( circuit->conn_id );
+
+  if ( or_connection != NULL )
+  {
+    MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+    // MUTEX GIVE
+  }
+
+  // streams still open on the circuit close without a RELAY_END
+  v_cleanup_local_connections_by_circ_id( circuit->circ_id );
+
+free_crypto:
+  for ( i = 0; i < BENCH_MAX_HOPS; i++ )
+  {
+    v_bench_free_hop( &relay_cryptos[i] );
+    v_bench_free_hop( &client->relay_cryptos[i] );
+  }
+
+  v_bench_free_hs( circuit->hs_crypto );
+  v_bench_free_hs( &client->hs_crypto );
+  free( circuit->hs_crypto );
+finish:
+  if ( link_fd >= 0 )
+  {
+    close( link_fd );
+  }
+
+  // the daemon sees the link close and drops it, there is no circuit left on
+  // it for the core to rebuild
+  if ( client->relay_fd >= 0 )
+  {
+    close( client->relay_fd );
+  }
+
+  if ( server != NULL )
+  {
+    // wakes the server if it is still waiting for a stream
+    close( server->listen_fd );
+
+    if ( MINITOR_SEMAPHORE_TAKE_MS( server->done, BENCH_STREAM_TIMEOUT_S * 1000 ) == pdTRUE )
+    {
+      MINITOR_SEMAPHORE_DELETE( server->done );
+      free( server );
+    }
+    else
+    {
+      // still sending to a stream that was dropped, leave it what it uses
+      MINITOR_LOG( BENCH_TAG, "stream_loopback: local server did not finish" );
+    }
+  }
+
+  free( client );
+  free( relay_cryptos );
+  free( db_relays );
+  free( circuit );
+  free( service );
+
+  return ret;
+}
+
+// a circuit on the benchmark link as the core would have left it, every part
+// is allocated so d_destroy_onion_circuit can free it
+static OnionCircuit* px_bench_circuit( int hops, CircuitStatus status )
+{
+  int i;
+  OnionCircuit* circuit;
+  DoublyLinkedOnionRelay* db_relay;
+
+  circuit = malloc( sizeof( OnionCircuit ) );
+
+  memset( circuit, 0, sizeof( OnionCircuit ) );
+
+  circuit->circ_id = ud_next_circ_id( 0 );
+  circuit->status = status;
+  circuit->target_status = status;
+  time( &circuit->last_action );
+
+  for ( i = 0; i < hops; i++ )
+  {
+    db_relay = malloc( sizeof( DoublyLinkedOnionRelay ) );
+    db_relay->relay = malloc( sizeof( OnionRelay ) );
+    db_relay->relay_crypto = malloc( sizeof( RelayCrypto ) );
+
+    memset( db_relay->relay, 0, sizeof( OnionRelay ) );
+    v_bench_init_hop( db_relay->relay_crypto, i );
+
+    v_add_relay_to_list( db_relay, &circuit->relay_list );
+  }
+
+  circuit->relay_list.built_length = hops;
+
+  return circuit;
+}
+
+// takes a circuit off the list and frees it once the core is done with it,
+// no DESTROY is sent since we are the relay on the other end. it is looked up
+// by circ_id since the service frees a standby it failed to extend
+static void v_bench_destroy_circuit( uint32_t circ_id )
+{
+  OnionCircuit* circuit;
+  DlConnection* or_connection;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  circuit = px_get_circuit_by_circ_id( onion_circuits, circ_id );
+
+  if ( circuit != NULL )
+  {
+    v_remove_circuit_from_list( circuit, &onion_circuits );
+  }
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  if ( circuit == NULL )
+  {
+    return;
+  }
+
+  // the core only uses the circuit while it holds the link's access mutex
+  // MUTEX TAKE
+  or_connection = px_get_conn_by_id_and_lock( circuit->conn_id );
+
+  if ( or_connection != NULL )
+  {
+    MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+    // MUTEX GIVE
+  }
+
+  // an extend that never finished still holds the keys from the intro
+  if ( circuit->status == CIRCUIT_EXTENDED && circuit->hs_crypto != NULL )
+  {
+    v_bench_free_hs( circuit->hs_crypto );
+    free( circuit->hs_crypto );
+  }
+
+  d_destroy_onion_circuit( circuit, NULL );
+
+  free( circuit );
+}
+
+// the client's INTRODUCE2 as the intro point passes it on, the encrypted part
+// names our rendezvous point and the mac and keys are the client's side of
+// what d_verify_and_decrypt_introduce_2 checks
+static int d_bench_send_introduce2( BenchRendezvous* bench, curve25519_key* client_key )
+{
+  int ret = 0;
+  int encrypted_length;
+  unsigned int idx;
+  uint8_t* working;
+  uint8_t* client_pk;
+  uint8_t* encrypted;
+  uint8_t secret_input[CURVE25519_KEYSIZE + ED25519_PUB_KEY_SIZE + CURVE25519_KEYSIZE + CURVE25519_KEYSIZE + HS_PROTOID_LENGTH];
+  uint8_t hs_keys[AES_256_KEY_SIZE + WC_SHA3_256_DIGEST_SIZE];
+  uint8_t length_buffer[8] = { 0 };
+  uint8_t aes_iv[16] = { 0 };
+  Aes aes_key;
+  wc_Shake shake;
+  Sha3 sha3;
+  Cell* cell;
+  IntroCrypto* intro_crypto = bench->intro_circuit->intro_crypto;
+
+  cell = malloc( MINITOR_CELL_LEN );
+
+  memset( cell, 0, MINITOR_CELL_LEN );
+
+  v_set_cell_circ_id( cell, bench->intro_circuit->circ_id );
+  cell->payload.relay.relay_command = RELAY_COMMAND_INTRODUCE2;
+  v_set_relay_stream_id( cell, 0 );
+
+  // legacy_key_id stays zero
+  cell->payload.relay.introduce2.auth_key_type = EDSHA3;
+  v_store_be16( &cell->payload.relay.introduce2.auth_key_length, ED25519_PUB_KEY_SIZE );
+  memcpy( cell->payload.relay.introduce2.auth_key, intro_crypto->auth_key.p, ED25519_PUB_KEY_SIZE );
+
+  working = cell->payload.relay.introduce2.auth_key + ED25519_PUB_KEY_SIZE;
+
+  // no extensions
+  working[0] = 0;
+  working++;
+
+  client_pk = working;
+
+  idx = PK_PUBKEY_LEN;
+
+  if ( wc_curve25519_export_public_ex( client_key, client_pk, &idx, EC25519_LITTLE_ENDIAN ) != 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  working += PK_PUBKEY_LEN;
+
+  // cookie, no extensions, the rendezvous point's onion key then its ipv4
+  // and legacy link specifiers
+  encrypted = working;
+
+  MINITOR_FILL_RANDOM( working, 20 );
+  working += 20;
+
+  working[0] = 0;
+  working++;
+
+  ((IntroOnionKey*)working)->onion_key_type = ONION_NTOR;
+  v_store_be16( &((IntroOnionKey*)working)->onion_key_length, H_LENGTH );
+  memcpy( ((IntroOnionKey*)working)->onion_key, bench->rend_relay.ntor_onion_key, H_LENGTH );
+  working += 3 + H_LENGTH;
+
+  working[0] = 2;
+  working++;
+
+  ((LinkSpecifier*)working)->type = IPv4Link;
+  ((LinkSpecifier*)working)->length = 6;
+  ((LinkSpecifier*)working)->specifier[0] = 127;
+  ((LinkSpecifier*)working)->specifier[1] = 0;
+  ((LinkSpecifier*)working)->specifier[2] = 0;
+  ((LinkSpecifier*)working)->specifier[3] = 1;
+  ((LinkSpecifier*)working)->specifier[4] = (uint8_t)( BENCH_REND_OR_PORT >> 8 );
+  ((LinkSpecifier*)working)->specifier[5] = (uint8_t)BENCH_REND_OR_PORT;
+  working += 2 + 6;
+
+  ((LinkSpecifier*)working)->type = LEGACYLink;
+  ((LinkSpecifier*)working)->length = ID_LENGTH;
+  memcpy( ((LinkSpecifier*)working)->specifier, bench->rend_relay.identity, ID_LENGTH );
+  working += 2 + ID_LENGTH;
+
+  encrypted_length = working - encrypted;
+
+  // EXP(B,x) | AUTH_KEY | X | B | PROTOID, expanded with the subcredential
+  // into the encryption key and the mac key
+  idx = CURVE25519_KEYSIZE;
+
+  if ( MINITOR_X25519_SHARED_SECRET( client_key, &intro_crypto->encrypt_key, secret_input, &idx ) < 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  memcpy( secret_input + CURVE25519_KEYSIZE, intro_crypto->auth_key.p, ED25519_PUB_KEY_SIZE );
+  memcpy( secret_input + CURVE25519_KEYSIZE + ED25519_PUB_KEY_SIZE, client_pk, CURVE25519_KEYSIZE );
+  memcpy( secret_input + CURVE25519_KEYSIZE * 2 + ED25519_PUB_KEY_SIZE, intro_crypto->encrypt_key.p.point, CURVE25519_KEYSIZE );
+  memcpy( secret_input + CURVE25519_KEYSIZE * 3 + ED25519_PUB_KEY_SIZE, HS_PROTOID, HS_PROTOID_LENGTH );
+
+  wc_InitShake256( &shake, NULL, INVALID_DEVID );
+  wc_Shake256_Update( &shake, secret_input, sizeof( secret_input ) );
+  wc_Shake256_Update( &shake, (uint8_t*)HS_PROTOID_KEY, HS_PROTOID_KEY_LENGTH );
+  wc_Shake256_Update( &shake, (uint8_t*)HS_PROTOID_EXPAND, HS_PROTOID_EXPAND_LENGTH );
+  wc_Shake256_Update( &shake, bench->service->current_sub_credential, WC_SHA3_256_DIGEST_SIZE );
+  wc_Shake256_Final( &shake, hs_keys, sizeof( hs_keys ) );
+  wc_Shake256_Free( &shake );
+
+  wc_AesInit( &aes_key, NULL, INVALID_DEVID );
+  wc_AesSetKeyDirect( &aes_key, hs_keys, AES_256_KEY_SIZE, aes_iv, AES_ENCRYPTION );
+
+  if ( wc_AesCtrEncrypt( &aes_key, encrypted, encrypted, encrypted_length ) != 0 )
+  {
+    wc_AesFree( &aes_key );
+
+    ret = -1;
+    goto finish;
+  }
+
+  wc_AesFree( &aes_key );
+
+  // the mac covers everything from legacy_key_id to the end of the
+  // encrypted part, prefixed with the mac key and its 64 bit length
+  length_buffer[7] = WC_SHA3_256_DIGEST_SIZE;
+
+  wc_InitSha3_256( &sha3, NULL, INVALID_DEVID );
+  wc_Sha3_256_Update( &sha3, length_buffer, 8 );
+  wc_Sha3_256_Update( &sha3, hs_keys + AES_256_KEY_SIZE, WC_SHA3_256_DIGEST_SIZE );
+  wc_Sha3_256_Update( &sha3, cell->payload.relay.data, working - cell->payload.relay.data );
+  wc_Sha3_256_Final( &sha3, working );
+  wc_Sha3_256_Free( &sha3 );
+
+  working += MAC_LEN;
+
+  v_set_relay_length( cell, working - cell->payload.relay.data );
+
+  // the intro point is the last hop of the intro circuit
+  if ( d_bench_relay_send( bench->relay_fd, bench->intro_cryptos, BENCH_MAX_HOPS - 1, cell ) < 0 )
+  {
+    ret = -1;
+  }
+
+finish:
+  free( cell );
+
+  return ret;
+}
+
+// plays the standby circuit's last hop, which extends to the rendezvous
+// point and sends back the point's half of the ntor handshake
+static int d_bench_answer_extend2( BenchRendezvous* bench, Cell* cell )
+{
+  int i;
+  int ret = 0;
+  uint8_t* working;
+  uint8_t client_public[G_LENGTH];
+  curve25519_key server_key;
+
+  wc_curve25519_init( &server_key );
+
+  for ( i = 0; i < BENCH_STANDBY_HOPS; i++ )
+  {
+    MINITOR_AES_CTR( &bench->standby_cryptos[i].aes_forward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+  }
+
+  if ( cell->payload.relay.relay_command != RELAY_EXTEND2 )
+  {
+    MINITOR_LOG( BENCH_TAG, "rendezvous_loopback: expected EXTEND2, got relay command %d", cell->payload.relay.relay_command );
+
+    ret = -1;
+    goto finish;
+  }
+
+  working = cell->payload.relay.extend2.link_specifiers;
+
+  for ( i = 0; i < cell->payload.relay.extend2.num_specifiers; i++ )
+  {
+    working += working[1] + 2;
+  }
+
+  // ID | B | X, the service has to be extending to the point the client named
+  if ( memcmp( ((Create2*)working)->handshake_data, bench->rend_relay.identity, ID_LENGTH ) != 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "rendezvous_loopback: EXTEND2 was not for our rendezvous point" );
+
+    ret = -1;
+    goto finish;
+  }
+
+  memcpy( client_public, ((Create2*)working)->handshake_data + ID_LENGTH + H_LENGTH, G_LENGTH );
+
+  if ( wc_curve25519_make_key( &bench->rng, 32, &server_key ) != 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  memset( cell->payload.relay.data, 0, RELAY_PAYLOAD_LEN );
+
+  cell->payload.relay.relay_command = RELAY_EXTENDED2;
+  v_set_relay_stream_id( cell, 0 );
+  v_set_relay_length( cell, 2 + G_LENGTH + WC_SHA256_DIGEST_SIZE );
+  v_store_be16( &cell->payload.relay.extended2.handshake_length, G_LENGTH + WC_SHA256_DIGEST_SIZE );
+
+  if (
+    d_bench_ntor_created2( cell->payload.relay.extended2.handshake_data, &bench->rend_relay, client_public, &server_key, &bench->rend_onion_key ) < 0 ||
+    d_bench_relay_send( bench->relay_fd, bench->standby_cryptos, BENCH_STANDBY_HOPS - 1, cell ) < 0
+  )
+  {
+    ret = -1;
+  }
+
+finish:
+  wc_curve25519_free( &server_key );
+
+  return ret;
+}
+
+// one intro as the client and its relays see it, from building the
+// INTRODUCE2 to the RENDEZVOUS1 arriving at the rendezvous point. our own
+// crypto runs on this chip too so service_us, the service's INTRODUCE2 to
+// RENDEZVOUS1 from its stats, is the part that is Minitor's
+static int d_bench_rendezvous_round( BenchRendezvous* bench, int round )
+{
+  int i;
+  int ret = 0;
+  int64_t start;
+  int64_t end;
+  uint32_t count;
+  uint32_t circ_id;
+  uint64_t total_us;
+  Cell* cell;
+  OnionCircuit* circuit;
+  MinitorStats* stats;
+  DlConnection* or_connection;
+  curve25519_key client_key;
+
+  stats = malloc( sizeof( MinitorStats ) );
+
+  wc_curve25519_init( &client_key );
+
+  // the standby circuit the service will extend to the rendezvous point
+  circuit = px_bench_circuit( BENCH_STANDBY_HOPS, CIRCUIT_STANDBY );
+  circuit->conn_id = bench->intro_circuit->conn_id;
+
+  circ_id = circuit->circ_id;
+
+  for ( i = 0; i < BENCH_STANDBY_HOPS; i++ )
+  {
+    v_bench_init_hop( &bench->standby_cryptos[i], i );
+  }
+
+  d_minitor_get_stats( stats );
+
+  count = stats->rendezvous.count;
+  total_us = stats->rendezvous.total_us;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  v_add_circuit_to_list( circuit, &onion_circuits );
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  // each round is a new client, the rate limit is for real intro floods
+  bench->service->rend_timestamp = 0;
+
+  if ( wc_curve25519_make_key( &bench->rng, 32, &client_key ) != 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  start = MINITOR_GET_TIME();
+
+  if ( d_bench_send_introduce2( bench, &client_key ) < 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  // the service's EXTEND2 goes out as RELAY_EARLY
+  if ( d_bench_recv_circuit_cell( bench->relay_fd, circ_id, RELAY_EARLY, &cell ) < 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "rendezvous_loopback: no EXTEND2 from the service" );
+
+    ret = -1;
+    goto finish;
+  }
+
+  ret = d_bench_answer_extend2( bench, cell );
+
+  free( cell );
+
+  if ( ret < 0 )
+  {
+    goto finish;
+  }
+
+  // the RENDEZVOUS1, its last layer is the rendezvous point's so it is only
+  // counted here, the service's stats say whether it joined
+  if ( d_bench_recv_circuit_cell( bench->relay_fd, circ_id, RELAY, &cell ) < 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "rendezvous_loopback: no RENDEZVOUS1 from the service" );
+
+    ret = -1;
+    goto finish;
+  }
+
+  end = MINITOR_GET_TIME();
+
+  free( cell );
+
+  // the core records the rendezvous before it gives the link, once we have
+  // had the link the stats include it
+  // MUTEX TAKE
+  or_connection = px_get_conn_by_id_and_lock( bench->intro_circuit->conn_id );
+
+  if ( or_connection != NULL )
+  {
+    MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+    // MUTEX GIVE
+  }
+
+  d_minitor_get_stats( stats );
+
+  if ( stats->rendezvous.count != count + 1 )
+  {
+    MINITOR_LOG( BENCH_TAG, "rendezvous_loopback: the service did not join the rendezvous" );
+
+    ret = -1;
+    goto finish;
+  }
+
+  printf(
+    "{\"bench\":\"rendezvous_loopback\",\"round\":%d,\"us\":%lld,\"service_us\":%llu}\n",
+    round,
+    (long long)( end - start ),
+    (unsigned long long)( stats->rendezvous.total_us - total_us )
+  );
+
+finish:
+  v_bench_destroy_circuit( circ_id );
+
+  for ( i = 0; i < BENCH_STANDBY_HOPS; i++ )
+  {
+    v_bench_free_hop( &bench->standby_cryptos[i] );
+  }
+
+  wc_curve25519_free( &client_key );
+  free( stats );
+
+  return ret;
+}
+
+// intro to rendezvous through the real service path, the connections
+// daemon, the core task, the crypto workers and the circuit code. the
+// benchmark plays the client, the intro point and the relays of each standby
+// circuit on a plain loopback link, like the stream benchmark, so the numbers
+// leave out tls and the network
+static int d_bench_rendezvous_loopback()
+{
+  int i;
+  int ret = 0;
+  int link_fd = -1;
+  unsigned int idx;
+  BenchRendezvous* bench;
+  IntroCrypto* intro_crypto;
+  DoublyLinkedRendezvousCookie* db_rendezvous_cookie;
+
+  bench = malloc( sizeof( BenchRendezvous ) );
+
+  memset( bench, 0, sizeof( BenchRendezvous ) );
+
+  bench->relay_fd = -1;
+
+  bench->service = malloc( sizeof( OnionService ) );
+
+  memset( bench->service, 0, sizeof( OnionService ) );
+
+  // the intro point's keys, a live intro circuit owns them
+  bench->intro_circuit = px_bench_circuit( BENCH_MAX_HOPS, CIRCUIT_INTRO_LIVE );
+  bench->intro_circuit->service = bench->service;
+  bench->intro_circuit->intro_crypto = malloc( sizeof( IntroCrypto ) );
+
+  intro_crypto = bench->intro_circuit->intro_crypto;
+
+  wc_ed25519_init( &intro_crypto->auth_key );
+  wc_curve25519_init( &intro_crypto->encrypt_key );
+  wc_curve25519_init( &bench->rend_onion_key );
+
+  for ( i = 0; i < BENCH_MAX_HOPS; i++ )
+  {
+    v_bench_init_hop( &bench->intro_cryptos[i], i );
+  }
+
+  if (
+    wc_InitRng( &bench->rng ) != 0 ||
+    wc_ed25519_make_key( &bench->rng, 32, &intro_crypto->auth_key ) != 0 ||
+    wc_curve25519_make_key( &bench->rng, 32, &intro_crypto->encrypt_key ) != 0 ||
+    wc_curve25519_make_key( &bench->rng, 32, &bench->rend_onion_key ) != 0
+  )
+  {
+    MINITOR_LOG( BENCH_TAG, "rendezvous_loopback: failed to make keys" );
+
+    ret = -1;
+    goto free_intro;
+  }
+
+  MINITOR_FILL_RANDOM( bench->service->current_sub_credential, WC_SHA3_256_DIGEST_SIZE );
+  MINITOR_FILL_RANDOM( bench->service->previous_sub_credential, WC_SHA3_256_DIGEST_SIZE );
+
+  // the rendezvous point the client picks
+  MINITOR_FILL_RANDOM( bench->rend_relay.identity, ID_LENGTH );
+
+  idx = H_LENGTH;
+  wc_curve25519_export_public_ex( &bench->rend_onion_key, bench->rend_relay.ntor_onion_key, &idx, EC25519_LITTLE_ENDIAN );
+
+  link_fd = d_bench_link( &bench->relay_fd );
+
+  if ( link_fd < 0 || d_attach_bench_or_connection( link_fd, bench->intro_circuit ) < 0 )
+  {
+    ret = -1;
+    goto free_intro;
+  }
+
+  // the daemon owns the link now, it closes it when we close our end
+  link_fd = -1;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  v_add_circuit_to_list( bench->intro_circuit, &onion_circuits );
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  for ( i = 0; i < BENCH_RENDEZVOUS_ROUNDS; i++ )
+  {
+    if ( d_bench_rendezvous_round( bench, i + 1 ) < 0 )
+    {
+      MINITOR_LOG( BENCH_TAG, "rendezvous_loopback: round %d failed", i + 1 );
+
+      ret = -1;
+
+      break;
+    }
+  }
+
+  v_bench_destroy_circuit( bench->intro_circuit->circ_id );
+
+  goto finish;
+
+free_intro:
+  // never made it onto the list
+  d_destroy_onion_circuit( bench->intro_circuit, NULL );
+  free( bench->intro_circuit );
+finish:
+  if ( link_fd >= 0 )
+  {
+    close( link_fd );
+  }
+
+  // the daemon sees the link close and drops it
+  if ( bench->relay_fd >= 0 )
+  {
+    close( bench->relay_fd );
+  }
+
+  // the cookies the service kept to catch replays
+  while ( bench->service->rendezvous_cookies.head != NULL )
+  {
+    db_rendezvous_cookie = bench->service->rendezvous_cookies.head;
+    bench->service->rendezvous_cookies.head = db_rendezvous_cookie->next;
+
+    free( db_rendezvous_cookie );
+  }
+
+  for ( i = 0; i < BENCH_MAX_HOPS; i++ )
+  {
+    v_bench_free_hop( &bench->intro_cryptos[i] );
+  }
+
+  wc_FreeRng( &bench->rng );
+  wc_curve25519_free( &bench->rend_onion_key );
+  free( bench->service );
+  free( bench );
+
+  return ret;
+}
+
+// bootstrap from the recorded consensus and descriptors, the files stand in
+// for the directory servers so what's left is parsing, the sd card and sha3
+static int d_bench_consensus_replay()
+{
+  ConsensusTimings timings;
+
+  if ( d_replay_consensus( MINITOR_REPLAY_CONSENSUS, MINITOR_REPLAY_DESCRIPTORS ) < 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "consensus_replay: replay failed" );
+
+    return -1;
+  }
+
+  v_get_consensus_timings( &timings );
+
+  if ( timings.insert.items == 0 )
+  {
+    MINITOR_LOG( BENCH_TAG, "consensus_replay: no hsdir relays in the recording" );
+
+    return -1;
+  }
+
+  v_bench_report( "consensus_replay", timings.insert.items, timings.wall_us );
+  v_bench_report_stage( "read", &timings.download );
+  v_bench_report_stage( "store", &timings.store );
+  v_bench_report_stage( "parse", &timings.parse );
+  v_bench_report_stage( "descriptor_read", &timings.fetch );
+  v_bench_report_stage( "descriptor_parse", &timings.descriptor_parse );
+  v_bench_report_stage( "id_hash", &timings.id_hash );
+  v_bench_report_stage( "insert", &timings.insert );
+
+  return 0;
+}
+
+// runs every benchmark and prints one json line per result, called once the
+// crypto provider has been picked so the numbers are for the backend Minitor
+// will use
+int d_minitor_bench()
+{
+  int ret = 0;
+  int hops;
+
+  // every benchmark runs even if one before it failed
+  if ( d_bench_relay_recognition() < 0 )
+  {
+    ret = -1;
+  }
+
+  for ( hops = 1; hops <= BENCH_MAX_HOPS; hops++ )
+  {
+    if ( d_bench_relay_encrypt( hops, false ) < 0 )
+    {
+      ret = -1;
+    }
+
+    if ( d_bench_relay_encrypt( hops, true ) < 0 )
+    {
+      ret = -1;
+    }
+
+    if ( d_bench_relay_decrypt( hops, false ) < 0 )
+    {
+      ret = -1;
+    }
+
+    if ( d_bench_relay_decrypt( hops, true ) < 0 )
+    {
+      ret = -1;
+    }
+  }
+
+  if ( d_bench_pad_cell() < 0 )
+  {
+    ret = -1;
+  }
+
+  if ( d_bench_recv_cell() < 0 )
+  {
+    ret = -1;
+  }
+
+  if ( d_bench_encoding() < 0 )
+  {
+    ret = -1;
+  }
+
+  if ( d_bench_ntor() < 0 )
+  {
+    ret = -1;
+  }
+
+  if ( d_bench_consensus_replay() < 0 )
+  {
+    ret = -1;
+  }
+
+  if ( d_bench_stream_loopback() < 0 )
+  {
+    ret = -1;
+  }
+
+  if ( d_bench_rendezvous_loopback() < 0 )
+  {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+#endif
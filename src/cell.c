@@ -28,311 +28,212 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../h/port.h"
 
 #include "../h/cell.h"
+#include "../h/crypto_provider.h"
+#include "../h/padding.h"
+#include "../h/trace.h"
+#include "../h/stats.h"
 #include "../h/structures/onion_message.h"
 
-void v_hostize_variable_short_cell( CellShortVariable* cell )
-{
-  int i;
-
-  cell->circ_id = ntohs( cell->circ_id );
-  cell->length = ntohs( cell->length );
-
-  switch ( cell->command )
-  {
-    case VERSIONS:
-      for ( i = 0; i < cell->length / 2; i++ )
-      {
-        cell->payload.versions[i] = ntohs( cell->payload.versions[i] );
-      }
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CELL
 
-      break;
+// the onion layers are applied to the payload this many bytes at a time
+#define ONION_BLOCK_LEN 64
 
-    default:
-      break;
-  }
-}
+MinitorMutex cell_pool_mutex;
+static Cell* cell_pool[MINITOR_CELL_POOL_SIZE];
+static int cell_pool_count = 0;
+static const uint8_t onion_zeros[ONION_BLOCK_LEN] = { 0 };
 
-void v_hostize_variable_cell( CellVariable* cell )
+Cell* px_take_pooled_cell()
 {
-  int i;
-  TorCert* cert;
+  Cell* cell = NULL;
 
-  cell->circ_id = ntohl( cell->circ_id );
-  cell->length = ntohs( cell->length );
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( cell_pool_mutex );
 
-  switch ( cell->command )
+  if ( cell_pool_count > 0 )
   {
-    case CERTS:
-      cert = cell->payload.certs.certs;
-
-      for ( i = 0; i < cell->payload.certs.num_certs; i++ )
-      {
-        // cert length
-        cert->cert_length = ntohs( cert->cert_length );
-
-        cert = (uint8_t*)cert + 3 + cert->cert_length;
-      }
-
-      break;
-
-    case AUTH_CHALLENGE:
-      cell->payload.auth_challenge.num_methods = ntohs( cell->payload.auth_challenge.num_methods );
-
-      for ( i = 0; i < cell->payload.auth_challenge.num_methods; i++ )
-      {
-        cell->payload.auth_challenge.methods[i] = ntohs( cell->payload.auth_challenge.methods[i] );
-      }
+    cell_pool_count--;
+    cell = cell_pool[cell_pool_count];
+  }
 
-      break;
+  MINITOR_MUTEX_GIVE( cell_pool_mutex );
+  // MUTEX GIVE
 
-    default:
-      break;
+  if ( cell == NULL )
+  {
+    cell = malloc( MINITOR_CELL_LEN );
   }
+
+  return cell;
 }
 
-void v_hostize_cell( Cell* cell )
+void v_give_pooled_cell( Cell* cell )
 {
-  cell->circ_id = ntohl( cell->circ_id );
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( cell_pool_mutex );
 
-  switch ( cell->command )
+  if ( cell_pool_count < MINITOR_CELL_POOL_SIZE )
   {
-    case RELAY:
-      cell->payload.relay.stream_id = ntohs( cell->payload.relay.stream_id );
-      cell->payload.relay.length = ntohs( cell->payload.relay.length );
-
-      switch ( cell->payload.relay.relay_command )
-      {
-        case RELAY_BEGIN:
-          // flags of relay_begin are after the address string
-          ((uint32_t*)cell->payload.relay.data + strlen( (char*)cell->payload.relay.data ) + 1)[0] = ntohl(((uint32_t*)cell->payload.relay.data + strlen( (char*)cell->payload.relay.data ) + 1)[0]);
-
-          break;
-
-        case RELAY_CONNECTED:
-          if ( cell->payload.relay.connected.address_4 != 0 )
-          {
-            cell->payload.relay.connected.ttl_4 = ntohl( cell->payload.relay.connected.ttl_4 );
-          }
-          else if ( cell->payload.relay.connected.address_type == 6 )
-          {
-            cell->payload.relay.connected.ttl_6 = ntohl( cell->payload.relay.connected.ttl_6 );
-          }
-
-          break;
-
-        case RELAY_EXTENDED2:
-          cell->payload.relay.extended2.handshake_length = ntohs( cell->payload.relay.extended2.handshake_length );
-
-          break;
-
-        case RELAY_COMMAND_INTRODUCE2:
-          cell->payload.relay.introduce2.auth_key_length = ntohs( cell->payload.relay.introduce2.auth_key_length );
+    cell_pool[cell_pool_count] = cell;
+    cell_pool_count++;
 
-          break;
+    cell = NULL;
+  }
 
-        default:
-          break;
-      }
+  MINITOR_MUTEX_GIVE( cell_pool_mutex );
+  // MUTEX GIVE
 
-      break;
+  if ( cell != NULL )
+  {
+    free( cell );
+  }
+}
 
-    case NETINFO:
-      cell->payload.netinfo.time = ntohl( cell->payload.netinfo.time );
+int d_pooled_cell_count()
+{
+  int count;
 
-      break;
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( cell_pool_mutex );
 
-    case CREATED2:
-      cell->payload.created2.handshake_length = ntohs( cell->payload.created2.handshake_length );
+  count = cell_pool_count;
 
-      break;
+  MINITOR_MUTEX_GIVE( cell_pool_mutex );
+  // MUTEX GIVE
 
-    default:
-      break;
-  }
+  return count;
 }
 
-void v_networkize_variable_short_cell( CellShortVariable* cell )
+// fills the unused tail of the cell, relay cells get random padding so their
+// length can't be guessed, everything else is zeroed
+void v_pad_cell( Cell* cell )
 {
-  int i;
-
-  switch ( cell->command )
+  if ( ( cell->command == RELAY || cell->command == RELAY_EARLY ) && cell->payload.relay.relay_command != RELAY_BEGIN_DIR )
   {
-    case VERSIONS:
-      for ( i = 0; i < cell->length / 2; i++ )
-      {
-        cell->payload.versions[i] = htons( cell->payload.versions[i] );
-      }
-
-      break;
+    MINITOR_FILL_PADDING( (uint8_t*)cell + FIXED_CELL_OFFSET + cell->length, CELL_LEN - cell->length );
+  }
+  else
+  {
+    memset( (uint8_t*)cell + FIXED_CELL_OFFSET + cell->length, 0, CELL_LEN - cell->length );
   }
-
-  cell->circ_id = htons( cell->circ_id );
-  cell->length = htons( cell->length );
 }
 
-void v_networkize_variable_cell ( CellVariable* cell )
+// applies count hop layers starting at db_relay, plus hs_aes if it isn't
+// NULL, in a single pass over data. each block's keystreams are xored
+// together on the stack first so data is read and written once however
+// many layers there are, the result is the same as one pass per layer
+static int d_apply_onion_layers( DoublyLinkedOnionRelay* db_relay, int count, bool forward, Aes* hs_aes, uint8_t* data, int length )
 {
   int i;
-  int length;
-  TorCert* cert;
-
-  switch ( cell->command )
+  int j;
+  int succ;
+  int offset;
+  int block_length;
+  Aes* aes;
+  uint32_t keystream[ONION_BLOCK_LEN / 4];
+  uint32_t combined[ONION_BLOCK_LEN / 4];
+  DoublyLinkedOnionRelay* hop;
+
+  for ( offset = 0; offset < length; offset += block_length )
   {
-    case AUTHENTICATE:
-      cell->payload.authenticate.auth_type = htons( cell->payload.authenticate.auth_type );
-      cell->payload.authenticate.auth_length = htons( cell->payload.authenticate.auth_length );
+    block_length = length - offset;
 
-      break;
+    if ( block_length > ONION_BLOCK_LEN )
+    {
+      block_length = ONION_BLOCK_LEN;
+    }
 
-    case CERTS:
-      cert = cell->payload.certs.certs;
+    memset( combined, 0, sizeof( combined ) );
 
-      for ( i = 0; i < cell->payload.certs.num_certs; i++ )
-      {
-        length = cert->cert_length;
-        cert->cert_length = htons( cert->cert_length );
+    hop = db_relay;
 
-        cert = (uint8_t*)cert + 3 + length;
+    for ( i = 0; i <= count; i++ )
+    {
+      if ( i < count )
+      {
+        aes = forward ? &hop->relay_crypto->aes_forward : &hop->relay_crypto->aes_backward;
+        hop = hop->next;
       }
-
-      break;
-
-    default:
-      break;
-  }
-
-  cell->circ_id = htonl( cell->circ_id );
-  cell->length = htons( cell->length );
-}
-
-void v_networkize_cell( Cell* cell )
-{
-  int i;
-  uint8_t* tmp_p;
-  Create2* create2;
-
-  switch ( cell->command )
-  {
-    case RELAY:
-    case RELAY_EARLY:
-      cell->payload.relay.stream_id = htons( cell->payload.relay.stream_id );
-      cell->payload.relay.length = htons( cell->payload.relay.length );
-
-      switch ( cell->payload.relay.relay_command )
+      else if ( hs_aes != NULL )
       {
-        case RELAY_CONNECTED:
-          if ( cell->payload.relay.connected.address_4 != 0 )
-          {
-            cell->payload.relay.connected.ttl_4 = htonl( cell->payload.relay.connected.ttl_4 );
-          }
-          else if ( cell->payload.relay.connected.address_type == 6 )
-          {
-            cell->payload.relay.connected.ttl_6 = htonl( cell->payload.relay.connected.ttl_6 );
-          }
-
-          break;
-        case RELAY_EXTEND2:
-          tmp_p = cell->payload.relay.extend2.link_specifiers;
-
-          // skip over the link specifiers
-          for ( i = 0; i < cell->payload.relay.extend2.num_specifiers; i++ )
-          {
-            tmp_p += tmp_p[1] + 2;
-          }
-
-          create2 = tmp_p;
-
-          create2->handshake_type = htons( create2->handshake_type );
-          create2->handshake_length = htons( create2->handshake_length );
-
-          break;
-        case RELAY_COMMAND_ESTABLISH_INTRO:
-          // this has already been networkized for the handshake auth, need to hostize it for this
-          tmp_p = cell->payload.relay.establish_intro.auth_key + ntohs( cell->payload.relay.establish_intro.auth_key_length ) + 1;
-
-          // extensions
-          for ( i = 0; i < cell->payload.relay.establish_intro.auth_key[ntohs( cell->payload.relay.establish_intro.auth_key_length )]; i++ )
-          {
-            if ( tmp_p[0] == EXTENSION_ED25519 )
-            {
-              tmp_p += 16 + 32 + 64;
-            }
-          }
-
-          tmp_p += MAC_LEN;
-
-          // signature length
-          ((uint16_t*)tmp_p)[0] = htons( ((uint16_t*)tmp_p)[0] );
-
-          // auth key length needs to be hostized before the signature is created, and before this function is called
-          //cell->payload.relay.establish_intro.auth_key_length = htons( cell->payload.relay.establish_intro.auth_key_length );
-
-          break;
-        default:
-          //MINITOR_LOG( MINITOR_TAG, "unhandled relay command %d", cell->payload.relay.relay_command );
-
-          break;
+        aes = hs_aes;
+      }
+      else
+      {
+        break;
       }
 
-      break;
-
-    case NETINFO:
-      cell->payload.netinfo.time = htonl( cell->payload.netinfo.time );
+      succ = MINITOR_AES_CTR( aes, (uint8_t*)keystream, onion_zeros, block_length );
 
-      break;
-
-    case CREATE2:
-      cell->payload.create2.handshake_type = htons( cell->payload.create2.handshake_type );
-      cell->payload.create2.handshake_length = htons( cell->payload.create2.handshake_length );
-      
-      break;
+      if ( succ < 0 )
+      {
+        return succ;
+      }
 
-    default:
-      //MINITOR_LOG( MINITOR_TAG, "unhandled command %d", cell->command );
+      for ( j = 0; j < ( block_length + 3 ) / 4; j++ )
+      {
+        combined[j] ^= keystream[j];
+      }
+    }
 
-      break;
+    for ( j = 0; j < block_length; j++ )
+    {
+      data[offset + j] ^= ((uint8_t*)combined)[j];
+    }
   }
 
-  cell->circ_id = htonl( cell->circ_id );
+  return 0;
+}
 
-  if ( ( cell->command == RELAY || cell->command == RELAY_EARLY ) && cell->payload.relay.relay_command != RELAY_BEGIN_DIR )
+// the benchmark's loopback link has no tls, its ssl is left NULL and cells
+// go straight to the socket
+static int d_send_on_link( DlConnection* or_connection, Cell* cell )
+{
+#ifdef MINITOR_BENCHMARK
+  if ( or_connection->ssl == NULL )
   {
-    MINITOR_FILL_RANDOM( (uint8_t*)cell + FIXED_CELL_OFFSET + cell->length, CELL_LEN - cell->length );
-  }
-  else
-  {
-    memset( (uint8_t*)cell + FIXED_CELL_OFFSET + cell->length, 0, CELL_LEN - cell->length );
+    return send( or_connection->sock_fd, (uint8_t*)cell + FIXED_CELL_OFFSET, CELL_LEN, 0 );
   }
+#endif
+
+  return wolfSSL_send( or_connection->ssl, (uint8_t*)cell + FIXED_CELL_OFFSET, CELL_LEN, 0 );
 }
 
 int d_send_cell_and_free( DlConnection* or_connection, Cell* cell )
 {
   int succ;
 
-  v_networkize_cell( cell );
+  v_pad_cell( cell );
+
+  MINITOR_TRACE( TRACE_CELL_SENT, ud_get_cell_circ_id( cell ), cell->command );
 
-  succ = wolfSSL_send( or_connection->ssl, (uint8_t*)cell + FIXED_CELL_OFFSET, CELL_LEN, 0 );
+  succ = d_send_on_link( or_connection, cell );
 
   if ( succ < 0 )
   {
     MINITOR_LOG( MINITOR_TAG, "Failed to send packed cell" );
   }
+  else
+  {
+    or_connection->cells_sent++;
+    MINITOR_STAT_INC( STAT_CELLS_SENT );
+  }
 
-  free( cell );
+  v_give_pooled_cell( cell );
 
   return succ;
 }
 
-int d_send_relay_cell_and_free( DlConnection* or_connection, Cell* cell, DoublyLinkedOnionRelayList* relay_list, HsCrypto* hs_crypto )
+// sets the digest for the last built hop, or the hs layer if there is one,
+// then adds every onion layer, the cell must already be padded
+int d_encrypt_relay_cell( Cell* cell, DoublyLinkedOnionRelayList* relay_list, HsCrypto* hs_crypto )
 {
-  int ret = 0;
   int i;
   int succ;
   unsigned char tmp_digest[WC_SHA3_256_DIGEST_SIZE];
   DoublyLinkedOnionRelay* db_relay = relay_list->head;
 
-  v_networkize_cell( cell );
-
   for ( i = 0; i < relay_list->built_length - 1; i++ )
   {
     db_relay = db_relay->next;
@@ -340,47 +241,55 @@ int d_send_relay_cell_and_free( DlConnection* or_connection, Cell* cell, DoublyL
 
   if ( hs_crypto == NULL )
   {
-    wc_ShaUpdate( &db_relay->relay_crypto->running_sha_forward, cell->payload.data, PAYLOAD_LEN );
+    MINITOR_SHA_UPDATE( &db_relay->relay_crypto->running_sha_forward, cell->payload.data, PAYLOAD_LEN );
     wc_ShaGetHash( &db_relay->relay_crypto->running_sha_forward, tmp_digest );
   }
   else
   {
-    wc_Sha3_256_Update( &hs_crypto->hs_running_sha_backward, cell->payload.data, PAYLOAD_LEN );
+    MINITOR_SHA3_256_UPDATE( &hs_crypto->hs_running_sha_backward, cell->payload.data, PAYLOAD_LEN );
     wc_Sha3_256_GetHash( &hs_crypto->hs_running_sha_backward, tmp_digest );
   }
 
   memcpy( &(cell->payload.relay.digest), tmp_digest, 4 );
 
-  // encrypt the RELAY_EARLY cell's payload from R_(node_index-1) to R_0
-  for ( i = relay_list->built_length - 1; i >= 0; i-- )
+  // encrypt the RELAY_EARLY cell's payload for R_0 to R_(node_index-1) and
+  // the hs layer in one pass
+  succ = d_apply_onion_layers(
+    relay_list->head,
+    relay_list->built_length,
+    true,
+    hs_crypto == NULL ? NULL : &hs_crypto->hs_aes_backward,
+    cell->payload.data,
+    PAYLOAD_LEN
+  );
+
+  if ( succ < 0 )
   {
-    succ = wc_AesCtrEncrypt( &db_relay->relay_crypto->aes_forward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+    MINITOR_LOG( MINITOR_TAG, "Failed to encrypt RELAY payload, error code: %d", succ );
 
-    if ( succ < 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Failed to encrypt RELAY payload, error code: %d", succ );
+    return -1;
+  }
 
-      ret = -1;
-      goto finish;
-    }
+  return 0;
+}
 
-    db_relay = db_relay->previous;
-  }
+int d_send_relay_cell_and_free( DlConnection* or_connection, Cell* cell, DoublyLinkedOnionRelayList* relay_list, HsCrypto* hs_crypto )
+{
+  int ret = 0;
+  int succ;
 
-  if ( hs_crypto != NULL )
-  {
-    succ = wc_AesCtrEncrypt( &hs_crypto->hs_aes_backward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+  v_pad_cell( cell );
 
-    if ( succ < 0 ) {
-      MINITOR_LOG( MINITOR_TAG, "Failed to encrypt RELAY payload using hs crypto, error code: %d", succ );
+  MINITOR_TRACE( TRACE_CELL_SENT, ud_get_cell_circ_id( cell ), cell->command );
 
-      ret = -1;
-      goto finish;
-    }
+  if ( d_encrypt_relay_cell( cell, relay_list, hs_crypto ) < 0 )
+  {
+    ret = -1;
+    goto finish;
   }
 
   // send the RELAY_EARLY to the first node in the circuit
-  succ = wolfSSL_send( or_connection->ssl, (uint8_t*)cell + FIXED_CELL_OFFSET, CELL_LEN, 0 );
+  succ = d_send_on_link( or_connection, cell );
 
   if ( succ < 0 )
   {
@@ -390,13 +299,47 @@ int d_send_relay_cell_and_free( DlConnection* or_connection, Cell* cell, DoublyL
     goto finish;
   }
 
+  or_connection->cells_sent++;
+  MINITOR_STAT_INC( STAT_CELLS_SENT );
+  MINITOR_STAT_INC( STAT_RELAY_CELLS_SENT );
+
 finish:
-  free( cell );
+  v_give_pooled_cell( cell );
 
   return ret;
 }
 
+static int d_wolfssl_cell_reader( void* reader_data, uint8_t* buf, int length )
+{
+  int rx_length;
+  WOLFSSL* ssl = reader_data;
+
+  rx_length = wolfSSL_recv( ssl, buf, length, 0 );
+
+  if ( rx_length <= 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to wolfSSL_recv rx_length: %d, error code: %d", rx_length, wolfSSL_get_error( ssl, rx_length ) );
+  }
+
+  return rx_length;
+}
+
 int d_recv_cell( WOLFSSL* ssl, uint8_t** cell, int circ_id_length )
+{
+  return d_recv_cell_from( d_wolfssl_cell_reader, ssl, cell, circ_id_length );
+}
+
+#ifdef MINITOR_BENCHMARK
+// reads a plain socket, reader_data points at the fd
+int d_socket_cell_reader( void* reader_data, uint8_t* buf, int length )
+{
+  return recv( *(int*)reader_data, buf, length, 0 );
+}
+#endif
+
+// frames one cell out of whatever reader gives it, the reader may return
+// less than it was asked for
+int d_recv_cell_from( CellReader reader, void* reader_data, uint8_t** cell, int circ_id_length )
 {
   int i;
   int rx_length;
@@ -421,18 +364,16 @@ int d_recv_cell( WOLFSSL* ssl, uint8_t** cell, int circ_id_length )
     // the cell or the length of the header
     if ( rx_limit - rx_length_total > CELL_LEN )
     {
-      rx_length = wolfSSL_recv( ssl, *cell + rx_length_total, CELL_LEN, 0 );
+      rx_length = reader( reader_data, *cell + rx_length_total, CELL_LEN );
     }
     else
     {
-      rx_length = wolfSSL_recv( ssl, *cell + rx_length_total, rx_limit - rx_length_total, 0 );
+      rx_length = reader( reader_data, *cell + rx_length_total, rx_limit - rx_length_total );
     }
 
     // if rx_length is 0 then we've hit an error and should return -1
     if ( rx_length <= 0 )
     {
-      MINITOR_LOG( MINITOR_TAG, "Failed to wolfSSL_recv rx_length: %d, error code: %d", rx_length, wolfSSL_get_error( ssl, rx_length ) );
-
       free( *cell );
 
       return -1;
@@ -503,15 +444,48 @@ int d_recv_cell( WOLFSSL* ssl, uint8_t** cell, int circ_id_length )
   return rx_limit;
 }
 
+// hashes the cell into the scratch copy of the hop's backward digest, on a
+// match the scratch becomes the live digest so nothing is copied back
+bool b_recognize_relay_cell( RelayCrypto* relay_crypto, Cell* cell )
+{
+  Sha* live_sha;
+  Sha* scratch_sha;
+  unsigned char zeros[4] = { 0 };
+  unsigned char tmp_digest[WC_SHA_DIGEST_SIZE];
+
+  live_sha = &relay_crypto->running_sha_backward[relay_crypto->sha_backward_index];
+  scratch_sha = &relay_crypto->running_sha_backward[!relay_crypto->sha_backward_index];
+
+  wc_ShaCopy( live_sha, scratch_sha );
+
+  // before digest
+  MINITOR_SHA_UPDATE( scratch_sha, (uint8_t*)(&cell->payload), 5 );
+  // zeros in lieu of the digest
+  MINITOR_SHA_UPDATE( scratch_sha, zeros, 4 );
+  MINITOR_SHA_UPDATE( scratch_sha, (uint8_t*)(&cell->payload.relay.length), PAYLOAD_LEN - 9 );
+  wc_ShaGetHash( scratch_sha, tmp_digest );
+
+  if ( memcmp( tmp_digest, (uint8_t*)(&cell->payload.relay.digest), 4 ) != 0 )
+  {
+    return false;
+  }
+
+  relay_crypto->sha_backward_index = !relay_crypto->sha_backward_index;
+
+  return true;
+}
+
 int d_decrypt_cell( Cell* cell, int circ_id_length, DoublyLinkedOnionRelayList* relay_list, HsCrypto* hs_crypto )
 {
   int i;
+  int first;
   int wolf_succ;
-  Sha tmp_sha;
-  Sha3 tmp_sha3;
+  Sha3* live_sha3;
+  Sha3* scratch_sha3;
   DoublyLinkedOnionRelay* db_relay;
+  DoublyLinkedOnionRelay* first_relay;
+  DoublyLinkedOnionRelay* last_relay;
   unsigned char zeros[4] = { 0 };
-  unsigned char tmp_digest[WC_SHA_DIGEST_SIZE];
   unsigned char tmp_sha3_digest[WC_SHA3_256_DIGEST_SIZE];
   int fully_recognized = 0;
 
@@ -530,11 +504,34 @@ int d_decrypt_cell( Cell* cell, int circ_id_length, DoublyLinkedOnionRelayList*
   }
 
   db_relay = relay_list->head;
+  i = 0;
   //wc_InitSha( &tmp_sha );
 
-  for ( i = 0; i < relay_list->built_length; i++ )
+  while ( i < relay_list->built_length )
   {
-    wolf_succ = wc_AesCtrEncrypt( &db_relay->relay_crypto->aes_backward, cell->payload.data, cell->payload.data, PAYLOAD_LEN );
+    first = i;
+    first_relay = db_relay;
+
+    // the header is in the first block, peel that one layer at a time until
+    // one looks like it came from its hop, that hop and the ones before it
+    // are the only layers the rest of the payload gets
+    do
+    {
+      wolf_succ = MINITOR_AES_CTR( &db_relay->relay_crypto->aes_backward, cell->payload.data, cell->payload.data, ONION_BLOCK_LEN );
+
+      if ( wolf_succ < 0 )
+      {
+        MINITOR_LOG( MINITOR_TAG, "Failed to decrypt RELAY payload, error code: %d", wolf_succ );
+
+        return -1;
+      }
+
+      last_relay = db_relay;
+      db_relay = db_relay->next;
+      i++;
+    } while ( i < relay_list->built_length && cell->payload.relay.recognized != 0 );
+
+    wolf_succ = d_apply_onion_layers( first_relay, i - first, false, NULL, cell->payload.data + ONION_BLOCK_LEN, PAYLOAD_LEN - ONION_BLOCK_LEN );
 
     if ( wolf_succ < 0 )
     {
@@ -543,40 +540,22 @@ int d_decrypt_cell( Cell* cell, int circ_id_length, DoublyLinkedOnionRelayList*
       return -1;
     }
 
-    if ( cell->payload.relay.recognized == 0 )
+    if ( cell->payload.relay.recognized == 0 && b_recognize_relay_cell( last_relay->relay_crypto, cell ) )
     {
-      wc_ShaCopy( &db_relay->relay_crypto->running_sha_backward, &tmp_sha );
-
-      // before digest
-      wc_ShaUpdate( &tmp_sha, (uint8_t*)(&cell->payload), 5 );
-      // zeros in lieu of the digest
-      wc_ShaUpdate( &tmp_sha, zeros, 4 );
-      wc_ShaUpdate( &tmp_sha, (uint8_t*)(&cell->payload.relay.length), PAYLOAD_LEN - 9 );
-      wc_ShaGetHash( &tmp_sha, tmp_digest );
-
-      if ( memcmp( tmp_digest, (uint8_t*)(&cell->payload.relay.digest), 4 ) == 0 )
-      {
-        //wc_ShaFree( &db_relay->relay_crypto->running_sha_backward );
-        wc_ShaCopy( &tmp_sha, &db_relay->relay_crypto->running_sha_backward );
-        fully_recognized = 1;
-        break;
-      }
+      fully_recognized = 1;
+      break;
     }
-
-    db_relay = db_relay->next;
   }
 
   if ( !fully_recognized && hs_crypto == NULL )
   {
     MINITOR_LOG( MINITOR_TAG, "Relay cell was not recognized on circuit" );
 
-    wc_ShaFree( &tmp_sha );
-
     return -1;
   }
   else if ( !fully_recognized && hs_crypto != NULL )
   {
-    wolf_succ = wc_AesCtrEncrypt( &hs_crypto->hs_aes_forward, (uint8_t*)(&cell->payload), (uint8_t*)(&cell->payload), PAYLOAD_LEN );
+    wolf_succ = MINITOR_AES_CTR( &hs_crypto->hs_aes_forward, (uint8_t*)(&cell->payload), (uint8_t*)(&cell->payload), PAYLOAD_LEN );
 
     if ( wolf_succ < 0 )
     {
@@ -587,24 +566,24 @@ int d_decrypt_cell( Cell* cell, int circ_id_length, DoublyLinkedOnionRelayList*
 
     if ( cell->payload.relay.recognized == 0 )
     {
-      wc_Sha3_256_Copy( &hs_crypto->hs_running_sha_forward, &tmp_sha3 );
+      live_sha3 = &hs_crypto->hs_running_sha_forward[hs_crypto->hs_sha_forward_index];
+      scratch_sha3 = &hs_crypto->hs_running_sha_forward[!hs_crypto->hs_sha_forward_index];
 
-      wc_Sha3_256_Update( &tmp_sha3, (uint8_t*)(&cell->payload), 5 );
-      wc_Sha3_256_Update( &tmp_sha3, zeros, 4 );
-      wc_Sha3_256_Update( &tmp_sha3, (uint8_t*)(&cell->payload.relay.length), PAYLOAD_LEN - 9 );
-      wc_Sha3_256_GetHash( &tmp_sha3, tmp_sha3_digest );
+      wc_Sha3_256_Copy( live_sha3, scratch_sha3 );
+
+      MINITOR_SHA3_256_UPDATE( scratch_sha3, (uint8_t*)(&cell->payload), 5 );
+      MINITOR_SHA3_256_UPDATE( scratch_sha3, zeros, 4 );
+      MINITOR_SHA3_256_UPDATE( scratch_sha3, (uint8_t*)(&cell->payload.relay.length), PAYLOAD_LEN - 9 );
+      wc_Sha3_256_GetHash( scratch_sha3, tmp_sha3_digest );
 
       if ( memcmp( tmp_sha3_digest, (uint8_t*)(&cell->payload.relay.digest), 4 ) == 0 )
       {
-        wc_Sha3_256_Free( &hs_crypto->hs_running_sha_forward );
-        wc_Sha3_256_Copy( &tmp_sha3, &hs_crypto->hs_running_sha_forward );
+        hs_crypto->hs_sha_forward_index = !hs_crypto->hs_sha_forward_index;
       }
       else
       {
         MINITOR_LOG( MINITOR_TAG, "Relay cell was not recognized on hidden service" );
 
-        wc_Sha3_256_Free( &tmp_sha3 );
-
         return -1;
       }
     }
@@ -29,12 +29,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "../h/connections.h"
 #include "../h/circuit.h"
+#include "../h/key_pool.h"
 #include "../h/cell.h"
+#include "../h/crypto_provider.h"
 #include "../h/encoding.h"
 #include "../h/structures/onion_message.h"
 #include "../h/models/relay.h"
 #include "../h/consensus.h"
 
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CIRCUIT
+
 static unsigned int ud_get_cert_date( unsigned char* date_buffer, int date_size ) {
   int i = 0;
   struct tm temp_time;
@@ -79,13 +83,31 @@ static unsigned int ud_get_cert_date( unsigned char* date_buffer, int date_size
   return 0;
 }
 
+// the circ_id picks the core shard that owns the circuit, skip ahead until we
+// land on the one we were asked for
+uint32_t ud_next_circ_id( int shard )
+{
+  uint32_t circ_id;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circ_id_mutex );
+
+  do
+  {
+    circ_id = ++circ_id_counter;
+  } while ( circ_id % MINITOR_CORE_SHARDS != shard );
+
+  MINITOR_MUTEX_GIVE( circ_id_mutex );
+  // MUTEX GIVE
+
+  return circ_id;
+}
+
 int d_prepare_onion_circuit( OnionCircuit* circuit, int length, OnionRelay* start_relay, OnionRelay* end_relay )
 {
   int i;
   DoublyLinkedOnionRelay* dl_relay;
 
-  circuit->circ_id = ++circ_id_counter;
-
   if ( start_relay != NULL )
   {
     length--;
@@ -276,7 +298,7 @@ int d_destroy_onion_circuit( OnionCircuit* circuit, DlConnection* or_connection
     // length is header plus 1 for destroy code
     destroy_cell->length = FIXED_CELL_HEADER_SIZE + 1;
     destroy_cell->command = DESTROY;
-    destroy_cell->circ_id = circuit->circ_id;
+    v_set_cell_circ_id( destroy_cell, circuit->circ_id );
     destroy_cell->payload.destroy_code = NO_DESTROY_CODE;
 
     if ( d_send_cell_and_free( or_connection, destroy_cell ) < 0 )
@@ -284,7 +306,7 @@ int d_destroy_onion_circuit( OnionCircuit* circuit, DlConnection* or_connection
       MINITOR_LOG( MINITOR_TAG, "Failed to send DESTROY cell" );
     }
 
-    MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+    MINITOR_MUTEX_GIVE( or_connection->access_mutex );
     // MUTEX GIVE
   }
 
@@ -295,7 +317,8 @@ int d_destroy_onion_circuit( OnionCircuit* circuit, DlConnection* or_connection
     if ( i < circuit->relay_list.built_length )
     {
       wc_ShaFree( &tmp_relay_node->relay_crypto->running_sha_forward );
-      wc_ShaFree( &tmp_relay_node->relay_crypto->running_sha_backward );
+      wc_ShaFree( &tmp_relay_node->relay_crypto->running_sha_backward[0] );
+      wc_ShaFree( &tmp_relay_node->relay_crypto->running_sha_backward[1] );
       wc_AesFree( &tmp_relay_node->relay_crypto->aes_forward );
       wc_AesFree( &tmp_relay_node->relay_crypto->aes_backward );
       free( tmp_relay_node->relay_crypto );
@@ -327,7 +350,8 @@ int d_destroy_onion_circuit( OnionCircuit* circuit, DlConnection* or_connection
   }
   else if ( circuit->status == CIRCUIT_RENDEZVOUS )
   {
-    wc_Sha3_256_Free( &circuit->hs_crypto->hs_running_sha_forward );
+    wc_Sha3_256_Free( &circuit->hs_crypto->hs_running_sha_forward[0] );
+    wc_Sha3_256_Free( &circuit->hs_crypto->hs_running_sha_forward[1] );
     wc_Sha3_256_Free( &circuit->hs_crypto->hs_running_sha_backward );
     wc_AesFree( &circuit->hs_crypto->hs_aes_forward );
     wc_AesFree( &circuit->hs_crypto->hs_aes_backward );
@@ -368,7 +392,8 @@ int d_router_truncate( OnionCircuit* circuit, DlConnection* or_connection, int n
     if ( i < circuit->relay_list.built_length )
     {
       wc_ShaFree( &tmp_relay_node->relay_crypto->running_sha_forward );
-      wc_ShaFree( &tmp_relay_node->relay_crypto->running_sha_backward );
+      wc_ShaFree( &tmp_relay_node->relay_crypto->running_sha_backward[0] );
+      wc_ShaFree( &tmp_relay_node->relay_crypto->running_sha_backward[1] );
       wc_AesFree( &tmp_relay_node->relay_crypto->aes_forward );
       wc_AesFree( &tmp_relay_node->relay_crypto->aes_backward );
       free( tmp_relay_node->relay_crypto );
@@ -390,13 +415,13 @@ int d_router_truncate( OnionCircuit* circuit, DlConnection* or_connection, int n
   // fixed header, relay header and 1 for destroy code
   truncate_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + 1;
   truncate_cell->command = RELAY;
-  truncate_cell->circ_id = circuit->circ_id;
+  v_set_cell_circ_id( truncate_cell, circuit->circ_id );
 
   truncate_cell->payload.relay.relay_command = RELAY_TRUNCATE;
   truncate_cell->payload.relay.recognized = 0;
-  truncate_cell->payload.relay.stream_id = 0;
+  v_set_relay_stream_id( truncate_cell, 0 );
   truncate_cell->payload.relay.digest = 0;
-  truncate_cell->payload.relay.length = 1;
+  v_set_relay_length( truncate_cell, 1 );
   truncate_cell->payload.relay.destroy_code = NO_DESTROY_CODE;
 
   // send a destroy cell to the first hop
@@ -413,22 +438,14 @@ int d_router_truncate( OnionCircuit* circuit, DlConnection* or_connection, int n
 int d_router_extend2( OnionCircuit* circuit, DlConnection* or_connection, int node_index )
 {
   int i;
-  int wolf_succ;
-  WC_RNG rng;
   DoublyLinkedOnionRelay* target_relay;
   Cell* extend2_cell;
   LinkSpecifier* working_specifier;
   Create2* create2;
 
-  wc_curve25519_init( &circuit->create2_handshake_key );
-  wc_InitRng( &rng );
-
-  wolf_succ = wc_curve25519_make_key( &rng, 32, &circuit->create2_handshake_key );
-
-  wc_FreeRng( &rng );
-
-  if ( wolf_succ != 0 ) {
-    MINITOR_LOG( MINITOR_TAG, "Failed to make extend2_handshake_key, error code %d", wolf_succ );
+  if ( d_take_ephemeral_key( &circuit->create2_handshake_key ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to make extend2_handshake_key" );
 
     goto fail;
   }
@@ -443,16 +460,16 @@ int d_router_extend2( OnionCircuit* circuit, DlConnection* or_connection, int no
   extend2_cell = malloc( MINITOR_CELL_LEN );
 
   // construct link specifiers
-  extend2_cell->circ_id = circuit->circ_id;
+  v_set_cell_circ_id( extend2_cell, circuit->circ_id );
   extend2_cell->command = RELAY_EARLY;
   extend2_cell->payload.relay.relay_command = RELAY_EXTEND2;
   extend2_cell->payload.relay.recognized = 0;
-  extend2_cell->payload.relay.stream_id = 0;
+  v_set_relay_stream_id( extend2_cell, 0 );
   extend2_cell->payload.relay.digest = 0;
-  extend2_cell->payload.relay.length = 35 + ID_LENGTH + H_LENGTH + G_LENGTH;
+  v_set_relay_length( extend2_cell, 35 + ID_LENGTH + H_LENGTH + G_LENGTH );
 
   // fixed header, relay header, relay body length
-  extend2_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + extend2_cell->payload.relay.length;
+  extend2_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + ud_get_relay_length( extend2_cell );
 
   extend2_cell->payload.relay.extend2.num_specifiers = 2;
 
@@ -475,8 +492,8 @@ int d_router_extend2( OnionCircuit* circuit, DlConnection* or_connection, int no
 
   create2 = (uint8_t*)working_specifier + 2 + ID_LENGTH;
 
-  create2->handshake_type = NTOR;
-  create2->handshake_length = ID_LENGTH + H_LENGTH + G_LENGTH;
+  v_set_create2_handshake_type( create2, NTOR );
+  v_set_create2_handshake_length( create2, ID_LENGTH + H_LENGTH + G_LENGTH );
 
   // construct our side of the handshake
   if ( d_ntor_handshake_start( create2->handshake_data, target_relay->relay, &circuit->create2_handshake_key ) < 0 )
@@ -488,6 +505,8 @@ int d_router_extend2( OnionCircuit* circuit, DlConnection* or_connection, int no
     goto fail;
   }
 
+  circuit->handshake_start_us = MINITOR_GET_TIME();
+
   // send the EXTEND2 cell
   if ( d_send_relay_cell_and_free( or_connection, extend2_cell, &circuit->relay_list, NULL ) < 0 )
   {
@@ -504,9 +523,12 @@ fail:
   return -1;
 }
 
-int d_router_extended2( OnionCircuit* circuit, int node_index, Cell* extended2_cell )
+// copies what the ntor finish needs out of the circuit so it can run on a
+// crypto worker, node_index is the relay the CREATED2 or EXTENDED2 came from
+CryptoJob* px_router_ntor_job( OnionCircuit* circuit, int node_index, uint8_t* handshake_data )
 {
   int i;
+  CryptoJob* job;
   DoublyLinkedOnionRelay* target_relay;
 
   target_relay = circuit->relay_list.head;
@@ -516,14 +538,46 @@ int d_router_extended2( OnionCircuit* circuit, int node_index, Cell* extended2_c
     target_relay = target_relay->next;
   }
 
-  if ( d_ntor_handshake_finish( extended2_cell->payload.relay.extended2.handshake_data, target_relay, &circuit->create2_handshake_key ) < 0 )
+  job = malloc( sizeof( CryptoJob ) );
+
+  memset( job, 0, sizeof( CryptoJob ) );
+
+  job->type = CRYPTO_JOB_NTOR;
+  job->circuit = circuit;
+  job->circ_id = circuit->circ_id;
+  job->node_index = node_index;
+
+  memcpy( job->handshake_data, handshake_data, G_LENGTH + WC_SHA256_DIGEST_SIZE );
+  memcpy( &job->relay, target_relay->relay, sizeof( OnionRelay ) );
+  memcpy( &job->handshake_key, &circuit->create2_handshake_key, sizeof( curve25519_key ) );
+
+  return job;
+}
+
+// moves the keys from a finished ntor job onto the relay it was for
+int d_router_ntor_job_finish( OnionCircuit* circuit, CryptoJob* job )
+{
+  int i;
+  DoublyLinkedOnionRelay* target_relay;
+
+  if ( job->result < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to compute handshake_data for extend" );
+    MINITOR_LOG( MINITOR_TAG, "Failed to finish ntor handshake for node %d", job->node_index );
 
     // destroy function will free the handshake key
     return -1;
   }
 
+  target_relay = circuit->relay_list.head;
+
+  for ( i = 0; i < job->node_index; i++ )
+  {
+    target_relay = target_relay->next;
+  }
+
+  target_relay->relay_crypto = job->db_relay.relay_crypto;
+  job->db_relay.relay_crypto = NULL;
+
   wc_curve25519_free( &circuit->create2_handshake_key );
 
   return 0;
@@ -531,28 +585,11 @@ int d_router_extended2( OnionCircuit* circuit, int node_index, Cell* extended2_c
 
 int d_router_create2( OnionCircuit* circuit, DlConnection* or_connection )
 {
-  int wolf_succ;
-  WC_RNG rng;
   Cell* create2_cell;
 
-  wc_curve25519_init( &circuit->create2_handshake_key );
-
-  wolf_succ = wc_InitRng( &rng );
-
-  if ( wolf_succ != 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to init rng %d", wolf_succ );
-
-    goto cleanup;
-  }
-
-  wolf_succ = wc_curve25519_make_key( &rng, 32, &circuit->create2_handshake_key );
-
-  wc_FreeRng( &rng );
-
-  if ( wolf_succ != 0 )
+  if ( d_take_ephemeral_key( &circuit->create2_handshake_key ) < 0 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to make create2_handshake_key, error code %d", wolf_succ );
+    MINITOR_LOG( MINITOR_TAG, "Failed to make create2_handshake_key" );
 
     goto cleanup;
   }
@@ -560,13 +597,13 @@ int d_router_create2( OnionCircuit* circuit, DlConnection* or_connection )
   create2_cell = malloc( MINITOR_CELL_LEN );
 
   // make a create2 cell
-  create2_cell->circ_id = circuit->circ_id;
+  v_set_cell_circ_id( create2_cell, circuit->circ_id );
   create2_cell->command = CREATE2;
-  create2_cell->payload.create2.handshake_type = NTOR;
-  create2_cell->payload.create2.handshake_length = ID_LENGTH + H_LENGTH + G_LENGTH;
+  v_set_create2_handshake_type( &create2_cell->payload.create2, NTOR );
+  v_set_create2_handshake_length( &create2_cell->payload.create2, ID_LENGTH + H_LENGTH + G_LENGTH );
 
   // fixed header, 2 for handshake_type, 2 for handshake_length and the handshake
-  create2_cell->length = FIXED_CELL_HEADER_SIZE + 2 + 2 + create2_cell->payload.create2.handshake_length;
+  create2_cell->length = FIXED_CELL_HEADER_SIZE + 2 + 2 + ud_get_create2_handshake_length( &create2_cell->payload.create2 );
 
   if ( d_ntor_handshake_start( create2_cell->payload.create2.handshake_data, circuit->relay_list.head->relay, &circuit->create2_handshake_key ) < 0 )
   {
@@ -577,6 +614,8 @@ int d_router_create2( OnionCircuit* circuit, DlConnection* or_connection )
     goto cleanup;
   }
 
+  circuit->handshake_start_us = MINITOR_GET_TIME();
+
   if ( d_send_cell_and_free( or_connection, create2_cell ) < 0 )
   {
     MINITOR_LOG( MINITOR_TAG, "Failed to send CREATE2 cell" );
@@ -592,22 +631,6 @@ cleanup:
   return -1;
 }
 
-// outer caller will free the unpacked cell
-int d_router_created2( OnionCircuit* circuit, Cell* created2_cell )
-{
-  if ( d_ntor_handshake_finish( created2_cell->payload.created2.handshake_data, circuit->relay_list.head, &circuit->create2_handshake_key ) < 0 )
-  {
-    MINITOR_LOG( MINITOR_TAG, "Failed to finish CREATED2 handshake" );
-
-    // create2_handshake_key is freed in destroy function
-    return -1;
-  }
-
-  wc_curve25519_free( &circuit->create2_handshake_key );
-
-  return 0;
-}
-
 int d_ntor_handshake_start( unsigned char* handshake_data, OnionRelay* relay, curve25519_key* key )
 {
   int wolf_succ;
@@ -654,7 +677,9 @@ int d_ntor_handshake_finish( uint8_t* handshake_data, DoublyLinkedOnionRelay* db
   db_relay->relay_crypto = malloc( sizeof( RelayCrypto ) );
 
   wc_InitSha( &db_relay->relay_crypto->running_sha_forward );
-  wc_InitSha( &db_relay->relay_crypto->running_sha_backward );
+  wc_InitSha( &db_relay->relay_crypto->running_sha_backward[0] );
+  wc_InitSha( &db_relay->relay_crypto->running_sha_backward[1] );
+  db_relay->relay_crypto->sha_backward_index = 0;
   wc_AesInit( &db_relay->relay_crypto->aes_forward, NULL, INVALID_DEVID );
   wc_AesInit( &db_relay->relay_crypto->aes_backward, NULL, INVALID_DEVID );
 
@@ -678,7 +703,7 @@ int d_ntor_handshake_finish( uint8_t* handshake_data, DoublyLinkedOnionRelay* db
 
   // create secret_input
   idx = 32;
-  wolf_succ = wc_curve25519_shared_secret_ex( key, &responder_handshake_public_key, working_secret_input, &idx, EC25519_LITTLE_ENDIAN );
+  wolf_succ = MINITOR_X25519_SHARED_SECRET( key, &responder_handshake_public_key, working_secret_input, &idx );
 
   if ( wolf_succ < 0 || idx != 32 )
   {
@@ -690,7 +715,7 @@ int d_ntor_handshake_finish( uint8_t* handshake_data, DoublyLinkedOnionRelay* db
   working_secret_input += 32;
 
   idx = 32;
-  wolf_succ = wc_curve25519_shared_secret_ex( key, &ntor_onion_key, working_secret_input, &idx, EC25519_LITTLE_ENDIAN );
+  wolf_succ = MINITOR_X25519_SHARED_SECRET( key, &ntor_onion_key, working_secret_input, &idx );
 
   if ( wolf_succ < 0 || idx != 32 )
   {
@@ -787,7 +812,7 @@ int d_ntor_handshake_finish( uint8_t* handshake_data, DoublyLinkedOnionRelay* db
   // seed the forward sha
   wc_ShaUpdate( &db_relay->relay_crypto->running_sha_forward, reusable_hmac_digest, HASH_LEN );
   // seed the first 16 bytes of backwards sha
-  wc_ShaUpdate( &db_relay->relay_crypto->running_sha_backward, reusable_hmac_digest + HASH_LEN, WC_SHA256_DIGEST_SIZE - HASH_LEN );
+  wc_ShaUpdate( &db_relay->relay_crypto->running_sha_backward[0], reusable_hmac_digest + HASH_LEN, WC_SHA256_DIGEST_SIZE - HASH_LEN );
   // mark how many bytes we've written to the backwards sha and how many remain
   bytes_written = WC_SHA256_DIGEST_SIZE - HASH_LEN;
   bytes_remaining = HASH_LEN - bytes_written;
@@ -801,7 +826,7 @@ int d_ntor_handshake_finish( uint8_t* handshake_data, DoublyLinkedOnionRelay* db
   wc_HmacFree( &reusable_hmac );
 
   // seed the last 8 bytes of backward sha
-  wc_ShaUpdate( &db_relay->relay_crypto->running_sha_backward, reusable_hmac_digest, bytes_remaining );
+  wc_ShaUpdate( &db_relay->relay_crypto->running_sha_backward[0], reusable_hmac_digest, bytes_remaining );
   // set the forward aes key
   memcpy( reusable_aes_key, reusable_hmac_digest + bytes_remaining, KEY_LEN );
   wc_AesSetKeyDirect( &db_relay->relay_crypto->aes_forward, reusable_aes_key, KEY_LEN, aes_iv, AES_ENCRYPTION );
@@ -837,7 +862,8 @@ int d_ntor_handshake_finish( uint8_t* handshake_data, DoublyLinkedOnionRelay* db
 
 fail:
   wc_ShaFree( &db_relay->relay_crypto->running_sha_forward );
-  wc_ShaFree( &db_relay->relay_crypto->running_sha_backward );
+  wc_ShaFree( &db_relay->relay_crypto->running_sha_backward[0] );
+  wc_ShaFree( &db_relay->relay_crypto->running_sha_backward[1] );
   wc_AesFree( &db_relay->relay_crypto->aes_forward );
   wc_AesFree( &db_relay->relay_crypto->aes_backward );
 
@@ -876,13 +902,11 @@ int d_start_v3_handshake( DlConnection* or_connection )
   versions_cell = malloc( LEGACY_CIRCID_LEN + 3 + 4 );
 
   // make a versions cell
-  versions_cell->circ_id = 0;
+  v_set_short_variable_circ_id( versions_cell, 0 );
   versions_cell->command = VERSIONS;
-  versions_cell->length = 4;
-  versions_cell->payload.versions[0] = 3;
-  versions_cell->payload.versions[1] = 4;
-
-  v_networkize_variable_short_cell( versions_cell );
+  v_set_short_variable_length( versions_cell, 4 );
+  v_set_version( versions_cell, 0, 3 );
+  v_set_version( versions_cell, 1, 4 );
 
   wc_Sha256Update( &or_connection->initiator_sha, (uint8_t*)versions_cell, LEGACY_CIRCID_LEN + 3 + 4 );
 
@@ -909,24 +933,22 @@ int d_start_v3_handshake( DlConnection* or_connection )
   // generate a certs cell of our own
   certs_cell = malloc( CIRCID_LEN + 3 + 7 + initiator_rsa_auth_cert_der_size + initiator_rsa_identity_cert_der_size );
 
-  certs_cell->circ_id = 0;
+  v_set_variable_circ_id( certs_cell, 0 );
   certs_cell->command = CERTS;
-  certs_cell->length = 7 + initiator_rsa_auth_cert_der_size + initiator_rsa_identity_cert_der_size;
+  v_set_variable_length( certs_cell, 7 + initiator_rsa_auth_cert_der_size + initiator_rsa_identity_cert_der_size );
   certs_cell->payload.certs.num_certs = 2;
 
   working_cert = certs_cell->payload.certs.certs;
 
   working_cert->cert_type = IDENTITY_CERT;
-  working_cert->cert_length = initiator_rsa_identity_cert_der_size;
-  memcpy( working_cert->cert, initiator_rsa_identity_cert_der, working_cert->cert_length );
+  v_set_cert_length( working_cert, initiator_rsa_identity_cert_der_size );
+  memcpy( working_cert->cert, initiator_rsa_identity_cert_der, initiator_rsa_identity_cert_der_size );
 
-  working_cert = (uint8_t*)working_cert + 3 + working_cert->cert_length;
+  working_cert = (uint8_t*)working_cert + 3 + initiator_rsa_identity_cert_der_size;
 
   working_cert->cert_type = RSA_AUTH_CERT;
-  working_cert->cert_length = initiator_rsa_auth_cert_der_size;
-  memcpy( working_cert->cert, initiator_rsa_auth_cert_der, working_cert->cert_length );
-
-  v_networkize_variable_cell( certs_cell );
+  v_set_cert_length( working_cert, initiator_rsa_auth_cert_der_size );
+  memcpy( working_cert->cert, initiator_rsa_auth_cert_der, initiator_rsa_auth_cert_der_size );
 
   wc_Sha256Update( &or_connection->initiator_sha, (uint8_t*)certs_cell, CIRCID_LEN + 3 + 7 + initiator_rsa_auth_cert_der_size + initiator_rsa_identity_cert_der_size );
 
@@ -983,8 +1005,6 @@ int d_process_certs( DlConnection* or_connection, CellVariable* certs_cell, int
 
   wc_Sha256Update( &or_connection->responder_sha, (uint8_t*)certs_cell, length );
 
-  v_hostize_variable_cell( certs_cell );
-
   peer_cert = wolfSSL_get_peer_certificate( or_connection->ssl );
 
   if ( peer_cert == NULL )
@@ -1051,12 +1071,12 @@ int d_process_challenge( DlConnection* or_connection, CellVariable* challenge_ce
   authenticate_cell = malloc( VARIABLE_CELL_HEADER_SIZE + 4 + 352 );
 
   // generate answer for auth challenge
-  authenticate_cell->circ_id = 0;
+  v_set_variable_circ_id( authenticate_cell, 0 );
   authenticate_cell->command = AUTHENTICATE;
-  authenticate_cell->length = 4 + 352;
+  v_set_variable_length( authenticate_cell, 4 + 352 );
 
-  authenticate_cell->payload.authenticate.auth_type = AUTH_ONE;
-  authenticate_cell->payload.authenticate.auth_length = 352;
+  v_set_authenticate_auth_type( authenticate_cell, AUTH_ONE );
+  v_set_authenticate_auth_length( authenticate_cell, 352 );
 
   // fill in type
   memcpy( authenticate_cell->payload.authenticate.auth_1.type, AUTH_ONE_TYPE_STRING, 8 );
@@ -1108,8 +1128,6 @@ int d_process_challenge( DlConnection* or_connection, CellVariable* challenge_ce
 
   wc_RsaSSL_Sign( reusable_sha_sum, 32, authenticate_cell->payload.authenticate.auth_1.signature, 128, &or_connection->initiator_rsa_auth_key, &rng );
 
-  v_networkize_variable_cell( authenticate_cell );
-
   wolf_succ = wolfSSL_send( or_connection->ssl, (uint8_t*)authenticate_cell, VARIABLE_CELL_HEADER_SIZE + 4 + 352, 0 );
 
   free( authenticate_cell );
@@ -1151,8 +1169,6 @@ int d_process_netinfo( DlConnection* or_connection, Cell* netinfo_cell )
   int other_address_length = 0;
   MyAddr* working_myaddr;
 
-  v_hostize_cell( netinfo_cell );
-
   my_address_length = netinfo_cell->payload.netinfo.addresses_4.otheraddr.length;
 
   if ( my_address_length == 4 )
@@ -1191,10 +1207,10 @@ int d_process_netinfo( DlConnection* or_connection, Cell* netinfo_cell )
   // fixed header, 4 for time, 6 for other addr, 1 for num addrs, 6 for my addr
   res_netinfo_cell->length = FIXED_CELL_HEADER_SIZE + 4 + 6 + 1 + 6;
 
-  res_netinfo_cell->circ_id = 0;
+  v_set_cell_circ_id( res_netinfo_cell, 0 );
   res_netinfo_cell->command = NETINFO;
 
-  time( &( res_netinfo_cell->payload.netinfo.time ) );
+  v_set_netinfo_time( res_netinfo_cell, (uint32_t)time( NULL ) );
 
   res_netinfo_cell->payload.netinfo.addresses_4.otheraddr.type = IPv4;
   res_netinfo_cell->payload.netinfo.addresses_4.otheraddr.length = other_address_length;
@@ -1208,7 +1224,7 @@ int d_process_netinfo( DlConnection* or_connection, Cell* netinfo_cell )
   working_myaddr->length = my_address_length;
   memcpy( working_myaddr->address, my_address, my_address_length );
 
-  v_networkize_cell( res_netinfo_cell );
+  v_pad_cell( res_netinfo_cell );
 
   wolf_succ = wolfSSL_send( or_connection->ssl, (uint8_t*)res_netinfo_cell + FIXED_CELL_OFFSET, CELL_LEN, 0 );
 
@@ -1256,7 +1272,7 @@ int d_verify_certs( CellVariable* certs_cell, WOLFSSL_X509* peer_cert, int* resp
 
     certificate = wolfSSL_X509_load_certificate_buffer(
       working_cert->cert,
-      working_cert->cert_length,
+      ud_get_cert_length( working_cert ),
       WOLFSSL_FILETYPE_ASN1 );
 
     if ( certificate == NULL )
@@ -1369,7 +1385,7 @@ int d_verify_certs( CellVariable* certs_cell, WOLFSSL_X509* peer_cert, int* resp
     }
 
     // advance to next cert, 3 is for the type and length
-    working_cert = (uint8_t*)working_cert + working_cert->cert_length + 3;
+    working_cert = (uint8_t*)working_cert + ud_get_cert_length( working_cert ) + 3;
   }
 
   if ( link_key_count == 0 )
@@ -38,15 +38,474 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../h/connections.h"
 #include "../h/consensus.h"
 #include "../h/core.h"
+#include "../h/stats.h"
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CONNECTIONS
 
 static const char* CONN_TAG = "CONNECTIONS DAEMON";
 
-uint32_t conn_id = 0;
 MinitorTask connections_daemon_task_handle;
-struct pollfd connections_poll[16];
 DlConnection* connections;
 MinitorMutex connections_mutex;
-MinitorMutex connection_access_mutex[16];
+// leaf lock, nothing else may be taken while it is held
+MinitorMutex local_streams_mutex;
+
+#define LOCAL_STREAM_BUCKETS 32
+// a core lane with this little room left gives no credit to the sockets that
+// feed it, we may still need to send RELAY_END and CONN_CLOSE messages from
+// inside the lock
+#define CORE_LANE_RESERVE 10
+#define CONNECTION_SLOT_CHUNK 16
+
+typedef struct ConnectionSlot
+{
+  MinitorMutex access_mutex;
+  DlConnection* connection;
+  uint16_t generation;
+  int next_free;
+} ConnectionSlot;
+
+// slots are handed out in chunks that are never freed so an access mutex
+// stays valid for as long as anyone could be waiting on it, guarded by
+// connections_mutex. a conn_id is the slot index in the low 16 bits and the
+// slot's generation in the high 16 bits, the generation changes whenever the
+// slot is given back so a stale conn_id never resolves to a new connection
+static ConnectionSlot* connection_slot_chunks[( MINITOR_CONNECTIONS_MAX + CONNECTION_SLOT_CHUNK - 1 ) / CONNECTION_SLOT_CHUNK];
+static volatile int connection_slot_count = 0;
+static int connection_slot_free = -1;
+static int local_connection_count = 0;
+static int paused_connection_count = 0;
+
+// set while a core lane is out of credit and the sockets feeding it have
+// POLLIN masked, only touched by the connections daemon
+static bool or_backpressure = false;
+static bool local_backpressure = false;
+static int64_t or_backpressure_start;
+static int64_t local_backpressure_start;
+static BackpressureStats backpressure_stats;
+
+// the poll set is owned by the connections daemon, other tasks mark it dirty
+// under connections_mutex when they add or remove a connection
+static struct pollfd* poll_set = NULL;
+static DlConnection** poll_connections = NULL;
+static int poll_set_size = 0;
+// poll_set_size plus the wake socket at the end
+static int poll_set_length = 0;
+static int poll_set_capacity = 0;
+static bool poll_set_dirty = true;
+// local connections that now have buffered output, guarded by local_streams_mutex
+static DlConnection* pollout_requests = NULL;
+// set when a stream is marked close_pending so the daemon scans right away
+static bool local_close_requested = false;
+// a loopback udp socket connected to itself, other tasks send a byte to it to
+// get the daemon out of poll, wake_pending keeps it to one byte per wakeup
+static int wake_fd = -1;
+static bool wake_pending = false;
+
+// local connections keyed by ( circ_id, stream_id ), with a second table
+// keyed by circ_id alone so a circuit's streams can be torn down together
+static DlConnection* local_streams[LOCAL_STREAM_BUCKETS];
+static DlConnection* local_circ_streams[LOCAL_STREAM_BUCKETS];
+
+static uint32_t ud_local_circ_bucket( uint32_t circ_id )
+{
+  return ( circ_id * 2654435761u ) >> 27;
+}
+
+static uint32_t ud_local_stream_bucket( uint32_t circ_id, uint16_t stream_id )
+{
+  return ( ( circ_id ^ ( (uint32_t)stream_id << 16 ) ^ stream_id ) * 2654435761u ) >> 27;
+}
+
+// caller must hold local_streams_mutex
+static DlConnection* px_find_local_stream( uint32_t circ_id, uint16_t stream_id )
+{
+  DlConnection* local_connection;
+
+  local_connection = local_streams[ud_local_stream_bucket( circ_id, stream_id )];
+
+  while ( local_connection != NULL )
+  {
+    if ( local_connection->circ_id == circ_id && local_connection->stream_id == stream_id )
+    {
+      break;
+    }
+
+    local_connection = local_connection->stream_next;
+  }
+
+  return local_connection;
+}
+
+static int d_create_wake_socket()
+{
+  int fd;
+  struct sockaddr_in wake_addr;
+  socklen_t wake_addr_length = sizeof( wake_addr );
+
+  fd = socket( AF_INET, SOCK_DGRAM, IPPROTO_IP );
+
+  if ( fd < 0 )
+  {
+    return -1;
+  }
+
+  memset( &wake_addr, 0, sizeof( wake_addr ) );
+
+  wake_addr.sin_family = AF_INET;
+  wake_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  wake_addr.sin_port = 0;
+
+  if (
+    bind( fd, (struct sockaddr*)&wake_addr, sizeof( wake_addr ) ) != 0 ||
+    getsockname( fd, (struct sockaddr*)&wake_addr, &wake_addr_length ) != 0 ||
+    connect( fd, (struct sockaddr*)&wake_addr, sizeof( wake_addr ) ) != 0
+  )
+  {
+    close( fd );
+
+    return -1;
+  }
+
+  return fd;
+}
+
+// safe from any task, the daemon clears wake_pending before it looks at
+// anything so a wakeup can't be lost
+static void v_wake_connections_daemon()
+{
+  uint8_t wake_byte = 0;
+
+  if ( wake_fd < 0 )
+  {
+    return;
+  }
+
+  if ( __atomic_exchange_n( &wake_pending, true, __ATOMIC_SEQ_CST ) == false )
+  {
+    send( wake_fd, &wake_byte, 1, MSG_DONTWAIT );
+  }
+}
+
+static void v_drain_wake_socket()
+{
+  uint8_t wake_buf[16];
+
+  if ( wake_fd < 0 )
+  {
+    return;
+  }
+
+  __atomic_store_n( &wake_pending, false, __ATOMIC_SEQ_CST );
+
+  while ( recv( wake_fd, wake_buf, sizeof( wake_buf ), MSG_DONTWAIT ) > 0 )
+  {
+  }
+}
+
+// called by the core task after it takes a message off a lane, only wakes
+// the daemon when it stopped reading for lane space and there is room again
+void v_connections_lane_dequeued()
+{
+  if (
+    ( __atomic_load_n( &or_backpressure, __ATOMIC_RELAXED ) == true && d_core_lane_spaces( CORE_LANE_CONTROL ) > CORE_LANE_RESERVE ) ||
+    ( __atomic_load_n( &local_backpressure, __ATOMIC_RELAXED ) == true && d_core_lane_spaces( CORE_LANE_BULK ) > CORE_LANE_RESERVE )
+  )
+  {
+    v_wake_connections_daemon();
+  }
+}
+
+// caller must hold local_streams_mutex, the daemon's scan does the close
+// since the caller may hold an OR access_mutex, which the daemon only takes
+// after connections_mutex
+static void v_request_local_close( DlConnection* local_connection, bool quietly )
+{
+  local_connection->close_pending = true;
+
+  if ( quietly == true )
+  {
+    local_connection->close_quietly = true;
+  }
+
+  __atomic_store_n( &local_close_requested, true, __ATOMIC_RELAXED );
+
+  v_wake_connections_daemon();
+}
+
+static void v_add_local_stream( DlConnection* local_connection )
+{
+  uint32_t bucket;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( local_streams_mutex );
+
+  bucket = ud_local_stream_bucket( local_connection->circ_id, local_connection->stream_id );
+  local_connection->stream_next = local_streams[bucket];
+  local_streams[bucket] = local_connection;
+
+  bucket = ud_local_circ_bucket( local_connection->circ_id );
+  local_connection->circ_stream_next = local_circ_streams[bucket];
+  local_circ_streams[bucket] = local_connection;
+
+  MINITOR_MUTEX_GIVE( local_streams_mutex );
+  // MUTEX GIVE
+}
+
+static void v_remove_local_stream( DlConnection* local_connection )
+{
+  DlConnection** link;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( local_streams_mutex );
+
+  if ( local_connection->pollout_requested == true )
+  {
+    link = &pollout_requests;
+
+    while ( *link != NULL && *link != local_connection )
+    {
+      link = &(*link)->pollout_next;
+    }
+
+    if ( *link != NULL )
+    {
+      *link = local_connection->pollout_next;
+    }
+  }
+
+  link = &local_streams[ud_local_stream_bucket( local_connection->circ_id, local_connection->stream_id )];
+
+  while ( *link != NULL && *link != local_connection )
+  {
+    link = &(*link)->stream_next;
+  }
+
+  if ( *link != NULL )
+  {
+    *link = local_connection->stream_next;
+  }
+
+  link = &local_circ_streams[ud_local_circ_bucket( local_connection->circ_id )];
+
+  while ( *link != NULL && *link != local_connection )
+  {
+    link = &(*link)->circ_stream_next;
+  }
+
+  if ( *link != NULL )
+  {
+    *link = local_connection->circ_stream_next;
+  }
+
+  MINITOR_MUTEX_GIVE( local_streams_mutex );
+  // MUTEX GIVE
+}
+
+static ConnectionSlot* px_get_connection_slot( int slot_index )
+{
+  return &connection_slot_chunks[slot_index / CONNECTION_SLOT_CHUNK][slot_index % CONNECTION_SLOT_CHUNK];
+}
+
+// caller must hold connections_mutex
+static int d_take_connection_slot( DlConnection* dl_connection )
+{
+  int i;
+  int slot_index;
+  ConnectionSlot* chunk;
+
+  if ( connection_slot_free < 0 )
+  {
+    if ( connection_slot_count + CONNECTION_SLOT_CHUNK > MINITOR_CONNECTIONS_MAX )
+    {
+      MINITOR_LOG( CONN_TAG, "Reached MINITOR_CONNECTIONS_MAX connections" );
+
+      return -1;
+    }
+
+    chunk = malloc( sizeof( ConnectionSlot ) * CONNECTION_SLOT_CHUNK );
+
+    if ( chunk == NULL )
+    {
+      MINITOR_LOG( CONN_TAG, "Failed to allocate connection slots" );
+
+      return -1;
+    }
+
+    for ( i = 0; i < CONNECTION_SLOT_CHUNK; i++ )
+    {
+      chunk[i].access_mutex = MINITOR_MUTEX_CREATE( "connection_access_mutex" );
+      chunk[i].connection = NULL;
+      // start at 1 so a zeroed conn_id is never valid
+      chunk[i].generation = 1;
+      chunk[i].next_free = connection_slot_free;
+      connection_slot_free = connection_slot_count + i;
+    }
+
+    // the chunk must be in place before the count lets lookups reach it
+    connection_slot_chunks[connection_slot_count / CONNECTION_SLOT_CHUNK] = chunk;
+    __sync_synchronize();
+    connection_slot_count += CONNECTION_SLOT_CHUNK;
+  }
+
+  slot_index = connection_slot_free;
+  connection_slot_free = px_get_connection_slot( slot_index )->next_free;
+
+  px_get_connection_slot( slot_index )->connection = dl_connection;
+  dl_connection->slot_index = slot_index;
+  dl_connection->conn_id = (uint32_t)slot_index | ( (uint32_t)px_get_connection_slot( slot_index )->generation << 16 );
+  dl_connection->access_mutex = px_get_connection_slot( slot_index )->access_mutex;
+
+  return 0;
+}
+
+// caller must hold connections_mutex
+static void v_give_connection_slot( DlConnection* dl_connection )
+{
+  ConnectionSlot* slot;
+
+  slot = px_get_connection_slot( dl_connection->slot_index );
+
+  slot->connection = NULL;
+  slot->generation++;
+
+  if ( slot->generation == 0 )
+  {
+    slot->generation = 1;
+  }
+
+  slot->next_free = connection_slot_free;
+  connection_slot_free = dl_connection->slot_index;
+}
+
+static bool b_connection_can_read( DlConnection* dl_connection )
+{
+  if ( dl_connection->is_or == 1 )
+  {
+    return dl_connection->reads_paused == false && or_backpressure == false;
+  }
+
+  return local_backpressure == false;
+}
+
+// caller must hold connections_mutex
+static void v_rebuild_poll_set()
+{
+  int i;
+  int count = 0;
+  int new_capacity;
+  struct pollfd* new_poll_set;
+  DlConnection** new_poll_connections;
+  DlConnection* dl_connection;
+
+  dl_connection = connections;
+
+  while ( dl_connection != NULL )
+  {
+    count++;
+    dl_connection = dl_connection->next;
+  }
+
+  // one more for the wake socket
+  if ( count + 1 > poll_set_capacity )
+  {
+    new_capacity = ( count + CONNECTION_SLOT_CHUNK ) / CONNECTION_SLOT_CHUNK * CONNECTION_SLOT_CHUNK;
+
+    new_poll_set = realloc( poll_set, sizeof( struct pollfd ) * new_capacity );
+
+    if ( new_poll_set == NULL )
+    {
+      MINITOR_LOG( CONN_TAG, "Failed to grow the poll set" );
+
+      return;
+    }
+
+    poll_set = new_poll_set;
+
+    new_poll_connections = realloc( poll_connections, sizeof( DlConnection* ) * new_capacity );
+
+    if ( new_poll_connections == NULL )
+    {
+      MINITOR_LOG( CONN_TAG, "Failed to grow the poll set" );
+
+      return;
+    }
+
+    poll_connections = new_poll_connections;
+    poll_set_capacity = new_capacity;
+  }
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( local_streams_mutex );
+
+  i = 0;
+  dl_connection = connections;
+
+  while ( dl_connection != NULL )
+  {
+    poll_set[i].fd = dl_connection->sock_fd;
+    poll_set[i].events = 0;
+    poll_set[i].revents = 0;
+
+    if ( b_connection_can_read( dl_connection ) )
+    {
+      poll_set[i].events |= POLLIN;
+    }
+
+    if ( dl_connection->is_or == 0 && dl_connection->output_length > 0 )
+    {
+      poll_set[i].events |= POLLOUT;
+    }
+
+    poll_connections[i] = dl_connection;
+    dl_connection->poll_index = i;
+
+    i++;
+    dl_connection = dl_connection->next;
+  }
+
+  // every buffered connection was just picked up
+  while ( pollout_requests != NULL )
+  {
+    pollout_requests->pollout_requested = false;
+    pollout_requests = pollout_requests->pollout_next;
+  }
+
+  MINITOR_MUTEX_GIVE( local_streams_mutex );
+  // MUTEX GIVE
+
+  poll_set_size = i;
+
+  if ( wake_fd >= 0 )
+  {
+    poll_set[i].fd = wake_fd;
+    poll_set[i].events = POLLIN;
+    poll_set[i].revents = 0;
+
+    i++;
+  }
+
+  poll_set_length = i;
+  poll_set_dirty = false;
+}
+
+// caller must hold connections_mutex and the poll set must be clean
+static void v_apply_pollout_requests()
+{
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( local_streams_mutex );
+
+  while ( pollout_requests != NULL )
+  {
+    poll_set[pollout_requests->poll_index].events |= POLLOUT;
+
+    pollout_requests->pollout_requested = false;
+    pollout_requests = pollout_requests->pollout_next;
+  }
+
+  MINITOR_MUTEX_GIVE( local_streams_mutex );
+  // MUTEX GIVE
+}
 
 static WC_INLINE int d_ignore_ca_callback( int preverify, WOLFSSL_X509_STORE_CTX* store )
 {
@@ -59,28 +518,28 @@ static WC_INLINE int d_ignore_ca_callback( int preverify, WOLFSSL_X509_STORE_CTX
   return 0;
 }
 
+// caller must hold connections_mutex and the connection's access mutex
 static void v_cleanup_connection_in_lock( DlConnection* dl_connection )
 {
   int i;
-  OnionMessage* onion_message;
+  int j;
 
   // we only need to inform the core daemon if an or connection
   // closed, local connections closing already triggered a
   // RELAY_END and don't need aditonal work
   if ( dl_connection->is_or == 1 )
   {
-    onion_message = malloc( sizeof( OnionMessage ) );
-    onion_message->type = CONN_CLOSE;
-    onion_message->data = dl_connection->conn_id;
-
     wolfSSL_shutdown( dl_connection->ssl );
     wolfSSL_free( dl_connection->ssl );
 
-    for ( i = 0; i < 20; i++ )
+    for ( j = 0; j < MINITOR_CORE_SHARDS; j++ )
     {
-      if ( dl_connection->cell_ring_buf[i] != NULL )
+      for ( i = 0; i < CELL_RING_SIZE; i++ )
       {
-        free( dl_connection->cell_ring_buf[i] );
+        if ( dl_connection->cell_rings[j].buf[i] != NULL )
+        {
+          free( dl_connection->cell_rings[j].buf[i] );
+        }
       }
     }
 
@@ -99,16 +558,44 @@ static void v_cleanup_connection_in_lock( DlConnection* dl_connection )
       wc_Sha256Free( &dl_connection->initiator_sha );
     }
 
-    MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+    // every shard rebuilds the circuits it owns on this connection
+    v_core_broadcast_blocking( CONN_CLOSE, dl_connection->conn_id );
+  }
+
+  if ( dl_connection->coalesce_cell != NULL )
+  {
+    v_give_pooled_cell( dl_connection->coalesce_cell );
+  }
+
+  if ( dl_connection->is_or == 0 )
+  {
+    local_connection_count--;
+  }
+
+  if ( dl_connection->reads_paused == true )
+  {
+    paused_connection_count--;
   }
 
-  connections_poll[dl_connection->poll_index].fd = -1;
+  v_give_connection_slot( dl_connection );
+  poll_set_dirty = true;
+  v_wake_connections_daemon();
 
   shutdown( dl_connection->sock_fd, 0 );
   close( dl_connection->sock_fd );
 
+  if ( dl_connection->is_or == 0 )
+  {
+    v_remove_local_stream( dl_connection );
+  }
+
   v_remove_connection_from_list( dl_connection, &connections );
 
+  if ( dl_connection->output_buf != NULL )
+  {
+    free( dl_connection->output_buf );
+  }
+
   free( dl_connection );
 }
 
@@ -127,7 +614,7 @@ void v_cleanup_connection( DlConnection* dl_connection )
     return;
   }
 
-  access_mutex = connection_access_mutex[dl_connection->mutex_index];
+  access_mutex = dl_connection->access_mutex;
 
   // MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( access_mutex );
@@ -141,24 +628,77 @@ void v_cleanup_connection( DlConnection* dl_connection )
   // MUTEX GIVE
 }
 
+// true if any shard's ring is full, we can't know which one the next cell is
+// for until it has been read
+static bool b_cell_ring_full( DlConnection* or_connection )
+{
+  int i;
+  CellRing* ring;
+
+  for ( i = 0; i < MINITOR_CORE_SHARDS; i++ )
+  {
+    ring = &or_connection->cell_rings[i];
+
+    if ( ring->end - __atomic_load_n( &ring->start, __ATOMIC_ACQUIRE ) >= CELL_RING_SIZE )
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// link cells have circ_id 0 and go to the first shard, as do the handshake
+// cells read before the link protocol was agreed
+static int d_cell_shard( DlConnection* or_connection, uint8_t* cell )
+{
+#if MINITOR_CORE_SHARDS > 1
+  uint32_t circ_id;
+
+  if ( or_connection->has_versions == false )
+  {
+    return 0;
+  }
+
+  if ( cell[CIRCID_LEN] == VERSIONS || cell[CIRCID_LEN] >= VPADDING )
+  {
+    circ_id = ud_get_variable_circ_id( (CellVariable*)cell );
+  }
+  else
+  {
+    circ_id = ud_get_cell_circ_id( (Cell*)cell );
+  }
+
+  return d_core_shard_for_circ_id( circ_id );
+#else
+  return 0;
+#endif
+}
+
+// only called from d_read_connection, which pauses reads instead of calling
+// this when the ring is full, so any failure here is a real link error
 static int d_recv_on_or_connection( DlConnection* or_connection )
 {
   int succ;
+  int shard;
+  uint32_t end;
   uint8_t* cell;
+  CellRing* ring;
   OnionMessage* onion_message;
 
-  if ( ( or_connection->cell_ring_end + 1 ) % 20 == or_connection->cell_ring_start )
-  {
-    succ = -1;
-    goto finish;
-  }
-
   if ( or_connection->has_versions == false )
   {
     succ = d_recv_cell( or_connection->ssl, &cell, LEGACY_CIRCID_LEN );
 
     or_connection->has_versions = true;
   }
+#ifdef MINITOR_BENCHMARK
+  // the benchmark's loopback link
+  else if ( or_connection->ssl == NULL )
+  {
+    succ = d_recv_cell_from( d_socket_cell_reader, &or_connection->sock_fd, &cell, CIRCID_LEN );
+  }
+#endif
   else
   {
     succ = d_recv_cell( or_connection->ssl, &cell, CIRCID_LEN );
@@ -170,55 +710,159 @@ static int d_recv_on_or_connection( DlConnection* or_connection )
     goto finish;
   }
 
-  or_connection->cell_ring_buf[or_connection->cell_ring_end] = cell;
+  shard = d_cell_shard( or_connection, cell );
+  ring = &or_connection->cell_rings[shard];
 
-  onion_message = malloc( sizeof( OnionMessage ) );
-  onion_message->data = or_connection->conn_id;
-  onion_message->length = succ;
+  end = ring->end;
+
+  ring->buf[end & ( CELL_RING_SIZE - 1 )] = cell;
+  ring->length[end & ( CELL_RING_SIZE - 1 )] = succ;
+
+  or_connection->cells_received++;
 
-  if ( or_connection->status == CONNECTION_LIVE )
+  __atomic_store_n( &ring->end, end + 1, __ATOMIC_SEQ_CST );
+
+  // the core task clears the flag before it drains the ring, so only the
+  // first cell after that needs a message
+  if ( __atomic_exchange_n( &ring->notified, true, __ATOMIC_SEQ_CST ) == false )
   {
+    onion_message = malloc( sizeof( OnionMessage ) );
     onion_message->type = TOR_CELL;
-  }
-  else
-  {
-    onion_message->type = CONN_HANDSHAKE;
-  }
+    onion_message->data = or_connection->conn_id;
 
-  or_connection->cell_ring_end = ( or_connection->cell_ring_end + 1 ) % 20;
-
-  MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+    v_core_enqueue_shard_blocking( onion_message, shard );
+  }
 
 finish:
   return succ;
 }
 
-static int d_recv_on_local_connection( DlConnection* local_connection )
+// hand a pooled cell straight to the core task, it fills in the rest of the
+// relay header and encrypts the payload in place
+static void v_enqueue_local_cell( DlConnection* local_connection, Cell* relay_cell, uint8_t relay_command, uint16_t length )
 {
-  int succ;
   OnionMessage* onion_message;
 
+  v_set_cell_circ_id( relay_cell, local_connection->circ_id );
+  relay_cell->payload.relay.relay_command = relay_command;
+  v_set_relay_stream_id( relay_cell, local_connection->stream_id );
+  v_set_relay_length( relay_cell, length );
+
+  if ( relay_command == RELAY_DATA && local_connection->begin_us != 0 )
+  {
+    v_stats_record_latency( LATENCY_LOCAL_FIRST_BYTE, MINITOR_GET_TIME() - local_connection->begin_us );
+    local_connection->begin_us = 0;
+  }
+
   onion_message = malloc( sizeof( OnionMessage ) );
 
   onion_message->type = SERVICE_TCP_DATA;
-  onion_message->data = malloc( sizeof( ServiceTcpTraffic ) );
-  ( (ServiceTcpTraffic*)onion_message->data )->circ_id = local_connection->circ_id;
-  ( (ServiceTcpTraffic*)onion_message->data )->stream_id = local_connection->stream_id;
-  ( (ServiceTcpTraffic*)onion_message->data )->data = malloc( sizeof( uint8_t ) * RELAY_PAYLOAD_LEN );
+  onion_message->data = relay_cell;
+
+  v_core_enqueue_blocking( onion_message );
+}
+
+static void v_flush_local_coalesce( DlConnection* local_connection )
+{
+  if ( local_connection->coalesce_length == 0 )
+  {
+    return;
+  }
+
+  v_enqueue_local_cell( local_connection, local_connection->coalesce_cell, RELAY_DATA, local_connection->coalesce_length );
+
+  // the core task owns the cell now
+  local_connection->coalesce_cell = NULL;
+  local_connection->coalesce_length = 0;
+}
+
+static int d_recv_on_local_connection( DlConnection* local_connection )
+{
+  int succ;
+
+  if ( local_connection->coalesce_cell == NULL )
+  {
+    local_connection->coalesce_cell = px_take_pooled_cell();
+    local_connection->coalesce_length = 0;
+  }
 
-  succ = recv( local_connection->sock_fd, ( (ServiceTcpTraffic*)onion_message->data )->data, sizeof( uint8_t ) * RELAY_PAYLOAD_LEN, 0 );
+  // read straight into the relay payload so the data is never copied
+  succ = recv( local_connection->sock_fd, local_connection->coalesce_cell->payload.relay.data + local_connection->coalesce_length, sizeof( uint8_t ) * ( RELAY_PAYLOAD_LEN - local_connection->coalesce_length ), 0 );
 
   if ( succ <= 0 )
   {
-    ( (ServiceTcpTraffic*)onion_message->data )->length = 0;
-    free( ( (ServiceTcpTraffic*)onion_message->data )->data );
+    // anything we were holding must go out before the RELAY_END
+    v_flush_local_coalesce( local_connection );
+
+    v_enqueue_local_cell( local_connection, px_take_pooled_cell(), RELAY_END, 0 );
+
+    return succ;
+  }
+
+  if ( local_connection->coalesce_length == 0 )
+  {
+    local_connection->coalesce_deadline = MINITOR_GET_TIME() + (int64_t)local_connection->coalesce_ms * 1000;
+  }
+
+  local_connection->coalesce_length += succ;
+
+  if ( local_connection->coalesce_length == RELAY_PAYLOAD_LEN || local_connection->coalesce_ms == 0 )
+  {
+    v_flush_local_coalesce( local_connection );
+  }
+
+  return succ;
+}
+
+// write as much of the buffered circuit data as the local server will take,
+// once it drains below the high water mark any SENDME we held back goes out
+static int d_flush_local_output( DlConnection* local_connection )
+{
+  int succ;
+  bool send_sendme = false;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( local_streams_mutex );
+
+  succ = send( local_connection->sock_fd, local_connection->output_buf, local_connection->output_length, MSG_DONTWAIT );
+
+  if ( succ < 0 )
+  {
+    if ( errno != EAGAIN && errno != EWOULDBLOCK )
+    {
+      MINITOR_LOG( CONN_TAG, "Failed to send to local connection, errno: %d", errno );
+
+      goto finish;
+    }
+
+    succ = 0;
+  }
+
+  local_connection->output_length -= succ;
+
+  if ( local_connection->output_length > 0 )
+  {
+    memmove( local_connection->output_buf, local_connection->output_buf + succ, local_connection->output_length );
   }
   else
   {
-    ( (ServiceTcpTraffic*)onion_message->data )->length = succ;
+    poll_set[local_connection->poll_index].events &= ~POLLOUT;
   }
 
-  MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+  if ( local_connection->delivered_cells >= STREAM_SENDME_INCREMENT && local_connection->output_length < MINITOR_LOCAL_OUTPUT_HIGH_WATER )
+  {
+    local_connection->delivered_cells -= STREAM_SENDME_INCREMENT;
+    send_sendme = true;
+  }
+
+finish:
+  MINITOR_MUTEX_GIVE( local_streams_mutex );
+  // MUTEX GIVE
+
+  if ( send_sendme == true )
+  {
+    v_enqueue_local_cell( local_connection, px_take_pooled_cell(), RELAY_SENDME, 0 );
+  }
 
   return succ;
 }
@@ -236,26 +880,285 @@ static int d_recv_on_connection( DlConnection* dl_connection )
     succ = d_recv_on_local_connection( dl_connection );
   }
 
-  return succ;
+  return succ;
+}
+
+// work out which core lanes have credit for more reads and mask POLLIN on the
+// sockets feeding a lane that doesn't, so poll stops reporting data we won't
+// read instead of waking us over and over. caller must hold connections_mutex
+static void v_update_backpressure( int64_t now_us )
+{
+  int i;
+  bool changed = false;
+  bool blocked;
+
+  blocked = d_core_lane_spaces( CORE_LANE_CONTROL ) <= CORE_LANE_RESERVE;
+
+  if ( blocked != or_backpressure )
+  {
+    if ( blocked == true )
+    {
+      backpressure_stats.or_events++;
+      or_backpressure_start = now_us;
+    }
+    else
+    {
+      backpressure_stats.or_us += now_us - or_backpressure_start;
+    }
+
+    or_backpressure = blocked;
+    changed = true;
+  }
+
+  blocked = d_core_lane_spaces( CORE_LANE_BULK ) <= CORE_LANE_RESERVE;
+
+  if ( blocked != local_backpressure )
+  {
+    if ( blocked == true )
+    {
+      backpressure_stats.local_events++;
+      local_backpressure_start = now_us;
+    }
+    else
+    {
+      backpressure_stats.local_us += now_us - local_backpressure_start;
+    }
+
+    local_backpressure = blocked;
+    changed = true;
+  }
+
+  // a dirty poll set picks the new masks up when it is rebuilt
+  if ( changed == false || poll_set_dirty == true )
+  {
+    return;
+  }
+
+  for ( i = 0; i < poll_set_size; i++ )
+  {
+    if ( b_connection_can_read( poll_connections[i] ) )
+    {
+      poll_set[i].events |= POLLIN;
+    }
+    else
+    {
+      poll_set[i].events &= ~POLLIN;
+    }
+  }
+}
+
+// returns -1 if the connection was closed and cleaned up, caller must hold
+// connections_mutex and the connection's access mutex
+static int d_read_connection( DlConnection* dl_connection )
+{
+  int succ;
+  int readable_bytes;
+
+  // because of how file descriptors in ssl are handled, we must read all the
+  // current contents in 1 go, otherwise the ssl connection will pull the data
+  // out of the file descriptor and the next poll will report no read ready
+  if ( lwip_ioctl( dl_connection->sock_fd, FIONREAD, &readable_bytes ) < 0 )
+  {
+    MINITOR_LOG( CONN_TAG, "Failed to ioctl on connection fd, errno: %d", errno );
+
+    return 0;
+  }
+
+  // a paused read may have left a record inside wolfssl that poll can't see
+  if ( dl_connection->is_or == 1 && dl_connection->ssl != NULL )
+  {
+    readable_bytes += wolfSSL_pending( dl_connection->ssl );
+  }
+
+  do
+  {
+    if ( dl_connection->is_or == 0 && d_core_lane_spaces( CORE_LANE_BULK ) <= CORE_LANE_RESERVE )
+    {
+      break;
+    }
+
+    // the core task is behind on this link, stop reading the socket until
+    // it catches up instead of dropping the connection. cells may already be
+    // sitting in wolfssl where poll can't see them, so a link stopped for
+    // lane credit is paused too and v_resume_paused_connections reads it
+    if (
+      dl_connection->is_or == 1 &&
+      ( d_core_lane_spaces( CORE_LANE_CONTROL ) <= CORE_LANE_RESERVE || b_cell_ring_full( dl_connection ) )
+    )
+    {
+      poll_set[dl_connection->poll_index].events &= ~POLLIN;
+
+      if ( dl_connection->reads_paused == false )
+      {
+        dl_connection->reads_paused = true;
+        paused_connection_count++;
+      }
+
+      break;
+    }
+
+    succ = d_recv_on_connection( dl_connection );
+
+    if ( succ <= 0 )
+    {
+      v_cleanup_connection_in_lock( dl_connection );
+
+      return -1;
+    }
+
+    readable_bytes -= succ;
+  } while (
+    ( dl_connection->is_or == 0 && readable_bytes > 0 ) ||
+    ( dl_connection->is_or == 1 && ( readable_bytes >= CELL_LEN || ( dl_connection->status == CONNECTION_WANT_CERTS && readable_bytes >= 0 ) ) )
+  );
+
+  return 0;
+}
+
+// caller must hold connections_mutex and the poll set must be clean
+static void v_resume_paused_connections()
+{
+  int i;
+  MinitorMutex access_mutex;
+  DlConnection* dl_connection;
+
+  for ( i = 0; i < poll_set_size && paused_connection_count > 0; i++ )
+  {
+    dl_connection = poll_connections[i];
+
+    if ( dl_connection->reads_paused == false || b_cell_ring_full( dl_connection ) )
+    {
+      continue;
+    }
+
+    // keep the ring paused until the control lane has credit again
+    if ( or_backpressure == true )
+    {
+      break;
+    }
+
+    access_mutex = dl_connection->access_mutex;
+
+    // MUTEX TAKE
+    MINITOR_MUTEX_TAKE_BLOCKING( access_mutex );
+
+    dl_connection->reads_paused = false;
+    paused_connection_count--;
+
+    if ( b_connection_can_read( dl_connection ) )
+    {
+      poll_set[i].events |= POLLIN;
+    }
+
+    if ( d_read_connection( dl_connection ) < 0 )
+    {
+      // the poll set is dirty now, the rest waits for the rebuild
+      MINITOR_MUTEX_GIVE( access_mutex );
+      // MUTEX GIVE
+
+      break;
+    }
+
+    MINITOR_MUTEX_GIVE( access_mutex );
+    // MUTEX GIVE
+  }
+}
+
+// flush expired coalesce buffers and close idle or overflowed local
+// connections, next_scan is set to when the next scan is due
+static void v_scan_local_connections( time_t now, int64_t now_us, int64_t* next_scan )
+{
+  MinitorMutex access_mutex;
+  DlConnection* dl_connection;
+  DlConnection* tmp_connection;
+
+  *next_scan = now_us + 1000 * 1000;
+
+  dl_connection = connections;
+
+  while ( dl_connection != NULL )
+  {
+    if ( dl_connection->is_or == 1 )
+    {
+      dl_connection = dl_connection->next;
+
+      continue;
+    }
+
+    access_mutex = dl_connection->access_mutex;
+
+    // MUTEX TAKE
+    MINITOR_MUTEX_TAKE_BLOCKING( access_mutex );
+
+    // send partial payloads whose coalesce window has closed
+    if ( dl_connection->coalesce_length > 0 && now_us >= dl_connection->coalesce_deadline )
+    {
+      v_flush_local_coalesce( dl_connection );
+    }
+
+    // need to send local connection timeout to the core task
+    // as a 0 length tcp event, same goes for a local server that
+    // let its output buffer overflow
+    if (
+      dl_connection->close_pending == true ||
+      ( now > dl_connection->last_action && now - dl_connection->last_action >= 5 )
+    )
+    {
+      tmp_connection = dl_connection->next;
+
+      if ( dl_connection->close_quietly == false )
+      {
+        v_flush_local_coalesce( dl_connection );
+
+        v_enqueue_local_cell( dl_connection, px_take_pooled_cell(), RELAY_END, 0 );
+      }
+
+      v_cleanup_connection_in_lock( dl_connection );
+
+      MINITOR_MUTEX_GIVE( access_mutex );
+      // MUTEX GIVE
+
+      dl_connection = tmp_connection;
+
+      continue;
+    }
+
+    if ( dl_connection->coalesce_length > 0 && dl_connection->coalesce_deadline < *next_scan )
+    {
+      *next_scan = dl_connection->coalesce_deadline;
+    }
+
+    MINITOR_MUTEX_GIVE( access_mutex );
+    // MUTEX GIVE
+
+    dl_connection = dl_connection->next;
+  }
 }
 
 void v_connections_daemon( void* pv_parameters )
 {
   int i;
   time_t now;
-  int want_next;
   int succ;
-  int readable_bytes;
-  uint8_t* rx_buffer;
+  int poll_timeout = 0;
+  short revents;
+  int64_t now_us;
+  int64_t next_scan = 0;
   MinitorMutex access_mutex;
-  OnionMessage* onion_message;
-  DlConnection* dl_connection;
-  DlConnection* tmp_connection;
-  DlConnection* ready_connections[16];
+  DlConnection* ready_connection;
+
+  wake_fd = d_create_wake_socket();
+
+  if ( wake_fd < 0 )
+  {
+    MINITOR_LOG( CONN_TAG, "Failed to create the wake socket, errno: %d", errno );
+  }
 
   while ( 1 )
   {
-    succ = poll( connections_poll, 16, 500 );
+    succ = poll( poll_set, poll_set_length, poll_timeout );
+
+    v_drain_wake_socket();
 
     if ( succ <= 0 )
     {
@@ -265,120 +1168,137 @@ void v_connections_daemon( void* pv_parameters )
       }
     }
 
-    if ( MINITOR_QUEUE_MESSAGES_WAITING( core_task_queue ) >= 15 )
-    {
-      continue;
-    }
-
     // MUTEX TAKE
     MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
 
-    i = 0;
     time( &now );
+    now_us = MINITOR_GET_TIME();
 
-    dl_connection = connections;
+    // a connection was added or removed while we were polling so the results
+    // may point at freed connections, rebuild and poll again
+    if ( poll_set_dirty == true )
+    {
+      poll_set_size = 0;
+      poll_set_length = 0;
+    }
 
-    while ( dl_connection != NULL )
+    for ( i = 0; i < poll_set_size; i++ )
     {
-      if ( ( connections_poll[dl_connection->poll_index].revents & connections_poll[dl_connection->poll_index].events ) != 0 )
+      revents = poll_set[i].revents & poll_set[i].events;
+
+      if ( revents == 0 )
       {
-        ready_connections[i] = dl_connection;
-        i++;
+        continue;
       }
-      // need to send local connection timeout to the core task
-      // as a 0 length tcp event
-      else if ( dl_connection->is_or == 0 && now > dl_connection->last_action && now - dl_connection->last_action >= 5 )
-      {
-        onion_message = malloc( sizeof( OnionMessage ) );
 
-        onion_message->type = SERVICE_TCP_DATA;
-        onion_message->data = malloc( sizeof( ServiceTcpTraffic ) );
-        ( (ServiceTcpTraffic*)onion_message->data )->length = 0;
-        ( (ServiceTcpTraffic*)onion_message->data )->circ_id = dl_connection->circ_id;
-        ( (ServiceTcpTraffic*)onion_message->data )->stream_id = dl_connection->stream_id;
+      ready_connection = poll_connections[i];
+      access_mutex = ready_connection->access_mutex;
 
-        MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+      // MUTEX TAKE
+      MINITOR_MUTEX_TAKE_BLOCKING( access_mutex );
 
-        tmp_connection = dl_connection->next;
+      if ( ready_connection->is_or == 0 && ( revents & POLLOUT ) != 0 )
+      {
+        if ( d_flush_local_output( ready_connection ) < 0 )
+        {
+          v_enqueue_local_cell( ready_connection, px_take_pooled_cell(), RELAY_END, 0 );
+          v_cleanup_connection_in_lock( ready_connection );
 
-        access_mutex = connection_access_mutex[dl_connection->mutex_index];
+          MINITOR_MUTEX_GIVE( access_mutex );
+          // MUTEX GIVE
 
-        // MUTEX TAKE
-        MINITOR_MUTEX_TAKE_BLOCKING( access_mutex );
+          continue;
+        }
 
-        v_cleanup_connection_in_lock( dl_connection );
+        ready_connection->last_action = now;
+      }
 
+      if ( ( revents & POLLIN ) == 0 )
+      {
         MINITOR_MUTEX_GIVE( access_mutex );
         // MUTEX GIVE
 
-        access_mutex = NULL;
-
-        dl_connection = tmp_connection;
-
         continue;
       }
 
-      dl_connection = dl_connection->next;
-    }
-
-    for ( i = i - 1; i >= 0; i-- )
-    {
-      access_mutex = connection_access_mutex[ready_connections[i]->mutex_index];
-
-      // MUTEX TAKE
-      MINITOR_MUTEX_TAKE_BLOCKING( access_mutex );
-
-      // because of how file descriptors in ssl are handled, we must read all the
-      // current contents in 1 go, otherwise the ssl connection will pull the data
-      // out of the file descriptor and the next poll will report no read ready
-      if ( lwip_ioctl( ready_connections[i]->sock_fd, FIONREAD, &readable_bytes ) < 0 )
+      if ( d_read_connection( ready_connection ) < 0 )
       {
-        MINITOR_LOG( CONN_TAG, "Failed to ioctl on connection fd, errno: %d", errno );
-
-        continue;
+        ready_connection = NULL;
       }
 
-      do
+      if ( ready_connection != NULL && ready_connection->is_or == 0 )
       {
-        if ( MINITOR_QUEUE_MESSAGES_WAITING( core_task_queue ) >= 15 )
+        ready_connection->last_action = now;
+
+        // make sure we wake up in time to send a partial payload
+        if ( ready_connection->coalesce_length > 0 && ready_connection->coalesce_deadline < next_scan )
         {
-          break;
+          next_scan = ready_connection->coalesce_deadline;
         }
+      }
 
-        succ = d_recv_on_connection( ready_connections[i] );
+      MINITOR_MUTEX_GIVE( access_mutex );
+      // MUTEX GIVE
+    }
 
-        if ( succ <= 0 )
-        {
-          v_cleanup_connection_in_lock( ready_connections[i] );
-          ready_connections[i] = NULL;
+    // coalesce deadlines and idle timeouts only need a walk over the local
+    // connections when one of them is due, not on every wakeup
+    if ( __atomic_exchange_n( &local_close_requested, false, __ATOMIC_RELAXED ) == true || now_us >= next_scan )
+    {
+      v_scan_local_connections( now, now_us, &next_scan );
+    }
 
-          break;
-        }
+    if ( poll_set_dirty == true )
+    {
+      v_rebuild_poll_set();
+    }
+    else
+    {
+      v_apply_pollout_requests();
+    }
 
-        readable_bytes -= succ;
-      } while (
-        ( ready_connections[i]->is_or == 0 && readable_bytes > 0 ) ||
-        ( ready_connections[i]->is_or == 1 && ( readable_bytes >= CELL_LEN || ( ready_connections[i]->status == CONNECTION_WANT_CERTS && readable_bytes >= 0 ) ) )
-      );
+    v_update_backpressure( now_us );
 
-      if ( ready_connections[i] != NULL && ready_connections[i]->is_or == 0 )
-      {
-        time( &now );
-        ready_connections[i]->last_action = now;
-      }
+    if ( paused_connection_count > 0 )
+    {
+      v_resume_paused_connections();
+    }
 
-      MINITOR_MUTEX_GIVE( access_mutex );
-      // MUTEX GIVE
+    // without the wake socket nothing gets us out of poll early, check back
+    // quickly while there is something another task could change
+    if (
+      wake_fd < 0 &&
+      ( local_connection_count > 0 || paused_connection_count > 0 || or_backpressure == true || local_backpressure == true )
+    )
+    {
+      poll_timeout = 10;
+    }
+    else
+    {
+      poll_timeout = -1;
     }
 
     MINITOR_MUTEX_GIVE( connections_mutex );
     // MUTEX GIVE
+
+    if ( poll_timeout < 0 )
+    {
+      now_us = MINITOR_GET_TIME();
+
+      if ( next_scan <= now_us )
+      {
+        poll_timeout = 0;
+      }
+      else
+      {
+        poll_timeout = ( next_scan - now_us + 999 ) / 1000;
+      }
+    }
   }
 }
 
 static DlConnection* px_create_or_connection( uint32_t address, uint16_t port )
 {
-  int i;
   int sock_fd;
   struct sockaddr_in dest_addr;
   WOLFSSL* ssl;
@@ -447,7 +1367,6 @@ static DlConnection* px_create_or_connection( uint32_t address, uint16_t port )
   or_connection->ssl = ssl;
   or_connection->sock_fd = sock_fd;
   or_connection->is_or = 1;
-  or_connection->conn_id = conn_id++;
 
   if ( d_start_v3_handshake( or_connection ) < 0 )
   {
@@ -458,37 +1377,17 @@ static DlConnection* px_create_or_connection( uint32_t address, uint16_t port )
 
   or_connection->status = CONNECTION_WANT_VERSIONS;
 
-  v_add_connection_to_list( or_connection, &connections );
-
-  if ( connections_daemon_task_handle == NULL )
-  {
-    for ( i = 0; i < 16; i++ )
-    {
-      connections_poll[i].fd = -1;
-      connection_access_mutex[i] = MINITOR_MUTEX_CREATE();
-    }
-  }
-
-  for ( i = 0; i < 16; i++ )
-  {
-    if ( connections_poll[i].fd == -1 )
-    {
-      or_connection->poll_index = i;
-      or_connection->mutex_index = i;
-      connections_poll[i].fd = sock_fd;
-      connections_poll[i].events = POLLIN;
-
-      break;
-    }
-  }
-
-  if ( i >= 16 )
+  if ( d_take_connection_slot( or_connection ) < 0 )
   {
-    MINITOR_LOG( CONN_TAG, "couldn't find an open poll spot" );
+    MINITOR_LOG( CONN_TAG, "couldn't find an open connection slot" );
 
     goto clean_connection;
   }
 
+  v_add_connection_to_list( or_connection, &connections );
+  poll_set_dirty = true;
+  v_wake_connections_daemon();
+
   if ( connections_daemon_task_handle == NULL )
   {
     b_create_connections_task( &connections_daemon_task_handle );
@@ -553,11 +1452,60 @@ int d_attach_or_connection( uint32_t address, uint16_t port, OnionCircuit* circu
   return 0;
 }
 
-int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, uint16_t port )
+#ifdef MINITOR_BENCHMARK
+// hands a connected plain socket to the daemon as a live OR link with no tls,
+// the benchmark plays the relay on the other end of it
+int d_attach_bench_or_connection( int sock_fd, OnionCircuit* circuit )
+{
+  DlConnection* or_connection;
+
+  or_connection = malloc( sizeof( DlConnection ) );
+
+  memset( or_connection, 0, sizeof( DlConnection ) );
+
+  or_connection->sock_fd = sock_fd;
+  or_connection->is_or = 1;
+  or_connection->has_versions = true;
+  or_connection->status = CONNECTION_LIVE;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+
+  if ( d_take_connection_slot( or_connection ) < 0 )
+  {
+    MINITOR_MUTEX_GIVE( connections_mutex );
+    // MUTEX GIVE
+
+    MINITOR_LOG( CONN_TAG, "couldn't find an open connection slot" );
+
+    free( or_connection );
+
+    return -1;
+  }
+
+  v_add_connection_to_list( or_connection, &connections );
+  poll_set_dirty = true;
+  v_wake_connections_daemon();
+
+  if ( connections_daemon_task_handle == NULL )
+  {
+    b_create_connections_task( &connections_daemon_task_handle );
+  }
+
+  circuit->conn_id = or_connection->conn_id;
+
+  MINITOR_MUTEX_GIVE( connections_mutex );
+  // MUTEX GIVE
+
+  return 0;
+}
+#endif
+
+int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, uint16_t port, int coalesce_ms )
 {
-  int i;
   int succ;
   int sock_fd;
+  int64_t begin_us = MINITOR_GET_TIME();
   struct sockaddr_in dest_addr;
   DlConnection* local_connection;
 
@@ -595,41 +1543,24 @@ int d_create_local_connection( uint32_t circ_id, uint16_t stream_id, uint16_t po
   local_connection->stream_id = stream_id;
   local_connection->sock_fd = sock_fd;
   local_connection->is_or = 0;
+  local_connection->coalesce_ms = coalesce_ms;
+  local_connection->begin_us = begin_us;
   // set last action to uint max so it isn't killed before it can read (no one should be killed before they can read)
   local_connection->last_action = INT_MAX;
-  local_connection->conn_id = conn_id++;
-
-  if ( connections_daemon_task_handle == NULL )
-  {
-    for ( i = 0; i < 16; i++ )
-    {
-      connections_poll[i].fd = -1;
-      connection_access_mutex[i] = MINITOR_MUTEX_CREATE();
-    }
-  }
-
-  for ( i = 0; i < 16; i++ )
-  {
-    if ( connections_poll[i].fd == -1 )
-    {
-      local_connection->poll_index = i;
-      local_connection->mutex_index = i;
-      connections_poll[i].fd = sock_fd;
-      connections_poll[i].events = POLLIN;
-
-      break;
-    }
-  }
 
-  if ( i >= 16 )
+  if ( d_take_connection_slot( local_connection ) < 0 )
   {
-    MINITOR_LOG( CONN_TAG, "couldn't find an open poll spot" );
+    MINITOR_LOG( CONN_TAG, "couldn't find an open connection slot" );
 
     free( local_connection );
     goto clean_socket;
   }
 
   v_add_connection_to_list( local_connection, &connections );
+  v_add_local_stream( local_connection );
+  local_connection_count++;
+  poll_set_dirty = true;
+  v_wake_connections_daemon();
 
   if ( connections_daemon_task_handle == NULL )
   {
@@ -651,98 +1582,180 @@ fail:
   return -1;
 }
 
+// returns 1 when the stream is owed a SENDME, the core task must not block
+// here so anything the local server won't take right away is buffered and
+// flushed by the connections daemon on POLLOUT
 int d_forward_to_local_connection( uint32_t circ_id, uint32_t stream_id, uint8_t* data, uint32_t length )
 {
   int ret = 0;
+  int succ;
+  int new_capacity;
+  uint8_t* new_buf;
   DlConnection* local_connection;
 
-  local_connection = connections;
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( local_streams_mutex );
 
-  while ( local_connection != NULL )
+  local_connection = px_find_local_stream( circ_id, stream_id );
+
+  if ( local_connection == NULL || local_connection->close_pending == true )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  // only write directly if nothing is queued ahead of this data
+  if ( local_connection->output_length == 0 )
   {
-    if ( local_connection->is_or == 0 && local_connection->circ_id == circ_id && local_connection->stream_id == stream_id )
+    succ = send( local_connection->sock_fd, data, length, MSG_DONTWAIT );
+
+    if ( succ < 0 )
     {
-      ret = send( local_connection->sock_fd, data, length, 0 );
+      if ( errno != EAGAIN && errno != EWOULDBLOCK )
+      {
+        ret = -1;
+        goto finish;
+      }
 
-      break;
+      succ = 0;
     }
 
-    local_connection = local_connection->next;
+    data += succ;
+    length -= succ;
   }
 
-  if ( local_connection == NULL )
+  if ( length > 0 )
   {
-    ret = -1;
+    if ( local_connection->output_length + length > MINITOR_LOCAL_OUTPUT_MAX )
+    {
+      MINITOR_LOG( CONN_TAG, "Local output buffer full, closing stream" );
+
+      // the daemon sends the RELAY_END and cleans up, we can't take the
+      // connections mutex from here
+      v_request_local_close( local_connection, false );
+
+      ret = -1;
+      goto finish;
+    }
+
+    if ( local_connection->output_length + length > local_connection->output_capacity )
+    {
+      new_capacity = local_connection->output_capacity * 2;
+
+      if ( new_capacity < local_connection->output_length + length )
+      {
+        new_capacity = local_connection->output_length + length;
+      }
+
+      if ( new_capacity > MINITOR_LOCAL_OUTPUT_MAX )
+      {
+        new_capacity = MINITOR_LOCAL_OUTPUT_MAX;
+      }
+
+      new_buf = realloc( local_connection->output_buf, new_capacity );
+
+      if ( new_buf == NULL )
+      {
+        MINITOR_LOG( CONN_TAG, "Failed to grow local output buffer" );
+
+        v_request_local_close( local_connection, false );
+
+        ret = -1;
+        goto finish;
+      }
+
+      local_connection->output_buf = new_buf;
+      local_connection->output_capacity = new_capacity;
+    }
+
+    memcpy( local_connection->output_buf + local_connection->output_length, data, length );
+    local_connection->output_length += length;
+
+    // the poll set belongs to the daemon, ask it to watch for POLLOUT
+    if ( local_connection->pollout_requested == false )
+    {
+      local_connection->pollout_requested = true;
+      local_connection->pollout_next = pollout_requests;
+      pollout_requests = local_connection;
+
+      v_wake_connections_daemon();
+    }
+  }
+
+  local_connection->delivered_cells++;
+
+  // past the high water mark the SENDME is held back until the daemon
+  // drains the buffer, which stops the client from sending more
+  if ( local_connection->delivered_cells >= STREAM_SENDME_INCREMENT && local_connection->output_length < MINITOR_LOCAL_OUTPUT_HIGH_WATER )
+  {
+    local_connection->delivered_cells -= STREAM_SENDME_INCREMENT;
+    ret = 1;
   }
 
+finish:
+  MINITOR_MUTEX_GIVE( local_streams_mutex );
+  // MUTEX GIVE
+
   return ret;
 }
 
+// called by the core task while it holds an OR connection's access_mutex,
+// taking connections_mutex here would deadlock against the daemon so the
+// stream is only marked and the daemon closes it
 void v_cleanup_local_connection( uint32_t circ_id, uint32_t stream_id )
 {
   DlConnection* local_connection;
 
   // MUTEX TAKE
-  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+  MINITOR_MUTEX_TAKE_BLOCKING( local_streams_mutex );
 
-  local_connection = connections;
+  local_connection = px_find_local_stream( circ_id, stream_id );
 
-  while ( local_connection != NULL )
+  if ( local_connection != NULL )
   {
-    if ( local_connection->is_or == 0 && local_connection->circ_id == circ_id && local_connection->stream_id == stream_id )
-    {
-      v_cleanup_connection_in_lock( local_connection );
-      break;
-    }
-
-    local_connection = local_connection->next;
+    v_request_local_close( local_connection, true );
   }
 
-  MINITOR_MUTEX_GIVE( connections_mutex );
+  MINITOR_MUTEX_GIVE( local_streams_mutex );
   // MUTEX GIVE
 }
 
 void v_cleanup_local_connections_by_circ_id( uint32_t circ_id )
 {
   DlConnection* local_connection;
-  DlConnection* tmp_connection;
 
-  local_connection = connections;
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( local_streams_mutex );
+
+  local_connection = local_circ_streams[ud_local_circ_bucket( circ_id )];
 
   while ( local_connection != NULL )
   {
-    if ( local_connection->is_or == 0 && local_connection->circ_id == circ_id )
-    {
-      tmp_connection = local_connection->next;
-      v_cleanup_connection_in_lock( local_connection );
-      local_connection = tmp_connection;
-    }
-    else
+    if ( local_connection->circ_id == circ_id )
     {
-      local_connection = local_connection->next;
+      v_request_local_close( local_connection, true );
     }
+
+    local_connection = local_connection->circ_stream_next;
   }
+
+  MINITOR_MUTEX_GIVE( local_streams_mutex );
+  // MUTEX GIVE
 }
 
+// caller must hold connections_mutex
 bool b_verify_or_connection( uint32_t id )
 {
-  bool ret = false;
-  DlConnection* in_list;
-
-  in_list = connections;
+  ConnectionSlot* slot;
 
-  while ( in_list != NULL )
+  if ( ( id & 0xffff ) >= connection_slot_count )
   {
-    if ( in_list->is_or == 1 && in_list->conn_id == id )
-    {
-      ret = true;
-      break;
-    }
-
-    in_list = in_list->next;
+    return false;
   }
 
-  return ret;
+  slot = px_get_connection_slot( id & 0xffff );
+
+  return slot->connection != NULL && slot->generation == ( id >> 16 ) && slot->connection->is_or == 1;
 }
 
 void v_dettach_connection( DlConnection* dl_connection )
@@ -774,31 +1787,78 @@ void v_dettach_connection( DlConnection* dl_connection )
   }
 }
 
-// caller must give the access semaphore
+// caller must give the access semaphore, resolves the conn_id through its
+// slot so the global connections_mutex is never taken
 DlConnection* px_get_conn_by_id_and_lock( uint32_t id )
 {
-  DlConnection* dl_connection;
+  ConnectionSlot* slot;
+
+  if ( ( id & 0xffff ) >= connection_slot_count )
+  {
+    return NULL;
+  }
+
+  slot = px_get_connection_slot( id & 0xffff );
 
   // MUTEX TAKE
-  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+  MINITOR_MUTEX_TAKE_BLOCKING( slot->access_mutex );
 
-  dl_connection = connections;
+  // the slot only changes owner under its access mutex, so once we hold it
+  // a matching generation means the connection is still alive
+  if ( slot->connection == NULL || slot->generation != ( id >> 16 ) )
+  {
+    MINITOR_MUTEX_GIVE( slot->access_mutex );
+    // MUTEX GIVE
 
-  while ( dl_connection != NULL )
+    return NULL;
+  }
+
+  return slot->connection;
+}
+
+uint8_t* px_pop_connection_cell( DlConnection* dl_connection, int shard, int* length )
+{
+  uint32_t start;
+  uint8_t* cell;
+  CellRing* ring = &dl_connection->cell_rings[shard];
+
+  start = ring->start;
+
+  if ( start == __atomic_load_n( &ring->end, __ATOMIC_ACQUIRE ) )
   {
-    if ( dl_connection->conn_id == id )
-    {
-      // MUTEX TAKE
-      MINITOR_MUTEX_TAKE_BLOCKING( connection_access_mutex[dl_connection->mutex_index] );
+    return NULL;
+  }
 
-      break;
-    }
+  cell = ring->buf[start & ( CELL_RING_SIZE - 1 )];
+  *length = ring->length[start & ( CELL_RING_SIZE - 1 )];
 
-    dl_connection = dl_connection->next;
+  ring->buf[start & ( CELL_RING_SIZE - 1 )] = NULL;
+
+  __atomic_store_n( &ring->start, start + 1, __ATOMIC_RELEASE );
+
+  // the daemon stopped reading this link until the ring has room
+  if ( __atomic_load_n( &dl_connection->reads_paused, __ATOMIC_RELAXED ) == true )
+  {
+    v_wake_connections_daemon();
   }
 
-  MINITOR_MUTEX_GIVE( connections_mutex );
-  // MUTEX GIVE
+  return cell;
+}
+
+bool b_connection_has_cells( DlConnection* dl_connection, int shard )
+{
+  return dl_connection->cell_rings[shard].start != __atomic_load_n( &dl_connection->cell_rings[shard].end, __ATOMIC_SEQ_CST );
+}
 
-  return dl_connection;
+// must be called before draining the ring, any cell pushed after this
+// sends a new TOR_CELL message to the shard
+void v_rearm_connection_cells( DlConnection* dl_connection, int shard )
+{
+  __atomic_store_n( &dl_connection->cell_rings[shard].notified, false, __ATOMIC_SEQ_CST );
+}
+
+// caller must hold connections_mutex
+void v_get_backpressure_stats( BackpressureStats* stats )
+{
+  memcpy( stats, &backpressure_stats, sizeof( BackpressureStats ) );
 }
@@ -32,6 +32,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../h/encoding.h"
 #include "../h/models/relay.h"
 
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CONSENSUS
+
 // TODO change back to 0 when issi ram is operating in quad mode
 int hsdir_tree_occupied = 1;
 NetworkConsensus* next_network_consensus;
@@ -54,6 +56,94 @@ typedef struct FetchDescriptorState
   uint64_t start;
 } FetchDescriptorState;
 
+// where d_parse_descriptor_chunk is inside a descriptor response, it is kept
+// between chunks since a key can be split across two reads
+typedef struct DescriptorParseState
+{
+  int end_header;
+  int relays_set;
+  int matched_relay;
+  int master_key_found;
+  char master_key_64[43];
+  int master_key_64_length;
+  int ntor_onion_key_found;
+  char ntor_onion_key_64[43];
+  int ntor_onion_key_64_length;
+  int signing_key_found;
+  char signing_key_64[187];
+  int signing_key_64_length;
+  Sha tmp_sha;
+} DescriptorParseState;
+
+typedef struct ConsensusParseState ConsensusParseState;
+
+// where d_parse_consensus_chunk is in a consensus, a line can be split across
+// two reads. the download and the replay only differ in what they do once the
+// header is parsed and with each hsdir relay
+struct ConsensusParseState
+{
+  NetworkConsensus* consensus;
+  // every chunk is appended here before it is parsed
+  const char* store_path;
+  char line[200];
+  int line_length;
+  int finished_consensus;
+  OnionRelay parse_relay;
+  // may be NULL
+  void ( *on_header )( ConsensusParseState* parse_state );
+  // takes a copy of parse_relay, the time spent in here isn't parse time
+  void ( *on_hsdir_relay )( ConsensusParseState* parse_state );
+  void* handler_data;
+};
+
+static const char descriptor_master_key[] = "\nmaster-key-ed25519 ";
+static const char descriptor_ntor_onion_key[] = "\nntor-onion-key ";
+static const char descriptor_signing_key[] = "\nsigning-key\n-----BEGIN RSA PUBLIC KEY-----\n";
+
+static ConsensusTimings consensus_timings;
+
+// set by v_minitor_set_dir_authorities, replaces tor_authorities when set
+static const char** custom_dir_authorities = NULL;
+static int custom_dir_authorities_count = 0;
+
+// the fetch tasks add to their stages at the same time
+static void v_add_consensus_stage( ConsensusStage* stage, uint32_t items, uint32_t bytes, int64_t us )
+{
+  __atomic_fetch_add( &stage->items, items, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &stage->bytes, bytes, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &stage->us, (uint32_t)us, __ATOMIC_RELAXED );
+}
+
+// not locked, this must be called before d_minitor_INIT starts fetching
+void v_minitor_set_dir_authorities( const char** authorities, int count )
+{
+  custom_dir_authorities = authorities;
+  custom_dir_authorities_count = count;
+}
+
+void v_get_consensus_timings( ConsensusTimings* timings )
+{
+  memcpy( timings, &consensus_timings, sizeof( ConsensusTimings ) );
+}
+
+static void v_log_consensus_stage( const char* name, ConsensusStage* stage )
+{
+  MINITOR_LOG( MINITOR_TAG, "%s: %u relays, %u bytes in %u ms", name, (unsigned int)stage->items, (unsigned int)stage->bytes, (unsigned int)( stage->us / 1000 ) );
+}
+
+static void v_log_consensus_timings( ConsensusTimings* timings )
+{
+  MINITOR_LOG( MINITOR_TAG, "Consensus took %u ms", (unsigned int)( timings->wall_us / 1000 ) );
+
+  v_log_consensus_stage( "download", &timings->download );
+  v_log_consensus_stage( "store", &timings->store );
+  v_log_consensus_stage( "parse", &timings->parse );
+  v_log_consensus_stage( "fetch", &timings->fetch );
+  v_log_consensus_stage( "descriptor parse", &timings->descriptor_parse );
+  v_log_consensus_stage( "id hash", &timings->id_hash );
+  v_log_consensus_stage( "insert", &timings->insert );
+}
+
 static void v_get_id_hash( uint8_t* identity, uint8_t* id_hash, int time_period, int hsdir_interval, uint8_t* srv )
 {
   uint8_t tmp_64_buffer[8];
@@ -93,6 +183,60 @@ static void v_get_id_hash( uint8_t* identity, uint8_t* id_hash, int time_period,
   wc_Sha3_256_Free( &reusable_sha3 );
 }
 
+// hashes the hsdir index and writes the relay to whichever staging lists it
+// belongs in
+static void v_crypto_and_insert_relay( NetworkConsensus* working_consensus, OnionRelay* onion_relay )
+{
+  int64_t start;
+  int64_t insert_start;
+
+  if ( onion_relay->hsdir == true )
+  {
+    start = MINITOR_GET_TIME();
+
+    v_get_id_hash( onion_relay->master_key, onion_relay->id_hash_previous, working_consensus->time_period, working_consensus->hsdir_interval, working_consensus->previous_shared_rand );
+    v_get_id_hash( onion_relay->master_key, onion_relay->id_hash, working_consensus->time_period + 1, working_consensus->hsdir_interval, working_consensus->shared_rand );
+
+    v_add_consensus_stage( &consensus_timings.id_hash, 1, 0, MINITOR_GET_TIME() - start );
+  }
+
+  insert_start = MINITOR_GET_TIME();
+
+  if ( onion_relay->hsdir == true )
+  {
+    while ( d_create_hsdir_relay( onion_relay ) < 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to d_create_hsdir_relay, retrying" );
+    }
+  }
+
+  if (
+    onion_relay->dir_cache == true &&
+    onion_relay->dir_port != 0 &&
+    d_get_staging_cache_relay_count() < 100
+  )
+  {
+    while ( d_create_cache_relay( onion_relay ) < 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to d_create_cache_relay, retrying" );
+    }
+  }
+
+  // some hsdir relays are not suitable and this will exclude them
+  if (
+    onion_relay->suitable == true &&
+    d_get_staging_fast_relay_count() < 100
+  )
+  {
+    while ( d_create_fast_relay( onion_relay ) < 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to d_create_fast_relay, retrying" );
+    }
+  }
+
+  v_add_consensus_stage( &consensus_timings.insert, 1, 0, MINITOR_GET_TIME() - insert_start );
+}
+
 void v_handle_crypto_and_insert( void* pv_parameters )
 {
   int process_count = 0;
@@ -134,40 +278,7 @@ void v_handle_crypto_and_insert( void* pv_parameters )
     process_count++;
 #endif
 
-    if ( onion_relay->hsdir == true )
-    {
-      v_get_id_hash( onion_relay->master_key, onion_relay->id_hash_previous, working_consensus->time_period, working_consensus->hsdir_interval, working_consensus->previous_shared_rand );
-      v_get_id_hash( onion_relay->master_key, onion_relay->id_hash, working_consensus->time_period + 1, working_consensus->hsdir_interval, working_consensus->shared_rand );
-
-      while ( d_create_hsdir_relay( onion_relay ) < 0 )
-      {
-        MINITOR_LOG( MINITOR_TAG, "Failed to d_create_hsdir_relay, retrying" );
-      }
-    }
-
-    if (
-      onion_relay->dir_cache == true &&
-      onion_relay->dir_port != 0 &&
-      d_get_staging_cache_relay_count() < 100
-    )
-    {
-      while ( d_create_cache_relay( onion_relay ) < 0 )
-      {
-        MINITOR_LOG( MINITOR_TAG, "Failed to d_create_cache_relay, retrying" );
-      }
-    }
-
-    // some hsdir relays are not suitable and this will exclude them
-    if (
-      onion_relay->suitable == true &&
-      d_get_staging_fast_relay_count() < 100
-    )
-    {
-      while ( d_create_fast_relay( onion_relay ) < 0 )
-      {
-        MINITOR_LOG( MINITOR_TAG, "Failed to d_create_fast_relay, retrying" );
-      }
-    }
+    v_crypto_and_insert_relay( working_consensus, onion_relay );
 
     free( onion_relay );
   }
@@ -207,7 +318,7 @@ static int d_get_suitable_dir_addr( struct sockaddr_in* dest_addr, char* ip_addr
 {
   int i;
   int ret = 0;
-  char* authority_string;
+  const char* authority_string;
   OnionRelay* cache_relay;
 
   if ( d_get_staging_cache_relay_count() != 0 )
@@ -272,9 +383,14 @@ static int d_get_suitable_dir_addr( struct sockaddr_in* dest_addr, char* ip_addr
   }
   else
   {
-    i = MINITOR_RANDOM() % tor_authorities_count;
-
-    authority_string = tor_authorities[i];
+    if ( custom_dir_authorities_count > 0 )
+    {
+      authority_string = custom_dir_authorities[MINITOR_RANDOM() % custom_dir_authorities_count];
+    }
+    else
+    {
+      authority_string = tor_authorities[MINITOR_RANDOM() % tor_authorities_count];
+    }
 
     for ( i = 0; i < strlen( authority_string ); i++ )
     {
@@ -400,188 +516,199 @@ fail:
   return -1;
 }
 
-static int d_finish_descriptor_fetch( FetchDescriptorState* fetch_state )
+static void v_init_descriptor_parse( DescriptorParseState* parse_state )
 {
-  int i;
-  int j;
-  int ret = 0;
-  int rx_length = 0;
-  char rx_buffer[512];
-  int end_header = 0;
-  int relays_set = 0;
-  int matched_relay = 0;
-  uint64_t end;
-
-  const char* master_key = "\nmaster-key-ed25519 ";
-  int master_key_found = 0;
-  char master_key_64[43] = { 0 };
-  int master_key_64_length = 0;
+  memset( parse_state, 0, sizeof( DescriptorParseState ) );
 
-  const char* ntor_onion_key = "\nntor-onion-key ";
-  int ntor_onion_key_found = 0;
-  char ntor_onion_key_64[43] = { 0 };
-  int ntor_onion_key_64_length = 0;
+  wc_InitSha( &parse_state->tmp_sha );
+}
 
-  const char* signing_key = "\nsigning-key\n-----BEGIN RSA PUBLIC KEY-----\n";
-  int signing_key_found = 0;
-  char signing_key_64[187] = { 0 };
-  int signing_key_64_length = 0;
+// feeds one chunk of a descriptor response through the key search, returns
+// how many bytes were used, parsing stops as soon as every relay in the fetch
+// has its keys so the rest of the chunk may belong to whatever comes next
+static int d_parse_descriptor_chunk( DescriptorParseState* parse_state, FetchDescriptorState* fetch_state, char* buf, int length )
+{
+  int i;
+  int j;
   uint8_t der[141];
   uint8_t identity_digest[ID_LENGTH];
-  Sha tmp_sha;
-
-  wc_InitSha( &tmp_sha );
 
-  // keep reading forever, we will break inside when the transfer is over
-  while ( relays_set < fetch_state->num_relays )
+  // iterate over each byte we got back from the socket recv
+  // NOTE that we can't rely on all the data being there, we
+  // have to treat each byte as though we only have that byte
+  for ( i = 0; i < length && parse_state->relays_set < fetch_state->num_relays; i++ )
   {
-    // recv data from the destination and fill the rx_buffer with the data
-    rx_length = recv( fetch_state->sock_fd, rx_buffer, sizeof( rx_buffer ), 0 );
-
-    // if we got less than 0 we encoutered an error
-    if ( rx_length < 0 )
+    // skip over the http header, when we get two \r\n s in a row we
+    // know we're at the end
+    if ( parse_state->end_header < 4 )
     {
-      MINITOR_LOG( MINITOR_TAG, "couldn't recv http server in d_finish_descriptor_fetch" );
-
-      ret = -1;
-      goto finish;
-    // we got 0 bytes back then the connection closed and we're done getting
-    // consensus data
-    }
-    else if ( rx_length == 0 )
-    {
-      break;
+      // increment end_header whenever we get part of a carrage retrun
+      if ( buf[i] == '\r' || buf[i] == '\n' )
+      {
+        parse_state->end_header++;
+      // otherwise reset the count
+      }
+      else
+      {
+        parse_state->end_header = 0;
+      }
+    // if we have 4 end_header we're onto the actual data
     }
-
-    // iterate over each byte we got back from the socket recv
-    // NOTE that we can't rely on all the data being there, we
-    // have to treat each byte as though we only have that byte
-    for ( i = 0; i < rx_length && relays_set < fetch_state->num_relays; i++ )
+    else
     {
-      // skip over the http header, when we get two \r\n s in a row we
-      // know we're at the end
-      if ( end_header < 4 )
+      if ( parse_state->ntor_onion_key_found != -1 )
       {
-        // increment end_header whenever we get part of a carrage retrun
-        if ( rx_buffer[i] == '\r' || rx_buffer[i] == '\n' )
+        if ( parse_state->ntor_onion_key_found == sizeof( descriptor_ntor_onion_key ) - 1 )
         {
-          end_header++;
-        // otherwise reset the count
+          parse_state->ntor_onion_key_64[parse_state->ntor_onion_key_64_length] = buf[i];
+          parse_state->ntor_onion_key_64_length++;
+
+          if ( parse_state->ntor_onion_key_64_length == 43 )
+          {
+            parse_state->ntor_onion_key_found = -1;
+          }
+        }
+        else if ( buf[i] == descriptor_ntor_onion_key[parse_state->ntor_onion_key_found] )
+        {
+          parse_state->ntor_onion_key_found++;
         }
         else
         {
-          end_header = 0;
+          parse_state->ntor_onion_key_found = 0;
         }
-      // if we have 4 end_header we're onto the actual data
       }
-      else
+
+      if ( parse_state->master_key_found != -1 )
       {
-        if ( ntor_onion_key_found != -1 )
+        if ( parse_state->master_key_found == sizeof( descriptor_master_key ) - 1 )
         {
-          if ( ntor_onion_key_found == strlen( ntor_onion_key ) )
-          {
-            ntor_onion_key_64[ntor_onion_key_64_length] = rx_buffer[i];
-            ntor_onion_key_64_length++;
+          parse_state->master_key_64[parse_state->master_key_64_length] = buf[i];
+          parse_state->master_key_64_length++;
 
-            if ( ntor_onion_key_64_length == 43 )
-            {
-              ntor_onion_key_found = -1;
-            }
-          }
-          else if ( rx_buffer[i] == ntor_onion_key[ntor_onion_key_found] )
-          {
-            ntor_onion_key_found++;
-          }
-          else
+          if ( parse_state->master_key_64_length == 43 )
           {
-            ntor_onion_key_found = 0;
+            parse_state->master_key_found = -1;
           }
         }
-
-        if ( master_key_found != -1 )
+        else if ( buf[i] == descriptor_master_key[parse_state->master_key_found] )
         {
-          if ( master_key_found == strlen( master_key ) )
-          {
-            master_key_64[master_key_64_length] = rx_buffer[i];
-            master_key_64_length++;
+          parse_state->master_key_found++;
+        }
+        else
+        {
+          parse_state->master_key_found = 0;
+        }
+      }
 
-            if ( master_key_64_length == 43 )
-            {
-              master_key_found = -1;
-            }
-          }
-          else if ( rx_buffer[i] == master_key[master_key_found] )
-          {
-            master_key_found++;
-          }
-          else
+      if ( parse_state->signing_key_found != -1 )
+      {
+        if ( parse_state->signing_key_found == sizeof( descriptor_signing_key ) - 1 )
+        {
+          if ( buf[i] != '\n' )
           {
-            master_key_found = 0;
+            parse_state->signing_key_64[parse_state->signing_key_64_length] = buf[i];
+            parse_state->signing_key_64_length++;
           }
-        }
 
-        if ( signing_key_found != -1 )
-        {
-          if ( signing_key_found == strlen( signing_key ) )
+          if ( parse_state->signing_key_64_length == 187 )
           {
-            if ( rx_buffer[i] != '\n' )
-            {
-              signing_key_64[signing_key_64_length] = rx_buffer[i];
-              signing_key_64_length++;
-            }
+            v_base_64_decode( der, parse_state->signing_key_64, 187 );
+            wc_ShaUpdate( &parse_state->tmp_sha, der, 140 );
+            wc_ShaFinal( &parse_state->tmp_sha, identity_digest );
 
-            if ( signing_key_64_length == 187 )
+            for ( j = 0; j < fetch_state->num_relays; j++ )
             {
-              v_base_64_decode( der, signing_key_64, 187 );
-              wc_ShaUpdate( &tmp_sha, der, 140 );
-              wc_ShaFinal( &tmp_sha, identity_digest );
-
-              for ( j = 0; j < fetch_state->num_relays; j++ )
+              if ( memcmp( identity_digest, fetch_state->relays[j]->identity, ID_LENGTH ) == 0 )
               {
-                if ( memcmp( identity_digest, fetch_state->relays[j]->identity, ID_LENGTH ) == 0 )
-                {
-                  matched_relay = j;
-                  break;
-                }
+                parse_state->matched_relay = j;
+                break;
               }
-              signing_key_found = -1;
             }
-          }
-          else if ( rx_buffer[i] == signing_key[signing_key_found] )
-          {
-            signing_key_found++;
-          }
-          else
-          {
-            signing_key_found = 0;
+            parse_state->signing_key_found = -1;
           }
         }
-
-        if ( master_key_found == -1 && ntor_onion_key_found == -1 && signing_key_found == -1 )
+        else if ( buf[i] == descriptor_signing_key[parse_state->signing_key_found] )
         {
-          v_base_64_decode( fetch_state->relays[matched_relay]->ntor_onion_key, ntor_onion_key_64, 43 );
-          v_base_64_decode( fetch_state->relays[matched_relay]->master_key, master_key_64, 43 );
-
-          relays_set++;
-          master_key_64_length = 0;
-          master_key_found = 0;
-          ntor_onion_key_64_length = 0;
-          ntor_onion_key_found = 0;
-          signing_key_64_length = 0;
-          signing_key_found = 0;
+          parse_state->signing_key_found++;
         }
+        else
+        {
+          parse_state->signing_key_found = 0;
+        }
+      }
+
+      if ( parse_state->master_key_found == -1 && parse_state->ntor_onion_key_found == -1 && parse_state->signing_key_found == -1 )
+      {
+        v_base_64_decode( fetch_state->relays[parse_state->matched_relay]->ntor_onion_key, parse_state->ntor_onion_key_64, 43 );
+        v_base_64_decode( fetch_state->relays[parse_state->matched_relay]->master_key, parse_state->master_key_64, 43 );
+
+        parse_state->relays_set++;
+        parse_state->master_key_64_length = 0;
+        parse_state->master_key_found = 0;
+        parse_state->ntor_onion_key_64_length = 0;
+        parse_state->ntor_onion_key_found = 0;
+        parse_state->signing_key_64_length = 0;
+        parse_state->signing_key_found = 0;
       }
     }
   }
 
+  return i;
+}
+
+static int d_finish_descriptor_fetch( FetchDescriptorState* fetch_state )
+{
+  int ret = 0;
+  int rx_length = 0;
+  int rx_total = 0;
+  char rx_buffer[512];
+  uint64_t end;
+  int64_t parse_start;
+  DescriptorParseState parse_state;
+
+  v_init_descriptor_parse( &parse_state );
+
+  // keep reading forever, we will break inside when the transfer is over
+  while ( parse_state.relays_set < fetch_state->num_relays )
+  {
+    // recv data from the destination and fill the rx_buffer with the data
+    rx_length = recv( fetch_state->sock_fd, rx_buffer, sizeof( rx_buffer ), 0 );
+
+    // if we got less than 0 we encoutered an error
+    if ( rx_length < 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "couldn't recv http server in d_finish_descriptor_fetch" );
+
+      ret = -1;
+      goto finish;
+    // we got 0 bytes back then the connection closed and we're done getting
+    // consensus data
+    }
+    else if ( rx_length == 0 )
+    {
+      break;
+    }
+
+    rx_total += rx_length;
+
+    parse_start = MINITOR_GET_TIME();
+
+    d_parse_descriptor_chunk( &parse_state, fetch_state, rx_buffer, rx_length );
+
+    v_add_consensus_stage( &consensus_timings.descriptor_parse, 0, rx_length, MINITOR_GET_TIME() - parse_start );
+  }
+
 finish:
-  wc_ShaFree( &tmp_sha );
+  wc_ShaFree( &parse_state.tmp_sha );
 
   shutdown( fetch_state->sock_fd, 0 );
   close( fetch_state->sock_fd );
 
   end = MINITOR_GET_TIME();
 
+  v_add_consensus_stage( &consensus_timings.fetch, parse_state.relays_set, rx_total, end - fetch_state->start );
+  v_add_consensus_stage( &consensus_timings.descriptor_parse, parse_state.relays_set, 0, 0 );
+
   // MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( fastest_cache_mutex );
 
@@ -991,6 +1118,128 @@ static int d_parse_line_to_relay( OnionRelay* relay, char* line )
   return 0;
 }
 
+// appends a chunk of consensus to store_path and parses the lines in it, returns
+// -1 if the chunk couldn't be stored
+static int d_parse_consensus_chunk( ConsensusParseState* parse_state, char* buf, int length )
+{
+  int i;
+  int fd;
+  int err;
+  int64_t stage_start;
+  int64_t handler_us = 0;
+
+  stage_start = MINITOR_GET_TIME();
+
+  if ( ( fd = open( parse_state->store_path, O_WRONLY | O_APPEND ) ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", parse_state->store_path, errno );
+
+    return -1;
+  }
+
+  err = write( fd, buf, length );
+
+  close( fd );
+
+  if ( err != length )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to write %s, errno: %d", parse_state->store_path, errno );
+
+    return -1;
+  }
+
+  v_add_consensus_stage( &consensus_timings.store, 0, length, MINITOR_GET_TIME() - stage_start );
+
+  stage_start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < length; i++ )
+  {
+    if ( buf[i] != '\n' )
+    {
+      parse_state->line[parse_state->line_length] = buf[i];
+      parse_state->line_length++;
+
+      // wrap around, we actually don't care about lines that are too long
+      if ( parse_state->line_length >= sizeof( parse_state->line ) )
+      {
+        parse_state->line_length = 0;
+      }
+    }
+    else
+    {
+      // NULL terminator
+      parse_state->line[parse_state->line_length] = 0;
+
+      if ( parse_state->finished_consensus == 0 && d_parse_line_to_consensus( parse_state->consensus, parse_state->line ) == 1 )
+      {
+        parse_state->finished_consensus = 1;
+
+        parse_state->consensus->time_period = d_get_hs_time_period( parse_state->consensus->fresh_until, parse_state->consensus->valid_after, parse_state->consensus->hsdir_interval );
+
+        if ( parse_state->on_header != NULL )
+        {
+          parse_state->on_header( parse_state );
+        }
+      }
+      // 1 means the relay is ready to have its descriptors fetched
+      else if ( parse_state->finished_consensus == 1 && d_parse_line_to_relay( &parse_state->parse_relay, parse_state->line ) == 1 )
+      {
+        consensus_timings.parse.items++;
+
+        if ( parse_state->parse_relay.hsdir == 1 )
+        {
+          handler_us -= MINITOR_GET_TIME();
+          parse_state->on_hsdir_relay( parse_state );
+          handler_us += MINITOR_GET_TIME();
+        }
+
+        memset( &parse_state->parse_relay, 0, sizeof( OnionRelay ) );
+      }
+
+      parse_state->line_length = 0;
+    }
+  }
+
+  v_add_consensus_stage( &consensus_timings.parse, 0, length, MINITOR_GET_TIME() - stage_start - handler_us );
+
+  return 0;
+}
+
+// the fetch and insert tasks of a download, started once the header is parsed
+typedef struct DownloadTasks
+{
+  MinitorTask fetch_handles[2];
+  MinitorTask crypto_insert_handle;
+  int found_hsdir;
+} DownloadTasks;
+
+static void v_start_download_tasks( ConsensusParseState* parse_state )
+{
+  DownloadTasks* tasks = parse_state->handler_data;
+
+  // sizeof pointer, not the actual struct
+  insert_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( OnionRelay* ) );
+  fetch_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( OnionRelay* ) );
+
+  // create two v_handle_relay_fetch to increase throughput
+  b_create_fetch_task( &tasks->fetch_handles[0], parse_state->consensus );
+  b_create_fetch_task( &tasks->fetch_handles[1], parse_state->consensus );
+
+  b_create_insert_task( &tasks->crypto_insert_handle, parse_state->consensus );
+}
+
+static void v_queue_hsdir_fetch( ConsensusParseState* parse_state )
+{
+  OnionRelay* tmp_relay;
+  DownloadTasks* tasks = parse_state->handler_data;
+
+  tasks->found_hsdir++;
+  tmp_relay = malloc( sizeof( OnionRelay ) );
+  memcpy( tmp_relay, &parse_state->parse_relay, sizeof( OnionRelay ) );
+
+  MINITOR_ENQUEUE_BLOCKING( fetch_relays_queue, (void*)(&tmp_relay) );
+}
+
 static int d_download_consensus()
 {
   int ret = 0;
@@ -1001,8 +1250,6 @@ static int d_download_consensus()
   char REQUEST[120];
   char ip_addr_str[16];
   char date_str[20];
-  char line[200];
-  int line_length = 0;
   char* authority_string;
   int i;
   char* rx_buffer;
@@ -1017,14 +1264,13 @@ static int d_download_consensus()
   int valid_until_found = 0;
   time_t now;
   time_t valid_until_time;
-  OnionRelay parse_relay;
   OnionRelay* tmp_relay;
-  int finished_consensus = 0;
   NetworkConsensus* consensus;
-  int found_hsdir = 0;
   bool insert_finished = false;
-  MinitorTask fetch_handles[2];
-  MinitorTask crypto_insert_handle;
+  ConsensusParseState parse_state;
+  DownloadTasks tasks;
+  int64_t download_start;
+  int64_t stage_start;
 
 #ifndef MINITOR_CHUTNEY
   // check if our current consensus is still fresh, no need to re-download
@@ -1131,6 +1377,9 @@ static int d_download_consensus()
   close( fd );
 #endif
 
+  memset( &consensus_timings, 0, sizeof( ConsensusTimings ) );
+  download_start = MINITOR_GET_TIME();
+
   if ( d_reset_staging_hsdir_relays() < 0 )
   {
     return -1;
@@ -1208,8 +1457,6 @@ static int d_download_consensus()
 
   close( fd );
 
-  memset( &parse_relay, 0, sizeof( OnionRelay ) );
-
   consensus = malloc( sizeof( NetworkConsensus ) );
   rx_buffer = malloc( sizeof( char ) * 4092 );
 
@@ -1227,8 +1474,19 @@ static int d_download_consensus()
   consensus->hsdir_n_replicas = HSDIR_N_REPLICAS_DEFAULT;
   consensus->hsdir_spread_store = HSDIR_SPREAD_STORE_DEFAULT;
 
+  memset( &tasks, 0, sizeof( DownloadTasks ) );
+  memset( &parse_state, 0, sizeof( ConsensusParseState ) );
+
+  parse_state.consensus = consensus;
+  parse_state.store_path = FILESYSTEM_PREFIX "consensus";
+  parse_state.on_header = v_start_download_tasks;
+  parse_state.on_hsdir_relay = v_queue_hsdir_fetch;
+  parse_state.handler_data = &tasks;
+
   while ( 1 )
   {
+    stage_start = MINITOR_GET_TIME();
+
     // recv data from the destination and fill the rx_buffer with the data
     rx_length = recv( sock_fd, rx_buffer, 4092, 0 );
 
@@ -1244,7 +1502,7 @@ static int d_download_consensus()
     }
     else if ( rx_length == 0 )
     {
-      if ( finished_consensus == 0 )
+      if ( parse_state.finished_consensus == 0 )
       {
         MINITOR_LOG( MINITOR_TAG, "couldn't recv a consensus, got 0 bytes before end" );
 
@@ -1255,6 +1513,8 @@ static int d_download_consensus()
       break;
     }
 
+    v_add_consensus_stage( &consensus_timings.download, 0, rx_length, MINITOR_GET_TIME() - stage_start );
+
     i = 0;
 
     if ( end_header < 4 )
@@ -1280,88 +1540,17 @@ static int d_download_consensus()
       }
     }
 
-    if ( end_header >= 4 )
+    // i is after the header or 0 if the header was already passed
+    if ( end_header >= 4 && d_parse_consensus_chunk( &parse_state, rx_buffer + i, rx_length - i ) < 0 )
     {
-      // first write chunck to consensus to file
-      do
-      {
-        if ( ( fd = open( FILESYSTEM_PREFIX "consensus", O_WRONLY | O_APPEND ) ) < 0 )
-        {
-          MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "consensus, errno: %d", errno );
-
-          continue;
-        }
-
-        err = write( fd, rx_buffer + i, ( rx_length - i ) );
-
-        if ( err != ( rx_length - i ) ) {
-          MINITOR_LOG( MINITOR_TAG, "Failed to write " FILESYSTEM_PREFIX "consensus, errno: %d", errno );
-
-          close( fd );
-        }
-      } while ( err != ( rx_length - i ) );
-
-      close( fd );
-
-      // then parse out the relays line by line and send them off for processing
-      // i is already set to be after the header or 0 if the header was passed
-      for ( ; i < rx_length; i++ )
-      {
-        if ( rx_buffer[i] != '\n' )
-        {
-          line[line_length] = rx_buffer[i];
-          line_length++;
-
-          // wrap around, we actually don't care about lines that are too long
-          if ( line_length >= sizeof( line ) )
-          {
-            line_length = 0;
-          }
-        }
-        else
-        {
-          // NULL terminator
-          line[line_length] = 0;
-
-          if ( finished_consensus == 0 && d_parse_line_to_consensus( consensus, line ) == 1 )
-          {
-            finished_consensus = 1;
-
-            consensus->time_period = d_get_hs_time_period( consensus->fresh_until, consensus->valid_after, consensus->hsdir_interval );
-
-            // sizeof pointer, not the actual struct
-            insert_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( OnionRelay* ) );
-            fetch_relays_queue = MINITOR_QUEUE_CREATE( 9, sizeof( OnionRelay* ) );
-
-            // create two v_handle_relay_fetch to increase throughput
-            b_create_fetch_task( &fetch_handles[0], consensus );
-            b_create_fetch_task( &fetch_handles[1], consensus );
-
-            b_create_insert_task( &crypto_insert_handle, consensus );
-          }
-          // 1 means the relay is ready to have its descriptors fetched
-          else if ( finished_consensus == 1 && d_parse_line_to_relay( &parse_relay, line ) == 1 )
-          {
-            if ( parse_relay.hsdir == 1 )
-            {
-              found_hsdir++;
-              tmp_relay = malloc( sizeof( OnionRelay ) );
-              memcpy( tmp_relay, &parse_relay, sizeof( OnionRelay ) );
-              MINITOR_ENQUEUE_BLOCKING( fetch_relays_queue, (void*)(&tmp_relay) );
-            }
-
-            memset( &parse_relay, 0, sizeof( OnionRelay ) );
-          }
-
-          line_length = 0;
-        }
-      }
+      ret = -1;
+      goto finish;
     }
 
     rx_total += rx_length;
   }
 
-  MINITOR_LOG( MINITOR_TAG, "Found %d hsdir relays in the consensus", found_hsdir );
+  MINITOR_LOG( MINITOR_TAG, "Found %d hsdir relays in the consensus", tasks.found_hsdir );
 
   // send two nulls, each fetch task will forward it to the insert task which
   // will wait for 2 before quitting
@@ -1413,14 +1602,18 @@ static int d_download_consensus()
   MINITOR_MUTEX_GIVE( network_consensus_mutex );
   // END mutex for the network consensus
 
+  consensus_timings.wall_us = MINITOR_GET_TIME() - download_start;
+
+  v_log_consensus_timings( &consensus_timings );
+
 finish:
-  if ( finished_consensus == 1 )
+  if ( parse_state.finished_consensus == 1 )
   {
     if ( insert_finished == false )
     {
-      MINITOR_TASK_DELETE( fetch_handles[0] );
-      MINITOR_TASK_DELETE( fetch_handles[1] );
-      MINITOR_TASK_DELETE( crypto_insert_handle );
+      MINITOR_TASK_DELETE( tasks.fetch_handles[0] );
+      MINITOR_TASK_DELETE( tasks.fetch_handles[1] );
+      MINITOR_TASK_DELETE( tasks.crypto_insert_handle );
     }
 
     vQueueDelete( fetch_relays_queue );
@@ -1557,3 +1750,256 @@ finish:
   // return 0 for no errors
   return ret;
 }
+
+#ifdef MINITOR_BENCHMARK
+// the recorded descriptors, a read can end partway through a descriptor so
+// what's left is kept for the next batch
+typedef struct ReplayDescriptors
+{
+  int fd;
+  char buffer[512];
+  int offset;
+  int length;
+  // hsdir relays waiting for a full batch
+  FetchDescriptorState fetch_state;
+  int missing;
+} ReplayDescriptors;
+
+// the file stands in for d_finish_descriptor_fetch's socket, returns how many
+// relays got their keys before the recording ran out
+static int d_replay_descriptor_fetch( ReplayDescriptors* descriptors, FetchDescriptorState* fetch_state )
+{
+  int used;
+  int64_t stage_start;
+  DescriptorParseState parse_state;
+
+  v_init_descriptor_parse( &parse_state );
+
+  // the recording holds bare descriptors, there is no http header to skip
+  parse_state.end_header = 4;
+
+  while ( parse_state.relays_set < fetch_state->num_relays )
+  {
+    if ( descriptors->offset >= descriptors->length )
+    {
+      stage_start = MINITOR_GET_TIME();
+
+      descriptors->length = read( descriptors->fd, descriptors->buffer, sizeof( descriptors->buffer ) );
+      descriptors->offset = 0;
+
+      if ( descriptors->length <= 0 )
+      {
+        descriptors->length = 0;
+
+        break;
+      }
+
+      v_add_consensus_stage( &consensus_timings.fetch, 0, descriptors->length, MINITOR_GET_TIME() - stage_start );
+    }
+
+    stage_start = MINITOR_GET_TIME();
+
+    used = d_parse_descriptor_chunk( &parse_state, fetch_state, descriptors->buffer + descriptors->offset, descriptors->length - descriptors->offset );
+
+    v_add_consensus_stage( &consensus_timings.descriptor_parse, 0, used, MINITOR_GET_TIME() - stage_start );
+
+    descriptors->offset += used;
+  }
+
+  wc_ShaFree( &parse_state.tmp_sha );
+
+  consensus_timings.fetch.items += parse_state.relays_set;
+  consensus_timings.descriptor_parse.items += parse_state.relays_set;
+
+  return parse_state.relays_set;
+}
+
+// does what the fetch and insert tasks do with a batch of hsdir relays, in
+// line so each stage is timed on its own
+static int d_replay_relay_batch( NetworkConsensus* consensus, ReplayDescriptors* descriptors, FetchDescriptorState* fetch_state )
+{
+  int i;
+  int missing;
+
+  missing = fetch_state->num_relays - d_replay_descriptor_fetch( descriptors, fetch_state );
+
+  for ( i = 0; i < fetch_state->num_relays; i++ )
+  {
+    v_crypto_and_insert_relay( consensus, fetch_state->relays[i] );
+
+    free( fetch_state->relays[i] );
+  }
+
+  memset( fetch_state, 0, sizeof( FetchDescriptorState ) );
+
+  return missing;
+}
+
+static void v_replay_hsdir_relay( ConsensusParseState* parse_state )
+{
+  ReplayDescriptors* descriptors = parse_state->handler_data;
+  FetchDescriptorState* fetch_state = &descriptors->fetch_state;
+
+  fetch_state->relays[fetch_state->num_relays] = malloc( sizeof( OnionRelay ) );
+  memcpy( fetch_state->relays[fetch_state->num_relays], &parse_state->parse_relay, sizeof( OnionRelay ) );
+  fetch_state->num_relays++;
+
+  if ( fetch_state->num_relays == 3 )
+  {
+    descriptors->missing += d_replay_relay_batch( parse_state->consensus, descriptors, fetch_state );
+  }
+}
+
+// runs a recorded consensus and the recorded descriptors of its hsdir relays
+// through the same parsing, sd card and sha3 work as d_download_consensus with
+// the files standing in for the directory servers, the results go to the
+// staging lists which the next download resets, the live lists aren't touched
+int d_replay_consensus( const char* consensus_path, const char* descriptors_path )
+{
+  int ret = 0;
+  int i;
+  int fd;
+  int consensus_fd;
+  int rx_length;
+  char* rx_buffer = NULL;
+  int64_t replay_start;
+  int64_t stage_start;
+  NetworkConsensus* consensus = NULL;
+  ConsensusParseState parse_state;
+  ReplayDescriptors* descriptors = NULL;
+
+  consensus_fd = open( consensus_path, O_RDONLY );
+
+  if ( consensus_fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", consensus_path, errno );
+
+    return -1;
+  }
+
+  memset( &parse_state, 0, sizeof( ConsensusParseState ) );
+
+  descriptors = malloc( sizeof( ReplayDescriptors ) );
+  memset( descriptors, 0, sizeof( ReplayDescriptors ) );
+
+  descriptors->fd = open( descriptors_path, O_RDONLY );
+
+  if ( descriptors->fd < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open %s, errno: %d", descriptors_path, errno );
+
+    ret = -1;
+    goto finish;
+  }
+
+  if (
+    d_reset_staging_hsdir_relays() < 0 ||
+    d_reset_staging_cache_relays() < 0 ||
+    d_reset_staging_fast_relays() < 0
+  )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  if ( ( fd = open( FILESYSTEM_PREFIX "consensus_replay", O_CREAT | O_TRUNC ) ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to open " FILESYSTEM_PREFIX "consensus_replay, errno: %d", errno );
+
+    ret = -1;
+    goto finish;
+  }
+
+  close( fd );
+
+  memset( &consensus_timings, 0, sizeof( ConsensusTimings ) );
+
+  consensus = malloc( sizeof( NetworkConsensus ) );
+  memset( consensus, 0, sizeof( NetworkConsensus ) );
+  rx_buffer = malloc( sizeof( char ) * 4092 );
+
+#ifdef MINITOR_CHUTNEY
+  consensus->hsdir_interval = 8;
+#else
+  consensus->hsdir_interval = HSDIR_INTERVAL_DEFAULT;
+#endif
+
+  consensus->hsdir_n_replicas = HSDIR_N_REPLICAS_DEFAULT;
+  consensus->hsdir_spread_store = HSDIR_SPREAD_STORE_DEFAULT;
+
+  parse_state.consensus = consensus;
+  parse_state.store_path = FILESYSTEM_PREFIX "consensus_replay";
+  parse_state.on_hsdir_relay = v_replay_hsdir_relay;
+  parse_state.handler_data = descriptors;
+
+  replay_start = MINITOR_GET_TIME();
+
+  while ( 1 )
+  {
+    stage_start = MINITOR_GET_TIME();
+
+    rx_length = read( consensus_fd, rx_buffer, 4092 );
+
+    if ( rx_length < 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Failed to read %s, errno: %d", consensus_path, errno );
+
+      ret = -1;
+      goto finish;
+    }
+    else if ( rx_length == 0 )
+    {
+      break;
+    }
+
+    v_add_consensus_stage( &consensus_timings.download, 0, rx_length, MINITOR_GET_TIME() - stage_start );
+
+    if ( d_parse_consensus_chunk( &parse_state, rx_buffer, rx_length ) < 0 )
+    {
+      ret = -1;
+      goto finish;
+    }
+  }
+
+  if ( descriptors->fetch_state.num_relays > 0 )
+  {
+    descriptors->missing += d_replay_relay_batch( consensus, descriptors, &descriptors->fetch_state );
+  }
+
+  consensus_timings.wall_us = MINITOR_GET_TIME() - replay_start;
+
+  if ( parse_state.finished_consensus == 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "%s doesn't hold a consensus", consensus_path );
+
+    ret = -1;
+  }
+
+  if ( descriptors->missing > 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "%d relays had no descriptor in %s", descriptors->missing, descriptors_path );
+  }
+
+  v_log_consensus_timings( &consensus_timings );
+
+finish:
+  for ( i = 0; i < descriptors->fetch_state.num_relays; i++ )
+  {
+    free( descriptors->fetch_state.relays[i] );
+  }
+
+  if ( descriptors->fd >= 0 )
+  {
+    close( descriptors->fd );
+  }
+
+  close( consensus_fd );
+  unlink( FILESYSTEM_PREFIX "consensus_replay" );
+
+  free( descriptors );
+  free( consensus );
+  free( rx_buffer );
+
+  return ret;
+}
+#endif
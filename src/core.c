@@ -28,6 +28,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../h/circuit.h"
 #include "../h/onion_service.h"
 #include "../h/connections.h"
+#include "../h/crypto_pool.h"
+#include "../h/trace.h"
+#include "../h/stats.h"
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CORE
 
 static const char* CORE_TAG = "MINITOR DAEMON";
 
@@ -35,9 +40,40 @@ MinitorTimer keepalive_timer;
 MinitorTimer timeout_timer;
 OnionCircuit* onion_circuits = NULL;
 OnionService* onion_services = NULL;
-MinitorQueue core_task_queue;
+// circuits live on one list but each belongs to the shard its circ_id hashes
+// to, only that shard's task builds, tears down or times them out. the one
+// exception is the first shard claiming a standby circuit for a rendezvous,
+// which it only does with the circuit's connection locked
+CoreShard core_shards[MINITOR_CORE_SHARDS];
 MinitorMutex circuits_mutex;
 
+// link cells have circ_id 0 so they land on the first shard
+int d_core_shard_for_circ_id( uint32_t circ_id )
+{
+  return circ_id % MINITOR_CORE_SHARDS;
+}
+
+static bool b_shard_owns_circuit( OnionCircuit* circuit, int shard )
+{
+  return d_core_shard_for_circ_id( circuit->circ_id ) == shard;
+}
+
+// circuits that carry service state stay on the first shard, rendezvous and
+// standby circuits carry the stream traffic and are spread round robin
+static int d_next_circuit_shard( CircuitStatus target_status )
+{
+  static int next_shard = 0;
+
+  if ( target_status != CIRCUIT_STANDBY && target_status != CIRCUIT_RENDEZVOUS )
+  {
+    return 0;
+  }
+
+  next_shard = ( next_shard + 1 ) % MINITOR_CORE_SHARDS;
+
+  return next_shard;
+}
+
 void v_send_init_circuit( int length, CircuitStatus target_status, OnionService* service, int desc_index, int target_relay_index, OnionRelay* start_relay, OnionRelay* end_relay, HsCrypto* hs_crypto )
 {
   OnionMessage* onion_message;
@@ -55,7 +91,7 @@ void v_send_init_circuit( int length, CircuitStatus target_status, OnionService*
   ((CreateCircuitRequest*)onion_message->data)->end_relay = end_relay;
   ((CreateCircuitRequest*)onion_message->data)->hs_crypto = hs_crypto;
 
-  MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+  v_core_enqueue_blocking( onion_message );
 }
 
 void v_set_hsdir_timer( MinitorTimer hsdir_timer )
@@ -135,6 +171,10 @@ static void v_send_init_circuit_intro( OnionService* service )
   {
     ((CreateCircuitRequest*)onion_message->data)->end_relay = px_get_random_fast_relay( 0, NULL, NULL, NULL );
 
+    // other shards may be changing the list
+    // MUTEX TAKE
+    MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
     circuit = onion_circuits;
 
     while ( circuit != NULL )
@@ -152,9 +192,12 @@ static void v_send_init_circuit_intro( OnionService* service )
 
       circuit = circuit->next;
     }
+
+    MINITOR_MUTEX_GIVE( circuits_mutex );
+    // MUTEX GIVE
   } while ( ((CreateCircuitRequest*)onion_message->data)->end_relay == NULL );
 
-  MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+  v_core_enqueue_blocking( onion_message );
 }
 
 static int d_send_circuit_create( OnionCircuit* circuit, DlConnection* or_connection )
@@ -267,69 +310,229 @@ circuit_destroy:
   free( circuit );
 }
 
-static void v_handle_tor_cell( uint32_t conn_id )
+static void v_update_want_action( OnionCircuit* circuit )
 {
-  int succ;
-  int recv_index;
-  Cell* cell;
-  DlConnection* or_connection;
-  OnionCircuit* working_circuit;
-  OnionCircuit* tmp_circuit;
-  OnionService* working_service;
-  OnionMessage* onion_message;
-  OnionRelay* target_relay;
-  OnionRelay* start_relay;
-  DoublyLinkedOnionRelay* dl_relay;
-  MinitorMutex access_mutex = NULL;
-
-  // MUTEX TAKE
-  or_connection = px_get_conn_by_id_and_lock( conn_id );
+  if (
+    circuit->status != CIRCUIT_INTRO_LIVE &&
+    circuit->status != CIRCUIT_RENDEZVOUS &&
+    circuit->status != CIRCUIT_STANDBY
+  )
+  {
+    // update the timeout struct to have current step
+    circuit->want_action = true;
+  }
+  else
+  {
+    circuit->want_action = false;
+  }
+}
 
-  if ( or_connection == NULL )
+// the rest of a CREATED2 or EXTENDED2 once its ntor handshake is done, called
+// with the access mutex held, returns true if it is still held
+static bool b_continue_circuit_build( OnionCircuit* circuit, DlConnection* or_connection, CryptoJob* job )
+{
+  if ( d_router_ntor_job_finish( circuit, job ) < 0 )
   {
-    return;
+    MINITOR_LOG( CORE_TAG, "failed to process created or extended" );
+
+    goto circuit_rebuild;
   }
 
-  access_mutex = connection_access_mutex[or_connection->mutex_index];
+  circuit->relay_list.built_length++;
 
-  cell = or_connection->cell_ring_buf[or_connection->cell_ring_start];
+  if ( circuit->relay_list.built_length < circuit->relay_list.length )
+  {
+    if ( d_router_extend2( circuit, or_connection, circuit->relay_list.built_length ) < 0 )
+    {
+      goto circuit_rebuild;
+    }
 
-  or_connection->cell_ring_buf[or_connection->cell_ring_start] = NULL;
+    circuit->status = CIRCUIT_EXTENDED;
+  }
+  else if ( circuit->status == CIRCUIT_CREATED )
+  {
+    circuit->status = circuit->target_status;
+  }
+  else if ( circuit->target_status == CIRCUIT_HSDIR_BEGIN_DIR )
+  {
+    if ( d_begin_hsdir( circuit, or_connection ) < 0 )
+    {
+      goto circuit_rebuild;
+    }
 
-  or_connection->cell_ring_start = ( or_connection->cell_ring_start + 1 ) % 20;
+    circuit->status = CIRCUIT_HSDIR_CONNECTED;
+  }
+  else if ( circuit->target_status == CIRCUIT_ESTABLISH_INTRO )
+  {
+    if ( d_router_establish_intro( circuit, or_connection ) < 0 )
+    {
+      goto circuit_rebuild;
+    }
 
-  if ( cell == NULL )
+    circuit->status = CIRCUIT_INTRO_ESTABLISHED;
+  }
+  else if ( circuit->target_status == CIRCUIT_RENDEZVOUS )
   {
-    MINITOR_MUTEX_GIVE( access_mutex );
-    // MUTEX GIVE
+    if ( d_router_join_rendezvous( circuit, or_connection, circuit->hs_crypto->rendezvous_cookie, circuit->hs_crypto->point, circuit->hs_crypto->auth_input_mac ) < 0 )
+    {
+      MINITOR_LOG( CORE_TAG, "Failed to join rend" );
 
-    return;
+      goto circuit_rebuild;
+    }
+
+    v_stats_record_latency( LATENCY_RENDEZVOUS, MINITOR_GET_TIME() - circuit->hs_crypto->introduce_us );
+
+    circuit->status = CIRCUIT_RENDEZVOUS;
+  }
+
+  time( &(circuit->last_action) );
+
+  v_update_want_action( circuit );
+
+  return true;
+
+circuit_rebuild:
+  // this will give the mutex
+  v_circuit_rebuild_or_destroy( circuit, or_connection );
+  // MUTEX GIVE
+
+  return false;
+}
+
+// hands the ntor handshake to a crypto worker, if none can take it the
+// handshake runs here and the build carries on, returns true if the access
+// mutex is still held
+static bool b_start_ntor_job( OnionCircuit* circuit, DlConnection* or_connection, CryptoJob* job )
+{
+  bool held;
+
+  circuit->crypto_pending = true;
+
+  if ( b_submit_crypto_job( job ) == true )
+  {
+    return true;
   }
 
+  circuit->crypto_pending = false;
+
+  v_run_crypto_job( job );
+
+  held = b_continue_circuit_build( circuit, or_connection, job );
+
+  v_free_crypto_job( job );
+
+  return held;
+}
+
+static void v_handle_crypto_result( CryptoJob* job )
+{
+  OnionCircuit* circuit;
+  DlConnection* or_connection;
+
   // MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
 
-  working_circuit = px_get_circuit_by_circ_id( onion_circuits, ntohl( cell->circ_id ) );
+  circuit = px_get_circuit_by_circ_id( onion_circuits, job->circ_id );
 
   MINITOR_MUTEX_GIVE( circuits_mutex );
   // MUTEX GIVE
 
-  if ( working_circuit == NULL )
+  // the circuit was torn down while the job was with a worker
+  if (
+    circuit != job->circuit ||
+    ( job->type == CRYPTO_JOB_INTRODUCE_2 && circuit->intro_jobs_pending == 0 ) ||
+    ( job->type != CRYPTO_JOB_INTRODUCE_2 && circuit->crypto_pending == false )
+  )
   {
-    MINITOR_LOG( CORE_TAG, "Discarding circuitless cell %d", cell->circ_id );
+    v_free_crypto_job( job );
 
-    MINITOR_MUTEX_GIVE( access_mutex );
+    return;
+  }
+
+  if ( job->type == CRYPTO_JOB_INTRODUCE_2 )
+  {
+    circuit->intro_jobs_pending--;
+
+    if ( d_onion_service_finish_introduce_2( circuit, job ) < 0 )
+    {
+      MINITOR_LOG( CORE_TAG, "Failed to handle RELAY_COMMAND_INTRODUCE2 cell" );
+    }
+  }
+  else
+  {
+    circuit->crypto_pending = false;
+
+    // MUTEX TAKE
+    or_connection = px_get_conn_by_id_and_lock( circuit->conn_id );
+
+    // if the connection is gone its CONN_CLOSE will rebuild the circuit
+    if ( or_connection != NULL && b_continue_circuit_build( circuit, or_connection, job ) == true )
+    {
+      MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+      // MUTEX GIVE
+    }
+  }
+
+  v_free_crypto_job( job );
+}
+
+// called with the access mutex held, returns true if it is still held. the
+// circuit for the last cell is kept in cached_circuit, it is only valid for
+// as long as the access mutex stays held
+static bool b_handle_tor_cell( DlConnection* or_connection, Cell* cell, OnionCircuit** cached_circuit )
+{
+  int succ;
+  OnionCircuit* working_circuit;
+  OnionCircuit* tmp_circuit;
+  OnionService* working_service;
+  OnionMessage* onion_message;
+  OnionRelay* target_relay;
+  OnionRelay* start_relay;
+  DoublyLinkedOnionRelay* dl_relay;
+  CryptoJob* crypto_job;
+  MinitorMutex access_mutex = NULL;
+
+  access_mutex = or_connection->access_mutex;
+
+  // a burst of cells is usually all for the same circuit
+  if ( *cached_circuit != NULL && (*cached_circuit)->circ_id == ud_get_cell_circ_id( cell ) )
+  {
+    working_circuit = *cached_circuit;
+  }
+  else
+  {
+    // MUTEX TAKE
+    MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+    working_circuit = px_get_circuit_by_circ_id( onion_circuits, ud_get_cell_circ_id( cell ) );
+
+    MINITOR_MUTEX_GIVE( circuits_mutex );
     // MUTEX GIVE
 
+    *cached_circuit = working_circuit;
+  }
+
+  if ( working_circuit == NULL )
+  {
+    MINITOR_TRACE( TRACE_CELL_DISCARDED, ud_get_cell_circ_id( cell ), cell->command );
+    MINITOR_STAT_INC( STAT_CELLS_RECEIVED );
+    MINITOR_STAT_INC( STAT_CELLS_DISCARDED );
+    MINITOR_LOG_DEBUG( CORE_TAG, "Discarding circuitless cell %d", ud_get_cell_circ_id( cell ) );
+
     free( cell );
 
-    return;
+    return true;
   }
 
+  MINITOR_TRACE( TRACE_CELL_RECEIVED, working_circuit->circ_id, cell->command );
+  MINITOR_STAT_INC( STAT_CELLS_RECEIVED );
+
   time( &(working_circuit->last_action) );
 
   if ( cell->command == RELAY )
   {
+    MINITOR_STAT_INC( STAT_RELAY_CELLS_RECEIVED );
+
     if ( working_circuit->status == CIRCUIT_RENDEZVOUS )
     {
       succ = d_decrypt_cell( cell, CIRCID_LEN, &working_circuit->relay_list, working_circuit->hs_crypto );
@@ -341,63 +544,49 @@ static void v_handle_tor_cell( uint32_t conn_id )
 
     if ( succ < 0 )
     {
+      MINITOR_TRACE( TRACE_CELL_UNRECOGNIZED, working_circuit->circ_id, 0 );
+      MINITOR_STAT_INC( STAT_CELLS_UNRECOGNIZED );
       MINITOR_LOG( CORE_TAG, "Failed to decrypt packed cell, discarding" );
 
-      MINITOR_MUTEX_GIVE( access_mutex );
-      // MUTEX GIVE
-
       free( cell );
 
-      return;
+      return true;
     }
   }
 
-  // after decryption we need to change from network byte order to our byte order
-  v_hostize_cell( cell );
-
   // discard padding cell
   if ( cell->command == PADDING )
   {
-    MINITOR_MUTEX_GIVE( access_mutex );
-    // MUTEX GIVE
-
     free( cell );
 
-    return;
+    return true;
   }
 
   switch ( working_circuit->status )
   {
     case CIRCUIT_CREATED:
-      if ( cell->command != CREATED2 )
-      {
-        goto circuit_rebuild;
-      }
-
-      if ( d_router_created2( working_circuit, cell ) < 0 )
+      if ( cell->command != CREATED2 || working_circuit->crypto_pending == true )
       {
         goto circuit_rebuild;
       }
 
-      working_circuit->relay_list.built_length++;
+      v_stats_record_latency( LATENCY_HOP_HANDSHAKE, MINITOR_GET_TIME() - working_circuit->handshake_start_us );
 
-      if ( working_circuit->relay_list.built_length < working_circuit->relay_list.length )
-      {
-        if ( d_router_extend2( working_circuit, or_connection, working_circuit->relay_list.built_length ) < 0 )
-        {
-          goto circuit_rebuild;
-        }
+      crypto_job = px_router_ntor_job( working_circuit, 0, cell->payload.created2.handshake_data );
 
-        working_circuit->status = CIRCUIT_EXTENDED;
-      }
-      else
+      if ( b_start_ntor_job( working_circuit, or_connection, crypto_job ) == false )
       {
-        working_circuit->status = working_circuit->target_status;
+        access_mutex = NULL;
+        working_circuit = NULL;
       }
 
       break;
     case CIRCUIT_EXTENDED:
-      if ( cell->command != RELAY || cell->payload.relay.relay_command != RELAY_EXTENDED2 )
+      if (
+        cell->command != RELAY ||
+        cell->payload.relay.relay_command != RELAY_EXTENDED2 ||
+        working_circuit->crypto_pending == true
+      )
       {
         MINITOR_LOG( CORE_TAG, "failed to get extended" );
         MINITOR_LOG( CORE_TAG, "circ_id: %x", working_circuit->circ_id );
@@ -407,53 +596,14 @@ static void v_handle_tor_cell( uint32_t conn_id )
         goto circuit_rebuild;
       }
 
-      if ( d_router_extended2( working_circuit, working_circuit->relay_list.built_length, cell ) < 0 )
-      {
-        MINITOR_LOG( CORE_TAG, "failed to process extended" );
-
-        goto circuit_rebuild;
-      }
+      v_stats_record_latency( LATENCY_HOP_HANDSHAKE, MINITOR_GET_TIME() - working_circuit->handshake_start_us );
 
-      working_circuit->relay_list.built_length++;
+      crypto_job = px_router_ntor_job( working_circuit, working_circuit->relay_list.built_length, cell->payload.relay.extended2.handshake_data );
 
-      if ( working_circuit->relay_list.built_length < working_circuit->relay_list.length )
-      {
-        if ( d_router_extend2( working_circuit, or_connection, working_circuit->relay_list.built_length ) < 0 )
-        {
-          goto circuit_rebuild;
-        }
-      }
-      else
+      if ( b_start_ntor_job( working_circuit, or_connection, crypto_job ) == false )
       {
-        if ( working_circuit->target_status == CIRCUIT_HSDIR_BEGIN_DIR )
-        {
-          if ( d_begin_hsdir( working_circuit, or_connection ) < 0 )
-          {
-            goto circuit_rebuild;
-          }
-
-          working_circuit->status = CIRCUIT_HSDIR_CONNECTED;
-        }
-        else if ( working_circuit->target_status == CIRCUIT_ESTABLISH_INTRO )
-        {
-          if ( d_router_establish_intro( working_circuit, or_connection ) < 0 )
-          {
-            goto circuit_rebuild;
-          }
-
-          working_circuit->status = CIRCUIT_INTRO_ESTABLISHED;
-        }
-        else if ( working_circuit->target_status == CIRCUIT_RENDEZVOUS )
-        {
-          if ( d_router_join_rendezvous( working_circuit, or_connection, working_circuit->hs_crypto->rendezvous_cookie, working_circuit->hs_crypto->point, working_circuit->hs_crypto->auth_input_mac ) < 0 )
-          {
-            MINITOR_LOG( CORE_TAG, "Failed to join rend" );
-
-            goto circuit_rebuild;
-          }
-
-          working_circuit->status = CIRCUIT_RENDEZVOUS;
-        }
+        access_mutex = NULL;
+        working_circuit = NULL;
       }
 
       break;
@@ -663,9 +813,10 @@ static void v_handle_tor_cell( uint32_t conn_id )
     case CIRCUIT_INTRO_LIVE:
     case CIRCUIT_RENDEZVOUS:
       // pass the access mutex on so it can be given on a cleanup event
-      v_onion_service_handle_cell( working_circuit, or_connection, cell );
-
-      access_mutex = NULL;
+      if ( b_onion_service_handle_cell( working_circuit, or_connection, cell ) == false )
+      {
+        access_mutex = NULL;
+      }
 
       break;
     default:
@@ -677,30 +828,12 @@ static void v_handle_tor_cell( uint32_t conn_id )
 
   if ( working_circuit != NULL )
   {
-    if (
-      working_circuit->status != CIRCUIT_INTRO_LIVE &&
-      working_circuit->status != CIRCUIT_RENDEZVOUS &&
-      working_circuit->status != CIRCUIT_STANDBY
-    )
-    {
-      // update the timeout struct to have current step
-      working_circuit->want_action = true;
-    }
-    else
-    {
-      working_circuit->want_action = false;
-    }
-  }
-
-  if ( access_mutex != NULL )
-  {
-    MINITOR_MUTEX_GIVE( access_mutex );
-    // MUTEX GIVE
+    v_update_want_action( working_circuit );
   }
 
   free( cell );
 
-  return;
+  return access_mutex != NULL;
 
 circuit_rebuild:
   // this will give the mutex
@@ -708,18 +841,20 @@ circuit_rebuild:
   // MUTEX GIVE
 
   free( cell );
+
+  return false;
 }
 
-static void v_handle_service_tcp_data( ServiceTcpTraffic* tcp_traffic )
+static void v_handle_service_tcp_data( Cell* relay_cell )
 {
   OnionCircuit* rend_circuit;
-  DlConnection* or_connection;
+  DlConnection* or_connection = NULL;
 
   // MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
 
   // get the service that uses this circ_id
-  rend_circuit = px_get_circuit_by_circ_id( onion_circuits, tcp_traffic->circ_id );
+  rend_circuit = px_get_circuit_by_circ_id( onion_circuits, ud_get_cell_circ_id( relay_cell ) );
 
   MINITOR_MUTEX_GIVE( circuits_mutex );
   // MUTEX GIVE
@@ -728,24 +863,25 @@ static void v_handle_service_tcp_data( ServiceTcpTraffic* tcp_traffic )
   {
     // MUTEX TAKE
     or_connection = px_get_conn_by_id_and_lock( rend_circuit->conn_id );
-
-    v_onion_service_handle_local_tcp_data( rend_circuit, or_connection, tcp_traffic );
-
-    MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
-    // MUTEX GIVE
   }
-  else if ( tcp_traffic->length > 0 )
+
+  if ( or_connection == NULL )
   {
-    free( tcp_traffic->data );
+    v_give_pooled_cell( relay_cell );
+
+    return;
   }
 
-  free( tcp_traffic );
+  v_onion_service_handle_local_tcp_data( rend_circuit, or_connection, relay_cell );
+
+  MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+  // MUTEX GIVE
 }
 
 // TODO had a failure to restart an hsdir upload circuit
 // this function seems to have been called but no subsequent
 // circuit init showed in the log
-static void v_handle_conn_close( uint32_t conn_id )
+static void v_handle_conn_close( uint32_t conn_id, int shard )
 {
   int i = 0;
   OnionCircuit* closed_circuits[20];
@@ -758,7 +894,7 @@ static void v_handle_conn_close( uint32_t conn_id )
 
   while ( closed_circuit != NULL )
   {
-    if ( closed_circuit->conn_id == conn_id )
+    if ( closed_circuit->conn_id == conn_id && b_shard_owns_circuit( closed_circuit, shard ) )
     {
       closed_circuits[i] = closed_circuit;
       i++;
@@ -795,6 +931,7 @@ static void v_init_circuit( CreateCircuitRequest* create_request )
   new_circuit->target_relay_index = create_request->target_relay_index;
   new_circuit->hs_crypto = create_request->hs_crypto;
   new_circuit->want_action = false;
+  new_circuit->circ_id = ud_next_circ_id( d_next_circuit_shard( new_circuit->target_status ) );
 
   if ( d_prepare_onion_circuit( new_circuit, create_request->length, create_request->start_relay, create_request->end_relay ) < 0 )
   {
@@ -811,6 +948,11 @@ static void v_init_circuit( CreateCircuitRequest* create_request )
   // MUTEX TAKE
   or_connection = px_get_conn_by_id_and_lock( new_circuit->conn_id );
 
+  if ( or_connection == NULL )
+  {
+    goto fail;
+  }
+
   // connection is live, start create
   if ( succ == 1 )
   {
@@ -824,9 +966,9 @@ static void v_init_circuit( CreateCircuitRequest* create_request )
     time( &(new_circuit->last_action) );
   }
 
-  MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
-  // MUTEX GIVE
-
+  // the circuit may belong to another shard, it has to be on the list before
+  // the connection is unlocked so that shard finds it for the first cell and
+  // for a CONN_READY or CONN_CLOSE
   // MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
 
@@ -836,6 +978,9 @@ static void v_init_circuit( CreateCircuitRequest* create_request )
   MINITOR_MUTEX_GIVE( circuits_mutex );
   // MUTEX GIVE
 
+  MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+  // MUTEX GIVE
+
   free( create_request );
 
   return;
@@ -876,13 +1021,37 @@ fail:
   free( new_circuit );
 }
 
-static void v_handle_conn_ready( uint32_t conn_id )
+static bool b_conn_has_circuits( uint32_t conn_id )
+{
+  OnionCircuit* circuit;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  circuit = onion_circuits;
+
+  while ( circuit != NULL && circuit->conn_id != conn_id )
+  {
+    circuit = circuit->next;
+  }
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  return circuit != NULL;
+}
+
+// the handshake finishes on the first shard, it passes the ready on to the
+// other shards with circuits waiting on the connection
+static void v_handle_conn_ready( uint32_t conn_id, int shard )
 {
   int i = 0;
   int f = 0;
+  int j;
+  bool notify[MINITOR_CORE_SHARDS] = { false };
   OnionCircuit* ready_circuit;
   OnionCircuit* ready_circuits[20];
-  OnionRelay* end_relay;
+  OnionMessage* onion_message;
   DlConnection* or_connection;
 
   // MUTEX TAKE
@@ -894,8 +1063,15 @@ static void v_handle_conn_ready( uint32_t conn_id )
   {
     if ( ready_circuit->conn_id == conn_id )
     {
-      ready_circuits[i] = ready_circuit;
-      i++;
+      if ( b_shard_owns_circuit( ready_circuit, shard ) )
+      {
+        ready_circuits[i] = ready_circuit;
+        i++;
+      }
+      else
+      {
+        notify[d_core_shard_for_circ_id( ready_circuit->circ_id )] = true;
+      }
     }
 
     ready_circuit = ready_circuit->next;
@@ -904,6 +1080,18 @@ static void v_handle_conn_ready( uint32_t conn_id )
   MINITOR_MUTEX_GIVE( circuits_mutex );
   // MUTEX GIVE
 
+  for ( j = 1; shard == 0 && j < MINITOR_CORE_SHARDS; j++ )
+  {
+    if ( notify[j] == true )
+    {
+      onion_message = malloc( sizeof( OnionMessage ) );
+      onion_message->type = CONN_READY;
+      onion_message->data = conn_id;
+
+      v_core_enqueue_shard_blocking( onion_message, j );
+    }
+  }
+
   // we shouldn't need to reaquire the lock every circuit
   // MUTEX TAKE
   or_connection = px_get_conn_by_id_and_lock( conn_id );
@@ -930,10 +1118,11 @@ static void v_handle_conn_ready( uint32_t conn_id )
     }
   }
 
-  MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+  MINITOR_MUTEX_GIVE( or_connection->access_mutex );
   // MUTEX GIVE
 
-  if ( f == 0 )
+  // another shard may still have circuits waiting on the connection
+  if ( f == 0 && b_conn_has_circuits( conn_id ) == false )
   {
     v_cleanup_connection( or_connection );
   }
@@ -949,50 +1138,72 @@ static void v_handle_scheduled_consensus()
   }
 }
 
-static void v_keep_circuitlist_alive()
+static void v_keep_circuitlist_alive( int shard )
 {
+  int i;
+  int count = 0;
+  uint32_t* ids;
   Cell* padding_cell;
   DlConnection* or_connection;
   OnionCircuit* working_circuit;
 
+  // the access mutex comes before circuits_mutex, so copy out the circ and
+  // conn ids and send the padding once the list is given back
   // MUTEX TAKE
   MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
 
-  working_circuit = onion_circuits;
+  for ( working_circuit = onion_circuits; working_circuit != NULL; working_circuit = working_circuit->next )
+  {
+    count++;
+  }
+
+  ids = malloc( sizeof( uint32_t ) * 2 * ( count + 1 ) );
+  count = 0;
+
+  for ( working_circuit = onion_circuits; working_circuit != NULL; working_circuit = working_circuit->next )
+  {
+    if ( b_shard_owns_circuit( working_circuit, shard ) )
+    {
+      ids[count * 2] = working_circuit->circ_id;
+      ids[count * 2 + 1] = working_circuit->conn_id;
+      count++;
+    }
+  }
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
 
-  while ( working_circuit != NULL )
+  for ( i = 0; i < count; i++ )
   {
     // MUTEX TAKE
-    or_connection = px_get_conn_by_id_and_lock( working_circuit->conn_id );
+    or_connection = px_get_conn_by_id_and_lock( ids[i * 2 + 1] );
 
     if ( or_connection == NULL )
     {
-      working_circuit = working_circuit->next;
-
       continue;
     }
 
     padding_cell = malloc( MINITOR_CELL_LEN );
 
     padding_cell->command = PADDING;
-    padding_cell->circ_id = working_circuit->circ_id;
+    v_set_cell_circ_id( padding_cell, ids[i * 2] );
     padding_cell->length = FIXED_CELL_HEADER_SIZE;
 
     if ( d_send_cell_and_free( or_connection, padding_cell ) < 0 )
     {
-      MINITOR_LOG( CORE_TAG, "Failed to send padding cell on circ_id: %d", working_circuit->circ_id );
+      MINITOR_LOG( CORE_TAG, "Failed to send padding cell on circ_id: %d", ids[i * 2] );
     }
 
-    MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+    MINITOR_MUTEX_GIVE( or_connection->access_mutex );
     // MUTEX GIVE
-
-    working_circuit = working_circuit->next;
   }
 
-  MINITOR_MUTEX_GIVE( circuits_mutex );
-  // MUTEX GIVE
+  free( ids );
 
-  MINITOR_TIMER_RESET_BLOCKING( keepalive_timer );
+  if ( shard == 0 )
+  {
+    MINITOR_TIMER_RESET_BLOCKING( keepalive_timer );
+  }
 }
 
 static void v_handle_scheduled_hsdir( OnionService* service )
@@ -1039,7 +1250,7 @@ static void v_init_service( OnionService* service )
     ((CreateCircuitRequest*)onion_message->data)->target_status = CIRCUIT_STANDBY;
     ((CreateCircuitRequest*)onion_message->data)->service = service;
 
-    MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+    v_core_enqueue_blocking( onion_message );
   }
 
   for ( i = 0; i < 3; i++ )
@@ -1086,11 +1297,11 @@ static void v_init_service( OnionService* service )
       memcpy( final_identities[i], ((CreateCircuitRequest*)onion_message->data)->end_relay->identity, ID_LENGTH );
     }
 
-    MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+    v_core_enqueue_blocking( onion_message );
   }
 }
 
-void v_handle_circuit_timeout()
+void v_handle_circuit_timeout( int shard )
 {
   int i = 0;
   time_t now;
@@ -1110,7 +1321,13 @@ void v_handle_circuit_timeout()
 
   while ( circuit != NULL )
   {
-    if ( circuit->want_action == true )
+    // a circuit with a handshake out on a worker is settled by the result
+    if (
+      b_shard_owns_circuit( circuit, shard ) &&
+      circuit->want_action == true &&
+      circuit->crypto_pending == false &&
+      circuit->intro_jobs_pending == 0
+    )
     {
       elapsed = now - circuit->last_action;
 
@@ -1151,12 +1368,24 @@ void v_handle_circuit_timeout()
     // MUTEX GIVE
   }
 
+  core_shards[shard].timeout_left = min_left;
+
+  // one timer serves every shard, set it for whichever is due first
+  for ( i = 0; i < MINITOR_CORE_SHARDS; i++ )
+  {
+    if ( core_shards[i].timeout_left > 0 && core_shards[i].timeout_left < min_left )
+    {
+      min_left = core_shards[i].timeout_left;
+    }
+  }
+
   // this should also start the timer
   MINITOR_TIMER_SET_MS_BLOCKING( timeout_timer, 1000 * min_left );
 }
 
-void v_handle_conn_handshake( uint32_t conn_id, uint32_t length )
+void v_handle_conn_handshake( uint32_t conn_id )
 {
+  int length;
   Cell* cell;
   DlConnection* or_connection;
   MinitorMutex access_mutex = NULL;
@@ -1169,13 +1398,10 @@ void v_handle_conn_handshake( uint32_t conn_id, uint32_t length )
     return;
   }
 
-  access_mutex = connection_access_mutex[or_connection->mutex_index];
+  access_mutex = or_connection->access_mutex;
 
-  cell = or_connection->cell_ring_buf[or_connection->cell_ring_start];
-
-  or_connection->cell_ring_buf[or_connection->cell_ring_start] = NULL;
-
-  or_connection->cell_ring_start = ( or_connection->cell_ring_start + 1 ) % 20;
+  // handshake cells are all circ_id 0 so they are on the first shard's ring
+  cell = (Cell*)px_pop_connection_cell( or_connection, 0, &length );
 
   if ( cell == NULL )
   {
@@ -1241,7 +1467,7 @@ void v_handle_conn_handshake( uint32_t conn_id, uint32_t length )
 
       access_mutex = NULL;
 
-      v_handle_conn_ready( or_connection->conn_id );
+      v_handle_conn_ready( or_connection->conn_id, 0 );
 
       break;
     case CONNECTION_LIVE:
@@ -1273,67 +1499,408 @@ fail:
   v_cleanup_connection( or_connection );
 }
 
-void v_minitor_daemon( void* pv_parameters )
+// the daemon sends one TOR_CELL per batch, drain everything in this shard's
+// ring and pick the handler by the connection's status when each cell is
+// processed. the access mutex is held across cells until a handler has to
+// give it
+static void v_handle_connection_cells( uint32_t conn_id, int shard )
+{
+  int length;
+  bool locked;
+  Cell* cell;
+  DlConnection* or_connection;
+  OnionCircuit* cached_circuit = NULL;
+
+  // MUTEX TAKE
+  or_connection = px_get_conn_by_id_and_lock( conn_id );
+
+  if ( or_connection == NULL )
+  {
+    return;
+  }
+
+  v_rearm_connection_cells( or_connection, shard );
+
+  while ( 1 )
+  {
+    if ( or_connection->status != CONNECTION_LIVE && shard == 0 )
+    {
+      locked = b_connection_has_cells( or_connection, 0 );
+
+      MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+      // MUTEX GIVE
+
+      if ( locked == false )
+      {
+        return;
+      }
+
+      v_handle_conn_handshake( conn_id );
+
+      locked = false;
+    }
+    else
+    {
+      cell = (Cell*)px_pop_connection_cell( or_connection, shard, &length );
+
+      if ( cell == NULL )
+      {
+        MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+        // MUTEX GIVE
+
+        return;
+      }
+
+      locked = b_handle_tor_cell( or_connection, cell, &cached_circuit );
+    }
+
+    if ( locked == false )
+    {
+      // circuits may have been destroyed while we didn't hold the lock
+      cached_circuit = NULL;
+
+      // MUTEX TAKE
+      or_connection = px_get_conn_by_id_and_lock( conn_id );
+
+      if ( or_connection == NULL )
+      {
+        return;
+      }
+    }
+  }
+}
+
+static int d_core_lane_for( OnionMessage* onion_message )
+{
+  if ( onion_message != NULL && onion_message->type == SERVICE_TCP_DATA )
+  {
+    return CORE_LANE_BULK;
+  }
+
+  return CORE_LANE_CONTROL;
+}
+
+// stream data and handshake results go to the shard that owns their circuit,
+// everything else is service or connection level work for the first shard
+static int d_core_shard_for( OnionMessage* onion_message )
 {
+  if ( onion_message == NULL )
+  {
+    return 0;
+  }
+
+  switch ( onion_message->type )
+  {
+    case SERVICE_TCP_DATA:
+      return d_core_shard_for_circ_id( ud_get_cell_circ_id( (Cell*)onion_message->data ) );
+    case CRYPTO_RESULT:
+      return d_core_shard_for_circ_id( ((CryptoJob*)onion_message->data)->circ_id );
+    default:
+      return 0;
+  }
+}
+
+static bool b_core_enqueue_lane( OnionMessage* onion_message, int shard, int ms )
+{
+  int lane;
+  int succ;
+  uint32_t waiting;
+  CoreShard* core_shard = &core_shards[shard];
+
+  lane = d_core_lane_for( onion_message );
+
+  if ( onion_message != NULL )
+  {
+    onion_message->enqueued_us = MINITOR_GET_TIME();
+  }
+
+  if ( ms < 0 )
+  {
+    succ = MINITOR_ENQUEUE_BLOCKING( core_shard->lane_queues[lane], (void*)(&onion_message) );
+  }
+  else
+  {
+    succ = MINITOR_ENQUEUE_MS( core_shard->lane_queues[lane], (void*)(&onion_message), ms );
+  }
+
+  if ( succ == pdFALSE )
+  {
+    __atomic_add_fetch( &core_shard->lane_stats[lane].rejected, 1, __ATOMIC_RELAXED );
+
+    return false;
+  }
+
+  __atomic_add_fetch( &core_shard->lane_stats[lane].enqueued, 1, __ATOMIC_RELAXED );
+
+  waiting = MINITOR_QUEUE_MESSAGES_WAITING( core_shard->lane_queues[lane] );
+
+  if ( waiting > core_shard->lane_stats[lane].high_water )
+  {
+    core_shard->lane_stats[lane].high_water = waiting;
+  }
+
+  MINITOR_SEMAPHORE_GIVE( core_shard->wake_semaphore );
+
+  return true;
+}
+
+// false if the message's lane stayed full for ms
+bool b_core_enqueue_ms( OnionMessage* onion_message, int ms )
+{
+  return b_core_enqueue_lane( onion_message, d_core_shard_for( onion_message ), ms );
+}
+
+void v_core_enqueue_blocking( OnionMessage* onion_message )
+{
+  b_core_enqueue_lane( onion_message, d_core_shard_for( onion_message ), -1 );
+}
+
+// a shard blocking on another shard's control lane can't deadlock against it
+// as long as the connections daemon leaves CORE_LANE_RESERVE free on each
+void v_core_enqueue_shard_blocking( OnionMessage* onion_message, int shard )
+{
+  b_core_enqueue_lane( onion_message, shard, -1 );
+}
+
+// one message of type to every shard, each gets its own copy
+void v_core_broadcast_blocking( OnionMessageType type, void* data )
+{
+  int i;
   OnionMessage* onion_message;
 
-  MINITOR_LOG( CORE_TAG, "Starting core" );
+  for ( i = 0; i < MINITOR_CORE_SHARDS; i++ )
+  {
+    onion_message = malloc( sizeof( OnionMessage ) );
+    onion_message->type = type;
+    onion_message->data = data;
+
+    b_core_enqueue_lane( onion_message, i, -1 );
+  }
+}
+
+// the space left on the fullest shard's lane
+int d_core_lane_spaces( CoreLane lane )
+{
+  int i;
+  int spaces;
+  int min_spaces;
+
+  min_spaces = MINITOR_QUEUE_SPACES_AVAILABLE( core_shards[0].lane_queues[lane] );
 
-  while ( MINITOR_DEQUEUE_BLOCKING( core_task_queue, &onion_message ) )
+  for ( i = 1; i < MINITOR_CORE_SHARDS; i++ )
   {
-    // got a null, time to shutdown
-    if ( onion_message == NULL )
+    spaces = MINITOR_QUEUE_SPACES_AVAILABLE( core_shards[i].lane_queues[lane] );
+
+    if ( spaces < min_spaces )
     {
-      MINITOR_LOG( CORE_TAG, "Minitor Shutdown" );
-      MINITOR_TASK_DELETE( NULL );
+      min_spaces = spaces;
     }
+  }
+
+  return min_spaces;
+}
+
+// totals across the shards, high_water is the highest any shard reached
+void v_core_get_lane_stats( CoreLaneStats* stats )
+{
+  int i;
+  int lane;
 
-    MINITOR_LOG( CORE_TAG, "Heap check %d, command: %d", xPortGetFreeHeapSize(), onion_message->type );
+  memset( stats, 0, sizeof( CoreLaneStats ) * CORE_LANE_COUNT );
 
-    switch ( onion_message->type )
+  for ( i = 0; i < MINITOR_CORE_SHARDS; i++ )
+  {
+    for ( lane = 0; lane < CORE_LANE_COUNT; lane++ )
     {
-      case TIMER_CONSENSUS:
-        v_handle_scheduled_consensus();
-        break;
-      case TIMER_KEEPALIVE:
-        v_keep_circuitlist_alive();
-        break;
-      case TIMER_HSDIR:
-        v_handle_scheduled_hsdir( onion_message->data );
-        break;
-      case TIMER_CIRCUIT_TIMEOUT:
-        v_handle_circuit_timeout();
-        break;
-      case INIT_SERVICE:
-        v_init_service( onion_message->data );
-        break;
-      case INIT_CIRCUIT:
-        v_init_circuit( onion_message->data );
-        break;
-      case TOR_CELL:
-        v_handle_tor_cell( onion_message->data );
-        break;
-      case SERVICE_TCP_DATA:
-        v_handle_service_tcp_data( onion_message->data );
-        break;
-      case CONN_HANDSHAKE:
-        v_handle_conn_handshake( onion_message->data, onion_message->length );
-        break;
-      case CONN_READY:
-        v_handle_conn_ready( onion_message->data );
-        break;
-      case CONN_CLOSE:
-        v_handle_conn_close( onion_message->data );
-        break;
-      default:
+      stats[lane].enqueued += core_shards[i].lane_stats[lane].enqueued;
+      stats[lane].dequeued += core_shards[i].lane_stats[lane].dequeued;
+      stats[lane].rejected += core_shards[i].lane_stats[lane].rejected;
+
+      if ( core_shards[i].lane_stats[lane].high_water > stats[lane].high_water )
+      {
+        stats[lane].high_water = core_shards[i].lane_stats[lane].high_water;
+      }
+    }
+  }
+}
+
+// timers fire on the first shard, each shard checks its own circuits. if a
+// shard is too busy to take it now it gets the next one
+static void v_fan_out_timer( OnionMessageType type )
+{
+  int i;
+  OnionMessage* onion_message;
+
+  for ( i = 1; i < MINITOR_CORE_SHARDS; i++ )
+  {
+    onion_message = malloc( sizeof( OnionMessage ) );
+    onion_message->type = type;
+    onion_message->data = NULL;
+
+    if ( b_core_enqueue_lane( onion_message, i, 0 ) == false )
+    {
+      free( onion_message );
+    }
+  }
+}
+
+static void v_handle_onion_message( OnionMessage* onion_message, int shard )
+{
+  switch ( onion_message->type )
+  {
+    case TIMER_CONSENSUS:
+      v_handle_scheduled_consensus();
+      break;
+    case TIMER_KEEPALIVE:
+      if ( shard == 0 )
+      {
+        v_fan_out_timer( TIMER_KEEPALIVE );
+      }
+
+      v_keep_circuitlist_alive( shard );
+      break;
+    case TIMER_HSDIR:
+      v_handle_scheduled_hsdir( onion_message->data );
+      break;
+    case TIMER_CIRCUIT_TIMEOUT:
+      if ( shard == 0 )
+      {
+        v_fan_out_timer( TIMER_CIRCUIT_TIMEOUT );
+      }
+
+      v_handle_circuit_timeout( shard );
+      break;
+    case INIT_SERVICE:
+      v_init_service( onion_message->data );
+      break;
+    case INIT_CIRCUIT:
+      v_init_circuit( onion_message->data );
+      break;
+    case TOR_CELL:
+      v_handle_connection_cells( onion_message->data, shard );
+      break;
+    case SERVICE_TCP_DATA:
+      v_handle_service_tcp_data( onion_message->data );
+      break;
+    case CONN_READY:
+      v_handle_conn_ready( onion_message->data, shard );
+      break;
+    case CONN_CLOSE:
+      v_handle_conn_close( onion_message->data, shard );
+      break;
+    case CRYPTO_RESULT:
+      v_handle_crypto_result( onion_message->data );
+      break;
+    default:
 #ifdef DEBUG_MINITOR
-        MINITOR_LOG( CORE_TAG, "Got an unknown onion message %d", onion_message->type );
+      MINITOR_LOG( CORE_TAG, "Got an unknown onion message %d", onion_message->type );
 #endif
-        break;
+      break;
+  }
+}
+
+// the wake semaphore has been taken so at least one lane has a message
+static void v_core_dequeue( CoreShard* core_shard, OnionMessage** onion_message )
+{
+  int lane = CORE_LANE_CONTROL;
+
+  // let one bulk message through after a long enough run of control messages
+  if (
+    MINITOR_CORE_BULK_WEIGHT > 0 &&
+    core_shard->control_streak >= MINITOR_CORE_BULK_WEIGHT &&
+    MINITOR_DEQUEUE_MS( core_shard->lane_queues[CORE_LANE_BULK], onion_message, 0 )
+  )
+  {
+    lane = CORE_LANE_BULK;
+  }
+  else if ( MINITOR_DEQUEUE_MS( core_shard->lane_queues[CORE_LANE_CONTROL], onion_message, 0 ) )
+  {
+    lane = CORE_LANE_CONTROL;
+  }
+  else
+  {
+    MINITOR_DEQUEUE_BLOCKING( core_shard->lane_queues[CORE_LANE_BULK], onion_message );
+
+    lane = CORE_LANE_BULK;
+  }
+
+  if ( lane == CORE_LANE_BULK )
+  {
+    core_shard->control_streak = 0;
+  }
+  else
+  {
+    core_shard->control_streak++;
+  }
+
+  core_shard->lane_stats[lane].dequeued++;
+
+  v_connections_lane_dequeued();
+}
+
+void v_minitor_daemon( void* pv_parameters )
+{
+  int i;
+  int count;
+  int shard = (int)pv_parameters;
+  int64_t start_us;
+  OnionMessageType type;
+  CoreShard* core_shard = &core_shards[shard];
+  OnionMessage* onion_messages[MINITOR_CORE_BATCH];
+
+  MINITOR_LOG( CORE_TAG, "Starting core shard %d", shard );
+
+  while ( MINITOR_SEMAPHORE_TAKE_BLOCKING( core_shard->wake_semaphore ) )
+  {
+    v_core_dequeue( core_shard, &onion_messages[0] );
+
+    count = 1;
+
+    // take whatever else is already waiting so a burst is handled in one pass
+    while (
+      count < MINITOR_CORE_BATCH &&
+      onion_messages[count - 1] != NULL &&
+      MINITOR_SEMAPHORE_TAKE_MS( core_shard->wake_semaphore, 0 )
+    )
+    {
+      v_core_dequeue( core_shard, &onion_messages[count] );
+      count++;
     }
 
-    free( onion_message );
-    
-    MINITOR_LOG( CORE_TAG, "message processed" );
+    for ( i = 0; i < count; i++ )
+    {
+      // got a null, time to shutdown
+      if ( onion_messages[i] == NULL )
+      {
+        MINITOR_LOG( CORE_TAG, "Minitor Shutdown" );
+        MINITOR_TASK_DELETE( NULL );
+      }
+
+      MINITOR_TRACE( TRACE_CORE_MESSAGE, onion_messages[i]->type, shard );
+
+      type = onion_messages[i]->type;
+      start_us = MINITOR_GET_TIME();
+
+      v_handle_onion_message( onion_messages[i], shard );
+
+      v_stats_record_message( type, start_us - onion_messages[i]->enqueued_us, MINITOR_GET_TIME() - start_us );
+
+      // one drain empties the connection's ring, so back to back TOR_CELLs
+      // for the same connection have nothing left to do
+      while (
+        onion_messages[i]->type == TOR_CELL &&
+        i + 1 < count &&
+        onion_messages[i + 1] != NULL &&
+        onion_messages[i + 1]->type == TOR_CELL &&
+        onion_messages[i + 1]->data == onion_messages[i]->data
+      )
+      {
+        free( onion_messages[i + 1] );
+        onion_messages[i + 1] = onion_messages[i];
+        i++;
+      }
+
+      free( onion_messages[i] );
+    }
   }
 }
@@ -0,0 +1,154 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "../include/config.h"
+#include "../h/port.h"
+
+#include "../h/crypto_pool.h"
+#include "../h/circuit.h"
+#include "../h/onion_service.h"
+#include "../h/core.h"
+#include "../h/stats.h"
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CRYPTO
+
+static const char* CRYPTO_POOL_TAG = "MINITOR CRYPTO POOL";
+
+MinitorQueue crypto_job_queue;
+
+// the core never waits on this queue, if it is full or there are no workers
+// the core runs the job itself, so a worker blocking on a full core queue
+// can't deadlock against it
+bool b_submit_crypto_job( CryptoJob* job )
+{
+#if MINITOR_CRYPTO_WORKERS > 0
+  if ( MINITOR_ENQUEUE_MS( crypto_job_queue, (void*)(&job), 0 ) == pdTRUE )
+  {
+    return true;
+  }
+#endif
+
+  return false;
+}
+
+void v_run_crypto_job( CryptoJob* job )
+{
+  int64_t start_us = MINITOR_GET_TIME();
+
+  switch ( job->type )
+  {
+    case CRYPTO_JOB_NTOR:
+      job->db_relay.relay = &job->relay;
+      job->db_relay.relay_crypto = NULL;
+
+      job->result = d_ntor_handshake_finish( job->handshake_data, &job->db_relay, &job->handshake_key );
+
+      v_stats_record_latency( LATENCY_NTOR_CRYPTO, MINITOR_GET_TIME() - start_us );
+
+      // the finish function frees its relay_crypto on failure
+      if ( job->result < 0 )
+      {
+        job->db_relay.relay_crypto = NULL;
+      }
+
+      break;
+    case CRYPTO_JOB_INTRODUCE_2:
+      job->result = d_onion_service_introduce_2_crypto( job );
+
+      v_stats_record_latency( LATENCY_INTRODUCE2_CRYPTO, MINITOR_GET_TIME() - start_us );
+
+      break;
+    default:
+      job->result = -1;
+
+      break;
+  }
+}
+
+// frees whatever the core didn't take ownership of
+void v_free_crypto_job( CryptoJob* job )
+{
+  if ( job->db_relay.relay_crypto != NULL )
+  {
+    wc_ShaFree( &job->db_relay.relay_crypto->running_sha_forward );
+    wc_ShaFree( &job->db_relay.relay_crypto->running_sha_backward[0] );
+    wc_ShaFree( &job->db_relay.relay_crypto->running_sha_backward[1] );
+    wc_AesFree( &job->db_relay.relay_crypto->aes_forward );
+    wc_AesFree( &job->db_relay.relay_crypto->aes_backward );
+
+    free( job->db_relay.relay_crypto );
+  }
+
+  if ( job->hs_crypto != NULL )
+  {
+    wc_Sha3_256_Free( &job->hs_crypto->hs_running_sha_forward[0] );
+    wc_Sha3_256_Free( &job->hs_crypto->hs_running_sha_forward[1] );
+    wc_Sha3_256_Free( &job->hs_crypto->hs_running_sha_backward );
+    wc_AesFree( &job->hs_crypto->hs_aes_forward );
+    wc_AesFree( &job->hs_crypto->hs_aes_backward );
+
+    free( job->hs_crypto );
+  }
+
+  if ( job->cell != NULL )
+  {
+    free( job->cell );
+  }
+
+  // these are copies of private keys, clear them
+  if ( job->type == CRYPTO_JOB_NTOR )
+  {
+    wc_curve25519_free( &job->handshake_key );
+  }
+  else
+  {
+    wc_curve25519_free( &job->encrypt_key );
+  }
+
+  free( job );
+}
+
+void v_crypto_pool_daemon( void* pv_parameters )
+{
+  CryptoJob* job;
+  OnionMessage* onion_message;
+
+  while ( 1 )
+  {
+    MINITOR_DEQUEUE_BLOCKING( crypto_job_queue, &job );
+
+    v_run_crypto_job( job );
+
+    onion_message = malloc( sizeof( OnionMessage ) );
+
+    onion_message->type = CRYPTO_RESULT;
+    onion_message->data = job;
+
+#ifdef DEBUG_MINITOR
+    if ( job->result < 0 )
+    {
+      MINITOR_LOG( CRYPTO_POOL_TAG, "Crypto job %d failed for circ_id: %d", job->type, job->circ_id );
+    }
+#endif
+
+    v_core_enqueue_blocking( onion_message );
+  }
+}
@@ -0,0 +1,389 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "user_settings.h"
+#include "wolfssl/wolfcrypt/aes.h"
+#include "wolfssl/wolfcrypt/sha.h"
+#include "wolfssl/wolfcrypt/sha3.h"
+#include "wolfssl/wolfcrypt/curve25519.h"
+
+#include "../include/config.h"
+#include "../h/port.h"
+#include "../h/structures/cell.h"
+
+#include "../h/crypto_provider.h"
+
+#ifdef MINITOR_ESP_AES
+#include "aes/esp_aes.h"
+#endif
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CRYPTO
+
+static const char* PROVIDER_TAG = "MINITOR CRYPTO PROVIDER";
+
+// relay sized payloads pushed through each backend when picking one
+#define PROVIDER_BENCH_ROUNDS 32
+
+static int d_wolfcrypt_init()
+{
+  return 0;
+}
+
+static int d_wolfcrypt_aes_ctr( Aes* aes, uint8_t* out, const uint8_t* in, uint32_t length )
+{
+  return wc_AesCtrEncrypt( aes, out, in, length );
+}
+
+static int d_wolfcrypt_sha_update( Sha* sha, const uint8_t* data, uint32_t length )
+{
+  return wc_ShaUpdate( sha, data, length );
+}
+
+static int d_wolfcrypt_sha3_256_update( Sha3* sha3, const uint8_t* data, uint32_t length )
+{
+  return wc_Sha3_256_Update( sha3, data, length );
+}
+
+static int d_wolfcrypt_x25519_shared_secret( curve25519_key* private_key, curve25519_key* public_key, uint8_t* out, word32* out_length )
+{
+  return wc_curve25519_shared_secret_ex( private_key, public_key, out, out_length, EC25519_LITTLE_ENDIAN );
+}
+
+static const MinitorCryptoProvider wolfcrypt_provider =
+{
+  .name = "wolfcrypt",
+  .init = d_wolfcrypt_init,
+  .aes_ctr = d_wolfcrypt_aes_ctr,
+  .sha_update = d_wolfcrypt_sha_update,
+  .sha3_256_update = d_wolfcrypt_sha3_256_update,
+  .x25519_shared_secret = d_wolfcrypt_x25519_shared_secret,
+};
+
+#ifdef MINITOR_ESP_AES
+static int d_esp_aes_init()
+{
+  return 0;
+}
+
+// the key schedule wolfcrypt keeps starts with the key itself, the software
+// schedule holds it as big endian words and the esp32 port keeps it raw
+static int d_esp_aes_raw_key( Aes* aes, uint8_t* key )
+{
+  int i;
+  int key_length = ( aes->rounds - 6 ) * 4;
+
+#if defined( WOLFSSL_ESP32WROOM32_CRYPT ) && !defined( NO_WOLFSSL_ESP32WROOM32_CRYPT_AES )
+  memcpy( key, aes->key, key_length );
+#else
+  for ( i = 0; i < key_length / 4; i++ )
+  {
+    key[i * 4] = (uint8_t)( aes->key[i] >> 24 );
+    key[i * 4 + 1] = (uint8_t)( aes->key[i] >> 16 );
+    key[i * 4 + 2] = (uint8_t)( aes->key[i] >> 8 );
+    key[i * 4 + 3] = (uint8_t)( aes->key[i] );
+  }
+#endif
+
+  return key_length;
+}
+
+// hands the whole payload to the aes peripheral instead of one block at a
+// time, the counter and keystream live in the wolfcrypt context so hops can
+// still be set up and torn down by wolfcrypt
+static int d_esp_aes_ctr( Aes* aes, uint8_t* out, const uint8_t* in, uint32_t length )
+{
+  int i;
+  int ret;
+  int key_length;
+  size_t nc_off;
+  uint8_t key[AES_256_KEY_SIZE];
+  esp_aes_context esp_aes;
+
+  key_length = d_esp_aes_raw_key( aes, key );
+
+  esp_aes_init( &esp_aes );
+
+  ret = esp_aes_setkey( &esp_aes, key, key_length * 8 );
+
+  if ( ret == 0 )
+  {
+    // wolfcrypt counts the keystream left over in tmp, esp_aes counts how
+    // much of it has been used
+    nc_off = ( AES_BLOCK_SIZE - aes->left ) % AES_BLOCK_SIZE;
+
+    ret = esp_aes_crypt_ctr( &esp_aes, length, &nc_off, (uint8_t*)aes->reg, (uint8_t*)aes->tmp, in, out );
+
+    aes->left = ( AES_BLOCK_SIZE - nc_off ) % AES_BLOCK_SIZE;
+  }
+
+  esp_aes_free( &esp_aes );
+
+  // volatile so the clear isn't optimized away
+  for ( i = 0; i < key_length; i++ )
+  {
+    ((volatile uint8_t*)key)[i] = 0;
+  }
+
+  return ret;
+}
+
+// the sha peripheral can't hand back a running digest to copy, so the
+// digests and x25519 stay on wolfcrypt
+static const MinitorCryptoProvider esp_aes_provider =
+{
+  .name = "esp_aes",
+  .init = d_esp_aes_init,
+  .aes_ctr = d_esp_aes_ctr,
+  .sha_update = d_wolfcrypt_sha_update,
+  .sha3_256_update = d_wolfcrypt_sha3_256_update,
+  .x25519_shared_secret = d_wolfcrypt_x25519_shared_secret,
+};
+#endif
+
+static const MinitorCryptoProvider* crypto_providers[] =
+{
+  &wolfcrypt_provider,
+#ifdef MINITOR_ESP_AES
+  &esp_aes_provider,
+#endif
+};
+
+const MinitorCryptoProvider* crypto_provider = &wolfcrypt_provider;
+
+// NIST SP 800-38A F.5.1 and F.5.5
+static const uint8_t aes_test_counter[AES_BLOCK_SIZE] =
+{
+  0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+};
+
+static const uint8_t aes_test_plain[64] =
+{
+  0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+  0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+  0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+  0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+
+static const uint8_t aes_128_test_key[AES_128_KEY_SIZE] =
+{
+  0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+static const uint8_t aes_128_test_cipher[64] =
+{
+  0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+  0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+  0x5a, 0xe4, 0xdf, 0x3e, 0xda, 0xb5, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e,
+  0xab, 0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1, 0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c,
+};
+
+static const uint8_t aes_256_test_key[AES_256_KEY_SIZE] =
+{
+  0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+  0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4,
+};
+
+static const uint8_t aes_256_test_cipher[64] =
+{
+  0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5, 0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+  0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a, 0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5,
+  0x2b, 0x09, 0x30, 0xda, 0xa2, 0x3d, 0xe9, 0x4c, 0xe8, 0x70, 0x17, 0xba, 0x2d, 0x84, 0x98, 0x8d,
+  0xdf, 0xc9, 0xc5, 0x8d, 0xb6, 0x7a, 0xad, 0xa6, 0x13, 0xc2, 0xdd, 0x08, 0x45, 0x79, 0x41, 0xa6,
+};
+
+// sha1 and sha3-256 of "abc"
+static const uint8_t sha_test_digest[WC_SHA_DIGEST_SIZE] =
+{
+  0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e, 0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c,
+  0x9c, 0xd0, 0xd8, 0x9d,
+};
+
+static const uint8_t sha3_test_digest[WC_SHA3_256_DIGEST_SIZE] =
+{
+  0x3a, 0x98, 0x5d, 0xa7, 0x4f, 0xe2, 0x25, 0xb2, 0x04, 0x5c, 0x17, 0x2d, 0x6b, 0xd3, 0x90, 0xbd,
+  0x85, 0x5f, 0x08, 0x6e, 0x3e, 0x9d, 0x52, 0x5b, 0x46, 0xbf, 0xe2, 0x45, 0x11, 0x43, 0x15, 0x32,
+};
+
+// runs the vector through in uneven pieces so a backend that loses track
+// of a partly used keystream block fails too
+static int d_test_aes_ctr( const MinitorCryptoProvider* provider, const uint8_t* key, int key_length, const uint8_t* expected )
+{
+  int i;
+  int offset = 0;
+  int ret = 0;
+  const int chunks[] = { 5, 27, 32 };
+  uint8_t out[64];
+  Aes aes;
+
+  wc_AesInit( &aes, NULL, INVALID_DEVID );
+
+  if ( wc_AesSetKeyDirect( &aes, key, key_length, aes_test_counter, AES_ENCRYPTION ) != 0 )
+  {
+    ret = -1;
+    goto finish;
+  }
+
+  for ( i = 0; i < sizeof( chunks ) / sizeof( int ); i++ )
+  {
+    if ( provider->aes_ctr( &aes, out + offset, aes_test_plain + offset, chunks[i] ) != 0 )
+    {
+      ret = -1;
+      goto finish;
+    }
+
+    offset += chunks[i];
+  }
+
+  if ( memcmp( out, expected, sizeof( out ) ) != 0 )
+  {
+    ret = -1;
+  }
+
+finish:
+  wc_AesFree( &aes );
+
+  return ret;
+}
+
+static int d_self_test_provider( const MinitorCryptoProvider* provider )
+{
+  int ret = 0;
+  uint8_t digest[WC_SHA3_256_DIGEST_SIZE];
+  Sha sha;
+  Sha3 sha3;
+
+  if ( provider->init() != 0 )
+  {
+    return -1;
+  }
+
+  if (
+    d_test_aes_ctr( provider, aes_128_test_key, AES_128_KEY_SIZE, aes_128_test_cipher ) < 0 ||
+    d_test_aes_ctr( provider, aes_256_test_key, AES_256_KEY_SIZE, aes_256_test_cipher ) < 0
+  )
+  {
+    MINITOR_LOG( PROVIDER_TAG, "%s failed aes-ctr self test", provider->name );
+
+    return -1;
+  }
+
+  wc_InitSha( &sha );
+  provider->sha_update( &sha, (uint8_t*)"ab", 2 );
+  provider->sha_update( &sha, (uint8_t*)"c", 1 );
+  wc_ShaFinal( &sha, digest );
+  wc_ShaFree( &sha );
+
+  if ( memcmp( digest, sha_test_digest, WC_SHA_DIGEST_SIZE ) != 0 )
+  {
+    MINITOR_LOG( PROVIDER_TAG, "%s failed sha1 self test", provider->name );
+
+    ret = -1;
+  }
+
+  wc_InitSha3_256( &sha3, NULL, INVALID_DEVID );
+  provider->sha3_256_update( &sha3, (uint8_t*)"ab", 2 );
+  provider->sha3_256_update( &sha3, (uint8_t*)"c", 1 );
+  wc_Sha3_256_Final( &sha3, digest );
+  wc_Sha3_256_Free( &sha3 );
+
+  if ( memcmp( digest, sha3_test_digest, WC_SHA3_256_DIGEST_SIZE ) != 0 )
+  {
+    MINITOR_LOG( PROVIDER_TAG, "%s failed sha3-256 self test", provider->name );
+
+    ret = -1;
+  }
+
+  return ret;
+}
+
+// microseconds to encrypt and digest PROVIDER_BENCH_ROUNDS relay payloads
+static int d_bench_provider( const MinitorCryptoProvider* provider )
+{
+  int i;
+  int64_t start;
+  int64_t elapsed;
+  uint8_t* payload;
+  Aes aes;
+  Sha sha;
+
+  payload = malloc( PAYLOAD_LEN );
+  memset( payload, 0, PAYLOAD_LEN );
+
+  wc_AesInit( &aes, NULL, INVALID_DEVID );
+  wc_AesSetKeyDirect( &aes, aes_128_test_key, AES_128_KEY_SIZE, aes_test_counter, AES_ENCRYPTION );
+  wc_InitSha( &sha );
+
+  start = MINITOR_GET_TIME();
+
+  for ( i = 0; i < PROVIDER_BENCH_ROUNDS; i++ )
+  {
+    provider->sha_update( &sha, payload, PAYLOAD_LEN );
+    provider->aes_ctr( &aes, payload, payload, PAYLOAD_LEN );
+  }
+
+  elapsed = MINITOR_GET_TIME() - start;
+
+  wc_ShaFree( &sha );
+  wc_AesFree( &aes );
+  free( payload );
+
+  return (int)elapsed;
+}
+
+// picks the fastest backend that passes its self test, wolfcrypt is the
+// fallback and has to pass for Minitor to start
+int d_crypto_provider_init()
+{
+  int i;
+  int elapsed;
+  int best_elapsed = -1;
+  const MinitorCryptoProvider* best = NULL;
+
+  for ( i = 0; i < sizeof( crypto_providers ) / sizeof( MinitorCryptoProvider* ); i++ )
+  {
+    if ( d_self_test_provider( crypto_providers[i] ) < 0 )
+    {
+      if ( crypto_providers[i] == &wolfcrypt_provider )
+      {
+        return -1;
+      }
+
+      continue;
+    }
+
+    elapsed = d_bench_provider( crypto_providers[i] );
+
+    MINITOR_LOG( PROVIDER_TAG, "%s: %d us for %d cells", crypto_providers[i]->name, elapsed, PROVIDER_BENCH_ROUNDS );
+
+    if ( best == NULL || elapsed < best_elapsed )
+    {
+      best = crypto_providers[i];
+      best_elapsed = elapsed;
+    }
+  }
+
+  crypto_provider = best;
+
+  MINITOR_LOG( PROVIDER_TAG, "Using %s crypto provider", crypto_provider->name );
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "user_settings.h"
+#include "wolfssl/wolfcrypt/curve25519.h"
+#include "wolfssl/wolfcrypt/random.h"
+
+#include "../include/config.h"
+#include "../h/port.h"
+
+#include "../h/key_pool.h"
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CRYPTO
+
+static const char* KEY_POOL_TAG = "MINITOR KEY POOL";
+
+// curve25519_key pointers, each key is used once and then thrown away
+MinitorQueue ephemeral_key_queue;
+
+// wc_curve25519_free clears the private half
+static void v_free_pooled_key( curve25519_key* key )
+{
+  wc_curve25519_free( key );
+  free( key );
+}
+
+// fills key with a fresh keypair, from the pool if it has one ready or made
+// here if the pool has run dry
+int d_take_ephemeral_key( curve25519_key* key )
+{
+  int wolf_succ;
+  WC_RNG rng;
+#if MINITOR_KEY_POOL_SIZE > 0
+  curve25519_key* pooled_key;
+
+  if ( MINITOR_DEQUEUE_MS( ephemeral_key_queue, &pooled_key, 0 ) == pdTRUE )
+  {
+    memcpy( key, pooled_key, sizeof( curve25519_key ) );
+
+    v_free_pooled_key( pooled_key );
+
+    return 0;
+  }
+#endif
+
+  wc_curve25519_init( key );
+
+  wolf_succ = wc_InitRng( &rng );
+
+  if ( wolf_succ != 0 )
+  {
+    MINITOR_LOG( KEY_POOL_TAG, "Failed to init rng %d", wolf_succ );
+
+    return -1;
+  }
+
+  wolf_succ = wc_curve25519_make_key( &rng, 32, key );
+
+  wc_FreeRng( &rng );
+
+  if ( wolf_succ != 0 )
+  {
+    MINITOR_LOG( KEY_POOL_TAG, "Failed to make ephemeral key, error code %d", wolf_succ );
+
+    return -1;
+  }
+
+  return 0;
+}
+
+// runs below everything else, it only gets the cpu when the other tasks are
+// idle and sleeps on the queue once the pool is full
+void v_key_pool_daemon( void* pv_parameters )
+{
+  int wolf_succ;
+  WC_RNG rng;
+  curve25519_key* key;
+
+  wolf_succ = wc_InitRng( &rng );
+
+  if ( wolf_succ != 0 )
+  {
+    MINITOR_LOG( KEY_POOL_TAG, "Failed to init rng %d, pool will stay empty", wolf_succ );
+    MINITOR_TASK_DELETE( NULL );
+  }
+
+  while ( 1 )
+  {
+    key = malloc( sizeof( curve25519_key ) );
+
+    wc_curve25519_init( key );
+
+    wolf_succ = wc_curve25519_make_key( &rng, 32, key );
+
+    if ( wolf_succ != 0 )
+    {
+      MINITOR_LOG( KEY_POOL_TAG, "Failed to make pooled key, error code %d", wolf_succ );
+
+      v_free_pooled_key( key );
+
+      continue;
+    }
+
+    MINITOR_ENQUEUE_BLOCKING( ephemeral_key_queue, (void*)(&key) );
+  }
+}
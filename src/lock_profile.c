@@ -0,0 +1,224 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "../include/config.h"
+
+#ifdef MINITOR_LOCK_PROFILE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../h/port.h"
+#include "../h/lock_profile.h"
+
+// distinct mutex names, anything past this is counted under the last one
+#define LOCK_PROFILE_NAMES 16
+// every mutex ever created, the connection slots make most of them
+#define LOCK_PROFILE_HANDLES 128
+
+typedef struct LockProfileHandle
+{
+  MinitorMutex mutex;
+  MinitorLockStats* stats;
+  // only written by the holder
+  int64_t taken_us;
+  const char* taken_file;
+  int taken_line;
+} LockProfileHandle;
+
+static MinitorLockStats lock_stats[LOCK_PROFILE_NAMES];
+static LockProfileHandle lock_handles[LOCK_PROFILE_HANDLES];
+
+static MinitorLockStats* px_lock_stats_for_name( const char* name )
+{
+  int i;
+  const char* expected;
+
+  for ( i = 0; i < LOCK_PROFILE_NAMES - 1; i++ )
+  {
+    expected = NULL;
+
+    if ( __atomic_compare_exchange_n( &lock_stats[i].name, &expected, name, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+    {
+      return &lock_stats[i];
+    }
+
+    if ( strcmp( expected, name ) == 0 )
+    {
+      return &lock_stats[i];
+    }
+  }
+
+  lock_stats[i].name = "other";
+
+  return &lock_stats[i];
+}
+
+static LockProfileHandle* px_lock_handle( MinitorMutex mutex )
+{
+  int i;
+  int start = ( (uintptr_t)mutex >> 3 ) & ( LOCK_PROFILE_HANDLES - 1 );
+  MinitorMutex found;
+  LockProfileHandle* handle;
+
+  for ( i = 0; i < LOCK_PROFILE_HANDLES; i++ )
+  {
+    handle = &lock_handles[( start + i ) & ( LOCK_PROFILE_HANDLES - 1 )];
+    found = __atomic_load_n( &handle->mutex, __ATOMIC_ACQUIRE );
+
+    if ( found == mutex )
+    {
+      return handle;
+    }
+
+    if ( found == NULL )
+    {
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+// a new handle claims the first empty slot after its hash, the stats pointer
+// is set before the mutex is published so a lookup never sees half of it
+MinitorMutex px_lock_profile_create( const char* name )
+{
+  int i;
+  int start;
+  MinitorLockStats* stats;
+  MinitorLockStats* expected;
+  LockProfileHandle* handle;
+  MinitorMutex mutex = xSemaphoreCreateMutex();
+
+  if ( mutex == NULL )
+  {
+    return NULL;
+  }
+
+  stats = px_lock_stats_for_name( name );
+  start = ( (uintptr_t)mutex >> 3 ) & ( LOCK_PROFILE_HANDLES - 1 );
+
+  for ( i = 0; i < LOCK_PROFILE_HANDLES; i++ )
+  {
+    handle = &lock_handles[( start + i ) & ( LOCK_PROFILE_HANDLES - 1 )];
+
+    expected = NULL;
+
+    if ( __atomic_compare_exchange_n( &handle->stats, &expected, stats, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+    {
+      __atomic_store_n( &handle->mutex, mutex, __ATOMIC_RELEASE );
+
+      break;
+    }
+  }
+
+  return mutex;
+}
+
+static void v_lock_profile_max( uint32_t* max, uint32_t value, const char** file_p, int* line_p, const char* file, int line )
+{
+  uint32_t current = __atomic_load_n( max, __ATOMIC_RELAXED );
+
+  while ( value > current )
+  {
+    if ( __atomic_compare_exchange_n( max, &current, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    {
+      // another task can race us here, the site may belong to a close second
+      *file_p = file;
+      *line_p = line;
+
+      break;
+    }
+  }
+}
+
+BaseType_t d_lock_profile_take( MinitorMutex mutex, TickType_t ticks, const char* file, int line )
+{
+  BaseType_t succ;
+  uint32_t wait_us;
+  int64_t start_us = MINITOR_GET_TIME();
+  LockProfileHandle* handle;
+
+  succ = xSemaphoreTake( mutex, ticks );
+
+  handle = px_lock_handle( mutex );
+
+  if ( handle == NULL )
+  {
+    return succ;
+  }
+
+  if ( succ != pdTRUE )
+  {
+    __atomic_fetch_add( &handle->stats->timeouts, 1, __ATOMIC_RELAXED );
+
+    return succ;
+  }
+
+  handle->taken_us = MINITOR_GET_TIME();
+  handle->taken_file = file;
+  handle->taken_line = line;
+
+  wait_us = (uint32_t)( handle->taken_us - start_us );
+
+  __atomic_fetch_add( &handle->stats->acquisitions, 1, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &handle->stats->total_wait_us, wait_us, __ATOMIC_RELAXED );
+  v_lock_profile_max( &handle->stats->max_wait_us, wait_us, &handle->stats->max_wait_file, &handle->stats->max_wait_line, file, line );
+
+  return succ;
+}
+
+BaseType_t d_lock_profile_give( MinitorMutex mutex )
+{
+  uint32_t hold_us;
+  LockProfileHandle* handle = px_lock_handle( mutex );
+
+  if ( handle != NULL )
+  {
+    hold_us = (uint32_t)( MINITOR_GET_TIME() - handle->taken_us );
+
+    __atomic_fetch_add( &handle->stats->total_hold_us, hold_us, __ATOMIC_RELAXED );
+    v_lock_profile_max( &handle->stats->max_hold_us, hold_us, &handle->stats->max_hold_file, &handle->stats->max_hold_line, handle->taken_file, handle->taken_line );
+  }
+
+  return xSemaphoreGive( mutex );
+}
+
+// copies up to max named entries and returns how many
+int d_minitor_get_lock_stats( MinitorLockStats* stats, int max )
+{
+  int i;
+  int count = 0;
+
+  for ( i = 0; i < LOCK_PROFILE_NAMES && count < max; i++ )
+  {
+    if ( __atomic_load_n( &lock_stats[i].name, __ATOMIC_ACQUIRE ) == NULL )
+    {
+      continue;
+    }
+
+    memcpy( &stats[count], &lock_stats[i], sizeof( MinitorLockStats ) );
+    count++;
+  }
+
+  return count;
+}
+
+#endif
@@ -25,22 +25,28 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "../h/consensus.h"
 #include "../h/circuit.h"
+#include "../h/cell.h"
 #include "../h/onion_service.h"
 #include "../h/connections.h"
 #include "../h/core.h"
+#include "../h/crypto_pool.h"
+#include "../h/key_pool.h"
+#include "../h/crypto_provider.h"
+#include "../h/bench.h"
+#include "../h/padding.h"
+#include "../h/stats.h"
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CORE
 
 WOLFSSL_CTX* xMinitorWolfSSL_Context;
 
 static void v_timer_trigger_timeout( MinitorTimer x_timer )
 {
-  int succ;
   OnionMessage* onion_message = malloc( sizeof( OnionMessage ) );
   onion_message->type = TIMER_CIRCUIT_TIMEOUT;
 
-  succ = MINITOR_ENQUEUE_MS( core_task_queue, (void*)(&onion_message), 0 );
-
   // try again in half a second
-  if ( succ == pdFALSE )
+  if ( b_core_enqueue_ms( onion_message, 0 ) == false )
   {
     free( onion_message );
     MINITOR_TIMER_SET_MS_BLOCKING( x_timer, 500 );
@@ -49,14 +55,11 @@ static void v_timer_trigger_timeout( MinitorTimer x_timer )
 
 static void v_timer_trigger_consensus( MinitorTimer x_timer )
 {
-  int succ;
   OnionMessage* onion_message = malloc( sizeof( OnionMessage ) );
   onion_message->type = TIMER_CONSENSUS;
 
-  succ = MINITOR_ENQUEUE_MS( core_task_queue, (void*)(&onion_message), 0 );
-
   // try again in half a second
-  if ( succ == pdFALSE )
+  if ( b_core_enqueue_ms( onion_message, 0 ) == false )
   {
     free( onion_message );
     MINITOR_TIMER_SET_MS_BLOCKING( x_timer, 500 );
@@ -65,14 +68,11 @@ static void v_timer_trigger_consensus( MinitorTimer x_timer )
 
 static void v_timer_trigger_keepalive( MinitorTimer x_timer )
 {
-  int succ;
   OnionMessage* onion_message = malloc( sizeof( OnionMessage ) );
   onion_message->type = TIMER_KEEPALIVE;
 
-  succ = MINITOR_ENQUEUE_MS( core_task_queue, (void*)(&onion_message), 0 );
-
   // try again in half a second
-  if ( succ == pdFALSE )
+  if ( b_core_enqueue_ms( onion_message, 0 ) == false )
   {
     free( onion_message );
     MINITOR_TIMER_SET_MS_BLOCKING( x_timer, 500 );
@@ -81,15 +81,12 @@ static void v_timer_trigger_keepalive( MinitorTimer x_timer )
 
 static void v_timer_trigger_hsdir_update( MinitorTimer x_timer )
 {
-  int succ;
   OnionMessage* onion_message = malloc( sizeof( OnionMessage ) );
   onion_message->type = TIMER_HSDIR;
   onion_message->data = pvTimerGetTimerID( x_timer );
 
-  succ = MINITOR_ENQUEUE_MS( core_task_queue, (void*)(&onion_message), 0 );
-
   // try again in half a second
-  if ( succ == pdFALSE )
+  if ( b_core_enqueue_ms( onion_message, 0 ) == false )
   {
     free( onion_message );
     MINITOR_TIMER_SET_MS_BLOCKING( x_timer, 500 );
@@ -99,16 +96,49 @@ static void v_timer_trigger_hsdir_update( MinitorTimer x_timer )
 // intialize tor
 int d_minitor_INIT()
 {
-  circ_id_mutex = MINITOR_MUTEX_CREATE();
-  network_consensus_mutex = MINITOR_MUTEX_CREATE();
-  crypto_insert_finish = MINITOR_MUTEX_CREATE();
-  connections_mutex = MINITOR_MUTEX_CREATE();
-  circuits_mutex = MINITOR_MUTEX_CREATE();
-  fastest_cache_mutex = MINITOR_MUTEX_CREATE();
+  int i;
+
+  circ_id_mutex = MINITOR_MUTEX_CREATE( "circ_id_mutex" );
+  network_consensus_mutex = MINITOR_MUTEX_CREATE( "network_consensus_mutex" );
+  crypto_insert_finish = MINITOR_MUTEX_CREATE( "crypto_insert_finish" );
+  connections_mutex = MINITOR_MUTEX_CREATE( "connections_mutex" );
+  circuits_mutex = MINITOR_MUTEX_CREATE( "circuits_mutex" );
+  fastest_cache_mutex = MINITOR_MUTEX_CREATE( "fastest_cache_mutex" );
+  cell_pool_mutex = MINITOR_MUTEX_CREATE( "cell_pool_mutex" );
+  local_streams_mutex = MINITOR_MUTEX_CREATE( "local_streams_mutex" );
+  padding_mutex = MINITOR_MUTEX_CREATE( "padding_mutex" );
+
+  for ( i = 0; i < MINITOR_CORE_SHARDS; i++ )
+  {
+    core_shards[i].lane_queues[CORE_LANE_CONTROL] = MINITOR_QUEUE_CREATE( MINITOR_CORE_CONTROL_DEPTH, sizeof( OnionMessage* ) );
+    core_shards[i].lane_queues[CORE_LANE_BULK] = MINITOR_QUEUE_CREATE( MINITOR_CORE_BULK_DEPTH, sizeof( OnionMessage* ) );
+    core_shards[i].wake_semaphore = MINITOR_SEMAPHORE_CREATE_COUNTING( MINITOR_CORE_CONTROL_DEPTH + MINITOR_CORE_BULK_DEPTH, 0 );
+  }
+
+  // every queue has to exist before any shard can post to another
+  for ( i = 0; i < MINITOR_CORE_SHARDS; i++ )
+  {
+    b_create_core_task( NULL, i );
+  }
+
+#if MINITOR_KEY_POOL_SIZE > 0
+  ephemeral_key_queue = MINITOR_QUEUE_CREATE( MINITOR_KEY_POOL_SIZE, sizeof( curve25519_key* ) );
+
+  b_create_key_pool_task( NULL );
+#endif
 
-  core_task_queue = MINITOR_QUEUE_CREATE( 25, sizeof( OnionMessage* ) );
+#if MINITOR_CRYPTO_WORKERS > 0
+  crypto_job_queue = MINITOR_QUEUE_CREATE( MINITOR_CRYPTO_QUEUE_DEPTH, sizeof( CryptoJob* ) );
 
-  b_create_core_task( NULL );
+  for ( i = 0; i < MINITOR_CRYPTO_WORKERS; i++ )
+  {
+    b_create_crypto_task( NULL );
+  }
+#endif
+
+#ifdef MINITOR_STATS_PORT
+  b_create_stats_task( NULL );
+#endif
 
   consensus_timer = MINITOR_TIMER_CREATE_MS(
     "CONSENSUS_TIMER",
@@ -140,6 +170,18 @@ int d_minitor_INIT()
   wolfSSL_Init();
   /* wolfSSL_Debugging_ON(); */
 
+  // nothing has touched a relay cell yet so the backend can still change
+  if ( d_crypto_provider_init() < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "crypto self test failed" );
+
+    return -1;
+  }
+
+#ifdef MINITOR_BENCHMARK
+  d_minitor_bench();
+#endif
+
   //if ( ( xMinitorWolfSSL_Context = wolfSSL_CTX_new( wolfTLSv1_3_client_method() ) ) == NULL )
   if ( ( xMinitorWolfSSL_Context = wolfSSL_CTX_new( wolfTLSv1_2_client_method() ) ) == NULL )
   {
@@ -161,6 +203,12 @@ int d_minitor_INIT()
 
 // ONION SERVICES
 int d_setup_onion_service( unsigned short local_port, unsigned short exit_port, const char* onion_service_directory )
+{
+  return d_setup_onion_service_ex( local_port, exit_port, onion_service_directory, MINITOR_LOCAL_COALESCE_MS );
+}
+
+// coalesce_ms of 0 turns off read coalescing for latency sensitive services
+int d_setup_onion_service_ex( unsigned short local_port, unsigned short exit_port, const char* onion_service_directory, unsigned int coalesce_ms )
 {
   OnionMessage* onion_message;
   OnionService* service = malloc( sizeof( OnionService ) );
@@ -169,6 +217,7 @@ int d_setup_onion_service( unsigned short local_port, unsigned short exit_port,
 
   service->local_port = local_port;
   service->exit_port = exit_port;
+  service->local_coalesce_ms = coalesce_ms;
   service->rend_timestamp = 0;
 
   service->hsdir_timer = MINITOR_TIMER_CREATE_MS(
@@ -193,7 +242,7 @@ int d_setup_onion_service( unsigned short local_port, unsigned short exit_port,
   onion_message->type = INIT_SERVICE;
   onion_message->data = service;
 
-  MINITOR_ENQUEUE_BLOCKING( core_task_queue, (void*)(&onion_message) );
+  v_core_enqueue_blocking( onion_message );
 
   return 0;
 }
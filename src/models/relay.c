@@ -33,6 +33,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../../h/consensus.h"
 #include "../../h/models/relay.h"
 
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CONSENSUS
+
 uint32_t hsdir_relay_count = 0;
 uint32_t cache_relay_count = 0;
 uint32_t fast_relay_count = 0;
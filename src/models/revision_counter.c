@@ -25,6 +25,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "../../h/constants.h"
 
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_ONION_SERVICE
+
 int d_roll_revision_counter()
 {
   int fd;
@@ -27,42 +27,42 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../h/consensus.h"
 #include "../h/encoding.h"
 #include "../h/cell.h"
+#include "../h/crypto_provider.h"
 #include "../h/circuit.h"
 #include "../h/connections.h"
 #include "../h/core.h"
+#include "../h/crypto_pool.h"
+#include "../h/key_pool.h"
 #include "../h/models/relay.h"
 #include "../h/models/revision_counter.h"
+#include "../h/trace.h"
+#include "../h/stats.h"
 
-void v_onion_service_handle_local_tcp_data( OnionCircuit* circuit, DlConnection* or_connection, ServiceTcpTraffic* tcp_traffic )
-{
-  int i;
-  Cell* relay_cell;
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_ONION_SERVICE
 
-  relay_cell = malloc( MINITOR_CELL_LEN );
-
-  relay_cell->circ_id = tcp_traffic->circ_id;
+// the relay_cell comes from the connections daemon with the payload already in
+// place, we only need to fill in the rest of the relay header
+void v_onion_service_handle_local_tcp_data( OnionCircuit* circuit, DlConnection* or_connection, Cell* relay_cell )
+{
   relay_cell->command = RELAY;
 
   relay_cell->payload.relay.recognized = 0;
-  relay_cell->payload.relay.stream_id = tcp_traffic->stream_id;
   relay_cell->payload.relay.digest = 0;
 
-  if ( tcp_traffic->length == 0 )
+  if ( relay_cell->payload.relay.relay_command == RELAY_END )
   {
-    relay_cell->payload.relay.relay_command = RELAY_END;
-    relay_cell->payload.relay.length = 1;
+    v_set_relay_length( relay_cell, 1 );
     relay_cell->payload.relay.destroy_code = REASON_DONE;
   }
-  else
-  {
-    relay_cell->payload.relay.relay_command = RELAY_DATA;
-    relay_cell->payload.relay.length = (uint16_t)tcp_traffic->length;
-    memcpy( relay_cell->payload.relay.data, tcp_traffic->data, tcp_traffic->length );
 
-    free( tcp_traffic->data );
-  }
+  relay_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + ud_get_relay_length( relay_cell );
 
-  relay_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + relay_cell->payload.relay.length;
+  MINITOR_TRACE( TRACE_STREAM_DATA_OUT, ud_get_relay_stream_id( relay_cell ), relay_cell->payload.relay.relay_command );
+
+  if ( relay_cell->payload.relay.relay_command == RELAY_DATA )
+  {
+    MINITOR_STAT_ADD( STAT_STREAM_BYTES_OUT, ud_get_relay_length( relay_cell ) );
+  }
 
   if ( d_send_relay_cell_and_free( or_connection, relay_cell, &circuit->relay_list, circuit->hs_crypto ) < 0 )
   {
@@ -70,12 +70,15 @@ void v_onion_service_handle_local_tcp_data( OnionCircuit* circuit, DlConnection*
   }
 }
 
-// at this point we have a lock on the connection access mutex
-void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connection, Cell* relay_cell )
+// at this point we have a lock on the connection access mutex, returns true
+// if we still hold it and the caller must give it
+bool b_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connection, Cell* relay_cell )
 {
+  int succ;
+  Cell* sendme_cell;
   MinitorMutex access_mutex;
 
-  access_mutex = connection_access_mutex[or_connection->mutex_index];
+  access_mutex = or_connection->access_mutex;
 
   switch( relay_cell->command )
   {
@@ -95,18 +98,32 @@ void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connec
 
           break;
         case RELAY_DATA:
-          if
-          (
-            d_forward_to_local_connection(
-              relay_cell->circ_id,
-              relay_cell->payload.relay.stream_id,
-              relay_cell->payload.relay.data,
-              relay_cell->payload.relay.length
-            ) < 0
-          )
+          MINITOR_TRACE( TRACE_STREAM_DATA_IN, ud_get_relay_stream_id( relay_cell ), ud_get_relay_length( relay_cell ) );
+          MINITOR_STAT_ADD( STAT_STREAM_BYTES_IN, ud_get_relay_length( relay_cell ) );
+
+          succ = d_forward_to_local_connection(
+            ud_get_cell_circ_id( relay_cell ),
+            ud_get_relay_stream_id( relay_cell ),
+            relay_cell->payload.relay.data,
+            ud_get_relay_length( relay_cell )
+          );
+
+          if ( succ < 0 )
           {
             MINITOR_LOG( MINITOR_TAG, "Failed to handle RELAY_DATA cell" );
           }
+          // the local server is keeping up, let the client send more
+          else if ( succ > 0 )
+          {
+            sendme_cell = px_take_pooled_cell();
+
+            v_set_cell_circ_id( sendme_cell, ud_get_cell_circ_id( relay_cell ) );
+            sendme_cell->payload.relay.relay_command = RELAY_SENDME;
+            v_set_relay_stream_id( sendme_cell, ud_get_relay_stream_id( relay_cell ) );
+            v_set_relay_length( sendme_cell, 0 );
+
+            v_onion_service_handle_local_tcp_data( circuit, or_connection, sendme_cell );
+          }
 
           break;
         case RELAY_END:
@@ -115,7 +132,7 @@ void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connec
 
           access_mutex = NULL;
 
-          v_cleanup_local_connection( relay_cell->circ_id, relay_cell->payload.relay.stream_id );
+          v_cleanup_local_connection( ud_get_cell_circ_id( relay_cell ), ud_get_relay_stream_id( relay_cell ) );
 
           break;
         case RELAY_TRUNCATED:
@@ -158,11 +175,7 @@ void v_onion_service_handle_cell( OnionCircuit* circuit, DlConnection* or_connec
 #endif
   }
 
-  if ( access_mutex != NULL )
-  {
-    MINITOR_MUTEX_GIVE( access_mutex );
-    // MUTEX GIVE
-  }
+  return access_mutex != NULL;
 }
 
 int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection* or_connection, Cell* begin_cell )
@@ -206,7 +219,7 @@ int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection
     goto finish;
   }
 
-  if ( d_create_local_connection( begin_cell->circ_id, begin_cell->payload.relay.stream_id, rend_circuit->service->local_port ) < 0 )
+  if ( d_create_local_connection( ud_get_cell_circ_id( begin_cell ), ud_get_relay_stream_id( begin_cell ), rend_circuit->service->local_port, rend_circuit->service->local_coalesce_ms ) < 0 )
   {
     MINITOR_LOG( MINITOR_TAG, "couldn't create local connection" );
 
@@ -214,6 +227,8 @@ int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection
     goto finish;
   }
 
+  MINITOR_STAT_INC( STAT_STREAMS_OPENED );
+
   // re-aquire our connection lock
   // MUTEX TAKE
   or_connection = px_get_conn_by_id_and_lock( or_connection->conn_id );
@@ -227,14 +242,14 @@ int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection
   connected_cell = malloc( MINITOR_CELL_LEN );
 
   connected_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE;
-  connected_cell->circ_id = begin_cell->circ_id;
+  v_set_cell_circ_id( connected_cell, ud_get_cell_circ_id( begin_cell ) );
   connected_cell->command = RELAY;
 
   connected_cell->payload.relay.relay_command = RELAY_CONNECTED;
   connected_cell->payload.relay.recognized = 0;
-  connected_cell->payload.relay.stream_id = begin_cell->payload.relay.stream_id;
+  v_set_relay_stream_id( connected_cell, ud_get_relay_stream_id( begin_cell ) );
   connected_cell->payload.relay.digest = 0;
-  connected_cell->payload.relay.length = 0;
+  v_set_relay_length( connected_cell, 0 );
 
   if ( d_send_relay_cell_and_free( or_connection, connected_cell, &rend_circuit->relay_list, rend_circuit->hs_crypto ) < 0 )
   {
@@ -243,7 +258,7 @@ int d_onion_service_handle_relay_begin( OnionCircuit* rend_circuit, DlConnection
     ret = -1;
   }
 
-  MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+  MINITOR_MUTEX_GIVE( or_connection->access_mutex );
   // MUTEX GIVE
 
 finish:
@@ -269,31 +284,20 @@ int d_onion_service_handle_relay_truncated( OnionCircuit* rend_circuit, DlConnec
 
   free( rend_circuit );
 
-  v_cleanup_local_connections_by_circ_id( truncated_cell->circ_id );
+  v_cleanup_local_connections_by_circ_id( ud_get_cell_circ_id( truncated_cell ) );
 
   return 0;
 }
 
+// runs on the core task, the checks that need the intro circuit are done here
+// and the handshake is handed to a crypto worker with copies of the keys
 int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* introduce_cell )
 {
-  int ret = 0;
-  int i;
-  int wolf_succ;
+  int ret;
   time_t now;
-  uint8_t* introduce_p;
-  uint8_t* client_pk;
-  uint8_t num_specifiers;
-  uint8_t num_extensions;
-  unsigned char auth_input_mac[MAC_LEN];
-  WC_RNG rng;
-  curve25519_key hs_handshake_key;
-  curve25519_key client_handshake_key;
-  DoublyLinkedRendezvousCookie* db_rendezvous_cookie;
-  OnionRelay* rend_relay;
-  HsCrypto* hs_crypto;
-  OnionCircuit* rend_circuit;
-  DoublyLinkedOnionRelay* dl_relay;
-  DlConnection* or_connection = NULL;
+  CryptoJob* job;
+
+  MINITOR_STAT_INC( STAT_INTRODUCE2_RECEIVED );
 
   time( &now );
 
@@ -303,38 +307,100 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
     MINITOR_LOG( MINITOR_TAG, "Rate limit in effect, dropping intro" );
 #endif
 
+    MINITOR_STAT_INC( STAT_INTRODUCE2_RATE_LIMITED );
+
     return -1;
   }
 
-  wc_curve25519_init( &client_handshake_key );
-  wc_curve25519_init( &hs_handshake_key );
+  if ( intro_circuit->intro_jobs_pending >= MINITOR_INTRO_JOBS_PER_CIRCUIT )
+  {
+#ifdef DEBUG_MINITOR
+    MINITOR_LOG( MINITOR_TAG, "Too many intros in progress, dropping intro" );
+#endif
 
-  wc_InitRng( &rng );
+    MINITOR_STAT_INC( STAT_INTRODUCE2_BUSY );
+
+    return -1;
+  }
 
   if ( introduce_cell->payload.relay.introduce2.auth_key_type != EDSHA3 )
   {
     MINITOR_LOG( MINITOR_TAG, "Auth key type for RELAY_COMMAND_INTRODUCE2 was not EDSHA3" );
 
-    ret = -1;
-    goto finish;
+    MINITOR_STAT_INC( STAT_INTRODUCE2_REJECTED );
+
+    return -1;
   }
 
-  if ( introduce_cell->payload.relay.introduce2.auth_key_length != 32 )
+  if ( ud_get_introduce2_auth_key_length( introduce_cell ) != 32 )
   {
     MINITOR_LOG( MINITOR_TAG, "Auth key length for RELAY_COMMAND_INTRODUCE2 was not 32" );
 
-    ret = -1;
-    goto finish;
+    MINITOR_STAT_INC( STAT_INTRODUCE2_REJECTED );
+
+    return -1;
   }
 
   if ( memcmp( introduce_cell->payload.relay.introduce2.auth_key, intro_circuit->intro_crypto->auth_key.p, 32 ) != 0 )
   {
     MINITOR_LOG( MINITOR_TAG, "Auth key for RELAY_COMMAND_INTRODUCE2 does not match" );
 
-    ret = -1;
-    goto finish;
+    MINITOR_STAT_INC( STAT_INTRODUCE2_REJECTED );
+
+    return -1;
   }
 
+  job = malloc( sizeof( CryptoJob ) );
+
+  memset( job, 0, sizeof( CryptoJob ) );
+
+  job->type = CRYPTO_JOB_INTRODUCE_2;
+  job->circuit = intro_circuit;
+  job->circ_id = intro_circuit->circ_id;
+  job->received_us = MINITOR_GET_TIME();
+
+  job->cell = malloc( MINITOR_CELL_LEN );
+  memcpy( job->cell, introduce_cell, MINITOR_CELL_LEN );
+
+  memcpy( &job->encrypt_key, &intro_circuit->intro_crypto->encrypt_key, sizeof( curve25519_key ) );
+  memcpy( job->current_sub_credential, intro_circuit->service->current_sub_credential, WC_SHA3_256_DIGEST_SIZE );
+  memcpy( job->previous_sub_credential, intro_circuit->service->previous_sub_credential, WC_SHA3_256_DIGEST_SIZE );
+
+  intro_circuit->intro_jobs_pending++;
+
+  if ( b_submit_crypto_job( job ) == true )
+  {
+    return 0;
+  }
+
+  // no worker could take it, do it here
+  intro_circuit->intro_jobs_pending--;
+
+  v_run_crypto_job( job );
+
+  ret = d_onion_service_finish_introduce_2( intro_circuit, job );
+
+  v_free_crypto_job( job );
+
+  return ret;
+}
+
+// runs on a crypto worker, only touches the job
+int d_onion_service_introduce_2_crypto( CryptoJob* job )
+{
+  int ret = 0;
+  int i;
+  int wolf_succ;
+  uint8_t* introduce_p;
+  uint8_t* client_pk;
+  uint8_t num_extensions;
+  curve25519_key hs_handshake_key;
+  curve25519_key client_handshake_key;
+  Cell* introduce_cell = job->cell;
+
+  wc_curve25519_init( &client_handshake_key );
+  wc_curve25519_init( &hs_handshake_key );
+
   introduce_p = introduce_cell->payload.relay.introduce2.auth_key + 32;
 
   num_extensions = introduce_p[0];
@@ -363,7 +429,7 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
   introduce_p += PK_PUBKEY_LEN;
 
   // verify and decrypt
-  if ( d_verify_and_decrypt_introduce_2( intro_circuit->service, introduce_cell, num_extensions, client_pk, introduce_p, intro_circuit, &client_handshake_key ) < 0 )
+  if ( d_verify_and_decrypt_introduce_2( job->current_sub_credential, job->previous_sub_credential, introduce_cell, num_extensions, client_pk, introduce_p, &job->encrypt_key, &client_handshake_key ) < 0 )
   {
     MINITOR_LOG( MINITOR_TAG, "Failed to verify and decrypt RELAY_COMMAND_INTRODUCE2" );
 
@@ -371,49 +437,96 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
     goto finish;
   }
 
-  db_rendezvous_cookie = intro_circuit->service->rendezvous_cookies.head;
+  job->decrypted_offset = introduce_p - (uint8_t*)introduce_cell;
 
-  for ( i = 0; i < intro_circuit->service->rendezvous_cookies.length; i++ )
+  if ( d_take_ephemeral_key( &hs_handshake_key ) < 0 )
   {
-    if ( memcmp( db_rendezvous_cookie->rendezvous_cookie, ((DecryptedIntroduce2*)introduce_p)->rendezvous_cookie, 20 ) == 0 )
-    {
-      MINITOR_LOG( MINITOR_TAG, "Got a replay, silently dropping" );
+    MINITOR_LOG( MINITOR_TAG, "Failed to make hs_handshake_key" );
 
-      goto finish;
-    }
+    ret = -1;
+    goto finish;
+  }
 
-    db_rendezvous_cookie = db_rendezvous_cookie->next;
+  job->hs_crypto = malloc( sizeof( HsCrypto ) );
+
+  if ( d_hs_ntor_handshake_finish( introduce_cell, client_pk, &job->encrypt_key, &hs_handshake_key, &client_handshake_key, job->hs_crypto, job->auth_input_mac ) < 0 )
+  {
+    MINITOR_LOG( MINITOR_TAG, "Failed to finish the RELAY_COMMAND_INTRODUCE2 ntor handshake" );
+
+    free( job->hs_crypto );
+    job->hs_crypto = NULL;
+
+    ret = -1;
+    goto finish;
   }
 
-  db_rendezvous_cookie = malloc( sizeof( DoublyLinkedRendezvousCookie ) );
+  memcpy( job->hs_point, hs_handshake_key.p.point, PK_PUBKEY_LEN );
 
-  // copy rendezvous cookie
-  memcpy( db_rendezvous_cookie->rendezvous_cookie, ((DecryptedIntroduce2*)introduce_p)->rendezvous_cookie, 20 );
+finish:
+  wc_curve25519_free( &client_handshake_key );
+  wc_curve25519_free( &hs_handshake_key );
 
-  v_add_rendezvous_cookie_to_list( db_rendezvous_cookie, &intro_circuit->service->rendezvous_cookies );
+  return ret;
+}
+
+// back on the core task, checks for a replay and starts the rendezvous
+int d_onion_service_finish_introduce_2( OnionCircuit* intro_circuit, CryptoJob* job )
+{
+  int ret = 0;
+  int i;
+  time_t now;
+  uint8_t* introduce_p;
+  uint8_t num_specifiers;
+  uint8_t num_extensions;
+  DoublyLinkedRendezvousCookie* db_rendezvous_cookie;
+  OnionRelay* rend_relay;
+  HsCrypto* hs_crypto;
+  OnionCircuit* rend_circuit;
+  uint32_t rend_circ_id;
+  uint32_t rend_conn_id;
+  DoublyLinkedOnionRelay* dl_relay;
+  DlConnection* or_connection = NULL;
 
-  wolf_succ = wc_curve25519_make_key( &rng, 32, &hs_handshake_key );
+  if ( job->result < 0 )
+  {
+    return -1;
+  }
 
-  if ( wolf_succ != 0 )
+  time( &now );
+
+  // another intro may have finished while this one was with a worker
+  if ( now - intro_circuit->service->rend_timestamp < 20 )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to make hs_handshake_key, error code %d", wolf_succ );
+#ifdef DEBUG_MINITOR
+    MINITOR_LOG( MINITOR_TAG, "Rate limit in effect, dropping intro" );
+#endif
 
-    ret = -1;
-    goto finish;
+    return -1;
   }
 
-  hs_crypto = malloc( sizeof( HsCrypto ) );
+  introduce_p = (uint8_t*)job->cell + job->decrypted_offset;
 
-  if ( d_hs_ntor_handshake_finish( introduce_cell, client_pk, intro_circuit, &hs_handshake_key, &client_handshake_key, hs_crypto, auth_input_mac ) < 0 )
+  db_rendezvous_cookie = intro_circuit->service->rendezvous_cookies.head;
+
+  for ( i = 0; i < intro_circuit->service->rendezvous_cookies.length; i++ )
   {
-    MINITOR_LOG( MINITOR_TAG, "Failed to finish the RELAY_COMMAND_INTRODUCE2 ntor handshake" );
+    if ( memcmp( db_rendezvous_cookie->rendezvous_cookie, ((DecryptedIntroduce2*)introduce_p)->rendezvous_cookie, 20 ) == 0 )
+    {
+      MINITOR_LOG( MINITOR_TAG, "Got a replay, silently dropping" );
 
-    free( hs_crypto );
+      return 0;
+    }
 
-    ret = -1;
-    goto finish;
+    db_rendezvous_cookie = db_rendezvous_cookie->next;
   }
 
+  db_rendezvous_cookie = malloc( sizeof( DoublyLinkedRendezvousCookie ) );
+
+  // copy rendezvous cookie
+  memcpy( db_rendezvous_cookie->rendezvous_cookie, ((DecryptedIntroduce2*)introduce_p)->rendezvous_cookie, 20 );
+
+  v_add_rendezvous_cookie_to_list( db_rendezvous_cookie, &intro_circuit->service->rendezvous_cookies );
+
   // extend to the specified relay and send the handshake reply
   rend_relay = malloc( sizeof( OnionRelay ) );
   rend_relay->address = 0;
@@ -434,17 +547,19 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
   {
     MINITOR_LOG( MINITOR_TAG, "Failed to get KEY_NTOR for onion key type" );
 
-    ret = -1;
-    goto finish;
+    free( rend_relay );
+
+    return -1;
   }
 
   // onion key length should be 32
-  if ( ntohs( ((IntroOnionKey*)introduce_p)->onion_key_length ) != 32 )
+  if ( ud_load_be16( &((IntroOnionKey*)introduce_p)->onion_key_length ) != 32 )
   {
     MINITOR_LOG( MINITOR_TAG, "Failed to get 32 for onion key length" );
 
-    ret = -1;
-    goto finish;
+    free( rend_relay );
+
+    return -1;
   }
 
   memcpy( rend_relay->ntor_onion_key, ((IntroOnionKey*)introduce_p)->onion_key, 32 );
@@ -485,6 +600,9 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
   {
     if ( rend_circuit->status == CIRCUIT_STANDBY )
     {
+      rend_circ_id = rend_circuit->circ_id;
+      rend_conn_id = rend_circuit->conn_id;
+
       break;
     }
 
@@ -494,9 +612,48 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
   MINITOR_MUTEX_GIVE( circuits_mutex );
   // MUTEX GIVE
 
+  // the standby may be owned by another core shard, the owner only touches
+  // it with the connection locked, so once we hold that lock check it is
+  // still in the list and still on standby
+  if ( rend_circuit != NULL )
+  {
+    // MUTEX TAKE
+    or_connection = px_get_conn_by_id_and_lock( rend_conn_id );
+
+    if ( or_connection == NULL )
+    {
+      rend_circuit = NULL;
+    }
+    else
+    {
+      // MUTEX TAKE
+      MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+      rend_circuit = px_get_circuit_by_circ_id( onion_circuits, rend_circ_id );
+
+      MINITOR_MUTEX_GIVE( circuits_mutex );
+      // MUTEX GIVE
+
+      if ( rend_circuit == NULL || rend_circuit->status != CIRCUIT_STANDBY )
+      {
+        rend_circuit = NULL;
+
+        MINITOR_MUTEX_GIVE( or_connection->access_mutex );
+        // MUTEX GIVE
+
+        or_connection = NULL;
+      }
+    }
+  }
+
+  // the circuit owns the keys from here on
+  hs_crypto = job->hs_crypto;
+  job->hs_crypto = NULL;
+
   memcpy( hs_crypto->rendezvous_cookie, db_rendezvous_cookie->rendezvous_cookie, 20 );
-  memcpy( hs_crypto->point, hs_handshake_key.p.point, PK_PUBKEY_LEN );
-  memcpy( hs_crypto->auth_input_mac, auth_input_mac, MAC_LEN );
+  memcpy( hs_crypto->point, job->hs_point, PK_PUBKEY_LEN );
+  memcpy( hs_crypto->auth_input_mac, job->auth_input_mac, MAC_LEN );
+  hs_crypto->introduce_us = job->received_us;
 
   if ( rend_circuit == NULL )
   {
@@ -509,13 +666,11 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
 
     v_add_relay_to_list( dl_relay, &rend_circuit->relay_list );
 
-    // MUTEX TAKE
-    or_connection = px_get_conn_by_id_and_lock( rend_circuit->conn_id );
-
-    if ( or_connection == NULL || d_router_extend2( rend_circuit, or_connection, rend_circuit->relay_list.built_length ) < 0 )
+    if ( d_router_extend2( rend_circuit, or_connection, rend_circuit->relay_list.built_length ) < 0 )
     {
 
-      wc_Sha3_256_Free( &hs_crypto->hs_running_sha_forward );
+      wc_Sha3_256_Free( &hs_crypto->hs_running_sha_forward[0] );
+      wc_Sha3_256_Free( &hs_crypto->hs_running_sha_forward[1] );
       wc_Sha3_256_Free( &hs_crypto->hs_running_sha_backward );
       wc_AesFree( &hs_crypto->hs_aes_forward );
       wc_AesFree( &hs_crypto->hs_aes_backward );
@@ -533,6 +688,8 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
       d_destroy_onion_circuit( rend_circuit, or_connection );
       // MUTEX GIVE
 
+      or_connection = NULL;
+
       free( rend_circuit );
 
       ret = -1;
@@ -547,19 +704,13 @@ int d_onion_service_handle_introduce_2( OnionCircuit* intro_circuit, Cell* intro
 
     if ( or_connection != NULL )
     {
-      MINITOR_MUTEX_GIVE( connection_access_mutex[or_connection->mutex_index] );
+      MINITOR_MUTEX_GIVE( or_connection->access_mutex );
       // MUTEX GIVE
     }
   }
 
   time( &( intro_circuit->service->rend_timestamp ) );
 
-finish:
-  wc_FreeRng( &rng );
-
-  wc_curve25519_free( &client_handshake_key );
-  wc_curve25519_free( &hs_handshake_key );
-
   return ret;
 }
 
@@ -569,16 +720,16 @@ int d_router_join_rendezvous( OnionCircuit* rend_circuit, DlConnection* or_conne
 
   rend_cell = malloc( MINITOR_CELL_LEN );
 
-  rend_cell->circ_id = rend_circuit->circ_id;
+  v_set_cell_circ_id( rend_cell, rend_circuit->circ_id );
   rend_cell->command = RELAY;
 
   rend_cell->payload.relay.relay_command = RELAY_COMMAND_RENDEZVOUS1;
   rend_cell->payload.relay.recognized = 0;
-  rend_cell->payload.relay.stream_id = 0;
+  v_set_relay_stream_id( rend_cell, 0 );
   rend_cell->payload.relay.digest = 0;
-  rend_cell->payload.relay.length = 20 + PK_PUBKEY_LEN + MAC_LEN;
+  v_set_relay_length( rend_cell, 20 + PK_PUBKEY_LEN + MAC_LEN );
 
-  rend_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + rend_cell->payload.relay.length;
+  rend_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + ud_get_relay_length( rend_cell );
 
   memcpy( rend_cell->payload.relay.rend2.rendezvous_cookie, rendezvous_cookie, 20 );
   memcpy( rend_cell->payload.relay.rend2.public_key, hs_pub_key, PK_PUBKEY_LEN );
@@ -595,12 +746,13 @@ int d_router_join_rendezvous( OnionCircuit* rend_circuit, DlConnection* or_conne
 }
 
 int d_verify_and_decrypt_introduce_2(
-  OnionService* onion_service,
+  uint8_t* current_sub_credential,
+  uint8_t* previous_sub_credential,
   Cell* introduce_cell,
   uint8_t num_extensions,
   uint8_t* client_pk,
   uint8_t* encrypted_data,
-  OnionCircuit* intro_circuit,
+  curve25519_key* encrypt_key,
   curve25519_key* client_handshake_key
 )
 {
@@ -621,7 +773,7 @@ int d_verify_and_decrypt_introduce_2(
   int64_t reusable_length;
   unsigned char reusable_length_buffer[8];
 
-  encrypted_length = introduce_cell->payload.relay.length - (uint16_t)( encrypted_data - introduce_cell->payload.relay.data + MAC_LEN );
+  encrypted_length = ud_get_relay_length( introduce_cell ) - (uint16_t)( encrypted_data - introduce_cell->payload.relay.data + MAC_LEN );
 
   wc_AesInit( &aes_key, NULL, INVALID_DEVID );
   wc_InitShake256( &reusable_shake, NULL, INVALID_DEVID );
@@ -629,7 +781,7 @@ int d_verify_and_decrypt_introduce_2(
 
   // compute intro_secret_hs_input
   idx = 32;
-  wolf_succ = wc_curve25519_shared_secret_ex( &intro_circuit->intro_crypto->encrypt_key, client_handshake_key, working_intro_secret_hs_input, &idx, EC25519_LITTLE_ENDIAN );
+  wolf_succ = MINITOR_X25519_SHARED_SECRET( encrypt_key, client_handshake_key, working_intro_secret_hs_input, &idx );
 
   if ( wolf_succ < 0 || idx != 32 )
   {
@@ -641,15 +793,15 @@ int d_verify_and_decrypt_introduce_2(
 
   working_intro_secret_hs_input += 32;
 
-  memcpy( working_intro_secret_hs_input, introduce_cell->payload.relay.introduce2.auth_key, introduce_cell->payload.relay.introduce2.auth_key_length );
+  memcpy( working_intro_secret_hs_input, introduce_cell->payload.relay.introduce2.auth_key, ud_get_introduce2_auth_key_length( introduce_cell ) );
 
-  working_intro_secret_hs_input += introduce_cell->payload.relay.introduce2.auth_key_length;
+  working_intro_secret_hs_input += ud_get_introduce2_auth_key_length( introduce_cell );
 
   memcpy( working_intro_secret_hs_input, client_pk, 32 );
 
   working_intro_secret_hs_input += 32;
 
-  memcpy( working_intro_secret_hs_input, intro_circuit->intro_crypto->encrypt_key.p.point, 32 );
+  memcpy( working_intro_secret_hs_input, encrypt_key->p.point, 32 );
 
   working_intro_secret_hs_input += 32;
 
@@ -661,11 +813,11 @@ int d_verify_and_decrypt_introduce_2(
   {
     if ( i == 0 )
     {
-      memcpy( info + HS_PROTOID_EXPAND_LENGTH, onion_service->current_sub_credential, WC_SHA3_256_DIGEST_SIZE );
+      memcpy( info + HS_PROTOID_EXPAND_LENGTH, current_sub_credential, WC_SHA3_256_DIGEST_SIZE );
     }
     else
     {
-      memcpy( info + HS_PROTOID_EXPAND_LENGTH, onion_service->previous_sub_credential, WC_SHA3_256_DIGEST_SIZE );
+      memcpy( info + HS_PROTOID_EXPAND_LENGTH, previous_sub_credential, WC_SHA3_256_DIGEST_SIZE );
     }
 
     // compute hs_keys
@@ -693,11 +845,11 @@ int d_verify_and_decrypt_introduce_2(
 
     wc_Sha3_256_Update( &reusable_sha3, reusable_length_buffer, 1 );
 
-    reusable_length_buffer[0] = (uint8_t)( introduce_cell->payload.relay.introduce2.auth_key_length >> 8 );
-    reusable_length_buffer[1] = (uint8_t)introduce_cell->payload.relay.introduce2.auth_key_length;
+    reusable_length_buffer[0] = (uint8_t)( ud_get_introduce2_auth_key_length( introduce_cell ) >> 8 );
+    reusable_length_buffer[1] = (uint8_t)ud_get_introduce2_auth_key_length( introduce_cell );
 
     wc_Sha3_256_Update( &reusable_sha3, reusable_length_buffer, 2 );
-    wc_Sha3_256_Update( &reusable_sha3, introduce_cell->payload.relay.introduce2.auth_key, introduce_cell->payload.relay.introduce2.auth_key_length );
+    wc_Sha3_256_Update( &reusable_sha3, introduce_cell->payload.relay.introduce2.auth_key, ud_get_introduce2_auth_key_length( introduce_cell ) );
     wc_Sha3_256_Update( &reusable_sha3, &num_extensions, 1 );
 
     wc_Sha3_256_Update( &reusable_sha3, client_pk, PK_PUBKEY_LEN );
@@ -705,7 +857,7 @@ int d_verify_and_decrypt_introduce_2(
     wc_Sha3_256_Final( &reusable_sha3, reusable_sha3_sum );
 
     // compare the mac
-    if ( memcmp( reusable_sha3_sum, introduce_cell->payload.relay.data + introduce_cell->payload.relay.length - MAC_LEN, WC_SHA3_256_DIGEST_SIZE ) == 0 )
+    if ( memcmp( reusable_sha3_sum, introduce_cell->payload.relay.data + ud_get_relay_length( introduce_cell ) - MAC_LEN, WC_SHA3_256_DIGEST_SIZE ) == 0 )
     {
       i = 0;
       break;
@@ -746,7 +898,7 @@ finish:
 int d_hs_ntor_handshake_finish(
   Cell* introduce_cell,
   uint8_t* client_pk,
-  OnionCircuit* intro_circuit,
+  curve25519_key* encrypt_key,
   curve25519_key* hs_handshake_key,
   curve25519_key* client_handshake_key,
   HsCrypto* hs_crypto,
@@ -772,7 +924,7 @@ int d_hs_ntor_handshake_finish(
 
   // compute rend_secret_hs_input
   idx = 32;
-  wolf_succ = wc_curve25519_shared_secret_ex( hs_handshake_key, client_handshake_key, working_rend_secret_hs_input, &idx, EC25519_LITTLE_ENDIAN );
+  wolf_succ = MINITOR_X25519_SHARED_SECRET( hs_handshake_key, client_handshake_key, working_rend_secret_hs_input, &idx );
 
   if ( wolf_succ < 0 || idx != 32 )
   {
@@ -785,7 +937,7 @@ int d_hs_ntor_handshake_finish(
   working_rend_secret_hs_input += CURVE25519_KEYSIZE;
 
   idx = 32;
-  wolf_succ = wc_curve25519_shared_secret_ex( &intro_circuit->intro_crypto->encrypt_key, client_handshake_key, working_rend_secret_hs_input, &idx, EC25519_LITTLE_ENDIAN );
+  wolf_succ = MINITOR_X25519_SHARED_SECRET( encrypt_key, client_handshake_key, working_rend_secret_hs_input, &idx );
 
   if ( wolf_succ < 0 || idx != 32 )
   {
@@ -797,10 +949,10 @@ int d_hs_ntor_handshake_finish(
 
   working_rend_secret_hs_input += CURVE25519_KEYSIZE;
 
-  memcpy( working_rend_secret_hs_input, introduce_cell->payload.relay.introduce2.auth_key, introduce_cell->payload.relay.introduce2.auth_key_length );
-  working_rend_secret_hs_input += introduce_cell->payload.relay.introduce2.auth_key_length;
+  memcpy( working_rend_secret_hs_input, introduce_cell->payload.relay.introduce2.auth_key, ud_get_introduce2_auth_key_length( introduce_cell ) );
+  working_rend_secret_hs_input += ud_get_introduce2_auth_key_length( introduce_cell );
 
-  memcpy( working_rend_secret_hs_input, intro_circuit->intro_crypto->encrypt_key.p.point, CURVE25519_KEYSIZE );
+  memcpy( working_rend_secret_hs_input, encrypt_key->p.point, CURVE25519_KEYSIZE );
   working_rend_secret_hs_input += CURVE25519_KEYSIZE;
 
   memcpy( working_rend_secret_hs_input, client_pk, PK_PUBKEY_LEN );
@@ -846,8 +998,8 @@ int d_hs_ntor_handshake_finish(
 
   wc_Sha3_256_Update( &reusable_sha3, reusable_length_buffer, 8 );
   wc_Sha3_256_Update( &reusable_sha3, reusable_sha3_sum, WC_SHA3_256_DIGEST_SIZE );
-  wc_Sha3_256_Update( &reusable_sha3, introduce_cell->payload.relay.introduce2.auth_key, introduce_cell->payload.relay.introduce2.auth_key_length );
-  wc_Sha3_256_Update( &reusable_sha3, intro_circuit->intro_crypto->encrypt_key.p.point, CURVE25519_KEYSIZE );
+  wc_Sha3_256_Update( &reusable_sha3, introduce_cell->payload.relay.introduce2.auth_key, ud_get_introduce2_auth_key_length( introduce_cell ) );
+  wc_Sha3_256_Update( &reusable_sha3, encrypt_key->p.point, CURVE25519_KEYSIZE );
   wc_Sha3_256_Update( &reusable_sha3, hs_handshake_key->p.point, CURVE25519_KEYSIZE );
   wc_Sha3_256_Update( &reusable_sha3, client_pk, CURVE25519_KEYSIZE );
   wc_Sha3_256_Update( &reusable_sha3, (unsigned char*)HS_PROTOID, HS_PROTOID_LENGTH );
@@ -860,12 +1012,14 @@ int d_hs_ntor_handshake_finish(
   wc_Shake256_Update( &reusable_shake, (unsigned char*)HS_PROTOID_EXPAND, HS_PROTOID_EXPAND_LENGTH );
   wc_Shake256_Final( &reusable_shake, expanded_keys,  WC_SHA3_256_DIGEST_SIZE * 2 + AES_256_KEY_SIZE * 2  );
 
-  wc_InitSha3_256( &hs_crypto->hs_running_sha_forward, NULL, INVALID_DEVID );
+  wc_InitSha3_256( &hs_crypto->hs_running_sha_forward[0], NULL, INVALID_DEVID );
+  wc_InitSha3_256( &hs_crypto->hs_running_sha_forward[1], NULL, INVALID_DEVID );
+  hs_crypto->hs_sha_forward_index = 0;
   wc_InitSha3_256( &hs_crypto->hs_running_sha_backward, NULL, INVALID_DEVID );
   wc_AesInit( &hs_crypto->hs_aes_forward, NULL, INVALID_DEVID );
   wc_AesInit( &hs_crypto->hs_aes_backward, NULL, INVALID_DEVID );
 
-  wc_Sha3_256_Update( &hs_crypto->hs_running_sha_forward, expanded_keys, WC_SHA3_256_DIGEST_SIZE );
+  wc_Sha3_256_Update( &hs_crypto->hs_running_sha_forward[0], expanded_keys, WC_SHA3_256_DIGEST_SIZE );
 
   wc_Sha3_256_Update( &hs_crypto->hs_running_sha_backward, expanded_keys + WC_SHA3_256_DIGEST_SIZE, WC_SHA3_256_DIGEST_SIZE );
 
@@ -2084,21 +2238,20 @@ int d_router_establish_intro( OnionCircuit* circuit, DlConnection* or_connection
 
   establish_cell = malloc( MINITOR_CELL_LEN );
 
-  establish_cell->circ_id = circuit->circ_id;
+  v_set_cell_circ_id( establish_cell, circuit->circ_id );
   establish_cell->command = RELAY;
 
   establish_cell->payload.relay.relay_command = RELAY_COMMAND_ESTABLISH_INTRO;
   establish_cell->payload.relay.recognized = 0;
-  establish_cell->payload.relay.stream_id = 0;
+  v_set_relay_stream_id( establish_cell, 0 );
   establish_cell->payload.relay.digest = 0;
-  establish_cell->payload.relay.length = 3 + ED25519_PUB_KEY_SIZE + 1 + MAC_LEN + 2 + ED25519_SIG_SIZE;
+  v_set_relay_length( establish_cell, 3 + ED25519_PUB_KEY_SIZE + 1 + MAC_LEN + 2 + ED25519_SIG_SIZE );
 
-  establish_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + establish_cell->payload.relay.length;
+  establish_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + ud_get_relay_length( establish_cell );
 
   establish_cell->payload.relay.establish_intro.auth_key_type = EDSHA3;
 
-  // make it network so that our signature is correct
-  establish_cell->payload.relay.establish_intro.auth_key_length = htons( ED25519_PUB_KEY_SIZE );
+  v_set_establish_intro_auth_key_length( establish_cell, ED25519_PUB_KEY_SIZE );
   memcpy( establish_cell->payload.relay.establish_intro.auth_key, tmp_pub_key, ED25519_PUB_KEY_SIZE );
 
   // skip over auth key
@@ -2130,7 +2283,7 @@ int d_router_establish_intro( OnionCircuit* circuit, DlConnection* or_connection
   establish_cell_p += MAC_LEN;
 
   // set the signature length
-  ((uint16_t*)establish_cell_p)[0] = ED25519_SIG_SIZE;
+  v_store_be16( establish_cell_p, ED25519_SIG_SIZE );
 
   establish_cell_p += 2;
 
@@ -2550,14 +2703,14 @@ int d_begin_hsdir( OnionCircuit* publish_circuit, DlConnection* or_connection )
 
   begin_cell = malloc( MINITOR_CELL_LEN );
 
-  begin_cell->circ_id = publish_circuit->circ_id;
+  v_set_cell_circ_id( begin_cell, publish_circuit->circ_id );
   begin_cell->command = RELAY;
 
   begin_cell->payload.relay.relay_command = RELAY_BEGIN_DIR;
   begin_cell->payload.relay.recognized = 0;
-  begin_cell->payload.relay.stream_id = 1;
+  v_set_relay_stream_id( begin_cell, 1 );
   begin_cell->payload.relay.digest = 0;
-  begin_cell->payload.relay.length = 0;
+  v_set_relay_length( begin_cell, 0 );
 
   begin_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE;
 
@@ -2635,15 +2788,15 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
   data_cell = malloc( MINITOR_CELL_LEN );
 
   data_cell->command = RELAY;
-  data_cell->circ_id = publish_circuit->circ_id;
+  v_set_cell_circ_id( data_cell, publish_circuit->circ_id );
 
   data_cell->payload.relay.relay_command = RELAY_DATA;
   data_cell->payload.relay.recognized = 0;
-  data_cell->payload.relay.stream_id = 1;
+  v_set_relay_stream_id( data_cell, 1 );
   data_cell->payload.relay.digest = 0;
-  data_cell->payload.relay.length = RELAY_PAYLOAD_LEN;
+  v_set_relay_length( data_cell, RELAY_PAYLOAD_LEN );
 
-  data_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + data_cell->payload.relay.length;
+  data_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + ud_get_relay_length( data_cell );
 
   memcpy( data_cell->payload.relay.data, REQUEST, strlen( REQUEST ) );
 
@@ -2676,11 +2829,11 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
     data_cell = malloc( MINITOR_CELL_LEN );
 
     data_cell->command = RELAY;
-    data_cell->circ_id = publish_circuit->circ_id;
+    v_set_cell_circ_id( data_cell, publish_circuit->circ_id );
 
     data_cell->payload.relay.relay_command = RELAY_DATA;
     data_cell->payload.relay.recognized = 0;
-    data_cell->payload.relay.stream_id = 1;
+    v_set_relay_stream_id( data_cell, 1 );
     data_cell->payload.relay.digest = 0;
 
     succ = read( desc_fd, data_cell->payload.relay.data, RELAY_PAYLOAD_LEN );
@@ -2702,9 +2855,9 @@ int d_post_hs_desc( OnionCircuit* publish_circuit, DlConnection* or_connection )
       break;
     }
 
-    data_cell->payload.relay.length = succ;
+    v_set_relay_length( data_cell, succ );
 
-    data_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + data_cell->payload.relay.length;
+    data_cell->length = FIXED_CELL_HEADER_SIZE + RELAY_CELL_HEADER_SIZE + ud_get_relay_length( data_cell );
 
     if ( d_send_relay_cell_and_free( or_connection, data_cell, &publish_circuit->relay_list, NULL ) < 0 )
     {
@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "user_settings.h"
+#include "wolfssl/wolfcrypt/chacha.h"
+
+#include "../include/config.h"
+#include "../h/port.h"
+
+#include "../h/padding.h"
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CELL
+
+static const char* PADDING_TAG = "MINITOR PADDING";
+
+// keystream generated per refill
+#define PADDING_BUFFER_LEN 512
+
+MinitorMutex padding_mutex;
+
+static ChaCha padding_chacha;
+static uint8_t padding_buffer[PADDING_BUFFER_LEN];
+// next unused byte of padding_buffer, PADDING_BUFFER_LEN when it is empty
+static int padding_offset = PADDING_BUFFER_LEN;
+// starts past the limit so the first fill seeds the stream
+static int padding_since_reseed = MINITOR_PADDING_RESEED_BYTES;
+
+// new key and nonce from the hardware rng, only done every
+// MINITOR_PADDING_RESEED_BYTES so the slow rng isn't read per cell
+static void v_reseed_padding()
+{
+  uint8_t key[CHACHA_MAX_KEY_SZ];
+  uint8_t iv[CHACHA_IV_BYTES];
+
+  MINITOR_FILL_RANDOM( key, sizeof( key ) );
+  MINITOR_FILL_RANDOM( iv, sizeof( iv ) );
+
+  if ( wc_Chacha_SetKey( &padding_chacha, key, sizeof( key ) ) < 0 || wc_Chacha_SetIV( &padding_chacha, iv, 0 ) < 0 )
+  {
+    MINITOR_LOG( PADDING_TAG, "Failed to seed padding stream" );
+  }
+
+  memset( key, 0, sizeof( key ) );
+
+  padding_since_reseed = 0;
+}
+
+// encrypting zeros leaves the raw keystream
+static void v_refill_padding()
+{
+  if ( padding_since_reseed >= MINITOR_PADDING_RESEED_BYTES )
+  {
+    v_reseed_padding();
+  }
+
+  memset( padding_buffer, 0, PADDING_BUFFER_LEN );
+
+  if ( wc_Chacha_Process( &padding_chacha, padding_buffer, padding_buffer, PADDING_BUFFER_LEN ) < 0 )
+  {
+    MINITOR_LOG( PADDING_TAG, "Failed to generate padding, using the hardware rng" );
+
+    MINITOR_FILL_RANDOM( padding_buffer, PADDING_BUFFER_LEN );
+  }
+
+  padding_since_reseed += PADDING_BUFFER_LEN;
+  padding_offset = 0;
+}
+
+// padding has to be unpredictable but not secret, it is under every onion
+// layer anyway, so it comes from a chacha20 stream instead of the hardware rng
+void v_fill_padding( uint8_t* dest, int length )
+{
+  int chunk;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( padding_mutex );
+
+  while ( length > 0 )
+  {
+    if ( padding_offset == PADDING_BUFFER_LEN )
+    {
+      v_refill_padding();
+    }
+
+    chunk = PADDING_BUFFER_LEN - padding_offset;
+
+    if ( chunk > length )
+    {
+      chunk = length;
+    }
+
+    memcpy( dest, padding_buffer + padding_offset, chunk );
+    // keystream is never handed out twice
+    memset( padding_buffer + padding_offset, 0, chunk );
+
+    padding_offset += chunk;
+    dest += chunk;
+    length -= chunk;
+  }
+
+  MINITOR_MUTEX_GIVE( padding_mutex );
+  // MUTEX GIVE
+}
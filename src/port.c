@@ -3,14 +3,18 @@
 #include "../h/core.h"
 #include "../h/connections.h"
 #include "../h/consensus.h"
+#include "../h/crypto_pool.h"
+#include "../h/key_pool.h"
+#include "../h/stats.h"
+#include "../h/bench.h"
 
-bool b_create_core_task( MinitorTask* handle )
+bool b_create_core_task( MinitorTask* handle, int shard )
 {
   return xTaskCreatePinnedToCore(
     v_minitor_daemon,
     "MINITOR_DAEMON",
     7168,
-    NULL,
+    (void*)shard,
     7,
     handle,
     tskNO_AFFINITY
@@ -55,3 +59,63 @@ bool b_create_insert_task( MinitorTask* handle, void* consensus )
     tskNO_AFFINITY
   );
 }
+
+// below the core so handshakes never hold up cells that are ready to go
+bool b_create_crypto_task( MinitorTask* handle )
+{
+  return xTaskCreatePinnedToCore(
+    v_crypto_pool_daemon,
+    "CRYPTO_WORKER",
+    6144,
+    NULL,
+    5,
+    handle,
+    tskNO_AFFINITY
+  );
+}
+
+// only gets the cpu when nothing else wants it
+bool b_create_key_pool_task( MinitorTask* handle )
+{
+  return xTaskCreatePinnedToCore(
+    v_key_pool_daemon,
+    "KEY_POOL",
+    3072,
+    NULL,
+    1,
+    handle,
+    tskNO_AFFINITY
+  );
+}
+
+#ifdef MINITOR_STATS_PORT
+bool b_create_stats_task( MinitorTask* handle )
+{
+  return xTaskCreatePinnedToCore(
+    v_stats_daemon,
+    "STATS",
+    3072,
+    NULL,
+    2,
+    handle,
+    tskNO_AFFINITY
+  );
+}
+#endif
+
+#ifdef MINITOR_BENCHMARK
+// the local server for the loopback stream benchmark, it sits where the
+// user's web server would
+bool b_create_bench_server_task( MinitorTask* handle, void* server )
+{
+  return xTaskCreatePinnedToCore(
+    v_bench_stream_server,
+    "BENCH_SERVER",
+    3072,
+    server,
+    4,
+    handle,
+    tskNO_AFFINITY
+  );
+}
+#endif
@@ -0,0 +1,449 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../h/port.h"
+
+#include "../h/stats.h"
+#include "../h/cell.h"
+#include "../h/core.h"
+#include "../h/connections.h"
+
+#define MINITOR_LOG_SUBSYSTEM MINITOR_LOG_CORE
+
+static const char* STATS_TAG = "MINITOR STATS";
+
+// room for one scrape, anything past this is cut off
+#define STATS_RESPONSE_LEN 7168
+// a scraper that connects and then says nothing is dropped after this long
+#define STATS_CLIENT_TIMEOUT_S 2
+
+uint32_t minitor_counters[STAT_COUNTER_COUNT];
+static MinitorLatency latencies[LATENCY_TYPE_COUNT];
+static MinitorMessageStats message_stats;
+
+void v_stats_record_latency( MinitorLatencyType type, int64_t us )
+{
+  uint32_t max_us;
+  MinitorLatency* latency = &latencies[type];
+
+  if ( us < 0 )
+  {
+    return;
+  }
+
+  __atomic_fetch_add( &latency->count, 1, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &latency->total_us, (uint64_t)us, __ATOMIC_RELAXED );
+
+  max_us = __atomic_load_n( &latency->max_us, __ATOMIC_RELAXED );
+
+  while ( (uint32_t)us > max_us && !__atomic_compare_exchange_n( &latency->max_us, &max_us, (uint32_t)us, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+  {
+  }
+}
+
+static void v_histogram_add( MinitorHistogram* histogram, int64_t us )
+{
+  int bucket = 0;
+
+  if ( us < 0 )
+  {
+    return;
+  }
+
+  if ( us > 0xffffffff )
+  {
+    us = 0xffffffff;
+  }
+
+  if ( us > 1 )
+  {
+    bucket = 31 - __builtin_clz( (uint32_t)us );
+  }
+
+  if ( bucket >= MINITOR_HISTOGRAM_BUCKETS )
+  {
+    bucket = MINITOR_HISTOGRAM_BUCKETS - 1;
+  }
+
+  __atomic_fetch_add( &histogram->count, 1, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &histogram->total_us, (uint64_t)us, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &histogram->buckets[bucket], 1, __ATOMIC_RELAXED );
+}
+
+// every core shard records here, so the adds are atomic
+void v_stats_record_message( OnionMessageType type, int64_t wait_us, int64_t service_us )
+{
+  if ( type >= ONION_MESSAGE_TYPE_COUNT )
+  {
+    return;
+  }
+
+  v_histogram_add( &message_stats.wait[type], wait_us );
+  v_histogram_add( &message_stats.service[type], service_us );
+}
+
+static void v_copy_histogram( MinitorHistogram* dest, MinitorHistogram* src )
+{
+  int i;
+
+  dest->count = __atomic_load_n( &src->count, __ATOMIC_RELAXED );
+  dest->total_us = __atomic_load_n( &src->total_us, __ATOMIC_RELAXED );
+
+  for ( i = 0; i < MINITOR_HISTOGRAM_BUCKETS; i++ )
+  {
+    dest->buckets[i] = __atomic_load_n( &src->buckets[i], __ATOMIC_RELAXED );
+  }
+}
+
+int d_minitor_get_message_stats( MinitorMessageStats* stats )
+{
+  int i;
+
+  for ( i = 0; i < ONION_MESSAGE_TYPE_COUNT; i++ )
+  {
+    v_copy_histogram( &stats->wait[i], &message_stats.wait[i] );
+    v_copy_histogram( &stats->service[i], &message_stats.service[i] );
+  }
+
+  return 0;
+}
+
+static void v_copy_latency( MinitorLatency* dest, MinitorLatencyType type )
+{
+  dest->count = __atomic_load_n( &latencies[type].count, __ATOMIC_RELAXED );
+  dest->total_us = __atomic_load_n( &latencies[type].total_us, __ATOMIC_RELAXED );
+  dest->max_us = __atomic_load_n( &latencies[type].max_us, __ATOMIC_RELAXED );
+}
+
+int d_minitor_get_stats( MinitorStats* stats )
+{
+  OnionCircuit* circuit;
+  DlConnection* dl_connection;
+
+  memset( stats, 0, sizeof( MinitorStats ) );
+
+  stats->cells_received = __atomic_load_n( &minitor_counters[STAT_CELLS_RECEIVED], __ATOMIC_RELAXED );
+  stats->cells_sent = __atomic_load_n( &minitor_counters[STAT_CELLS_SENT], __ATOMIC_RELAXED );
+  stats->relay_cells_received = __atomic_load_n( &minitor_counters[STAT_RELAY_CELLS_RECEIVED], __ATOMIC_RELAXED );
+  stats->relay_cells_sent = __atomic_load_n( &minitor_counters[STAT_RELAY_CELLS_SENT], __ATOMIC_RELAXED );
+  stats->cells_discarded = __atomic_load_n( &minitor_counters[STAT_CELLS_DISCARDED], __ATOMIC_RELAXED );
+  stats->cells_unrecognized = __atomic_load_n( &minitor_counters[STAT_CELLS_UNRECOGNIZED], __ATOMIC_RELAXED );
+  stats->stream_bytes_in = __atomic_load_n( &minitor_counters[STAT_STREAM_BYTES_IN], __ATOMIC_RELAXED );
+  stats->stream_bytes_out = __atomic_load_n( &minitor_counters[STAT_STREAM_BYTES_OUT], __ATOMIC_RELAXED );
+  stats->streams_opened = __atomic_load_n( &minitor_counters[STAT_STREAMS_OPENED], __ATOMIC_RELAXED );
+  stats->introduce2_received = __atomic_load_n( &minitor_counters[STAT_INTRODUCE2_RECEIVED], __ATOMIC_RELAXED );
+  stats->introduce2_rate_limited = __atomic_load_n( &minitor_counters[STAT_INTRODUCE2_RATE_LIMITED], __ATOMIC_RELAXED );
+  stats->introduce2_rejected = __atomic_load_n( &minitor_counters[STAT_INTRODUCE2_REJECTED], __ATOMIC_RELAXED );
+  stats->introduce2_busy = __atomic_load_n( &minitor_counters[STAT_INTRODUCE2_BUSY], __ATOMIC_RELAXED );
+
+  v_copy_latency( &stats->hop_handshake, LATENCY_HOP_HANDSHAKE );
+  v_copy_latency( &stats->ntor_crypto, LATENCY_NTOR_CRYPTO );
+  v_copy_latency( &stats->introduce2_crypto, LATENCY_INTRODUCE2_CRYPTO );
+  v_copy_latency( &stats->rendezvous, LATENCY_RENDEZVOUS );
+  v_copy_latency( &stats->local_first_byte, LATENCY_LOCAL_FIRST_BYTE );
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( circuits_mutex );
+
+  for ( circuit = onion_circuits; circuit != NULL; circuit = circuit->next )
+  {
+    if ( circuit->status < CIRCUIT_STATUS_COUNT )
+    {
+      stats->circuits[circuit->status]++;
+    }
+  }
+
+  MINITOR_MUTEX_GIVE( circuits_mutex );
+  // MUTEX GIVE
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+
+  for ( dl_connection = connections; dl_connection != NULL; dl_connection = dl_connection->next )
+  {
+    if ( dl_connection->is_or == 1 )
+    {
+      stats->or_connections++;
+    }
+    else
+    {
+      stats->local_connections++;
+    }
+  }
+
+  MINITOR_MUTEX_GIVE( connections_mutex );
+  // MUTEX GIVE
+
+  v_core_get_lane_stats( stats->lanes );
+  v_get_backpressure_stats( &stats->backpressure );
+
+  stats->pooled_cells = d_pooled_cell_count();
+  stats->heap_free = MINITOR_HEAP_FREE();
+  stats->heap_min_free = MINITOR_HEAP_MIN_FREE();
+
+  return 0;
+}
+
+// fills up to max entries, one per connection, and returns how many
+int d_minitor_get_connection_stats( MinitorConnectionStats* stats, int max )
+{
+  int count = 0;
+  DlConnection* dl_connection;
+
+  // MUTEX TAKE
+  MINITOR_MUTEX_TAKE_BLOCKING( connections_mutex );
+
+  for ( dl_connection = connections; dl_connection != NULL && count < max; dl_connection = dl_connection->next )
+  {
+    stats[count].conn_id = dl_connection->conn_id;
+    stats[count].address = dl_connection->address;
+    stats[count].port = dl_connection->port;
+    stats[count].is_or = dl_connection->is_or;
+    stats[count].cells_received = dl_connection->cells_received;
+    stats[count].cells_sent = dl_connection->cells_sent;
+
+    count++;
+  }
+
+  MINITOR_MUTEX_GIVE( connections_mutex );
+  // MUTEX GIVE
+
+  return count;
+}
+
+#ifdef MINITOR_STATS_PORT
+static const char* circuit_status_names[CIRCUIT_STATUS_COUNT] =
+{
+  "create",
+  "created",
+  "extended",
+  "truncated",
+  "establish_intro",
+  "intro_established",
+  "hsdir_begin_dir",
+  "hsdir_connected",
+  "hsdir_data",
+  "standby",
+  "intro_live",
+  "rendezvous",
+};
+
+static const char* message_type_names[ONION_MESSAGE_TYPE_COUNT] =
+{
+  "tor_cell",
+  "service_tcp_data",
+  "conn_ready",
+  "conn_close",
+  "init_service",
+  "init_circuit",
+  "timer_consensus",
+  "timer_keepalive",
+  "timer_hsdir",
+  "timer_circuit_timeout",
+  "crypto_result",
+};
+
+static int d_append_metric( char* buf, int offset, const char* name, const char* labels, uint64_t value )
+{
+  int succ;
+
+  if ( offset >= STATS_RESPONSE_LEN )
+  {
+    return offset;
+  }
+
+  succ = snprintf( buf + offset, STATS_RESPONSE_LEN - offset, "minitor_%s%s %llu\n", name, labels, (unsigned long long)value );
+
+  if ( succ < 0 )
+  {
+    return offset;
+  }
+
+  offset += succ;
+
+  return offset > STATS_RESPONSE_LEN ? STATS_RESPONSE_LEN : offset;
+}
+
+static int d_format_prometheus( char* buf )
+{
+  int i;
+  int offset;
+  char labels[48];
+  MinitorStats* stats;
+
+  stats = malloc( sizeof( MinitorStats ) );
+
+  if ( stats == NULL )
+  {
+    return -1;
+  }
+
+  d_minitor_get_stats( stats );
+
+  offset = snprintf( buf, STATS_RESPONSE_LEN, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n" );
+
+  offset = d_append_metric( buf, offset, "cells_received_total", "", stats->cells_received );
+  offset = d_append_metric( buf, offset, "cells_sent_total", "", stats->cells_sent );
+  offset = d_append_metric( buf, offset, "relay_cells_received_total", "", stats->relay_cells_received );
+  offset = d_append_metric( buf, offset, "relay_cells_sent_total", "", stats->relay_cells_sent );
+  offset = d_append_metric( buf, offset, "cells_discarded_total", "", stats->cells_discarded );
+  offset = d_append_metric( buf, offset, "cells_unrecognized_total", "", stats->cells_unrecognized );
+  offset = d_append_metric( buf, offset, "stream_bytes_in_total", "", stats->stream_bytes_in );
+  offset = d_append_metric( buf, offset, "stream_bytes_out_total", "", stats->stream_bytes_out );
+  offset = d_append_metric( buf, offset, "streams_opened_total", "", stats->streams_opened );
+  offset = d_append_metric( buf, offset, "introduce2_received_total", "", stats->introduce2_received );
+  offset = d_append_metric( buf, offset, "introduce2_rate_limited_total", "", stats->introduce2_rate_limited );
+  offset = d_append_metric( buf, offset, "introduce2_rejected_total", "", stats->introduce2_rejected );
+  offset = d_append_metric( buf, offset, "introduce2_busy_total", "", stats->introduce2_busy );
+  offset = d_append_metric( buf, offset, "hop_handshake_us_count", "", stats->hop_handshake.count );
+  offset = d_append_metric( buf, offset, "hop_handshake_us_sum", "", stats->hop_handshake.total_us );
+  offset = d_append_metric( buf, offset, "hop_handshake_us_max", "", stats->hop_handshake.max_us );
+  offset = d_append_metric( buf, offset, "ntor_crypto_us_count", "", stats->ntor_crypto.count );
+  offset = d_append_metric( buf, offset, "ntor_crypto_us_sum", "", stats->ntor_crypto.total_us );
+  offset = d_append_metric( buf, offset, "ntor_crypto_us_max", "", stats->ntor_crypto.max_us );
+  offset = d_append_metric( buf, offset, "introduce2_crypto_us_count", "", stats->introduce2_crypto.count );
+  offset = d_append_metric( buf, offset, "introduce2_crypto_us_sum", "", stats->introduce2_crypto.total_us );
+  offset = d_append_metric( buf, offset, "introduce2_crypto_us_max", "", stats->introduce2_crypto.max_us );
+  offset = d_append_metric( buf, offset, "rendezvous_us_count", "", stats->rendezvous.count );
+  offset = d_append_metric( buf, offset, "rendezvous_us_sum", "", stats->rendezvous.total_us );
+  offset = d_append_metric( buf, offset, "rendezvous_us_max", "", stats->rendezvous.max_us );
+  offset = d_append_metric( buf, offset, "local_first_byte_us_count", "", stats->local_first_byte.count );
+  offset = d_append_metric( buf, offset, "local_first_byte_us_sum", "", stats->local_first_byte.total_us );
+  offset = d_append_metric( buf, offset, "local_first_byte_us_max", "", stats->local_first_byte.max_us );
+
+  for ( i = 0; i < CIRCUIT_STATUS_COUNT; i++ )
+  {
+    snprintf( labels, sizeof( labels ), "{status=\"%s\"}", circuit_status_names[i] );
+    offset = d_append_metric( buf, offset, "circuits", labels, stats->circuits[i] );
+  }
+
+  offset = d_append_metric( buf, offset, "connections", "{kind=\"or\"}", stats->or_connections );
+  offset = d_append_metric( buf, offset, "connections", "{kind=\"local\"}", stats->local_connections );
+
+  for ( i = 0; i < CORE_LANE_COUNT; i++ )
+  {
+    snprintf( labels, sizeof( labels ), "{lane=\"%s\"}", i == CORE_LANE_CONTROL ? "control" : "bulk" );
+    offset = d_append_metric( buf, offset, "core_enqueued_total", labels, stats->lanes[i].enqueued );
+    offset = d_append_metric( buf, offset, "core_dequeued_total", labels, stats->lanes[i].dequeued );
+    offset = d_append_metric( buf, offset, "core_rejected_total", labels, stats->lanes[i].rejected );
+    offset = d_append_metric( buf, offset, "core_high_water", labels, stats->lanes[i].high_water );
+  }
+
+  offset = d_append_metric( buf, offset, "backpressure_events_total", "{kind=\"or\"}", stats->backpressure.or_events );
+  offset = d_append_metric( buf, offset, "backpressure_events_total", "{kind=\"local\"}", stats->backpressure.local_events );
+  offset = d_append_metric( buf, offset, "pooled_cells", "", stats->pooled_cells );
+  offset = d_append_metric( buf, offset, "heap_free_bytes", "", stats->heap_free );
+  offset = d_append_metric( buf, offset, "heap_min_free_bytes", "", stats->heap_min_free );
+
+  free( stats );
+
+  // only the totals, the buckets are there through d_minitor_get_message_stats
+  for ( i = 0; i < ONION_MESSAGE_TYPE_COUNT; i++ )
+  {
+    snprintf( labels, sizeof( labels ), "{type=\"%s\"}", message_type_names[i] );
+    offset = d_append_metric( buf, offset, "core_wait_us_count", labels, __atomic_load_n( &message_stats.wait[i].count, __ATOMIC_RELAXED ) );
+    offset = d_append_metric( buf, offset, "core_wait_us_sum", labels, __atomic_load_n( &message_stats.wait[i].total_us, __ATOMIC_RELAXED ) );
+    offset = d_append_metric( buf, offset, "core_service_us_count", labels, __atomic_load_n( &message_stats.service[i].count, __ATOMIC_RELAXED ) );
+    offset = d_append_metric( buf, offset, "core_service_us_sum", labels, __atomic_load_n( &message_stats.service[i].total_us, __ATOMIC_RELAXED ) );
+  }
+
+  return offset;
+}
+
+// serves the stats in prometheus text format to anything on this device
+// that connects, it is bound to loopback so it is never reachable from the
+// network or through the onion service
+void v_stats_daemon( void* pv_parameters )
+{
+  int length;
+  int listen_fd;
+  int client_fd;
+  char* buf;
+  struct sockaddr_in bind_addr;
+  struct timeval timeout;
+
+  listen_fd = socket( AF_INET, SOCK_STREAM, IPPROTO_IP );
+
+  if ( listen_fd < 0 )
+  {
+    MINITOR_LOG( STATS_TAG, "Failed to create stats socket, errno: %d", errno );
+
+    MINITOR_TASK_DELETE( NULL );
+  }
+
+  memset( &bind_addr, 0, sizeof( bind_addr ) );
+
+  bind_addr.sin_family = AF_INET;
+  bind_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  bind_addr.sin_port = htons( MINITOR_STATS_PORT );
+
+  if ( bind( listen_fd, (struct sockaddr*)&bind_addr, sizeof( bind_addr ) ) != 0 || listen( listen_fd, 1 ) != 0 )
+  {
+    MINITOR_LOG( STATS_TAG, "Failed to listen on stats port, errno: %d", errno );
+
+    close( listen_fd );
+
+    MINITOR_TASK_DELETE( NULL );
+  }
+
+  buf = malloc( STATS_RESPONSE_LEN + 1 );
+
+  if ( buf == NULL )
+  {
+    close( listen_fd );
+
+    MINITOR_TASK_DELETE( NULL );
+  }
+
+  while ( 1 )
+  {
+    client_fd = accept( listen_fd, NULL, NULL );
+
+    if ( client_fd < 0 )
+    {
+      continue;
+    }
+
+    // one stuck client would block every scrape after it
+    timeout.tv_sec = STATS_CLIENT_TIMEOUT_S;
+    timeout.tv_usec = 0;
+
+    setsockopt( client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+    setsockopt( client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+
+    // the request doesn't matter, every path gets the metrics
+    recv( client_fd, buf, STATS_RESPONSE_LEN, 0 );
+
+    length = d_format_prometheus( buf );
+
+    if ( length > 0 )
+    {
+      send( client_fd, buf, length, 0 );
+    }
+
+    shutdown( client_fd, SHUT_RDWR );
+    close( client_fd );
+  }
+}
+#endif
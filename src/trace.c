@@ -0,0 +1,141 @@
+/*
+Copyright (C) 2022 Triple Layer Development Inc.
+
+Minitor is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+Minitor is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/config.h"
+#include "../h/port.h"
+
+#include "../h/trace.h"
+
+#if MINITOR_TRACE_SIZE > 0
+
+// writers claim a slot with an atomic increment and never wait on each other
+// or on a reader, an event that is overwritten while being read is dropped
+static MinitorTraceEvent trace_ring[MINITOR_TRACE_SIZE];
+static uint32_t trace_head = 0;
+
+void v_minitor_trace( uint16_t event, uint32_t arg0, uint32_t arg1 )
+{
+  uint32_t position;
+  MinitorTraceEvent* slot;
+
+  position = __atomic_fetch_add( &trace_head, 1, __ATOMIC_RELAXED );
+  slot = &trace_ring[position & ( MINITOR_TRACE_SIZE - 1 )];
+
+  __atomic_store_n( &slot->sequence, 0, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+
+  slot->time = (uint32_t)MINITOR_GET_TIME();
+  slot->event = event;
+  slot->arg0 = arg0;
+  slot->arg1 = arg1;
+
+  __atomic_store_n( &slot->sequence, position + 1, __ATOMIC_RELEASE );
+}
+
+// copies up to max of the most recent events into events, oldest first, and
+// returns how many were copied
+int d_minitor_trace_read( MinitorTraceEvent* events, int max )
+{
+  int count = 0;
+  uint32_t head;
+  uint32_t position;
+  uint32_t sequence;
+  MinitorTraceEvent* slot;
+
+  head = __atomic_load_n( &trace_head, __ATOMIC_ACQUIRE );
+
+  if ( max > MINITOR_TRACE_SIZE )
+  {
+    max = MINITOR_TRACE_SIZE;
+  }
+
+  position = head > (uint32_t)max ? head - max : 0;
+
+  for ( ; position != head; position++ )
+  {
+    slot = &trace_ring[position & ( MINITOR_TRACE_SIZE - 1 )];
+
+    sequence = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE );
+
+    if ( sequence != position + 1 )
+    {
+      continue;
+    }
+
+    memcpy( &events[count], slot, sizeof( MinitorTraceEvent ) );
+
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+    // a writer lapped us while we were copying
+    if ( __atomic_load_n( &slot->sequence, __ATOMIC_RELAXED ) != sequence )
+    {
+      continue;
+    }
+
+    count++;
+  }
+
+  return count;
+}
+
+void v_minitor_trace_dump()
+{
+  int i;
+  int count;
+  MinitorTraceEvent* events;
+
+  events = malloc( sizeof( MinitorTraceEvent ) * MINITOR_TRACE_SIZE );
+
+  if ( events == NULL )
+  {
+    return;
+  }
+
+  count = d_minitor_trace_read( events, MINITOR_TRACE_SIZE );
+
+  printf( "minitor trace, %d events\n", count );
+
+  for ( i = 0; i < count; i++ )
+  {
+    printf( "%u %u %u %u\n", (unsigned int)events[i].time, (unsigned int)events[i].event, (unsigned int)events[i].arg0, (unsigned int)events[i].arg1 );
+  }
+
+  free( events );
+}
+
+#else
+
+void v_minitor_trace( uint16_t event, uint32_t arg0, uint32_t arg1 )
+{
+}
+
+int d_minitor_trace_read( MinitorTraceEvent* events, int max )
+{
+  return 0;
+}
+
+void v_minitor_trace_dump()
+{
+}
+
+#endif